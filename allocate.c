@@ -1,31 +1,437 @@
 #include "allocate.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 
+#include "file_meta.h"
+#include "memory_sync.h"
+#include "stats.h"
+#include "trace.h"
+#include "wal.h"
 
-off_t Allocate(int fd, const char* buf, off_t count) {
+/* Allocation is serialized by a lock on one byte far beyond EOF.
+ * Range relative to SEEK_END cannot be used: by the time of unlock
+ * the end of file has moved, and the original range stays locked. */
+#define ALLOCATE_LOCK_OFFSET ((off_t)1 << 62)
+
+/* ...which does not exclude threads of one process */
+static pthread_mutex_t allocator_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int LockAllocator(int fd) {
   struct flock flockstr = {
     .l_type = F_WRLCK,
-    .l_whence = SEEK_END,
-    .l_start = 0,
-    .l_len = count
+    .l_whence = SEEK_SET,
+    .l_start = ALLOCATE_LOCK_OFFSET,
+    .l_len = 1
   };
 
-  // TODO: deal with errors
-
+  pthread_mutex_lock(&allocator_mutex);
   if (fcntl(fd, F_SETLKW, &flockstr) == -1) {
+    pthread_mutex_unlock(&allocator_mutex);
     return -1;
   }
+  return 0;
+}
 
-  off_t record_offset = lseek(fd, 0, SEEK_END);
-
-  (void)pwrite(fd, buf, count, record_offset);
+static void UnlockAllocator(int fd) {
+  struct flock flockstr = {
+    .l_type = F_UNLCK,
+    .l_whence = SEEK_SET,
+    .l_start = ALLOCATE_LOCK_OFFSET,
+    .l_len = 1
+  };
 
-  flockstr.l_type = F_UNLCK;
   (void)fcntl(fd, F_SETLKW, &flockstr);
+  pthread_mutex_unlock(&allocator_mutex);
+}
+
+
+/*
+ * GetState -
+ * allocator state of the file; initialized on first use.
+ * Must be called under allocator lock.
+*/
+static struct AllocState* GetState(int fd, char* mapping) {
+  struct AllocState* state = &((struct FileMeta*)mapping)->alloc_state;
+
+  if (state->magic != ALLOCATE_STATE_MAGIC) {
+    off_t end = lseek(fd, 0, SEEK_END);
+
+    *state = (struct AllocState){
+      .magic = ALLOCATE_STATE_MAGIC,
+      .end = end,
+      .reserved_end = end
+    };
+  }
+
+  return state;
+}
+
+
+static off_t ClassSize(int i) {
+  return ((off_t)ALLOCATE_MIN_EXTENT << (i / 4)) * (4 + i % 4) / 4;
+}
+
+/* Smallest class that fits 'count' bytes; ALLOCATE_CLASSES if none */
+static int ClassUp(off_t count) {
+  int i = 0;
+  while (i < ALLOCATE_CLASSES && ClassSize(i) < count) {
+    ++i;
+  }
+  return i;
+}
+
+/* Largest class that extent of 'size' bytes can serve; -1 if too small */
+static int ClassDown(off_t size) {
+  int i = -1;
+  while (i + 1 < ALLOCATE_CLASSES && ClassSize(i + 1) <= size) {
+    ++i;
+  }
+  return i;
+}
+
+
+/*
+ * ExtentSize -
+ * number of bytes taken by record of 'count' bytes.
+ * Records laid out by caller in one allocation must follow it
+ * to be freed one by one later.
+*/
+off_t ExtentSize(off_t count) {
+  int i = ClassUp(count);
+  return i < ALLOCATE_CLASSES ? ClassSize(i) : count;
+}
+
+
+/* Changes made under allocator lock; logged as one group before unlock */
+struct Redo {
+  struct WalImage images[4];
+  off_t links[2];
+  size_t links_count;
+  size_t count;
+};
+
+static void RedoAdd(struct Redo* redo,
+                    off_t offset, const void* data, off_t size) {
+  redo->images[redo->count++] = (struct WalImage){
+    .offset = offset,
+    .data = data,
+    .size = (uint32_t)size
+  };
+}
+
+/* Log redo together with allocator state */
+static void RedoLog(struct Wal* wal, char* mapping, struct Redo* redo) {
+  if (wal == NULL) {
+    return;
+  }
+  RedoAdd(redo, offsetof(struct FileMeta, alloc_state),
+          mapping + offsetof(struct FileMeta, alloc_state),
+          sizeof(struct AllocState));
+  (void)WalAppend(wal, redo->images, redo->count);
+}
+
+
+/* Link 'offset' in front of list 'head'; returns new head */
+static off_t PushFree(int fd, struct Redo* redo, off_t head, off_t offset) {
+  (void)pwrite(fd, &head, sizeof(head), offset);
+
+  off_t* link = &redo->links[redo->links_count++];
+  *link = head;
+  RedoAdd(redo, offset, link, sizeof(*link));
+
+  return offset;
+}
+
+/* Next element of list after 'offset' */
+static off_t NextFree(int fd, off_t offset) {
+  off_t next;
+  if (pread(fd, &next, sizeof(next), offset) != sizeof(next)) {
+    perror("pread");
+    return 0; /* drop broken list rather than hand out garbage */
+  }
+  return next;
+}
+
+
+static void FreeExtentLocked(int fd, struct AllocState* state,
+                             struct Redo* redo, off_t offset, off_t size) {
+  int i = ClassDown(size);
+  if (i < 0) {
+    /* Too small to keep a link */
+    return;
+  }
+
+  state->free_extents[i] = PushFree(fd, redo, state->free_extents[i], offset);
+  state->free_bytes += ClassSize(i);
+}
+
+
+/*
+ * Reserve -
+ * make sure file is preallocated up to 'needed'.
+ * File grows by chunks proportional to its size, so
+ * appends (and splits) almost never touch file size.
+ *
+ * Returns:
+ * @int: 0 on success, -1 on failure.
+*/
+static int Reserve(int fd, char* mapping,
+                   struct AllocState* state, off_t needed) {
+  if (needed <= state->reserved_end) {
+    return 0;
+  }
+
+  off_t chunk = state->reserved_end / 8;
+  if (chunk < ALLOCATE_MIN_CHUNK) {
+    chunk = ALLOCATE_MIN_CHUNK;
+  }
+  off_t new_end = state->reserved_end + chunk;
+  if (new_end < needed) {
+    new_end = needed;
+  }
+  new_end = (new_end + ALLOCATE_MIN_CHUNK - 1)
+    / ALLOCATE_MIN_CHUNK * ALLOCATE_MIN_CHUNK;
+
+  if (fallocate(fd, 0, state->reserved_end, new_end - state->reserved_end)
+      == -1) {
+    if (errno != EOPNOTSUPP) {
+      perror("fallocate");
+      return -1;
+    }
+    /* File system cannot preallocate; sparse extension still
+     * saves size updates on every allocation */
+    if (ftruncate(fd, new_end) == -1) {
+      perror("ftruncate");
+      return -1;
+    }
+  }
+  state->reserved_end = new_end;
+
+  /* Reserved space must never be handed out twice after restart */
+  MSync(mapping, sizeof(struct FileMeta));
+
+  return 0;
+}
+
+
+/*
+ * Bump -
+ * take 'count' bytes from never used space.
+ * Alignment gap is kept for small records.
+*/
+static off_t Bump(int fd, char* mapping, struct AllocState* state,
+                  struct Redo* redo, off_t count, off_t alignment) {
+  off_t offset = (state->end + alignment - 1) / alignment * alignment;
+
+  if (Reserve(fd, mapping, state, offset + count) == -1) {
+    return -1;
+  }
+
+  FreeExtentLocked(fd, state, redo, state->end, offset - state->end);
+  state->end = offset + count;
+
+  return offset;
+}
+
+
+/*
+ * Allocate -
+ * place record 'buf' into the tree file;
+ * it takes ExtentSize(count) bytes.
+ * Freed extent of fitting size class is reused first;
+ * remainder of a bigger extent goes back to free lists.
+ *
+ * Returns:
+ * @offset: record's offset in file, or -1 on failure.
+*/
+off_t Allocate(int fd, char* mapping, const char* buf, off_t count,
+               struct Wal* wal) {
+  uint64_t trace = TraceBegin();
+  if (LockAllocator(fd) == -1) {
+    return -1;
+  }
+  struct AllocState* state = GetState(fd, mapping);
+  struct Redo redo = {0};
+
+  off_t size = ExtentSize(count);
+  StatsAdd(STATS_ALLOCATE_CALLS, 1);
+  StatsAdd(STATS_ALLOCATE_BYTES, size);
+
+  off_t offset = -1;
+  for (int i = ClassUp(size); i < ALLOCATE_CLASSES; ++i) {
+    if (state->free_extents[i] == 0) {
+      continue;
+    }
+    offset = state->free_extents[i];
+    state->free_extents[i] = NextFree(fd, offset);
+    state->free_bytes -= ClassSize(i);
+    FreeExtentLocked(fd, state, &redo, offset + size, ClassSize(i) - size);
+    break;
+  }
+  if (offset == -1) {
+    offset = Bump(fd, mapping, state, &redo, size, 1);
+  }
+
+  if (offset != -1) {
+    (void)pwrite(fd, buf, count, offset);
+    RedoAdd(&redo, offset, buf, count);
+    RedoLog(wal, mapping, &redo);
+  }
+
+  UnlockAllocator(fd);
+  TraceEnd(TRACE_ALLOCATE, trace, offset, 0);
+
+  return offset;
+}
+
+
+/*
+ * AllocatePage -
+ * place node 'buf' into page aligned place of the tree file.
+ * Freed node pages are reused first.
+ *
+ * Returns:
+ * @offset: node's offset in file, or -1 on failure.
+*/
+off_t AllocatePage(int fd, char* mapping, const char* buf, off_t count,
+                   struct Wal* wal) {
+  uint64_t trace = TraceBegin();
+  if (LockAllocator(fd) == -1) {
+    return -1;
+  }
+  struct AllocState* state = GetState(fd, mapping);
+  struct Redo redo = {0};
+  StatsAdd(STATS_ALLOCATE_CALLS, 1);
+  StatsAdd(STATS_ALLOCATE_BYTES, count);
+
+  off_t offset;
+  if (state->free_pages != 0 && state->page_size == count) {
+    offset = state->free_pages;
+    state->free_pages = NextFree(fd, offset);
+    --state->free_pages_count;
+  } else {
+    offset = Bump(fd, mapping, state, &redo, count, ALLOCATE_PAGE);
+  }
+
+  if (offset != -1) {
+    (void)pwrite(fd, buf, count, offset);
+    /* Page is logged as zeroes: its content is logged by the node owner */
+    RedoAdd(&redo, offset, NULL, count);
+    RedoLog(wal, mapping, &redo);
+  }
+
+  UnlockAllocator(fd);
+  TraceEnd(TRACE_ALLOCATE, trace, offset, 0);
+
+  return offset;
+}
+
+
+/*
+ * AllocateRun -
+ * take 'count' bytes, page aligned, from never used space:
+ * freed pages and extents are not reused, so runs taken one after
+ * another follow each other in file (see BLinkTree::Defragment).
+ * Caller writes and logs the content; pieces of run are freed
+ * as nodes and records they hold.
+ *
+ * Returns:
+ * @offset: run's offset in file, or -1 on failure.
+*/
+off_t AllocateRun(int fd, char* mapping, off_t count, struct Wal* wal) {
+  uint64_t trace = TraceBegin();
+  if (LockAllocator(fd) == -1) {
+    return -1;
+  }
+  struct AllocState* state = GetState(fd, mapping);
+  struct Redo redo = {0};
+  StatsAdd(STATS_ALLOCATE_CALLS, 1);
+  StatsAdd(STATS_ALLOCATE_BYTES, count);
+
+  off_t offset = Bump(fd, mapping, state, &redo, count, ALLOCATE_PAGE);
+  if (offset != -1) {
+    RedoLog(wal, mapping, &redo);
+  }
+
+  UnlockAllocator(fd);
+  TraceEnd(TRACE_ALLOCATE, trace, offset, 0);
+
+  return offset;
+}
+
+
+/*
+ * FreeExtent -
+ * give back extent of record of 'count' bytes.
+ * Caller guarantees nobody can reach the record anymore.
+*/
+void FreeExtent(int fd, char* mapping, off_t offset, off_t count,
+                struct Wal* wal) {
+  if (LockAllocator(fd) == -1) {
+    return;
+  }
+  struct AllocState* state = GetState(fd, mapping);
+
+  struct Redo redo = {0};
+  FreeExtentLocked(fd, state, &redo, offset, ExtentSize(count));
+  RedoLog(wal, mapping, &redo);
+
+  UnlockAllocator(fd);
+}
+
+
+/*
+ * FreeRemainder -
+ * give back 'size' bytes at 'offset' left over from an extent
+ * (not an extent by itself): only as much as a size class below
+ * 'size' covers goes back, the rest stays unused.
+*/
+void FreeRemainder(int fd, char* mapping, off_t offset, off_t size,
+                   struct Wal* wal) {
+  if (LockAllocator(fd) == -1) {
+    return;
+  }
+  struct AllocState* state = GetState(fd, mapping);
+
+  struct Redo redo = {0};
+  FreeExtentLocked(fd, state, &redo, offset, size);
+  RedoLog(wal, mapping, &redo);
+
+  UnlockAllocator(fd);
+}
+
+
+/*
+ * FreePage -
+ * give back node page.
+ * Caller guarantees nobody can reach the node anymore.
+*/
+void FreePage(int fd, char* mapping, off_t offset, off_t count,
+              struct Wal* wal) {
+  if (LockAllocator(fd) == -1) {
+    return;
+  }
+  struct AllocState* state = GetState(fd, mapping);
+
+  struct Redo redo = {0};
+  if (state->free_pages == 0) {
+    state->page_size = count;
+  }
+  if (state->page_size == count) {
+    state->free_pages = PushFree(fd, &redo, state->free_pages, offset);
+    ++state->free_pages_count;
+  } else {
+    FreeExtentLocked(fd, state, &redo, offset, count);
+  }
+  RedoLog(wal, mapping, &redo);
 
-  return record_offset;
+  UnlockAllocator(fd);
 }
@@ -1,8 +1,62 @@
 #ifndef ALLOCATE_H
 #define ALLOCATE_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
-off_t Allocate(int fd, const char* buf, off_t count);
+#define ALLOCATE_STATE_MAGIC 0x434f4c4c414b4c42ULL /* "BLKALLOC" */
+
+#define ALLOCATE_PAGE 4096
+#define ALLOCATE_MIN_CHUNK ((off_t)1 << 20) /* file grows by 1MiB at least */
+
+/* Record extents are rounded up to size classes:
+ * 4 classes per power of two (16, 20, 24, 28, 32, 40, ...),
+ * so at most 1/4 of extent is wasted. Records bigger than
+ * the last class (224MiB) take exactly their size. */
+#define ALLOCATE_MIN_EXTENT 16
+#define ALLOCATE_CLASSES 96
+
+/* Free space state of tree file; lives in FileMeta page.
+ * All-zero state means "not initialized yet": it is built lazily
+ * from the file size, so files written by TouchTreeFile
+ * and BulkLoader need no special preparation.
+ * Freed extents are linked through their first 8 bytes. */
+struct AllocState {
+  uint64_t magic;
+
+  off_t end; /* everything before 'end' is handed out */
+  off_t reserved_end; /* file is preallocated up to here */
+
+  off_t free_pages; /* head of list of freed node pages */
+  off_t page_size; /* size of every page in 'free_pages' */
+  uint64_t free_pages_count;
+
+  off_t free_extents[ALLOCATE_CLASSES]; /* heads of freed lists by class */
+  uint64_t free_bytes;
+} __attribute__((packed));
+
+
+/* Every change of allocator state is logged to 'wal' (if not NULL)
+ * as one group, before allocator lock is released. */
+struct Wal;
+
+off_t ExtentSize(off_t count);
+
+off_t Allocate(int fd, char* mapping, const char* buf, off_t count,
+               struct Wal* wal);
+
+off_t AllocatePage(int fd, char* mapping, const char* buf, off_t count,
+                   struct Wal* wal);
+
+off_t AllocateRun(int fd, char* mapping, off_t count, struct Wal* wal);
+
+void FreeExtent(int fd, char* mapping, off_t offset, off_t count,
+                struct Wal* wal);
+
+void FreeRemainder(int fd, char* mapping, off_t offset, off_t size,
+                   struct Wal* wal);
+
+void FreePage(int fd, char* mapping, off_t offset, off_t count,
+              struct Wal* wal);
 
 #endif  // ALLOCATE_H
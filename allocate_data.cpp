@@ -1,9 +1,69 @@
 #include "allocate_data.hpp"
 
+#include <cstring>
+
 #include "allocate.h"
+#include "checksum.h"
+
+
+std::size_t RecordSize(std::size_t length) {
+  return sizeof(RecordHeader) + length;
+}
+
+
+/*
+ * EncodeRecord -
+ * append header and bytes of 'record' to 'out'.
+*/
+void EncodeRecord(std::string& out, std::string_view record) {
+  RecordHeader header {
+    .length = static_cast<std::uint32_t>(record.size()),
+    .checksum = Crc32c(0, record.data(), record.size())
+  };
+
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.append(record);
+}
+
+
+/*
+ * RecordValue -
+ * bytes of record whose header starts at 'raw'; no copy is made.
+*/
+std::string_view RecordValue(const char* raw) {
+  RecordHeader header;
+  std::memcpy(&header, raw, sizeof(header));
 
+  return {raw + sizeof(header), header.length};
+}
+
+
+bool RecordIntact(const char* raw) {
+  RecordHeader header;
+  std::memcpy(&header, raw, sizeof(header));
+
+  return Crc32c(0, raw + sizeof(header), header.length) == header.checksum;
+}
 
-off_t AllocateRecord(int fd, std::string_view record) {
+
+off_t AllocateRecord(int fd, char* mapping, std::string_view record,
+                     Wal* wal) {
   // std::cout << "Allocate record: " << record.size() << "\n";
-  return Allocate(fd, record.data(), static_cast<off_t>(record.size()));
+  std::string encoded;
+  encoded.reserve(RecordSize(record.size()));
+  EncodeRecord(encoded, record);
+
+  return Allocate(fd, mapping, encoded.data(),
+                  static_cast<off_t>(encoded.size()), wal);
+}
+
+
+/*
+ * FreeRecord -
+ * give back record of 'length' bytes (not counting header).
+*/
+void FreeRecord(int fd, char* mapping, off_t record_ptr, std::size_t length,
+                Wal* wal) {
+  FreeExtent(fd, mapping, record_ptr,
+             static_cast<off_t>(RecordSize(length)), wal);
 }
@@ -2,28 +2,69 @@
 #define ALLOCATE_DATA_HPP
 
 #include <cstddef>
+#include <cstdint>
+#include <string>
 #include <string_view>
 
 #include <sys/types.h>
 
 #include "allocate.h"
+#include "checksum.h"
 #include "node.hpp"
+#include "wal.h"
 
 
+/*
+ * RecordHeader -
+ * every record in file is prefixed by its length and CRC32C of the bytes,
+ * so value can be read back (and checked) knowing only its offset.
+ * Record takes ExtentSize(RecordSize(length)) bytes of file.
+*/
+struct __attribute__((packed)) RecordHeader {
+  std::uint32_t length;
+  std::uint32_t checksum;
+};
+
+
+template <std::size_t KeysCount>
+off_t AllocateNode(int fd, char* mapping, Wal* wal = nullptr);
+
 template <std::size_t KeysCount>
-off_t AllocateNode(int fd);
+void FreeNode(int fd, char* mapping, off_t node_ptr, Wal* wal = nullptr);
+
+std::size_t RecordSize(std::size_t length);
+
+void EncodeRecord(std::string& out, std::string_view record);
+
+std::string_view RecordValue(const char* raw);
 
-off_t AllocateRecord(int fd, std::string_view record);
+bool RecordIntact(const char* raw);
+
+off_t AllocateRecord(int fd, char* mapping, std::string_view record,
+                     Wal* wal = nullptr);
+
+void FreeRecord(int fd, char* mapping, off_t record_ptr, std::size_t length,
+                Wal* wal = nullptr);
 
 
 
 template <std::size_t KeysCount>
-off_t AllocateNode(int fd) {
+off_t AllocateNode(int fd, char* mapping, Wal* wal) {
   // std::cout << "Allocate node: " << sizeof(Node<KeysCount>) << "\n";
 
-  char buf[sizeof(Node<KeysCount>)] = {0};
+  /* Not on stack: page-filling nodes may be megabytes */
+  static const char buf[sizeof(Node<KeysCount>)] = {0};
+
+  /* Nodes are page aligned: node's version word is accessed atomically,
+   * and one node never spans more pages than necessary.
+   * Reused page is zeroed by the same write. */
+  return AllocatePage(fd, mapping, buf, sizeof(Node<KeysCount>), wal);
+}
+
 
-  return Allocate(fd, buf, sizeof(Node<KeysCount>));
+template <std::size_t KeysCount>
+void FreeNode(int fd, char* mapping, off_t node_ptr, Wal* wal) {
+  FreePage(fd, mapping, node_ptr, sizeof(Node<KeysCount>), wal);
 }
 
 #endif  // ALLOCATE_DATA_HPP
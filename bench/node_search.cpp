@@ -0,0 +1,115 @@
+#include "node.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * node_search - compare intra-node search kernels.
+ *
+ * Usage: node_search [lookups]
+ *
+ * For several node orders fills a leaf with sorted keys
+ * (dense or random), then times ScanNodeFor and GetRecordByKey
+ * of every kernel on the same probe sequence.
+ * Results of all kernels are checked against StdSearch.
+*/
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+  double ns_per_lookup;
+  std::uint64_t checksum;
+};
+
+
+template <std::size_t KeysCount, typename Search>
+Result Run(const std::vector<std::uint64_t>& keys,
+           const std::vector<std::uint64_t>& probes) {
+  auto node = std::make_unique<Node<KeysCount, std::uint64_t, off_t, Search>>();
+  node->InitEmpty(0);
+  for (auto key : keys) {
+    node->Append(key, static_cast<off_t>(key + 1));
+  }
+  node->Seal(0, keys.back() + 1);
+
+  std::uint64_t checksum = 0;
+  auto start = Clock::now();
+  for (auto probe : probes) {
+    checksum += node->ScanNodeFor(probe);
+    checksum += node->GetRecordByKey(probe);
+  }
+  auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start);
+
+  return {elapsed.count() / (2.0 * probes.size()), checksum};
+}
+
+
+template <std::size_t KeysCount>
+bool Compare(const char* distribution, std::size_t lookups, bool dense) {
+  constexpr std::size_t size = 2 * KeysCount;
+  std::mt19937_64 rng{KeysCount};
+
+  std::vector<std::uint64_t> keys(size);
+  std::uint64_t key = 0;
+  for (auto& k : keys) {
+    key += dense ? 1 : 1 + rng() % (1ull << 40);
+    k = key;
+  }
+
+  /* Half of probes hit existing keys, half fall between them */
+  std::vector<std::uint64_t> probes(lookups);
+  for (auto& probe : probes) {
+    probe = keys[rng() % size] - (rng() & 1);
+  }
+
+  Result expected = Run<KeysCount, StdSearch>(keys, probes);
+  bool ok = true;
+
+  auto report = [&](const char* name, Result result) {
+    bool match = result.checksum == expected.checksum;
+    ok = ok && match;
+    printf("  %-14s %8.2f ns%s\n", name, result.ns_per_lookup,
+           match ? "" : "  MISMATCH");
+  };
+
+  printf("KeysCount %zu, %zu keys, %s:\n", KeysCount, size, distribution);
+  report("std", expected);
+  report("branchless", Run<KeysCount, BranchlessSearch>(keys, probes));
+  report("interpolation", Run<KeysCount, InterpolationSearch>(keys, probes));
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    report("avx2", Run<KeysCount, Avx2Search>(keys, probes));
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    report("avx512", Run<KeysCount, Avx512Search>(keys, probes));
+  }
+#endif
+  report("auto", Run<KeysCount, AutoSearch>(keys, probes));
+
+  return ok;
+}
+
+
+template <std::size_t KeysCount>
+bool CompareAll(std::size_t lookups) {
+  bool ok = Compare<KeysCount>("dense", lookups, true);
+  return Compare<KeysCount>("random", lookups, false) && ok;
+}
+
+
+int main(int argc, char** argv) {
+  std::size_t lookups = argc > 1 ? std::stoull(argv[1]) : 1 << 20;
+
+  bool ok = CompareAll<2>(lookups);
+  ok = CompareAll<8>(lookups) && ok;
+  ok = CompareAll<32>(lookups) && ok;
+  ok = CompareAll<127>(lookups) && ok;
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,564 @@
+#include "blinktree.hpp"
+#include "bulk_load.hpp"
+#include "trace.h"
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * ycsb - YCSB core workloads against a tree file.
+ *
+ * Usage: ycsb [-w workloads] [-d distributions] [-k orders]
+ *             [-p processes] [-t threads] [-n records] [-o operations]
+ *             [-v value-size] [-f tree-file] [-s] [-b frames]
+ *
+ *   -w  letters of workloads to run, default ABCDEF:
+ *         A  50% read, 50% update
+ *         B  95% read, 5% update
+ *         C  100% read
+ *         D  95% read of recent keys, 5% insert
+ *         E  95% scan of up to 100 records, 5% insert
+ *         F  50% read, 50% read-modify-write
+ *   -d  comma separated key distributions, default
+ *       uniform,zipfian,sequential
+ *   -k  comma separated orders (4, 32, 128, page), default 4,32,page
+ *   -p  processes, each with its own tree handle, default 1
+ *   -t  threads per process sharing the handle, default 1
+ *   -n  records loaded before every run, default 100000
+ *   -o  operations of every run split among all threads, default 100000
+ *   -v  record size in bytes, default 100
+ *   -f  tree file, default ./database/ycsb.bin
+ *   -s  commit every write synchronously (WAL flush), default off
+ *   -b  keep nodes in a buffer pool of that many frames instead of
+ *       the mapping (see BufferPool); needs -p 1, default off
+ *
+ * Every (order, workload, distribution) run starts from a freshly
+ * bulk loaded file with keys 0 .. records-1. Update removes
+ * and inserts the key again, as the tree has no in-place update.
+ * Workload D picks keys by recency: rank drawn from the distribution
+ * is counted back from the newest key.
+ *
+ * Output is CSV, one row per run: throughput of the whole run
+ * (first operation of any thread to last one) and latency
+ * percentiles of single operations.
+*/
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t kMaxScanLength = 100;
+
+
+/*
+ * Histogram -
+ * latencies in ns, 32 buckets per power of two (error within 3%).
+ * Lives in memory shared by all processes of a run.
+*/
+struct Histogram {
+  constexpr static int kSubBits = 5;
+  constexpr static int kLinear = 2 << kSubBits;
+  constexpr static int kBuckets = kLinear + (64 - kSubBits - 1) * (1 << kSubBits);
+
+  std::uint64_t buckets[kBuckets];
+
+  static int Index(std::uint64_t ns) {
+    if (ns < kLinear) {
+      return static_cast<int>(ns);
+    }
+    int exponent = 63 - std::countl_zero(ns);
+    int sub = (ns >> (exponent - kSubBits)) & ((1 << kSubBits) - 1);
+    return kLinear + (exponent - kSubBits - 1) * (1 << kSubBits) + sub;
+  }
+
+  static std::uint64_t Lower(int index) {
+    if (index < kLinear) {
+      return index;
+    }
+    int exponent = (index - kLinear) / (1 << kSubBits) + kSubBits + 1;
+    std::uint64_t sub = (index - kLinear) % (1 << kSubBits);
+    return ((1ull << kSubBits) + sub) << (exponent - kSubBits);
+  }
+
+  void Add(const Histogram& other) {
+    for (int i = 0; i < kBuckets; ++i) {
+      if (other.buckets[i] != 0) {
+        __atomic_fetch_add(&buckets[i], other.buckets[i], __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  double Percentile(double fraction) const {
+    std::uint64_t total = 0;
+    for (auto count : buckets) {
+      total += count;
+    }
+    std::uint64_t rank = static_cast<std::uint64_t>(std::ceil(fraction * total));
+    std::uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= rank && seen > 0) {
+        return Lower(i) / 1000.0;
+      }
+    }
+    return 0;
+  }
+};
+
+
+/* State of one run shared by the driver and its processes */
+struct Shared {
+  std::atomic<std::uint64_t> ready;
+  std::atomic<std::uint64_t> done;
+  std::atomic<bool> go;
+  std::atomic<std::uint64_t> next_key; // next key to insert
+  Histogram latency;
+};
+
+
+/*
+ * Zipfian -
+ * ranks 0 .. n-1 with P(rank) ~ 1 / (rank + 1)^theta,
+ * generator of Gray et al. as used by YCSB.
+*/
+class Zipfian {
+public:
+  explicit Zipfian(std::uint64_t n, double theta = 0.99)
+    : n_{n}, theta_{theta} {
+    double zeta2 = Zeta(2);
+    zetan_ = Zeta(n);
+    alpha_ = 1.0 / (1.0 - theta);
+    eta_ = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+  }
+
+  std::uint64_t Next(double u) const {
+    double uz = u * zetan_;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < 1.0 + std::pow(0.5, theta_)) {
+      return 1;
+    }
+    auto rank = static_cast<std::uint64_t>(
+      n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+    return std::min(rank, n_ - 1);
+  }
+
+private:
+  double Zeta(std::uint64_t n) const {
+    double sum = 0;
+    for (std::uint64_t i = 1; i <= n; ++i) {
+      sum += 1.0 / std::pow(static_cast<double>(i), theta_);
+    }
+    return sum;
+  }
+
+  std::uint64_t n_;
+  double theta_;
+  double zetan_;
+  double alpha_;
+  double eta_;
+};
+
+
+enum class Distribution { kUniform, kZipfian, kSequential };
+
+struct Config {
+  std::string workloads = "ABCDEF";
+  std::vector<std::string> distributions = {"uniform", "zipfian", "sequential"};
+  std::vector<std::string> orders = {"4", "32", "page"};
+  int processes = 1;
+  int threads = 1;
+  std::uint64_t records = 100000;
+  std::uint64_t operations = 100000;
+  std::size_t value_size = 100;
+  std::string path = "./database/ycsb.bin";
+  bool sync_commit = false;
+  std::size_t frames = 0;
+};
+
+
+/*
+ * KeyChooser -
+ * ranks in [0, n) of one thread: uniform, zipfian with hot ranks
+ * scattered over the key space, or consecutive starting at thread's
+ * own offset.
+*/
+class KeyChooser {
+public:
+  KeyChooser(Distribution distribution, const Zipfian& zipfian,
+             std::uint64_t start, std::uint64_t seed)
+    : distribution_{distribution}, zipfian_{zipfian},
+      cursor_{start}, rng_{seed} {}
+
+  std::uint64_t Next(std::uint64_t n, bool scrambled = true) {
+    switch (distribution_) {
+    case Distribution::kUniform:
+      return rng_() % n;
+    case Distribution::kZipfian: {
+      std::uint64_t rank = zipfian_.Next(Uniform());
+      return scrambled ? Fnv(rank) % n : rank % n;
+    }
+    case Distribution::kSequential:
+      return cursor_++ % n;
+    }
+    return 0;
+  }
+
+  double Uniform() {
+    return (rng_() >> 11) * 0x1.0p-53;
+  }
+
+private:
+  static std::uint64_t Fnv(std::uint64_t value) {
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (int i = 0; i < 8; ++i) {
+      hash = (hash ^ (value & 0xff)) * 0x100000001b3ull;
+      value >>= 8;
+    }
+    return hash;
+  }
+
+  Distribution distribution_;
+  const Zipfian& zipfian_;
+  std::uint64_t cursor_;
+  std::mt19937_64 rng_;
+};
+
+
+static std::string Value(std::uint64_t key, std::size_t size) {
+  std::string value(size, 'a' + key % 26);
+  return value;
+}
+
+
+template <std::size_t KeysCount>
+void Load(const Config& config) {
+  BulkLoader<KeysCount> loader{config.path};
+  for (std::uint64_t key = 0; key < config.records; ++key) {
+    loader.Add(key, Value(key, config.value_size));
+  }
+  loader.Finish();
+}
+
+
+/*
+ * Worker -
+ * one thread of one process: waits for the start signal,
+ * runs its share of operations and adds its latencies to 'shared'.
+*/
+template <std::size_t KeysCount>
+void Worker(BLinkTree<KeysCount>& tree, const Config& config,
+            char workload, Distribution distribution,
+            const Zipfian& zipfian, Shared* shared, int worker) {
+  int workers = config.processes * config.threads;
+  std::uint64_t operations = config.operations / workers
+    + (static_cast<std::uint64_t>(worker) < config.operations % workers);
+  KeyChooser chooser{distribution, zipfian,
+                     config.records / workers * worker,
+                     0x9e3779b97f4a7c15ull * (worker + 1)};
+  auto histogram = std::make_unique<Histogram>();
+  std::string buffer;
+
+  auto read = [&](std::uint64_t key) {
+    auto guard = tree.Get(key);
+    if (guard) {
+      buffer.assign(guard.Value());
+    }
+  };
+  auto update = [&](std::uint64_t key) {
+    tree.Remove(key);
+    tree.Insert(key, Value(key + 1, config.value_size));
+  };
+  auto insert = [&] {
+    std::uint64_t key = shared->next_key.fetch_add(1);
+    tree.Insert(key, Value(key, config.value_size));
+  };
+  auto existing = [&] {
+    return shared->next_key.load(std::memory_order_relaxed);
+  };
+
+  ++shared->ready;
+  while (!shared->go.load(std::memory_order_acquire)) {
+    sched_yield();
+  }
+
+  for (std::uint64_t i = 0; i < operations; ++i) {
+    double dice = chooser.Uniform();
+    auto start = Clock::now();
+
+    switch (workload) {
+    case 'A':
+    case 'B': {
+      std::uint64_t key = chooser.Next(config.records);
+      if (dice < (workload == 'A' ? 0.5 : 0.95)) {
+        read(key);
+      } else {
+        update(key);
+      }
+      break;
+    }
+    case 'C':
+      read(chooser.Next(config.records));
+      break;
+    case 'D':
+      if (dice < 0.95) {
+        std::uint64_t newest = existing() - 1;
+        std::uint64_t rank = chooser.Next(newest + 1, false);
+        read(newest - rank);
+      } else {
+        insert();
+      }
+      break;
+    case 'E':
+      if (dice < 0.95) {
+        std::uint64_t key = chooser.Next(existing());
+        std::size_t length = 1 + chooser.Uniform() * kMaxScanLength;
+        std::size_t scanned = 0;
+        tree.ForEach(key, std::numeric_limits<std::uint64_t>::max(),
+                     [&](std::uint64_t, off_t) {
+                       return ++scanned < length;
+                     });
+      } else {
+        insert();
+      }
+      break;
+    case 'F': {
+      std::uint64_t key = chooser.Next(config.records);
+      read(key);
+      if (dice >= 0.5) {
+        if (!buffer.empty()) {
+          ++buffer[0];
+        }
+        tree.Remove(key);
+        tree.Insert(key, buffer);
+      }
+      break;
+    }
+    }
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count();
+    ++histogram->buckets[Histogram::Index(ns)];
+  }
+
+  shared->latency.Add(*histogram);
+  ++shared->done;
+}
+
+
+/*
+ * RunOne -
+ * load file, fork processes with their threads, time the run.
+ * Returns: false if some process failed
+*/
+template <std::size_t KeysCount>
+bool RunOne(const Config& config, const std::string& order,
+            char workload, const std::string& distribution_name,
+            Distribution distribution, const Zipfian& zipfian) {
+  Load<KeysCount>(config);
+
+  auto* shared = static_cast<Shared*>(mmap(
+    nullptr, sizeof(Shared), PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  new (shared) Shared{};
+  shared->next_key = config.records;
+
+  for (int process = 0; process < config.processes; ++process) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      BLinkTree<KeysCount> tree{config.path, config.sync_commit, {},
+                                BufferPoolOptions{.frames = config.frames}};
+      std::vector<std::thread> threads;
+      for (int thread = 0; thread < config.threads; ++thread) {
+        threads.emplace_back(Worker<KeysCount>, std::ref(tree),
+                             std::cref(config), workload, distribution,
+                             std::cref(zipfian), shared,
+                             process * config.threads + thread);
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      /* _exit skips atexit handlers */
+      TraceDump();
+      _exit(EXIT_SUCCESS);
+    }
+  }
+
+  std::uint64_t workers = config.processes * config.threads;
+  bool ok = true;
+  auto wait_all = [&](std::atomic<std::uint64_t>& counter) {
+    while (counter.load() < workers) {
+      int status;
+      pid_t pid = waitpid(-1, &status, WNOHANG);
+      if (pid > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        return false;
+      }
+      usleep(50);
+    }
+    return true;
+  };
+
+  ok = wait_all(shared->ready);
+  auto start = Clock::now();
+  shared->go.store(true, std::memory_order_release);
+  ok = ok && wait_all(shared->done);
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  int status;
+  while (wait(&status) > 0) {
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+  }
+
+  if (ok) {
+    printf("%c,%s,%s,%zu,%d,%d,%llu,%llu,%.3f,%.0f,%.2f,%.2f,%.2f\n",
+           workload, distribution_name.c_str(), order.c_str(), KeysCount,
+           config.processes, config.threads,
+           static_cast<unsigned long long>(config.records),
+           static_cast<unsigned long long>(config.operations),
+           seconds, config.operations / seconds,
+           shared->latency.Percentile(0.50),
+           shared->latency.Percentile(0.99),
+           shared->latency.Percentile(0.999));
+    fflush(stdout);
+  } else {
+    fprintf(stderr, "ycsb: run %c/%s/%s failed\n",
+            workload, distribution_name.c_str(), order.c_str());
+  }
+
+  munmap(shared, sizeof(Shared));
+  return ok;
+}
+
+
+template <std::size_t KeysCount>
+bool RunOrder(const Config& config, const std::string& order,
+              const Zipfian& zipfian) {
+  bool ok = true;
+  for (char workload : config.workloads) {
+    for (const auto& name : config.distributions) {
+      Distribution distribution = name == "zipfian" ? Distribution::kZipfian
+        : name == "sequential" ? Distribution::kSequential
+        : Distribution::kUniform;
+      ok = RunOne<KeysCount>(config, order, workload, name,
+                             distribution, zipfian) && ok;
+    }
+  }
+  return ok;
+}
+
+
+static std::vector<std::string> Split(const char* list) {
+  std::vector<std::string> items;
+  std::string_view rest{list};
+  while (!rest.empty()) {
+    std::size_t comma = std::min(rest.find(','), rest.size());
+    items.emplace_back(rest.substr(0, comma));
+    rest.remove_prefix(std::min(comma + 1, rest.size()));
+  }
+  return items;
+}
+
+
+static bool Valid(const Config& config) {
+  for (char workload : config.workloads) {
+    if (workload < 'A' || workload > 'F') {
+      fprintf(stderr, "ycsb: unknown workload %c\n", workload);
+      return false;
+    }
+  }
+  for (const auto& name : config.distributions) {
+    if (name != "uniform" && name != "zipfian" && name != "sequential") {
+      fprintf(stderr, "ycsb: unknown distribution %s\n", name.c_str());
+      return false;
+    }
+  }
+  for (const auto& order : config.orders) {
+    if (order != "4" && order != "32" && order != "128" && order != "page") {
+      fprintf(stderr, "ycsb: unsupported order %s\n", order.c_str());
+      return false;
+    }
+  }
+  if (config.frames > 0 && config.processes != 1) {
+    fprintf(stderr, "ycsb: buffer pool handle is the only one, use -p 1\n");
+    return false;
+  }
+  return config.processes > 0 && config.threads > 0 && config.records > 0;
+}
+
+
+int main(int argc, char** argv) {
+  Config config;
+  int option;
+  while ((option = getopt(argc, argv, "w:d:k:p:t:n:o:v:f:sb:")) != -1) {
+    switch (option) {
+    case 'w': config.workloads = optarg; break;
+    case 'd': config.distributions = Split(optarg); break;
+    case 'k': config.orders = Split(optarg); break;
+    case 'p': config.processes = std::atoi(optarg); break;
+    case 't': config.threads = std::atoi(optarg); break;
+    case 'n': config.records = std::strtoull(optarg, nullptr, 10); break;
+    case 'o': config.operations = std::strtoull(optarg, nullptr, 10); break;
+    case 'v': config.value_size = std::strtoull(optarg, nullptr, 10); break;
+    case 'f': config.path = optarg; break;
+    case 's': config.sync_commit = true; break;
+    case 'b': config.frames = std::strtoull(optarg, nullptr, 10); break;
+    default:
+      fprintf(stderr, "Usage: %s [-w ABCDEF] [-d uniform,zipfian,sequential] "
+              "[-k 4,32,128,page] [-p processes] [-t threads] [-n records] "
+              "[-o operations] [-v value-size] [-f tree-file] [-s] "
+              "[-b frames]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!Valid(config)) {
+    return EXIT_FAILURE;
+  }
+
+  /* Shared by all threads read-only, built once: zeta takes O(records) */
+  Zipfian zipfian{config.records};
+
+  printf("workload,distribution,order,keys_count,processes,threads,"
+         "records,operations,seconds,ops_per_sec,p50_us,p99_us,p999_us\n");
+  bool ok = true;
+  for (const auto& order : config.orders) {
+    if (order == "4") {
+      ok = RunOrder<4>(config, order, zipfian) && ok;
+    } else if (order == "32") {
+      ok = RunOrder<32>(config, order, zipfian) && ok;
+    } else if (order == "128") {
+      ok = RunOrder<128>(config, order, zipfian) && ok;
+    } else {
+      ok = RunOrder<KeysPerPage<4096>>(config, order, zipfian) && ok;
+    }
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
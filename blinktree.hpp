@@ -1,28 +1,127 @@
 #ifndef BLINKTREE_HPP
 #define BLINKTREE_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
 #include <stack>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "allocate_data.hpp"
+#include "buffer_pool.hpp"
+#include "coroutine.hpp"
+#include "epoch.h"
 #include "file_meta.h"
 #include "locks.hpp"
-#include "memory_sync.h"
+#include "mapping.h"
 #include "node.hpp"
+#include "stats.h"
+#include "trace.h"
+#include "versions.h"
+#include "wal.h"
 
 
 
 
+/* Zero threads: one per CPU */
+struct VerifyOptions {
+  unsigned threads{0};
+  bool repair{false}; // insert separators missing from parents
+  std::size_t max_problems{32}; // descriptions kept in VerifyReport
+};
+
+
+/*
+ * VerifyReport -
+ * what BLinkTree::Verify has found. Orphans are nodes reached
+ * only through the link of their left sibling, as after a split
+ * interrupted before the parent got the separator: tree is still
+ * correct, only slower to search, until they are repaired.
+*/
+struct VerifyReport {
+  std::size_t nodes{0}; // visited, retired ones included
+  std::size_t levels{0};
+  std::size_t corrupt{0}; // checksum does not match
+  std::size_t malformed{0}; // flags, level, keys or fences are wrong
+  std::size_t broken_links{0}; // pointers leading out of file or astray
+  std::size_t orphans{0};
+  std::size_t repaired{0}; // orphans given their separators
+  std::vector<std::string> problems;
+
+  bool Ok() const {
+    return corrupt == 0 && malformed == 0 && broken_links == 0
+      && orphans == repaired;
+  }
+};
+
+
+
+/* One call of BLinkTree::Defragment visits at most 'pages' leaves */
+struct DefragOptions {
+  std::size_t pages{64};
+  bool records{false}; // move records too, each leaf's right after it
+};
+
+
+struct DefragStep {
+  std::size_t visited{0};
+  std::size_t moved{0};
+  bool done{false}; // pass got to the last leaf; next call starts over
+};
+
+
+/*
+ * LeafLocality -
+ * how leaves lie in file, in key order. Sibling is sequential if it
+ * follows the leaf closely enough for readahead to bring it in.
+*/
+struct LeafLocality {
+  std::size_t leaves{0};
+  std::size_t forward{0}; // right sibling lies later in file
+  std::size_t sequential{0};
+  double mean_distance{0}; // between leaf and its right sibling, in pages
+  std::size_t records{0};
+  std::size_t records_near{0}; // record follows its leaf closely
+};
+
+
+
+/*
+ * BLinkTree -
+ * handle of tree file. Processes open their own handles;
+ * threads of one process may share one.
+ * File is mapped into address range reserved at open, so
+ * node and record pointers stay valid while file grows;
+ * 'mapping_options' tune the reservation and huge pages.
+ * With 'pool_options' nodes are kept in a buffer pool of the handle
+ * instead (see BufferPool): such handle must be the only one open
+ * on the file, and one opened otherwise is refused.
+*/
 template <std::size_t KeysCount>
 class BLinkTree {
 private:
@@ -30,460 +129,3704 @@ private:
   using PtrType = off_t;
 
 public:
-  BLinkTree(std::string path);
+  BLinkTree(std::string path, bool sync_commit = true,
+            MappingOptions mapping_options = {},
+            BufferPoolOptions pool_options = {});
 
   ~BLinkTree();
 
-  auto/*PtrType*/ Search(KeyType key) const;
+  auto/*PtrType*/ Search(KeyType key);
+
+  class RecordGuard;
+
+  RecordGuard Get(KeyType key);
+
+  template <typename Callback>
+  void MultiGet(std::span<const KeyType> keys, Callback callback);
 
   void Insert(KeyType key, std::string_view record);
 
+  void InsertBatch(std::span<std::pair<KeyType, std::string_view>> batch);
+
   bool Remove(KeyType key);
 
   FileMeta ReadMeta() const;
 
   auto/*PtrType*/ GetRoot() const;
 
+  class ScanIterator;
+
+  ScanIterator Scan(KeyType lo, KeyType hi);
+
+  template <typename Callback>
+  void ForEach(KeyType lo, KeyType hi, Callback callback);
+
+  class SnapshotView;
+
+  SnapshotView Snapshot();
+
+  Task<PtrType> SearchAsync(KeyType key);
+
+  Task<void> InsertAsync(KeyType key, std::string_view record);
+
+  Task<bool> RemoveAsync(KeyType key);
+
+  template <typename Callback>
+  Task<void> ScanAsync(KeyType lo, KeyType hi, Callback callback);
+
+  void Sync();
+
+  std::size_t Compact();
+
+  VerifyReport Verify(VerifyOptions options = {});
+
+  DefragStep Defragment(DefragOptions options = {});
+
+  LeafLocality Locality();
+
+  TreeStats Stats() const;
+  void ResetStats();
+
 private:
+  class EpochGuard;
+  class WriteGuard;
+  class AsyncGuard;
+  class StatsGuard;
+  class TraceSpan;
+  /* Frames read without lock are not reused meanwhile */
+  using FrameGuard = typename BufferPool<KeysCount>::ReadGuard;
+
+  enum class SearchStep { kDescend, kFound, kRetry };
+
+  bool OptimisticSearch(KeyType key, PtrType& result);
+  SearchStep OptimisticStep(KeyType key, PtrType& current_ptr);
+  auto/*PtrType*/ LockedSearch(KeyType key);
+
+  bool OptimisticFindLeaf(KeyType key, PtrType& leaf_ptr);
+  auto/*PtrType*/ FindLeaf(KeyType key);
+  PtrType RMoveRight(KeyType key, PtrType current_ptr);
+  void FindLeaves(const KeyType* keys, std::size_t count,
+                  PtrType* leaf_ptrs, bool cold);
+  void PrefetchNode(PtrType ptr, bool cold);
+  static long MajorFaults();
+
+  std::size_t ReadLeaf(PtrType ptr, KeyType lo, KeyType hi,
+                       KeyType* keys, PtrType* ptrs,
+                       PtrType& link_ptr, KeyType& high_key);
+
+  void Readahead(PtrType ptr);
+
+  std::string_view ReadRecord(PtrType ptr);
+
+  bool InsertRecord(KeyType key, std::string_view record,
+                    PtrType leaf_ptr, std::stack<PtrType>& stack);
+  void InsertLocked(KeyType key, PtrType ptr, PtrType current_ptr,
+                    std::stack<PtrType>& stack);
+  auto/*PtrType*/ SplitNode(PtrType current_ptr,
+                            std::stack<PtrType>& stack,
+                            KeyType& key, PtrType& ptr);
+
   auto/*PtrType*/ MoveRight(KeyType key, PtrType current_ptr);
+  bool StepRight(KeyType key, PtrType& current_ptr, bool& coupled);
+
+  bool RemoveLocked(KeyType key, PtrType leaf_ptr);
+
+  std::size_t CompactLevel(std::uint32_t level);
+  bool MergeChildren(PtrType parent_ptr, std::size_t i);
+  std::size_t CollapseRoot();
+  void RetireNode(PtrType node_ptr);
+  void Preserve(PtrType node_ptr);
+  static void FreeDeferred(void* tree, off_t ptr, std::size_t size);
+  std::size_t ReclaimNodes();
+
+  struct VerifyEntry;
+  struct VerifyPart;
+  void VerifySegment(const std::vector<VerifyEntry>& entries,
+                     std::size_t begin, std::size_t end,
+                     std::uint32_t level, VerifyPart& part);
+  void VerifyRetired(VerifyPart& part);
+  bool RepairSeparator(PtrType orphan_ptr, KeyType key, std::uint32_t level);
+
+  bool DefragLeaf(bool records, DefragStep& step);
+  bool InPlace(const Node<KeysCount>* leaf, PtrType leaf_ptr, bool records,
+               PtrType& end);
+  void MoveRecords(Node<KeysCount>* leaf, PtrType begin);
 
   auto/*PtrType*/ UpdateDescend(KeyType key,
                                 std::stack<PtrType>& stack,
                                 std::uint32_t level);
+  PtrType DescendStep(KeyType key, PtrType node_ptr,
+                      const Node<KeysCount>* node,
+                      std::stack<PtrType>& stack);
+
+  Task<PtrType> UpdateDescendAsync(KeyType key, std::stack<PtrType>& stack,
+                                   AsyncGuard& guard);
+  Task<PtrType> MoveRightAsync(KeyType key, PtrType current_ptr,
+                               AsyncGuard& guard);
+  Task<void> FetchNode(PtrType ptr, AsyncGuard& guard);
+  bool NodeResident(PtrType ptr);
+  Task<void> WLockAsync(PtrType ptr, AsyncGuard& guard);
+  Task<void> CommitAsync(AsyncGuard& guard);
 
   Node<KeysCount>* GetRaw(PtrType ptr);
+  auto/*PtrType*/ NewNode();
+  void UnpinNode(PtrType ptr);
+  void DeleteNode(PtrType ptr);
 
+  void RLockNode(PtrType ptr);
+  bool TryRLockNode(PtrType ptr);
   Node<KeysCount>* RGetRawLocked(PtrType ptr);
-  void RDispatchNode(PtrType ptr);
+  void RDispatchNode(PtrType ptr, Node<KeysCount>* node);
 
   void WLockNode(PtrType ptr);
+  bool TryWLockNode(PtrType ptr);
   void UnlockNode(PtrType ptr);
 
-  void PinNodeInRAM(PtrType ptr);
-  void UnpinNode(PtrType ptr);
+  void LogNodes(std::initializer_list<PtrType> node_ptrs,
+                bool with_retired = false);
+  void LogMeta();
+  void Commit();
 
   void UpdateMappingIfNecessary(PtrType ptr);
   void UpdateMapping();
 
 private:
   int fd;
-  char* mapping;
-  size_t mapping_size;
+  LatchTable* latches{nullptr};
+  Wal* wal{nullptr};
+  EpochTable* epochs{nullptr};
+  VersionStore* versions{nullptr};
+  StatsTable* stats{nullptr};
+  bool sync_commit_;
+  Mapping region_;
+  char* mapping; // region_.base; never moves
+  std::unique_ptr<BufferPool<KeysCount>> pool_; // nodes, if not in mapping
+
+  std::mutex compaction_mutex_;
+
+  /* Where Defragment goes on; guarded by compaction_mutex_ */
+  KeyType defrag_key_{0}; // low key of the next leaf
+  PtrType defrag_left_{0}; // leaf before it, 0 at the start of a pass
+  PtrType defrag_end_{0}; // end of that leaf (and its records) in file
 
   std::string path_;
 
+  /* Odd version is never stable: first GetRoot reads meta */
+  mutable std::atomic<std::uint64_t> cached_meta_version_{1};
+  mutable std::atomic<PtrType> cached_root_{0};
+
+  std::atomic<PtrType> readahead_begin_{0};
+  std::atomic<PtrType> readahead_end_{0};
+
   constexpr static auto NodeSize = sizeof(Node<KeysCount>);
+  constexpr static int kOptimisticAttempts = 8;
+  constexpr static PtrType kReadaheadWindow = 32 * 4096;
+  /* Descents of MultiGet in flight together */
+  constexpr static std::size_t kMultiGetGroup = 16;
+  /* Turns a coroutine lets others run while kernel reads its node */
+  constexpr static int kFetchPauses = 64;
+  /* Fewer nodes of a level than this are not worth another thread */
+  constexpr static std::size_t kVerifyChunk = 256;
+};
+
+
+
+/* Node of level being verified: parent's pointer and its range */
+template <std::size_t KeysCount>
+struct BLinkTree<KeysCount>::VerifyEntry {
+  PtrType ptr;
+  KeyType lo;
+  KeyType hi;
+};
+
+
+/* What one thread has found on its part of a level */
+template <std::size_t KeysCount>
+struct BLinkTree<KeysCount>::VerifyPart {
+  VerifyReport report;
+  std::vector<VerifyEntry> children; // entries of the level below
+  std::vector<std::pair<VerifyEntry, std::uint32_t>> orphans; // with level
+  PtrType file_size;
+  PtrType root_ptr;
+  std::size_t max_problems;
+
+  void Problem(std::size_t& counter, PtrType ptr, const char* what) {
+    ++counter;
+    if (report.problems.size() < max_problems) {
+      report.problems.push_back("node " + std::to_string(ptr) + ": " + what);
+    }
+  }
+
+  bool InFile(PtrType ptr) const {
+    return ptr >= 4096 && ptr % 4096 == 0
+      && ptr + static_cast<PtrType>(NodeSize) <= file_size;
+  }
+};
+
+
+
+/*
+ * ScanIterator -
+ * ordered walk over live records with keys in [lo, hi).
+ * Entries are copied out one leaf at a time, so no lock is held
+ * between calls; leaves are followed by link pointers, and every leaf
+ * is read starting from previous leaf's high key, so concurrent
+ * splits and merges neither lose nor repeat entries.
+ * Iterator holds an epoch (see EpochGuard) while alive:
+ * the leaf it is going to read next is never reused.
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::ScanIterator {
+public:
+  ScanIterator(ScanIterator&& other);
+  ScanIterator& operator=(ScanIterator&&) = delete;
+
+  ScanIterator(const ScanIterator&) = delete;
+  ScanIterator& operator=(const ScanIterator&) = delete;
+
+  ~ScanIterator();
+
+  bool Valid() const;
+
+  auto/*KeyType*/ Key() const;
+  auto/*PtrType*/ Record() const;
+
+  void Next();
+
+private:
+  friend class BLinkTree;
+
+  ScanIterator(BLinkTree* tree, KeyType lo, KeyType hi);
+  ScanIterator(BLinkTree* tree, KeyType lo, KeyType hi, PtrType leaf_ptr);
+
+  void LoadLeaves();
+  void LoadLeaf();
+
+private:
+  BLinkTree* tree_;
+
+  PtrType leaf_ptr_; // next leaf to be read; 0 if none
+  KeyType resume_key_; // no entries below it are left
+  KeyType hi_;
+
+  std::size_t count_{0};
+  std::size_t pos_{0};
+
+  KeyType keys_[Node<KeysCount>::Capacity];
+  PtrType ptrs_[Node<KeysCount>::Capacity];
+};
+
+
+
+/*
+ * SnapshotView -
+ * read-only view of the tree as it was when taken (see Snapshot).
+ * Nothing is locked: node written since is read in the version its
+ * writer saved for the view (see Preserve), and records removed since
+ * are freed only when the last view of the tree is gone. Readers of
+ * the view and writers of the tree never wait for each other; writers
+ * only copy a node the first time they change it while views are open.
+ * View is used by one thread at a time and must not outlive the handle.
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::SnapshotView {
+public:
+  SnapshotView(SnapshotView&& other);
+  SnapshotView& operator=(SnapshotView&&) = delete;
+
+  SnapshotView(const SnapshotView&) = delete;
+  SnapshotView& operator=(const SnapshotView&) = delete;
+
+  ~SnapshotView();
+
+  auto/*PtrType*/ Search(KeyType key) const;
+
+  std::string_view Read(PtrType record_ptr) const;
+
+  template <typename Callback>
+  void ForEach(KeyType lo, KeyType hi, Callback callback) const;
+
+  std::uint64_t Epoch() const;
+
+private:
+  friend class BLinkTree;
+
+  SnapshotView(BLinkTree* tree, int slot, std::uint64_t epoch);
+
+  template <typename Reader>
+  auto ReadNode(PtrType ptr, Reader reader) const;
+  std::uint64_t Saved(std::uint64_t older) const;
+  bool Visible(PtrType ptr) const;
+  auto/*PtrType*/ FindLeaf(KeyType key) const;
+
+private:
+  BLinkTree* tree_;
+  int slot_; // in versions store; -1 if moved from
+  std::uint64_t epoch_;
+  PtrType root_ptr_{0};
+};
+
+
+
+/*
+ * StatsGuard -
+ * counters of the calling thread go to this tree's stats table,
+ * from modules below the tree as well (see stats.h),
+ * until the guard is gone.
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::StatsGuard {
+public:
+  explicit StatsGuard(StatsTable* stats): previous_{StatsBind(stats)} {}
+
+  StatsGuard(const StatsGuard&) = delete;
+  StatsGuard& operator=(const StatsGuard&) = delete;
+
+  ~StatsGuard() {
+    StatsRestore(previous_);
+  }
+
+private:
+  StatsSlot* previous_;
+};
+
+
+
+/*
+ * TraceSpan -
+ * span of 'kind' from construction to destruction,
+ * recorded if tracing is on (see trace.h).
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::TraceSpan {
+public:
+  explicit TraceSpan(TraceKind kind): kind_{kind}, begin_{TraceBegin()} {}
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  ~TraceSpan() {
+    TraceEnd(kind_, begin_, 0, 0);
+  }
+
+private:
+  TraceKind kind_;
+  std::uint64_t begin_;
+};
+
+
+
+/*
+ * EpochGuard -
+ * operation in progress: nodes merged away meanwhile
+ * keep their pages until it is over (see epoch.h),
+ * so lock free reads never land on a reused page.
+ * Operation's counters go to 'stats'.
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::EpochGuard {
+public:
+  EpochGuard(EpochTable* epochs, StatsTable* stats)
+    : stats_{stats}, epochs_{epochs} {
+    EpochEnter(epochs_);
+  }
+
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+
+  ~EpochGuard() {
+    EpochExit(epochs_);
+  }
+
+private:
+  StatsGuard stats_;
+  EpochTable* epochs_;
+};
+
+
+
+/*
+ * WriteGuard -
+ * modifying operation in progress: Snapshot waits for it to end,
+ * and it does not start while a Snapshot is being taken,
+ * so no view sees it halfway (see EpochBlockWriters).
+ * Taken before EpochGuard: a writer held back holds no epoch.
+ * Coroutine operations pass std::adopt_lock once
+ * EpochTryBeginWrite lets them in, pausing until then.
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::WriteGuard {
+public:
+  explicit WriteGuard(EpochTable* epochs) : epochs_{epochs} {
+    EpochBeginWrite(epochs_);
+  }
+
+  WriteGuard(EpochTable* epochs, std::adopt_lock_t) : epochs_{epochs} {}
+
+  WriteGuard(const WriteGuard&) = delete;
+  WriteGuard& operator=(const WriteGuard&) = delete;
+
+  ~WriteGuard() {
+    EpochEndWrite(epochs_);
+  }
+
+private:
+  EpochTable* epochs_;
+};
+
+
+
+/*
+ * AsyncGuard -
+ * EpochGuard of a coroutine operation, which shares its thread
+ * with others in flight (see Scheduler).
+ * Thread's epoch slot is held by the oldest of them: it moves on
+ * when that one is done, rather than when all of them are, so a thread
+ * that always has some operation going does not stop reclamation.
+ * Counters are bound to 'stats' while the coroutine runs, and given
+ * back to whoever runs next at every Pause.
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::AsyncGuard {
+public:
+  AsyncGuard(EpochTable* epochs, StatsTable* stats);
+
+  AsyncGuard(const AsyncGuard&) = delete;
+  AsyncGuard& operator=(const AsyncGuard&) = delete;
+
+  ~AsyncGuard();
+
+  auto Pause();
+
+  bool Cold() const;
+
+private:
+  EpochTable* epochs_;
+  StatsTable* stats_;
+  StatsSlot* previous_;
+  std::uint64_t epoch_; // see EpochNow
+  bool cold_;
+
+  /* Epochs of operations in flight in this thread, per table */
+  inline static thread_local
+    std::map<EpochTable*, std::multiset<std::uint64_t>> in_flight_;
+  inline static thread_local long faults_{0}; // see MajorFaults
+};
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::AsyncGuard::AsyncGuard(EpochTable* epochs,
+                                             StatsTable* stats)
+  : epochs_{epochs}, stats_{stats}, previous_{StatsBind(stats)} {
+  EpochEnter(epochs_);
+  /* Everything it reads is reachable from now on */
+  epoch_ = EpochNow(epochs_);
+  in_flight_[epochs_].insert(epoch_);
+
+  long faults = MajorFaults();
+  cold_ = faults != faults_;
+  faults_ = faults;
+}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::AsyncGuard::~AsyncGuard() {
+  StatsRestore(previous_);
+
+  auto found = in_flight_.find(epochs_);
+  std::multiset<std::uint64_t>& epochs = found->second;
+  bool oldest = *epochs.begin() == epoch_;
+  epochs.erase(epochs.find(epoch_));
+
+  if (epochs.empty()) {
+    in_flight_.erase(found);
+  } else if (oldest) {
+    EpochRefresh(epochs_, *epochs.begin());
+  }
+  EpochExit(epochs_);
+}
+
+
+/*
+ * Pause -
+ * awaitable: Yield that leaves counters of the thread as they
+ * were before the operation while others run.
+ * Operation holds no node lock and no frame at a Pause.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::AsyncGuard::Pause() {
+  struct Awaiter : Yield {
+    void await_suspend(std::coroutine_handle<> handle) {
+      suspended = true;
+      StatsRestore(guard->previous_);
+      Yield::await_suspend(handle);
+    }
+
+    void await_resume() {
+      if (suspended) {
+        guard->previous_ = StatsBind(guard->stats_);
+      }
+    }
+
+    AsyncGuard* guard;
+    bool suspended{false};
+  };
+
+  return Awaiter{{}, this};
+}
+
+
+/* Thread has waited for disk since its previous operation began */
+template <std::size_t KeysCount>
+inline bool BLinkTree<KeysCount>::AsyncGuard::Cold() const {
+  return cold_;
+}
+
+
+
+/*
+ * RecordGuard -
+ * zero-copy view of a record inside the tree mapping.
+ * Guard holds read lock on the record's leaf, so record can be neither
+ * removed nor freed while guard is alive. Release it before modifying
+ * the tree through the same handle: writers of that leaf, and of any
+ * node sharing its latch slot, wait for it.
+*/
+template <std::size_t KeysCount>
+class BLinkTree<KeysCount>::RecordGuard {
+public:
+  RecordGuard() = default;
+
+  RecordGuard(RecordGuard&& other);
+  RecordGuard& operator=(RecordGuard&& other);
+
+  RecordGuard(const RecordGuard&) = delete;
+  RecordGuard& operator=(const RecordGuard&) = delete;
+
+  ~RecordGuard();
+
+  explicit operator bool() const;
+
+  std::string_view Value() const;
+
+  bool Verify() const;
+
+  void Release();
+
+private:
+  friend class BLinkTree;
+
+  RecordGuard(BLinkTree* tree, PtrType leaf_ptr, const char* raw);
+
+private:
+  BLinkTree* tree_{nullptr};
+  PtrType leaf_ptr_{0};
+  const char* raw_{nullptr}; // record header inside mapping
 };
 
 
 
 
 template <std::size_t KeysCount>
-BLinkTree<KeysCount>::BLinkTree(std::string path): path_{path} {
-  fd = open(path_.data(), O_RDWR);
-  if (fd < 0) {
-    perror("open");
-    exit(EXIT_FAILURE);
-  }
-  struct stat statbuf;
-  if (fstat(fd, &statbuf)) {
-    perror("fstat");
-    exit(EXIT_FAILURE);
+BLinkTree<KeysCount>::BLinkTree(std::string path, bool sync_commit,
+                                MappingOptions mapping_options,
+                                BufferPoolOptions pool_options)
+  : sync_commit_{sync_commit}, path_{path} {
+  fd = open(path_.data(), O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  /* Frames of a pool are not seen by other handles */
+  int share = pool_options.frames > 0 ? LOCK_EX : LOCK_SH;
+  if (flock(fd, share | LOCK_NB) == -1) {
+    perror("flock");
+    exit(EXIT_FAILURE);
+  }
+  /* Replays log, if necessary, before the tree is looked at */
+  wal = OpenWal(path_.data(), fd, Node<KeysCount>::ContentSize);
+  if (wal == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  epochs = OpenEpochTable(path_.data());
+  if (epochs == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  versions = OpenVersionStore(path_.data());
+  if (versions == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  stats = OpenStatsTable(path_.data());
+  if (stats == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  if (OpenMapping(&region_, fd, &mapping_options) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  mapping = region_.base;
+#if !defined(BLINK_FCNTL_LOCKS)
+  latches = OpenLatchTable(path_.data());
+#else
+  latches = OpenPrivateLatchTable();
+#endif
+  if (latches == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  if (pool_options.frames > 0) {
+    pool_ = std::make_unique<BufferPool<KeysCount>>(
+      path_, fd, latches, pool_options.frames, region_.reserved);
+    WalSetFlusher(wal, BufferPool<KeysCount>::FlushPool, pool_.get());
+  }
+}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::~BLinkTree() {
+  CloseMapping(&region_);
+
+  /* Last checkpoint writes frames of the pool */
+  CloseWal(wal);
+
+  pool_.reset();
+
+  CloseVersionStore(versions);
+
+  CloseEpochTable(epochs);
+
+  CloseStatsTable(stats);
+
+  CloseLatchTable(latches);
+
+  close(fd);
+}
+
+
+
+/*
+ * Search -
+ * search for key in tree.
+ *
+ * @key: key that being searched.
+ *
+ * Returns:
+ * @ptr: offset-pointer to record or 0 if not present.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::Search(KeyType key) {
+  TraceSpan span{TRACE_SEARCH};
+  EpochGuard guard{epochs, stats};
+  PtrType res;
+
+  for (int attempt = 0; attempt < kOptimisticAttempts; ++attempt) {
+    if (OptimisticSearch(key, res)) [[likely]] {
+      return res;
+    }
+  }
+
+  /* Too much concurrent modifications; fall back to locks */
+  return LockedSearch(key);
+}
+
+
+
+/*
+ * Get -
+ * find record under 'key' and give access to its bytes
+ * without copying them out of the mapping.
+ *
+ * @key: key that being searched.
+ *
+ * Returns:
+ * @guard: empty if key is not present; see RecordGuard.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::Get(KeyType key) -> RecordGuard {
+  TraceSpan span{TRACE_GET};
+  /* Once leaf is locked, it cannot be merged away */
+  EpochGuard guard{epochs, stats};
+  PtrType current_ptr = RMoveRight(key, FindLeaf(key));
+
+  PtrType record_ptr = GetRaw(current_ptr)->GetRecordByKey(key);
+  if (record_ptr == 0) {
+    UnlockNode(current_ptr);
+    return RecordGuard{};
+  }
+
+  ReadRecord(record_ptr);
+  return RecordGuard{this, current_ptr, mapping + record_ptr};
+}
+
+
+
+/*
+ * MultiGet -
+ * look up many keys at once: 'callback(i, record)' is called for
+ * every keys[i] that is present, with record's leaf read locked,
+ * so 'record' is valid during the call only. Callback must not use
+ * the tree. Keys are looked up in key order, so calls are too.
+ *
+ * Lookups go in groups of kMultiGetGroup: descents of a group step
+ * down the tree together (see FindLeaves), so misses on their nodes
+ * overlap instead of following each other. Once a group has waited
+ * for disk, leaves of the next ones are asked from the kernel ahead;
+ * on a tree in memory that would only cost a syscall per leaf.
+ * With buffer pool, children of a level are read through its ring,
+ * a group's reads in flight at once.
+*/
+template <std::size_t KeysCount>
+template <typename Callback>
+void BLinkTree<KeysCount>::MultiGet(std::span<const KeyType> keys,
+                                    Callback callback) {
+  TraceSpan span{TRACE_MULTI_GET};
+  EpochGuard guard{epochs, stats};
+
+  /* Neighbouring keys share nodes, and their leaves are near */
+  std::vector<std::size_t> order(keys.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&](std::size_t a, std::size_t b) {
+                     return keys[a] < keys[b];
+                   });
+
+  KeyType group_keys[kMultiGetGroup];
+  PtrType leaf_ptrs[kMultiGetGroup];
+  long faults = MajorFaults();
+
+  for (std::size_t begin = 0; begin < order.size(); begin += kMultiGetGroup) {
+    std::size_t count = std::min(kMultiGetGroup, order.size() - begin);
+    for (std::size_t j = 0; j < count; ++j) {
+      group_keys[j] = keys[order[begin + j]];
+    }
+    long previous = faults;
+    faults = MajorFaults();
+    FindLeaves(group_keys, count, leaf_ptrs, faults != previous);
+
+    for (std::size_t j = 0; j < count; ++j) {
+      KeyType key = group_keys[j];
+      PtrType current_ptr = RMoveRight(key, leaf_ptrs[j]);
+
+      PtrType record_ptr = GetRaw(current_ptr)->GetRecordByKey(key);
+      if (record_ptr != 0) {
+        callback(order[begin + j], ReadRecord(record_ptr));
+      }
+      UnlockNode(current_ptr);
+    }
+  }
+}
+
+
+
+/*
+ * Insert -
+ * insert (key, record) into BlinkTree.
+ *
+ * @key: key that should be inserted.
+ * @record: string_view to record.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::Insert(KeyType key, std::string_view record) {
+  TraceSpan span{TRACE_INSERT};
+  WriteGuard writing{epochs};
+  EpochGuard guard{epochs, stats};
+  std::stack<PtrType> stack;
+
+  PtrType current_ptr = UpdateDescend(key, stack, 0);
+
+  /* Now current_ptr is leaf;
+   * no locks being hold. */
+
+  current_ptr = MoveRight(key, current_ptr);
+
+  /* Note: current is under WriteLock now */
+
+  if (InsertRecord(key, record, current_ptr, stack)) {
+    Commit();
+  }
+}
+
+
+/*
+ * InsertRecord -
+ * append 'record' and insert it under 'key' into WriteLocked leaf
+ * 'leaf_ptr', splitting up the tree as needed (see InsertLocked);
+ * leaf is unlocked on return.
+ *
+ * Returns:
+ * @bool: false if key is present already and nothing was done.
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::InsertRecord(KeyType key, std::string_view record,
+                                        PtrType leaf_ptr,
+                                        std::stack<PtrType>& stack) {
+  if (GetRaw(leaf_ptr)->Contains(key)) {
+    UnlockNode(leaf_ptr);
+    return false;
+  }
+
+  PtrType record_ptr = AllocateRecord(fd, mapping, record, wal);
+
+  InsertLocked(key, record_ptr, leaf_ptr, stack);
+  return true;
+}
+
+
+
+/*
+ * InsertBatch -
+ * insert many (key, record) pairs at once.
+ * Batch is sorted in place; keys of one leaf are inserted
+ * under one write lock after one descent, and all records
+ * are allocated with one append.
+ * Keys already present in tree (or repeated in batch) are skipped:
+ * repeats are never encoded, records of present keys are freed.
+ *
+ * @batch: pairs to insert.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::InsertBatch(
+  std::span<std::pair<KeyType, std::string_view>> batch) {
+  if (batch.empty()) {
+    return;
+  }
+  TraceSpan span{TRACE_INSERT_BATCH};
+  WriteGuard writing{epochs};
+  EpochGuard guard{epochs, stats};
+
+  std::stable_sort(batch.begin(), batch.end(),
+                   [](const auto& lhs, const auto& rhs) {
+                     return lhs.first < rhs.first;
+                   });
+
+  std::vector<PtrType> record_ptrs(batch.size());
+  std::string records;
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    /* First of equal keys wins; the rest get no record (pointer 0) */
+    if (i > 0 && batch[i - 1].first == batch[i].first) {
+      record_ptrs[i] = -1;
+      continue;
+    }
+    record_ptrs[i] = static_cast<PtrType>(records.size());
+    EncodeRecord(records, batch[i].second);
+    /* Keep every record in its own extent, so it can be freed alone */
+    records.resize(record_ptrs[i]
+                   + ExtentSize(RecordSize(batch[i].second.size())));
+  }
+  /* Records are encoded already: allocate the bytes as they are */
+  off_t records_size = static_cast<off_t>(records.size());
+  PtrType records_ptr = Allocate(fd, mapping, records.data(),
+                                 records_size, wal);
+  /* Extent of the whole batch is rounded up: give back its tail */
+  if (ExtentSize(records_size) > records_size) {
+    FreeRemainder(fd, mapping, records_ptr + records_size,
+                  ExtentSize(records_size) - records_size, wal);
+  }
+  for (auto& record_ptr : record_ptrs) {
+    record_ptr = record_ptr == -1 ? 0 : record_ptr + records_ptr;
+  }
+
+  std::stack<PtrType> stack;
+  std::size_t i = 0;
+
+  while (i < batch.size()) {
+    stack = {};
+    PtrType current_ptr = UpdateDescend(batch[i].first, stack, 0);
+    current_ptr = MoveRight(batch[i].first, current_ptr);
+    /* Note: current is under WriteLock now */
+    bool modified = false;
+
+    while (true) {
+      if (i == batch.size()
+          || GetRaw(current_ptr)->ShouldMoveRight(batch[i].first)) {
+        /* Rest of batch belongs to other leaves */
+        if (modified) {
+          LogNodes({current_ptr});
+        }
+        UnlockNode(current_ptr);
+        break;
+      }
+
+      KeyType key = batch[i].first;
+      PtrType record_ptr = record_ptrs[i];
+      std::size_t length = batch[i].second.size();
+      ++i;
+
+      if (record_ptr == 0) {
+        continue;
+      }
+      if (GetRaw(current_ptr)->Contains(key)) {
+        /* Nobody has seen the record: free it right away */
+        FreeRecord(fd, mapping, record_ptr, length, wal);
+        continue;
+      }
+
+      Preserve(current_ptr);
+      GetRaw(current_ptr)->Insert(key, record_ptr);
+      modified = true;
+      if (GetRaw(current_ptr)->IsSafe()) [[likely]] {
+        continue;
+      }
+
+      PtrType parent_ptr = SplitNode(current_ptr, stack, key, record_ptr);
+      if (parent_ptr != 0) {
+        InsertLocked(key, record_ptr, parent_ptr, stack);
+      }
+      /* Stack is partially consumed; let next split find parents again */
+      stack = {};
+
+      if (i == batch.size()) {
+        break;
+      }
+      /* Split leaf is still a valid place to continue from */
+      current_ptr = MoveRight(batch[i].first, current_ptr);
+      modified = false;
+    }
+  }
+
+  Commit();
+}
+
+
+
+/*
+ * Remove -
+ * record under 'key' from tree.
+ * Record counts as removed if pointer to it is 0;
+ * such entries stay in leaf until Compact.
+ *
+ * @key: key whose record should be removed.
+ *
+ * Returns:
+ * @bool: true if actually removed record.
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::Remove(KeyType key) {
+  TraceSpan span{TRACE_REMOVE};
+  WriteGuard writing{epochs};
+  EpochGuard guard{epochs, stats};
+  StatsAdd(STATS_DESCENTS, 1);
+  std::uint64_t descent = TraceBegin();
+  PtrType current_ptr = GetRoot();
+  Node<KeysCount>* current = RGetRawLocked(current_ptr);
+
+  while (!current->IsLeaf()) {
+    auto tmp_ptr = current_ptr;
+    auto tmp = current;
+    current_ptr = current->ScanNodeFor(key);
+    RDispatchNode(tmp_ptr, tmp);
+    current = RGetRawLocked(current_ptr);
+  }
+
+  RDispatchNode(current_ptr, current);
+  TraceEnd(TRACE_DESCENT, descent, 0, 0);
+
+  current_ptr = MoveRight(key, current_ptr);
+  /* 'current' is unser WriteLock now */
+
+  bool res = RemoveLocked(key, current_ptr);
+
+  if (res) {
+    Commit();
+  }
+
+  return res;
+}
+
+
+/*
+ * RemoveLocked -
+ * Remove from WriteLocked leaf 'leaf_ptr'; leaf is unlocked on return.
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::RemoveLocked(KeyType key, PtrType leaf_ptr) {
+  PtrType record_ptr = GetRaw(leaf_ptr)->GetRecordByKey(key);
+  if (record_ptr != 0) {
+    Preserve(leaf_ptr);
+  }
+  bool res = GetRaw(leaf_ptr)->Remove(key);
+
+  if (res) {
+    LogNodes({leaf_ptr});
+    /* Guards of this record hold read lock on the leaf,
+     * so nobody can be looking at it now; snapshots can */
+    std::size_t size = ReadRecord(record_ptr).size();
+    if (!VersionsOpen(versions)
+        || !VersionDefer(versions, record_ptr, size)) {
+      FreeRecord(fd, mapping, record_ptr, size, wal);
+    }
+  }
+
+  UnlockNode(leaf_ptr);
+
+  return res;
+}
+
+
+
+/*
+ * ReadMeta - reads file meta.
+ *
+ * Returns:
+ * @meta: copy of consistent file meta at some point.
+*/
+template <std::size_t KeysCount>
+FileMeta BLinkTree<KeysCount>::ReadMeta() const {
+  FileMeta* meta = GetMetaLocked(fd, mapping);
+
+  FileMeta copy{*meta};
+
+  DispatchMeta(fd, mapping, meta);
+
+  return copy;
+}
+
+
+
+/*
+ * GetRoot - get current tree root.
+ * Root is cached until meta version changes, so meta is neither
+ * locked nor read most of the time. Root got just before
+ * it is replaced is fine: its right links lead to the rest of level.
+ *
+ * Returns:
+ * @root: offset-pointer to root.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::GetRoot() const {
+  std::uint64_t version = MetaVersion(mapping);
+  if (version != cached_meta_version_.load(std::memory_order_acquire))
+    [[unlikely]] {
+    /* Threads sharing the handle may race here: any root they store
+     * is one read after their version check, so good enough for it */
+    off_t root = 0;
+    std::size_t height = 0;
+    version = ReadMetaRoot(mapping, &root, &height);
+    cached_root_.store(root, std::memory_order_relaxed);
+    cached_meta_version_.store(version, std::memory_order_release);
+    return static_cast<PtrType>(root);
+  }
+
+  return cached_root_.load(std::memory_order_relaxed);
+}
+
+
+/*
+ * Scan -
+ * start ordered range scan.
+ *
+ * @lo: first key of range (inclusive).
+ * @hi: end of range (exclusive).
+ *
+ * Returns:
+ * @iterator: positioned at the first live record in range.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::Scan(KeyType lo, KeyType hi) -> ScanIterator {
+  return ScanIterator{this, lo, hi};
+}
+
+
+
+/*
+ * ForEach -
+ * call 'callback(key, record_ptr)' for every live record
+ * with key in [lo, hi) in key order.
+ * If callback returns bool, false stops the scan.
+*/
+template <std::size_t KeysCount>
+template <typename Callback>
+void BLinkTree<KeysCount>::ForEach(KeyType lo, KeyType hi,
+                                   Callback callback) {
+  using Result = std::invoke_result_t<Callback&, KeyType, PtrType>;
+  TraceSpan span{TRACE_SCAN};
+
+  for (auto it = Scan(lo, hi); it.Valid(); it.Next()) {
+    if constexpr (std::is_same_v<Result, bool>) {
+      if (!callback(it.Key(), it.Record())) {
+        break;
+      }
+    } else {
+      callback(it.Key(), it.Record());
+    }
+  }
+}
+
+
+
+/*
+ * Snapshot -
+ * view of the tree fixed at this point in time (see SnapshotView).
+ * Holds back modifying operations of other threads and waits for
+ * those in progress, so that none of them is seen halfway; the view
+ * sees operations that start later as if they had not happened.
+ * Thread must not have modifying operations of its own in flight.
+ *
+ * Returns:
+ * @view: open until destroyed.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::Snapshot() -> SnapshotView {
+  StatsGuard guard{stats};
+
+  while (true) {
+    std::uint64_t epoch;
+    /* Writers that stamp nodes at 'epoch' or before are done,
+     * those that start later stamp them after it */
+    EpochBlockWriters(epochs);
+    int slot = TakeSnapshot(versions, epochs, &epoch);
+    EpochUnblockWriters(epochs);
+    if (slot == -1) {
+      exit(EXIT_FAILURE);
+    }
+
+    SnapshotView view{this, slot, epoch};
+    view.root_ptr_ = GetRoot();
+    /* Root made by a split since has nothing for the view: take again */
+    if (view.Visible(view.root_ptr_)) [[likely]] {
+      return view;
+    }
+  }
+}
+
+
+
+/*
+ * SearchAsync -
+ * Search as a coroutine (see Task): it pauses, letting other tasks
+ * of the thread's Scheduler run, where Search would block the thread.
+ * That is, before a node that is not in memory yet, while it is read
+ * (by the pool's ring, or by kernel readahead), and while a node lock
+ * it needs or log flush of another thread is awaited.
+ * Operation never pauses holding a lock, so tasks of one thread do not
+ * wait for each other; splits and record allocation, which hold locks
+ * while they write, are done without pausing.
+ * ScanIterator or RecordGuard of the thread must not be kept across
+ * pauses of its tasks: they do not hold back reclamation (see
+ * AsyncGuard), and a task could wait for the guard's lock forever.
+ *
+ * Returns:
+ * @ptr: as Search.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::SearchAsync(KeyType key) -> Task<PtrType> {
+  TraceSpan span{TRACE_SEARCH};
+  AsyncGuard guard{epochs, stats};
+
+  for (int attempt = 0; attempt < kOptimisticAttempts; ++attempt) {
+    StatsAdd(STATS_DESCENTS, 1);
+    PtrType current_ptr = GetRoot();
+    SearchStep step = SearchStep::kDescend;
+
+    while (step == SearchStep::kDescend) {
+      co_await FetchNode(current_ptr, guard);
+      FrameGuard frames{pool_.get()};
+      step = OptimisticStep(key, current_ptr);
+    }
+    if (step == SearchStep::kFound) {
+      co_return current_ptr;
+    }
+  }
+
+  /* Too much concurrent modifications; fall back to locks */
+  std::stack<PtrType> stack;
+  PtrType current_ptr = co_await UpdateDescendAsync(key, stack, guard);
+
+  while (true) {
+    co_await FetchNode(current_ptr, guard);
+    Node<KeysCount>* current = RGetRawLocked(current_ptr);
+    if (!current->ShouldMoveRight(key)) {
+      PtrType res = current->GetRecordByKey(key);
+      RDispatchNode(current_ptr, current);
+      co_return res;
+    }
+    StatsAdd(STATS_MOVE_RIGHT, 1);
+    PtrType next_ptr = current->LinkPointer();
+    RDispatchNode(current_ptr, current);
+    current_ptr = next_ptr;
+  }
+}
+
+
+/*
+ * InsertAsync -
+ * Insert as a coroutine, see SearchAsync.
+ * 'record' must stay valid until the task is done.
+*/
+template <std::size_t KeysCount>
+Task<void> BLinkTree<KeysCount>::InsertAsync(KeyType key,
+                                             std::string_view record) {
+  TraceSpan span{TRACE_INSERT};
+  while (!EpochTryBeginWrite(epochs)) {
+    co_await Yield{};
+  }
+  WriteGuard writing{epochs, std::adopt_lock};
+  AsyncGuard guard{epochs, stats};
+  std::stack<PtrType> stack;
+
+  PtrType current_ptr = co_await UpdateDescendAsync(key, stack, guard);
+  current_ptr = co_await MoveRightAsync(key, current_ptr, guard);
+
+  if (InsertRecord(key, record, current_ptr, stack)) {
+    co_await CommitAsync(guard);
+  }
+}
+
+
+/*
+ * RemoveAsync -
+ * Remove as a coroutine, see SearchAsync.
+*/
+template <std::size_t KeysCount>
+Task<bool> BLinkTree<KeysCount>::RemoveAsync(KeyType key) {
+  TraceSpan span{TRACE_REMOVE};
+  while (!EpochTryBeginWrite(epochs)) {
+    co_await Yield{};
+  }
+  WriteGuard writing{epochs, std::adopt_lock};
+  AsyncGuard guard{epochs, stats};
+  std::stack<PtrType> stack;
+
+  PtrType current_ptr = co_await UpdateDescendAsync(key, stack, guard);
+  current_ptr = co_await MoveRightAsync(key, current_ptr, guard);
+
+  bool res = RemoveLocked(key, current_ptr);
+
+  if (res) {
+    co_await CommitAsync(guard);
+  }
+
+  co_return res;
+}
+
+
+/*
+ * ScanAsync -
+ * ForEach as a coroutine, see SearchAsync; it pauses between
+ * leaves only. Callback must not await.
+*/
+template <std::size_t KeysCount>
+template <typename Callback>
+Task<void> BLinkTree<KeysCount>::ScanAsync(KeyType lo, KeyType hi,
+                                           Callback callback) {
+  using Result = std::invoke_result_t<Callback&, KeyType, PtrType>;
+  TraceSpan span{TRACE_SCAN};
+  AsyncGuard guard{epochs, stats};
+
+  if (!(lo < hi)) {
+    co_return;
+  }
+
+  std::stack<PtrType> stack;
+  PtrType leaf_ptr = co_await UpdateDescendAsync(lo, stack, guard);
+  ScanIterator it{this, lo, hi, leaf_ptr};
+
+  while (true) {
+    while (!it.Valid() && it.leaf_ptr_ != 0) {
+      co_await FetchNode(it.leaf_ptr_, guard);
+      it.LoadLeaf();
+    }
+    if (!it.Valid()) {
+      co_return;
+    }
+
+    for (; it.Valid(); ++it.pos_) {
+      if constexpr (std::is_same_v<Result, bool>) {
+        if (!callback(it.Key(), it.Record())) {
+          co_return;
+        }
+      } else {
+        callback(it.Key(), it.Record());
+      }
+    }
+  }
+}
+
+
+
+/*
+ * Sync -
+ * make every modification done by calling thread durable.
+ * Needed only if handle was opened without 'sync_commit'.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::Sync() {
+  StatsGuard guard{stats};
+  WalCommit(wal, WalLastLsn());
+}
+
+
+
+/*
+ * Stats -
+ * counters of operations on the tree by every handle
+ * of every process since the stats were created or reset
+ * (see stats.h for their meaning).
+*/
+template <std::size_t KeysCount>
+TreeStats BLinkTree<KeysCount>::Stats() const {
+  TreeStats result;
+  ReadStats(stats, &result);
+  return result;
+}
+
+
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::ResetStats() {
+  ::ResetStats(stats);
+}
+
+
+
+/*
+ * Compact -
+ * shrink tree after removals: drop removed entries from leaves,
+ * merge siblings that fit into one node (level by level, bottom-up,
+ * until nothing merges) and take away root levels left with
+ * the only child.
+ * Pages of nodes merged away are given back as soon as no operation
+ * can be looking at them, maybe by some later call.
+ * Runs alongside other operations: children are only try-locked,
+ * busy ones are left for the next call. Returns at once if another
+ * compaction of the tree is in progress.
+ *
+ * Returns:
+ * @count: number of nodes removed from tree.
+*/
+template <std::size_t KeysCount>
+std::size_t BLinkTree<KeysCount>::Compact() {
+  /* Lock of file excludes other handles, mutex - other threads */
+  std::unique_lock compaction{compaction_mutex_, std::try_to_lock};
+  if (!compaction.owns_lock() || !TryLockCompaction(fd)) {
+    return 0;
+  }
+
+  TraceSpan span{TRACE_COMPACT};
+  std::size_t removed = 0;
+  {
+    WriteGuard writing{epochs};
+    EpochGuard guard{epochs, stats};
+
+    /* Merge concatenates children of merged nodes, which may
+     * be mergeable themselves now: repeat while tree shrinks */
+    std::size_t pass_removed;
+    do {
+      pass_removed = 0;
+      std::size_t height = ReadMeta().height;
+      for (std::uint32_t level = 1; level < height; ++level) {
+        pass_removed += CompactLevel(level);
+      }
+      pass_removed += CollapseRoot();
+      removed += pass_removed;
+    } while (pass_removed > 0);
+  }
+
+  ReclaimNodes();
+
+  UnlockCompaction(fd);
+
+  Commit();
+
+  return removed;
+}
+
+
+
+/*
+ * Verify -
+ * check every node reachable from root and retired ones: checksums,
+ * flags and levels, order of keys, fences given by parents,
+ * and links going along each level from one child to the next.
+ * Levels go top-down; nodes of a level are split between threads,
+ * each following links from its share of the parents' children.
+ * With 'repair' orphans get their separators, as their splits would
+ * have done; other problems are only reported.
+ * Meant for tree nobody modifies meanwhile (say, at startup):
+ * concurrent operations may make it report problems that are not there.
+*/
+template <std::size_t KeysCount>
+VerifyReport BLinkTree<KeysCount>::Verify(VerifyOptions options) {
+  std::size_t threads = options.threads != 0
+    ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+
+  /* Nodes past the end of mapping are past the end of file */
+  UpdateMapping();
+  PtrType file_size = static_cast<PtrType>(MappingSize(&region_));
+  PtrType root_ptr = GetRoot();
+  std::size_t height = ReadMeta().height;
+
+  VerifyReport report;
+  std::vector<std::pair<VerifyEntry, std::uint32_t>> orphans;
+  auto merge = [&](VerifyPart& part) {
+    report.nodes += part.report.nodes;
+    report.corrupt += part.report.corrupt;
+    report.malformed += part.report.malformed;
+    report.broken_links += part.report.broken_links;
+    for (std::string& problem : part.report.problems) {
+      if (report.problems.size() < options.max_problems) {
+        report.problems.push_back(std::move(problem));
+      }
+    }
+    orphans.insert(orphans.end(), part.orphans.begin(), part.orphans.end());
+  };
+  auto make_part = [&] {
+    VerifyPart part;
+    part.file_size = file_size;
+    part.root_ptr = root_ptr;
+    part.max_problems = options.max_problems;
+    return part;
+  };
+
+  std::vector<VerifyEntry> entries{
+    {root_ptr, 0, std::numeric_limits<KeyType>::max()}};
+  for (std::uint32_t level = height - 1; !entries.empty(); --level) {
+    ++report.levels;
+    std::size_t count = std::clamp<std::size_t>(
+      entries.size() / kVerifyChunk, 1, threads);
+    std::vector<VerifyPart> parts(count, make_part());
+
+    auto run = [&](std::size_t p) {
+      EpochGuard guard{epochs, stats};
+      VerifySegment(entries, entries.size() * p / count,
+                    entries.size() * (p + 1) / count, level, parts[p]);
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t p = 1; p < count; ++p) {
+      workers.emplace_back(run, p);
+    }
+    run(0);
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    entries.clear();
+    for (VerifyPart& part : parts) {
+      merge(part);
+      entries.insert(entries.end(),
+                     part.children.begin(), part.children.end());
+    }
+    if (level == 0) {
+      break;
+    }
+  }
+
+  VerifyPart retired = make_part();
+  VerifyRetired(retired);
+  merge(retired);
+
+  report.orphans = orphans.size();
+  if (options.repair) {
+    for (const auto& [orphan, level] : orphans) {
+      report.repaired += RepairSeparator(orphan.ptr, orphan.lo, level);
+    }
+  }
+
+  return report;
+}
+
+
+
+/*
+ * Defragment -
+ * one step of a pass that makes file order of leaves follow their
+ * key order, so scans read the file forward and readahead helps.
+ * Leaves are visited left to right from where the previous step
+ * stopped; one not lying right after its left sibling is copied to
+ * space taken from the end of file, and parent's pointer and sibling's
+ * link are turned to the copy. With 'records' its records go along,
+ * right after it, and leaf counts as in place only with them near.
+ * Runs alongside other operations, as Compact does: nodes are only
+ * try-locked, busy leaves are visited again by the next step.
+ * Moved leaf stays dead with link to its copy until no operation
+ * can be looking at it.
+ * Pass moves each leaf once at most: a second one moves nothing
+ * unless leaves have split meanwhile. Compare Locality before and after.
+*/
+template <std::size_t KeysCount>
+DefragStep BLinkTree<KeysCount>::Defragment(DefragOptions options) {
+  DefragStep step;
+
+  std::unique_lock compaction{compaction_mutex_, std::try_to_lock};
+  if (!compaction.owns_lock() || !TryLockCompaction(fd)) {
+    return step;
+  }
+
+  {
+    WriteGuard writing{epochs};
+    EpochGuard guard{epochs, stats};
+    while (step.visited < options.pages) {
+      if (!DefragLeaf(options.records, step)) {
+        step.done = true;
+        defrag_key_ = 0;
+        defrag_left_ = 0;
+        defrag_end_ = 0;
+        break;
+      }
+    }
+  }
+
+  ReclaimNodes();
+
+  UnlockCompaction(fd);
+
+  Commit();
+
+  return step;
+}
+
+
+
+/*
+ * Locality -
+ * walk leaves along links and see where they and their records lie.
+*/
+template <std::size_t KeysCount>
+LeafLocality BLinkTree<KeysCount>::Locality() {
+  EpochGuard guard{epochs, stats};
+  LeafLocality result;
+
+  std::vector<KeyType> keys(Node<KeysCount>::Capacity);
+  std::vector<PtrType> ptrs(Node<KeysCount>::Capacity);
+  std::size_t links = 0;
+  double distance = 0;
+
+  PtrType leaf_ptr = FindLeaf(0);
+  while (leaf_ptr != 0) {
+    PtrType link_ptr;
+    KeyType high_key;
+    std::size_t count = ReadLeaf(leaf_ptr, 0,
+                                 std::numeric_limits<KeyType>::max(),
+                                 keys.data(), ptrs.data(),
+                                 link_ptr, high_key);
+    /* Dead leaf, moved or merged away, is only passed through */
+    if (high_key != 0) {
+      ++result.leaves;
+      PtrType end = leaf_ptr + static_cast<PtrType>(NodeSize);
+      for (std::size_t i = 0; i < count; ++i) {
+        ++result.records;
+        result.records_near += ptrs[i] >= end
+          && ptrs[i] - end < kReadaheadWindow;
+      }
+      if (link_ptr != 0) {
+        ++links;
+        result.forward += link_ptr > leaf_ptr;
+        result.sequential += link_ptr >= end
+          && link_ptr - end < kReadaheadWindow;
+        distance += std::abs(static_cast<double>(link_ptr - leaf_ptr)) / 4096;
+      }
+    }
+    leaf_ptr = link_ptr;
+  }
+
+  result.mean_distance = links != 0 ? distance / links : 0;
+  return result;
+}
+
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::ScanIterator::ScanIterator(
+  BLinkTree* tree, KeyType lo, KeyType hi)
+  : ScanIterator{tree, lo, hi, 0} {
+  StatsGuard stats{tree_->stats};
+
+  if (lo < hi) {
+    leaf_ptr_ = tree_->FindLeaf(lo);
+    LoadLeaves();
+  }
+}
+
+
+/* Iterator before 'leaf_ptr' is read (see ScanAsync) */
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::ScanIterator::ScanIterator(
+  BLinkTree* tree, KeyType lo, KeyType hi, PtrType leaf_ptr)
+  : tree_{tree}, leaf_ptr_{leaf_ptr}, resume_key_{lo}, hi_{hi} {
+  EpochEnter(tree_->epochs);
+}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::ScanIterator::ScanIterator(ScanIterator&& other)
+  : tree_{std::exchange(other.tree_, nullptr)},
+    leaf_ptr_{other.leaf_ptr_}, resume_key_{other.resume_key_},
+    hi_{other.hi_}, count_{other.count_}, pos_{other.pos_} {
+  std::copy(other.keys_, other.keys_ + count_, keys_);
+  std::copy(other.ptrs_, other.ptrs_ + count_, ptrs_);
+}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::ScanIterator::~ScanIterator() {
+  if (tree_ != nullptr) {
+    EpochExit(tree_->epochs);
+  }
+}
+
+
+template <std::size_t KeysCount>
+inline bool BLinkTree<KeysCount>::ScanIterator::Valid() const {
+  return pos_ < count_;
+}
+
+
+template <std::size_t KeysCount>
+inline auto BLinkTree<KeysCount>::ScanIterator::Key() const {
+  return keys_[pos_];
+}
+
+
+template <std::size_t KeysCount>
+inline auto BLinkTree<KeysCount>::ScanIterator::Record() const {
+  return ptrs_[pos_];
+}
+
+
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::ScanIterator::Next() {
+  ++pos_;
+  if (pos_ == count_) {
+    StatsGuard stats{tree_->stats};
+    LoadLeaves();
+  }
+}
+
+
+/*
+ * LoadLeaves -
+ * read leaves to the right until some entries are found
+ * or range is exhausted.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::ScanIterator::LoadLeaves() {
+  while (pos_ == count_ && leaf_ptr_ != 0) {
+    LoadLeaf();
+    if (leaf_ptr_ != 0) {
+      tree_->Readahead(leaf_ptr_);
+    }
+  }
+}
+
+
+/* Read keys of leaf 'leaf_ptr_' and step to the next one */
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::ScanIterator::LoadLeaf() {
+  PtrType link_ptr;
+  KeyType high_key;
+
+  count_ = tree_->ReadLeaf(leaf_ptr_, resume_key_, hi_,
+                           keys_, ptrs_, link_ptr, high_key);
+  pos_ = 0;
+
+  if (high_key >= hi_ || link_ptr == 0) {
+    leaf_ptr_ = 0;
+    return;
+  }
+
+  /* Keys to the right are not less than this leaf's high key,
+   * even if it was split after being read. */
+  resume_key_ = std::max(resume_key_, high_key);
+  leaf_ptr_ = link_ptr;
+}
+
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::SnapshotView::SnapshotView(BLinkTree* tree, int slot,
+                                                 std::uint64_t epoch)
+  : tree_{tree}, slot_{slot}, epoch_{epoch} {}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::SnapshotView::SnapshotView(SnapshotView&& other)
+  : tree_{other.tree_}, slot_{std::exchange(other.slot_, -1)},
+    epoch_{other.epoch_}, root_ptr_{other.root_ptr_} {}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::SnapshotView::~SnapshotView() {
+  if (slot_ != -1) {
+    StatsGuard stats{tree_->stats};
+    ReleaseSnapshot(tree_->versions, slot_, FreeDeferred, tree_);
+  }
+}
+
+
+/*
+ * Search -
+ * record under 'key' as of the view.
+ *
+ * Returns:
+ * @ptr: offset-pointer to record (see Read) or 0 if not present.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::SnapshotView::Search(KeyType key) const {
+  TraceSpan span{TRACE_SEARCH};
+  PtrType current_ptr = FindLeaf(key);
+
+  while (true) {
+    auto [found, next_ptr] = ReadNode(
+      current_ptr, [&](const Node<KeysCount>* leaf) {
+        return leaf->ShouldMoveRight(key)
+          ? std::pair{false, PtrType{leaf->LinkPointer()}}
+          : std::pair{true, PtrType{leaf->GetRecordByKey(key)}};
+      });
+    if (found) {
+      return next_ptr;
+    }
+    current_ptr = next_ptr;
+  }
+}
+
+
+/* Bytes of record found through the view; valid while it is open */
+template <std::size_t KeysCount>
+std::string_view BLinkTree<KeysCount>::SnapshotView::Read(
+  PtrType record_ptr) const {
+  return tree_->ReadRecord(record_ptr);
+}
+
+
+/*
+ * ForEach -
+ * as BLinkTree::ForEach, over records of the view.
+*/
+template <std::size_t KeysCount>
+template <typename Callback>
+void BLinkTree<KeysCount>::SnapshotView::ForEach(KeyType lo, KeyType hi,
+                                                 Callback callback) const {
+  using Result = std::invoke_result_t<Callback&, KeyType, PtrType>;
+  TraceSpan span{TRACE_SCAN};
+
+  std::vector<KeyType> keys(Node<KeysCount>::Capacity);
+  std::vector<PtrType> ptrs(Node<KeysCount>::Capacity);
+  PtrType leaf_ptr = lo < hi ? FindLeaf(lo) : 0;
+  KeyType resume_key = lo;
+
+  while (leaf_ptr != 0) {
+    PtrType link_ptr;
+    KeyType high_key;
+    std::size_t count = ReadNode(
+      leaf_ptr, [&](const Node<KeysCount>* leaf) {
+        link_ptr = leaf->LinkPointer();
+        high_key = leaf->HighKey();
+        return leaf->CopyRange(resume_key, hi, keys.data(), ptrs.data());
+      });
+
+    for (std::size_t i = 0; i < count; ++i) {
+      if constexpr (std::is_same_v<Result, bool>) {
+        if (!callback(keys[i], ptrs[i])) {
+          return;
+        }
+      } else {
+        callback(keys[i], ptrs[i]);
+      }
+    }
+
+    if (high_key >= hi || link_ptr == 0) {
+      break;
+    }
+    /* Versions of the view do not change: leaves never overlap */
+    resume_key = std::max(resume_key, high_key);
+    leaf_ptr = link_ptr;
+    tree_->Readahead(leaf_ptr);
+  }
+}
+
+
+/* Epoch of the view: it sees node versions stamped at or before it */
+template <std::size_t KeysCount>
+inline std::uint64_t BLinkTree<KeysCount>::SnapshotView::Epoch() const {
+  return epoch_;
+}
+
+
+/*
+ * ReadNode -
+ * 'reader(node)' applied to the version of node at 'ptr' the view sees.
+ * Node itself, if it was not written since, is read optimistically
+ * until nobody changes it meanwhile. Saved versions never change.
+ *
+ * Returns:
+ * @result: of reader.
+*/
+template <std::size_t KeysCount>
+template <typename Reader>
+auto BLinkTree<KeysCount>::SnapshotView::ReadNode(PtrType ptr,
+                                                  Reader reader) const {
+  std::uint64_t older;
+  {
+    FrameGuard frames{tree_->pool_.get()};
+    const Node<KeysCount>* node = tree_->GetRaw(ptr);
+
+    while (true) {
+      auto version = node->ReadBegin();
+      if (node->Stamp() <= epoch_) {
+        auto result = reader(node);
+        if (node->ReadValidate(version)) [[likely]] {
+          return result;
+        }
+        continue;
+      }
+      older = node->Older();
+      if (node->ReadValidate(version)) {
+        break;
+      }
+    }
+  }
+
+  older = Saved(older);
+  if (older == 0) {
+    fprintf(stderr, "Snapshot: node at %lld has no version for epoch %llu\n",
+            static_cast<long long>(ptr),
+            static_cast<unsigned long long>(epoch_));
+    exit(EXIT_FAILURE);
+  }
+  return reader(static_cast<const Node<KeysCount>*>(
+    VersionAt(tree_->versions, older, NodeSize)));
+}
+
+
+/*
+ * Saved -
+ * go along chain of saved versions from 'older'.
+ *
+ * Returns:
+ * @offset: of the newest version the view sees, or 0 if none.
+*/
+template <std::size_t KeysCount>
+std::uint64_t BLinkTree<KeysCount>::SnapshotView::Saved(
+  std::uint64_t older) const {
+  while (older != 0) {
+    auto saved = static_cast<const Node<KeysCount>*>(
+      VersionAt(tree_->versions, older, NodeSize));
+    if (saved->Stamp() <= epoch_) {
+      break;
+    }
+    older = saved->Older();
+  }
+  return older;
+}
+
+
+/* Node at 'ptr' existed when the view was taken */
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::SnapshotView::Visible(PtrType ptr) const {
+  std::uint64_t stamp;
+  std::uint64_t older;
+  {
+    FrameGuard frames{tree_->pool_.get()};
+    const Node<KeysCount>* node = tree_->GetRaw(ptr);
+    std::uint32_t version;
+    do {
+      version = node->ReadBegin();
+      stamp = node->Stamp();
+      older = node->Older();
+    } while (!node->ReadValidate(version));
+  }
+
+  return stamp <= epoch_ || Saved(older) != 0;
+}
+
+
+/* Leaf of the view where search for 'key' begins */
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::SnapshotView::FindLeaf(KeyType key) const {
+  PtrType current_ptr = root_ptr_;
+
+  while (true) {
+    auto [leaf, next_ptr] = ReadNode(
+      current_ptr, [&](const Node<KeysCount>* node) {
+        return node->IsLeaf()
+          ? std::pair{true, PtrType{0}}
+          : std::pair{false, PtrType{node->ScanNodeFor(key)}};
+      });
+    if (leaf) {
+      return current_ptr;
+    }
+    current_ptr = next_ptr;
+  }
+}
+
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::RecordGuard::RecordGuard(BLinkTree* tree,
+                                               PtrType leaf_ptr,
+                                               const char* raw)
+  : tree_{tree}, leaf_ptr_{leaf_ptr}, raw_{raw} {}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::RecordGuard::RecordGuard(RecordGuard&& other)
+  : tree_{std::exchange(other.tree_, nullptr)},
+    leaf_ptr_{other.leaf_ptr_},
+    raw_{std::exchange(other.raw_, nullptr)} {}
+
+
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::RecordGuard::operator=(RecordGuard&& other)
+  -> RecordGuard& {
+  if (this != &other) {
+    Release();
+    tree_ = std::exchange(other.tree_, nullptr);
+    leaf_ptr_ = other.leaf_ptr_;
+    raw_ = std::exchange(other.raw_, nullptr);
+  }
+  return *this;
+}
+
+
+template <std::size_t KeysCount>
+BLinkTree<KeysCount>::RecordGuard::~RecordGuard() {
+  Release();
+}
+
+
+template <std::size_t KeysCount>
+inline BLinkTree<KeysCount>::RecordGuard::operator bool() const {
+  return raw_ != nullptr;
+}
+
+
+template <std::size_t KeysCount>
+inline std::string_view BLinkTree<KeysCount>::RecordGuard::Value() const {
+  return raw_ != nullptr ? RecordValue(raw_) : std::string_view{};
+}
+
+
+/*
+ * Verify -
+ * check record bytes against checksum from its header.
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::RecordGuard::Verify() const {
+  return raw_ != nullptr && RecordIntact(raw_);
+}
+
+
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::RecordGuard::Release() {
+  if (tree_ != nullptr) {
+    tree_->UnlockNode(leaf_ptr_);
+  }
+  tree_ = nullptr;
+  raw_ = nullptr;
+}
+
+
+
+/*
+ * Private methods
+*/
+
+
+/*
+ * OptimisticSearch -
+ * lock free descent from root to leaf.
+ * Every node is validated by its version after being read,
+ * concurrent split is handled by moving right.
+ *
+ * @key: key that being searched.
+ * @result: offset-pointer to record or 0 if not present.
+ *
+ * Returns:
+ * @bool: false if some node was modified while being read
+ *   and search should be restarted.
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::OptimisticSearch(KeyType key, PtrType& result) {
+  TraceSpan span{TRACE_DESCENT};
+  FrameGuard frames{pool_.get()};
+  StatsAdd(STATS_DESCENTS, 1);
+  PtrType current_ptr = GetRoot();
+
+  while (true) {
+    SearchStep step = OptimisticStep(key, current_ptr);
+    if (step == SearchStep::kFound) {
+      result = current_ptr;
+      return true;
+    }
+    if (step == SearchStep::kRetry) {
+      return false;
+    }
+  }
+}
+
+
+/*
+ * OptimisticStep -
+ * one node of OptimisticSearch. Caller is inside FrameGuard.
+ *
+ * @current_ptr: node to read; replaced with the node to go to
+ *   next, or with the record pointer if the search is over.
+ *
+ * Returns:
+ * @step: kRetry if node was modified while being read.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::OptimisticStep(KeyType key,
+                                          PtrType& current_ptr) -> SearchStep {
+  UpdateMappingIfNecessary(current_ptr);
+  if (current_ptr % 4096 != 0
+      || current_ptr + NodeSize > MappingSize(&region_)) [[unlikely]] {
+    /* torn pointer */
+    return SearchStep::kRetry;
+  }
+  Node<KeysCount>* current = GetRaw(current_ptr);
+
+  auto version = current->ReadBegin();
+  if (version & 1) {
+    return SearchStep::kRetry;
+  }
+
+  PtrType next_ptr;
+  bool found = false;
+
+  if (!current->IsLeaf()) {
+    next_ptr = current->ScanNodeFor(key);
+  } else if (current->ShouldMoveRight(key)) {
+    next_ptr = current->LinkPointer();
+    StatsAdd(STATS_MOVE_RIGHT, 1);
+  } else {
+    next_ptr = current->GetRecordByKey(key);
+    found = true;
+  }
+
+  if (!current->ReadValidate(version)) {
+    return SearchStep::kRetry;
+  }
+
+  if (!found && next_ptr == 0) [[unlikely]] {
+    return SearchStep::kRetry;
+  }
+  current_ptr = next_ptr;
+  return found ? SearchStep::kFound : SearchStep::kDescend;
+}
+
+
+
+/*
+ * LockedSearch -
+ * search for key taking read lock on every node on the way.
+ *
+ * @key: key that being searched.
+ *
+ * Returns:
+ * @ptr: offset-pointer to record or 0 if not present.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::LockedSearch(KeyType key) {
+  TraceSpan span{TRACE_DESCENT};
+  StatsAdd(STATS_DESCENTS, 1);
+  PtrType current_ptr = GetRoot();
+  Node<KeysCount>* current = RGetRawLocked(current_ptr);
+
+  while (!current->IsLeaf()) {
+    auto tmp_ptr = current_ptr;
+    auto tmp = current;
+    current_ptr = current->ScanNodeFor(key);
+    RDispatchNode(tmp_ptr, tmp);
+    current = RGetRawLocked(current_ptr);
+  }
+
+  while (current->ShouldMoveRight(key)) {
+    StatsAdd(STATS_MOVE_RIGHT, 1);
+    auto tmp_ptr = current_ptr;
+    auto tmp = current;
+    current_ptr = current->LinkPointer();
+    RDispatchNode(tmp_ptr, tmp);
+    current = RGetRawLocked(current_ptr);
+  }
+
+  PtrType res = current->GetRecordByKey(key);
+
+  RDispatchNode(current_ptr, current);
+
+  return res;
+}
+
+
+
+/*
+ * OptimisticFindLeaf -
+ * lock free descent to the leaf where 'key' belongs
+ * (or to some leaf to the left of it).
+ *
+ * Returns:
+ * @bool: false if descent should be restarted.
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::OptimisticFindLeaf(KeyType key,
+                                              PtrType& leaf_ptr) {
+  TraceSpan span{TRACE_DESCENT};
+  FrameGuard frames{pool_.get()};
+  StatsAdd(STATS_DESCENTS, 1);
+  PtrType current_ptr = GetRoot();
+
+  while (true) {
+    UpdateMappingIfNecessary(current_ptr);
+    if (current_ptr % 4096 != 0
+        || current_ptr + NodeSize > MappingSize(&region_)) [[unlikely]] {
+      return false;
+    }
+    Node<KeysCount>* current = GetRaw(current_ptr);
+
+    auto version = current->ReadBegin();
+    bool leaf = current->IsLeaf();
+    PtrType next_ptr = leaf ? 0 : current->ScanNodeFor(key);
+
+    if (!current->ReadValidate(version)) {
+      return false;
+    }
+    if (leaf) {
+      leaf_ptr = current_ptr;
+      return true;
+    }
+    if (next_ptr == 0) [[unlikely]] {
+      return false;
+    }
+    current_ptr = next_ptr;
+  }
+}
+
+
+
+/*
+ * FindLeaf -
+ * find leaf to start looking for 'key' from.
+ * No locks are held on return; caller should be ready to move right.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::FindLeaf(KeyType key) {
+  PtrType leaf_ptr;
+
+  for (int attempt = 0; attempt < kOptimisticAttempts; ++attempt) {
+    if (OptimisticFindLeaf(key, leaf_ptr)) [[likely]] {
+      return leaf_ptr;
+    }
+  }
+
+  std::stack<PtrType> stack;
+  return UpdateDescend(key, stack, 0);
+}
+
+
+
+/*
+ * RMoveRight -
+ * read lock leaf 'current_ptr' and go right from it
+ * until we find the leaf holding 'key'.
+ *
+ * Returns:
+ * @current_ptr: offset-pointer to RLocked leaf for 'key'.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::RMoveRight(KeyType key, PtrType current_ptr)
+  -> PtrType {
+  RLockNode(current_ptr);
+
+  while (GetRaw(current_ptr)->ShouldMoveRight(key)) {
+    StatsAdd(STATS_MOVE_RIGHT, 1);
+    PtrType next_ptr = GetRaw(current_ptr)->LinkPointer();
+    /* As in StepRight, couple locks only if it takes no waiting */
+    if (TryRLockNode(next_ptr)) {
+      UnlockNode(current_ptr);
+      current_ptr = next_ptr;
+      continue;
+    }
+    UnlockNode(current_ptr);
+    RLockNode(next_ptr);
+    current_ptr = next_ptr;
+
+    /* Merged away while unlocked: it is not freed before
+     * our epoch ends, but its keys are elsewhere now */
+    if (GetRaw(current_ptr)->IsDead()) [[unlikely]] {
+      UnlockNode(current_ptr);
+      current_ptr = FindLeaf(key);
+      RLockNode(current_ptr);
+    }
+  }
+
+  return current_ptr;
+}
+
+
+
+/*
+ * FindLeaves -
+ * FindLeaf for 'count' keys at once. Descents are interleaved:
+ * every one reads its node and only prefetches the child, which
+ * it reads when the others have had their turn. Descent that meets
+ * a node being modified is finished by FindLeaf.
+ *
+ * @cold: leaves are likely not in memory (see PrefetchNode).
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::FindLeaves(const KeyType* keys,
+                                      std::size_t count,
+                                      PtrType* leaf_ptrs, bool cold) {
+  TraceSpan span{TRACE_DESCENT};
+  StatsAdd(STATS_DESCENTS, count);
+  enum class Step : std::uint8_t { kDescend, kLeaf, kRetry };
+  Step steps[kMultiGetGroup];
+
+  PtrType root_ptr = GetRoot();
+  for (std::size_t j = 0; j < count; ++j) {
+    leaf_ptrs[j] = root_ptr;
+    steps[j] = Step::kDescend;
+  }
+
+  std::size_t descending = count;
+  while (descending > 0) {
+    FrameGuard frames{pool_.get()};
+
+    for (std::size_t j = 0; j < count; ++j) {
+      if (steps[j] != Step::kDescend) {
+        continue;
+      }
+      PtrType current_ptr = leaf_ptrs[j];
+      UpdateMappingIfNecessary(current_ptr);
+      if (current_ptr % 4096 != 0
+          || current_ptr + NodeSize > MappingSize(&region_)) [[unlikely]] {
+        steps[j] = Step::kRetry;
+        --descending;
+        continue;
+      }
+      Node<KeysCount>* current = GetRaw(current_ptr);
+
+      auto version = current->ReadBegin();
+      bool leaf = current->IsLeaf();
+      bool above_leaves = current->Level() == 1;
+      PtrType next_ptr = leaf ? 0 : current->ScanNodeFor(keys[j]);
+
+      if (!current->ReadValidate(version)
+          || (!leaf && next_ptr == 0)) [[unlikely]] {
+        steps[j] = Step::kRetry;
+        --descending;
+      } else if (leaf) {
+        steps[j] = Step::kLeaf;
+        --descending;
+      } else {
+        leaf_ptrs[j] = next_ptr;
+        PrefetchNode(next_ptr, cold && above_leaves);
+      }
+    }
+    if (pool_) {
+      pool_->Submit();
+    }
+  }
+
+  for (std::size_t j = 0; j < count; ++j) {
+    if (steps[j] == Step::kRetry) [[unlikely]] {
+      leaf_ptrs[j] = FindLeaf(keys[j]);
+    }
+  }
+}
+
+
+
+/*
+ * PrefetchNode -
+ * start bringing node at 'ptr' into cache; with 'cold' its page
+ * is asked from the kernel as well, rather than faulted in when read.
+ * Pool queues a read of the frame instead, caller submits it.
+*/
+template <std::size_t KeysCount>
+inline void BLinkTree<KeysCount>::PrefetchNode(PtrType ptr, bool cold) {
+  if (ptr % 4096 != 0
+      || ptr + NodeSize > MappingSize(&region_)) [[unlikely]] {
+    return;
+  }
+  if (pool_) {
+    pool_->Prefetch(ptr);
+    return;
+  }
+  const char* node = mapping + ptr;
+  /* Header with the first keys, and the middle of keys,
+   * where search starts */
+  __builtin_prefetch(node);
+  __builtin_prefetch(node + 64);
+  __builtin_prefetch(node + NodeSize / 2);
+
+  if (cold) {
+    (void)madvise(mapping + ptr, NodeSize, MADV_WILLNEED);
+  }
+}
+
+
+
+/* Page faults of calling thread that waited for disk */
+template <std::size_t KeysCount>
+long BLinkTree<KeysCount>::MajorFaults() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage) == -1) {
+    return 0;
+  }
+  return usage.ru_majflt;
+}
+
+
+
+/*
+ * ReadLeaf -
+ * copy out leaf entries with lo <= key < hi (see Node::CopyRange),
+ * lock free if possible.
+ *
+ * @link_ptr: leaf's right sibling.
+ * @high_key: leaf's high key.
+ *
+ * Returns:
+ * @count: number of copied entries.
+*/
+template <std::size_t KeysCount>
+std::size_t BLinkTree<KeysCount>::ReadLeaf(
+  PtrType ptr, KeyType lo, KeyType hi,
+  KeyType* keys, PtrType* ptrs,
+  PtrType& link_ptr, KeyType& high_key) {
+
+  {
+    FrameGuard frames{pool_.get()};
+    Node<KeysCount>* leaf = GetRaw(ptr);
+
+    for (int attempt = 0; attempt < kOptimisticAttempts; ++attempt) {
+      auto version = leaf->ReadBegin();
+
+      std::size_t count = leaf->CopyRange(lo, hi, keys, ptrs);
+      link_ptr = leaf->LinkPointer();
+      high_key = leaf->HighKey();
+
+      if (leaf->ReadValidate(version)) [[likely]] {
+        return count;
+      }
+    }
+  }
+
+  Node<KeysCount>* leaf = RGetRawLocked(ptr);
+
+  std::size_t count = leaf->CopyRange(lo, hi, keys, ptrs);
+  link_ptr = leaf->LinkPointer();
+  high_key = leaf->HighKey();
+
+  RDispatchNode(ptr, leaf);
+
+  return count;
+}
+
+
+
+/*
+ * Readahead -
+ * hint kernel that node at 'ptr' will be read soon.
+ * Hint covers a window of pages, so leaves laid out
+ * sequentially in file cost one madvise per window.
+ * Pool starts reading the node's frame instead.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::Readahead(PtrType ptr) {
+  if (pool_) {
+    UpdateMappingIfNecessary(ptr);
+    if (ptr % 4096 == 0 && ptr + NodeSize <= MappingSize(&region_)) {
+      pool_->Prefetch(ptr);
+      pool_->Submit();
+    }
+    return;
+  }
+  __builtin_prefetch(mapping + ptr);
+
+  /* Window is a hint only: threads may replace it in any order */
+  if (readahead_begin_.load(std::memory_order_relaxed) <= ptr
+      && ptr + static_cast<PtrType>(NodeSize)
+             <= readahead_end_.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  UpdateMappingIfNecessary(ptr);
+
+  PtrType begin = ptr / 4096 * 4096;
+  PtrType end = std::min<PtrType>(begin + kReadaheadWindow,
+                                  MappingSize(&region_));
+  if (begin >= end) [[unlikely]] {
+    return;
+  }
+
+  (void)madvise(mapping + begin, end - begin, MADV_WILLNEED);
+
+  readahead_begin_.store(begin, std::memory_order_relaxed);
+  readahead_end_.store(end, std::memory_order_relaxed);
+}
+
+
+
+/*
+ * ReadRecord -
+ * bytes of record at 'ptr', mapping is extended to cover them.
+ * Caller keeps record alive (holds lock on its leaf).
+*/
+template <std::size_t KeysCount>
+std::string_view BLinkTree<KeysCount>::ReadRecord(PtrType ptr) {
+  UpdateMappingIfNecessary(ptr);
+  std::string_view value = RecordValue(mapping + ptr);
+
+  PtrType end = ptr + static_cast<PtrType>(RecordSize(value.size()));
+  if (static_cast<std::size_t>(end) > MappingSize(&region_)) [[unlikely]] {
+    UpdateMapping();
+  }
+
+  return value;
+}
+
+
+
+/*
+ * InsertLocked -
+ * insert (key, ptr) into WriteLocked node 'current_ptr',
+ * splitting nodes up the tree as long as necessary.
+ * All locks are released on return.
+ *
+ * @stack: right-most nodes saved by UpdateDescend;
+ *   nodes on the way up are taken from it.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::InsertLocked(KeyType key, PtrType ptr,
+                                        PtrType current_ptr,
+                                        std::stack<PtrType>& stack) {
+  while (true) {
+    Preserve(current_ptr);
+    GetRaw(current_ptr)->Insert(key, ptr);
+    if (GetRaw(current_ptr)->IsSafe()) [[likely]] {
+      LogNodes({current_ptr});
+      UnlockNode(current_ptr);
+      break;
+    }
+
+    current_ptr = SplitNode(current_ptr, stack, key, ptr);
+    if (current_ptr == 0) {
+      break;
+    }
+    /* Note: current is under WriteLock now */
+  }
+}
+
+
+
+/*
+ * SplitNode -
+ * split WriteLocked and unsafe node 'current_ptr'.
+ * Both halves are logged as one change; 'current' is unlocked on return.
+ *
+ * @key, @ptr: separator that should be inserted into parent (out).
+ *
+ * Returns:
+ * @parent_ptr: WriteLocked node where (key, ptr) should be inserted,
+ *   or 0 if root was split and nothing is left to do.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::SplitNode(PtrType current_ptr,
+                                     std::stack<PtrType>& stack,
+                                     KeyType& key, PtrType& ptr) {
+  std::uint64_t begin = TraceBegin();
+  StatsAddSplit(GetRaw(current_ptr)->Level());
+  if (GetRaw(current_ptr)->IsRoot()) {
+    StatsAdd(STATS_ROOT_SPLITS, 1);
+    /* 'current' is root and unsafe.
+     * Create 2 new nodes (new root and right son of new root). */
+    PtrType new_root_ptr = NewNode();
+    PtrType right_son_ptr = NewNode();
+    GetRaw(current_ptr)->RearrangeRoot(
+      GetRaw(new_root_ptr), new_root_ptr,
+      GetRaw(right_son_ptr), right_son_ptr,
+      current_ptr
+    );
+
+    LogNodes({right_son_ptr, new_root_ptr, current_ptr});
+    /* UpdateMeta syncs meta itself: new root must be durable before */
+    Commit();
+
+    UpdateMeta(fd, mapping, new_root_ptr, GetRaw(new_root_ptr)->Level() + 1);
+    LogMeta();
+    UnpinNode(right_son_ptr);
+    UnpinNode(new_root_ptr);
+
+    TraceEnd(TRACE_ROOT_SPLIT, begin, current_ptr,
+             GetRaw(current_ptr)->Level());
+    UnlockNode(current_ptr);
+
+    return PtrType{0};
+  }
+
+  PtrType new_node_ptr = NewNode();
+  GetRaw(current_ptr)->Rearrange(GetRaw(new_node_ptr), new_node_ptr);
+
+  key = GetRaw(current_ptr)->HighKey();
+  ptr = new_node_ptr;
+
+  LogNodes({new_node_ptr, current_ptr});
+  UnpinNode(new_node_ptr);
+
+  auto level = GetRaw(current_ptr)->Level();
+
+  TraceEnd(TRACE_SPLIT, begin, current_ptr, level);
+  UnlockNode(current_ptr);
+
+  while (stack.empty()) {
+    /* Stack is empty, but 'current' isn't root.
+     * Go again from root to current level,
+     * saving right-most nodes in 'stack'.
+     * Root may still be on this level: concurrent root split
+     * has made the right son, but not published new root yet. */
+    UpdateDescend(key, stack, level);
+    if (stack.empty()) [[unlikely]] {
+      sched_yield();
+    }
+  }
+
+  PtrType parent_ptr = stack.top();
+  stack.pop();
+
+  return MoveRight(key, parent_ptr);
+}
+
+
+
+/*
+ * MoveRight -
+ * go right on current tree level
+ * until we find proper node to insert key.
+ *
+ * @key: key that should be inserted.
+ * @current_ptr: starting point
+ * 
+ * Returns:
+ * @current_ptr: offset-pointer to WriteLocked node
+ *   in which key should be inserted.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::MoveRight(KeyType key, PtrType current_ptr) {
+  WLockNode(current_ptr);
+
+  bool coupled;
+  while (StepRight(key, current_ptr, coupled)) {
+    if (!coupled) {
+      WLockNode(current_ptr);
+    }
+  }
+
+  return current_ptr;
+}
+
+
+/*
+ * StepRight -
+ * one step of MoveRight from WriteLocked 'current_ptr'.
+ *
+ * @current_ptr: replaced with its right sibling if key is there.
+ * @coupled: false if the sibling is not locked yet and caller
+ *   should lock it.
+ *
+ * Returns:
+ * @bool: false if 'current_ptr' is the node for key (still locked).
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::StepRight(KeyType key, PtrType& current_ptr,
+                                     bool& coupled) {
+  if (!GetRaw(current_ptr)->ShouldMoveRight(key)) {
+    return false;
+  }
+  StatsAdd(STATS_MOVE_RIGHT, 1);
+  auto tmp_ptr = GetRaw(current_ptr)->LinkPointer();
+  /* Lock coupling is only an optimization here:
+   * nodes split to the right only, so right sibling stays
+   * a valid place to continue even if 'current' is released first.
+   * Falling back to release-then-lock avoids deadlocks on
+   * latches shared by several nodes. */
+  coupled = TryWLockNode(tmp_ptr);
+  UnlockNode(current_ptr);
+
+  current_ptr = tmp_ptr;
+  return true;
+}
+
+
+
+/*
+ * UpdateDescend -
+ * go down to level 'level' inclusively,
+ * searching for place where 'key' could be inserted.
+ * Right-most nodes are added to 'stack'.
+ * 'stack' MUST be empty.
+ *
+ * @key: key that will be inserted
+ * @stack: std::stack for saving right-most nodes
+ * @level: go down until this level
+ *
+ * Returns:
+ * @current_ptr: offset-pointer to RLocked node
+ *   on needed level.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::UpdateDescend(
+  KeyType key,
+  std::stack<PtrType>& stack,
+  std::uint32_t level) {
+
+  assert(stack.empty() && "UpdateDescend: stack is not empty!");
+  TraceSpan span{TRACE_DESCENT};
+  StatsAdd(STATS_DESCENTS, 1);
+
+  PtrType current_ptr = GetRoot();
+  Node<KeysCount>* current = RGetRawLocked(current_ptr);
+
+  std::uint32_t current_level = current->Level();
+
+  while (current_level != level && !current->IsLeaf()) {
+    auto tmp_ptr = current_ptr;
+    auto tmp = current;
+    current_ptr = DescendStep(key, tmp_ptr, tmp, stack);
+    RDispatchNode(tmp_ptr, tmp);
+    current = RGetRawLocked(current_ptr);
+
+    current_level = current->Level();
+  }
+
+  RDispatchNode(current_ptr, current);
+
+  return current_ptr;
+}
+
+
+/*
+ * DescendStep -
+ * child of read locked inner 'node' to go on to for 'key';
+ * 'node' is saved to 'stack' unless the child is its right sibling.
+*/
+template <std::size_t KeysCount>
+inline auto BLinkTree<KeysCount>::DescendStep(KeyType key, PtrType node_ptr,
+                                              const Node<KeysCount>* node,
+                                              std::stack<PtrType>& stack)
+  -> PtrType {
+  PtrType child_ptr = node->ScanNodeFor(key);
+  if (child_ptr != node->LinkPointer()) {
+    stack.push(node_ptr);
+  }
+  return child_ptr;
+}
+
+
+
+/*
+ * UpdateDescendAsync -
+ * UpdateDescend to the leaf level in a coroutine:
+ * every node is fetched before it is read, see FetchNode.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::UpdateDescendAsync(KeyType key,
+                                              std::stack<PtrType>& stack,
+                                              AsyncGuard& guard)
+  -> Task<PtrType> {
+  assert(stack.empty() && "UpdateDescendAsync: stack is not empty!");
+  StatsAdd(STATS_DESCENTS, 1);
+
+  PtrType current_ptr = GetRoot();
+
+  while (true) {
+    co_await FetchNode(current_ptr, guard);
+    Node<KeysCount>* current = RGetRawLocked(current_ptr);
+    if (current->IsLeaf()) {
+      RDispatchNode(current_ptr, current);
+      co_return current_ptr;
+    }
+
+    PtrType next_ptr = DescendStep(key, current_ptr, current, stack);
+    RDispatchNode(current_ptr, current);
+    current_ptr = next_ptr;
+  }
+}
+
+
+/*
+ * MoveRightAsync -
+ * MoveRight in a coroutine: locks are waited for by pausing.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::MoveRightAsync(KeyType key, PtrType current_ptr,
+                                          AsyncGuard& guard)
+  -> Task<PtrType> {
+  co_await FetchNode(current_ptr, guard);
+  co_await WLockAsync(current_ptr, guard);
+
+  bool coupled;
+  while (StepRight(key, current_ptr, coupled)) {
+    if (!coupled) {
+      co_await FetchNode(current_ptr, guard);
+      co_await WLockAsync(current_ptr, guard);
+    }
+  }
+
+  co_return current_ptr;
+}
+
+
+/*
+ * FetchNode -
+ * pause until node at 'ptr' can be read without waiting for disk.
+ * Pool reads its frame through the ring. Mapped node is looked at
+ * (mincore) only by a thread that has been waiting for disk lately,
+ * kernel is asked to read it and it is given a few turns to arrive;
+ * after that it is faulted in as usual.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::FetchNode(PtrType ptr,
+                                     AsyncGuard& guard) -> Task<void> {
+  UpdateMappingIfNecessary(ptr);
+  if (ptr % 4096 != 0
+      || ptr + NodeSize > MappingSize(&region_)) [[unlikely]] {
+    co_return;
+  }
+
+  if (pool_) {
+    if (pool_->Prefetch(ptr)) {
+      pool_->Submit();
+      while (pool_->Loading(ptr)) {
+        pool_->Poll();
+        co_await guard.Pause();
+      }
+    }
+    co_return;
+  }
+
+  if (!guard.Cold() || NodeResident(ptr)) {
+    co_return;
+  }
+  PrefetchNode(ptr, true);
+  for (int pause = 0; pause < kFetchPauses && !NodeResident(ptr); ++pause) {
+    co_await guard.Pause();
+  }
+}
+
+
+/* Every page of node at 'ptr' is in page cache */
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::NodeResident(PtrType ptr) {
+  unsigned char pages[(NodeSize + 4095) / 4096];
+  if (mincore(mapping + ptr, NodeSize, pages) == -1) {
+    return true;
+  }
+  return std::all_of(std::begin(pages), std::end(pages),
+                     [](unsigned char page) { return page & 1; });
+}
+
+
+/*
+ * WLockAsync -
+ * WLockNode in a coroutine: lock is tried again after every pause.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::WLockAsync(PtrType ptr,
+                                      AsyncGuard& guard) -> Task<void> {
+  if (TryWLockNode(ptr)) [[likely]] {
+    co_return;
+  }
+
+  StatsAdd(STATS_LOCK_WAITS, 1);
+  std::uint64_t begin = TraceBegin();
+  do {
+    co_await guard.Pause();
+  } while (!TryWLockNode(ptr));
+  TraceEnd(TRACE_LOCK_WAIT, begin, ptr, GetRaw(ptr)->Level());
+}
+
+
+/*
+ * CommitAsync -
+ * Commit in a coroutine: flush of another thread is awaited
+ * by pausing (see WalTryCommit).
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::CommitAsync(AsyncGuard& guard) -> Task<void> {
+  if (!sync_commit_) {
+    co_return;
+  }
+  std::uint64_t lsn = WalLastLsn();
+  while (!WalTryCommit(wal, lsn)) {
+    co_await guard.Pause();
+  }
+}
+
+
+
+/*
+ * CompactLevel -
+ * walk nodes of 'level' from left to right, merging their children.
+ *
+ * Returns:
+ * @count: number of children merged away.
+*/
+template <std::size_t KeysCount>
+std::size_t BLinkTree<KeysCount>::CompactLevel(std::uint32_t level) {
+  std::stack<PtrType> stack;
+  PtrType parent_ptr = UpdateDescend(0, stack, level);
+  std::size_t removed = 0;
+
+  while (parent_ptr != 0) {
+    WLockNode(parent_ptr);
+    Node<KeysCount>* parent = GetRaw(parent_ptr);
+    if (parent->Level() != level || parent->IsDead()) [[unlikely]] {
+      /* Nodes of this level die only when level above is compacted */
+      UnlockNode(parent_ptr);
+      break;
+    }
+
+    std::size_t i = 1;
+    while (i < parent->Size()) {
+      if (MergeChildren(parent_ptr, i)) {
+        /* Next child has shifted to i */
+        ++removed;
+      } else {
+        ++i;
+      }
+    }
+
+    PtrType next_ptr = parent->LinkPointer();
+    UnlockNode(parent_ptr);
+    parent_ptr = next_ptr;
+  }
+
+  return removed;
+}
+
+
+
+/*
+ * MergeChildren -
+ * purge children i-1 and i of WriteLocked node 'parent_ptr'
+ * and merge the right one into the left one if they fit together.
+ * Parent, left and right child are logged as one change.
+ *
+ * Returns:
+ * @bool: true if i-th child was merged away.
+*/
+template <std::size_t KeysCount>
+bool BLinkTree<KeysCount>::MergeChildren(PtrType parent_ptr, std::size_t i) {
+  Node<KeysCount>* parent = GetRaw(parent_ptr);
+  PtrType left_ptr = parent->GetIthPtr(i - 1);
+  PtrType right_ptr = parent->GetIthPtr(i);
+
+  /* Writers lock child before parent, so children are never waited for */
+  if (!TryWLockNode(left_ptr)) {
+    return false;
+  }
+  if (!TryWLockNode(right_ptr)) {
+    UnlockNode(left_ptr);
+    return false;
+  }
+  Node<KeysCount>* left = GetRaw(left_ptr);
+  Node<KeysCount>* right = GetRaw(right_ptr);
+
+  /* Left child being split is not followed by right one;
+   * merged node must have room for inserts (see Node::CanAbsorb) */
+  bool merged = left->LinkPointer() == right_ptr && left->CanAbsorb(right);
+
+  if (merged) {
+    Preserve(parent_ptr);
+    Preserve(left_ptr);
+    Preserve(right_ptr);
+    left->Absorb(right, left_ptr);
+    parent->RemoveChild(i);
+    RetireNode(right_ptr);
+    LogNodes({parent_ptr, left_ptr, right_ptr}, true);
+  } else if (left->IsLeaf() && left->Purge() + right->Purge() > 0) {
+    LogNodes({left_ptr, right_ptr});
+  }
+
+  UnlockNode(right_ptr);
+  UnlockNode(left_ptr);
+
+  return merged;
+}
+
+
+
+/*
+ * CollapseRoot -
+ * while root has the only child, make the child root.
+ *
+ * Returns:
+ * @count: number of levels taken away.
+*/
+template <std::size_t KeysCount>
+std::size_t BLinkTree<KeysCount>::CollapseRoot() {
+  std::size_t removed = 0;
+
+  while (true) {
+    PtrType root_ptr = GetRoot();
+    WLockNode(root_ptr);
+    Node<KeysCount>* root = GetRaw(root_ptr);
+
+    if (!root->IsRoot() || root->IsLeaf() || root->Size() != 1) {
+      UnlockNode(root_ptr);
+      break;
+    }
+
+    PtrType child_ptr = root->GetIthPtr(0);
+    if (!TryWLockNode(child_ptr)) {
+      UnlockNode(root_ptr);
+      break;
+    }
+    Node<KeysCount>* child = GetRaw(child_ptr);
+    if (child->LinkPointer() != 0) {
+      /* Child is being split: it will not be alone on its level */
+      UnlockNode(child_ptr);
+      UnlockNode(root_ptr);
+      break;
+    }
+
+    Preserve(root_ptr);
+    Preserve(child_ptr);
+    root->Collapse(child_ptr);
+    child->MarkRoot();
+    RetireNode(root_ptr);
+
+    LogNodes({root_ptr, child_ptr}, true);
+    /* UpdateMeta syncs meta itself: new root must be durable before */
+    Commit();
+
+    UpdateMeta(fd, mapping, child_ptr, child->Level() + 1);
+    LogMeta();
+
+    UnlockNode(child_ptr);
+    UnlockNode(root_ptr);
+
+    ++removed;
+  }
+
+  return removed;
+}
+
+
+
+/*
+ * RetireNode -
+ * put WriteLocked node that has just been merged away
+ * into the list of retired nodes (FileMeta::retired_nodes).
+ * Caller holds compaction lock and logs the node and the list.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::RetireNode(PtrType node_ptr) {
+  FileMeta* meta = reinterpret_cast<FileMeta*>(mapping);
+
+  /* Operations entered from now on cannot reach the node */
+  std::uint64_t stamp = EpochAdvance(epochs);
+
+  GetRaw(node_ptr)->Retire(meta->retired_nodes, stamp);
+  meta->retired_nodes = node_ptr;
+}
+
+
+
+/*
+ * Preserve -
+ * WriteLocked node is about to change: if some open snapshot may
+ * read it as it is, save this version first (see SnapshotView), and
+ * stamp node with the current epoch. Node's first change in an epoch
+ * saves it; others find it stamped already.
+ * Changes nobody reads (dropping removed entries, links of retired
+ * nodes) need no new version.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::Preserve(PtrType node_ptr) {
+  if (!VersionsOpen(versions)) [[likely]] {
+    return;
   }
-  // mapping_size = statbuf.st_size;
-  mapping_size = 10000000; // 10mln; костыль
-  mapping =
-    (char*)mmap(
-      NULL,
-      mapping_size,
-      PROT_READ | PROT_WRITE,
-      MAP_SHARED,
-      fd,
-      0
-    );
-  if (mapping == MAP_FAILED) {
-    perror("mmap");
-    exit(EXIT_FAILURE);
+  Node<KeysCount>* node = GetRaw(node_ptr);
+  /* Read under the lock: whoever wrote node before stamped it earlier */
+  std::uint64_t now = EpochNow(epochs);
+  if (node->Stamp() == now) {
+    return;
   }
-  if (madvise(mapping, mapping_size, MADV_RANDOM) == -1) {
-    perror("madvise");
+
+  std::uint64_t older = node->Older();
+  if (VersionNeeded(versions, node->Stamp())
+      && !VersionCopy(versions, node, Node<KeysCount>::ContentSize, &older)) {
     exit(EXIT_FAILURE);
   }
+  node->Restamp(now, older);
 }
 
 
+/* Record removed while snapshots were open (see ReleaseSnapshot) */
 template <std::size_t KeysCount>
-BLinkTree<KeysCount>::~BLinkTree() {
-  munmap(mapping, mapping_size);
-
-  close(fd);
+void BLinkTree<KeysCount>::FreeDeferred(void* tree, off_t ptr,
+                                        std::size_t size) {
+  auto self = static_cast<BLinkTree*>(tree);
+  FreeRecord(self->fd, self->mapping, ptr, size, self->wal);
 }
 
 
 
 /*
- * Search -
- * search for key in tree.
- *
- * @key: key that being searched.
+ * ReclaimNodes -
+ * free pages of retired nodes that no operation can be looking at.
+ * List goes from the newest stamp to the oldest, so such nodes
+ * are its tail. Tail is cut off before being freed: crash in between
+ * leaks the pages rather than hands them out twice.
+ * Caller holds compaction lock.
  *
  * Returns:
- * @ptr: offset-pointer to record or 0 if not present.
+ * @count: number of freed nodes.
 */
 template <std::size_t KeysCount>
-auto BLinkTree<KeysCount>::Search(KeyType key) const {
-  PtrType current_ptr = GetRoot();
-  Node<KeysCount>* current = RGetRawLocked(current_ptr);
-
-  while (!current->IsLeaf()) {
-    auto tmp_ptr = current_ptr;
-    current_ptr = current->ScanNodeFor(key);
-    current = RGetRawLocked(current_ptr);
-    RDispatchNode(tmp_ptr);
+std::size_t BLinkTree<KeysCount>::ReclaimNodes() {
+  FileMeta* meta = reinterpret_cast<FileMeta*>(mapping);
+  /* Snapshots reach nodes retired after they were taken */
+  std::uint64_t oldest = std::min(EpochOldest(epochs),
+                                  VersionOldest(versions));
+
+  PtrType prev_ptr = 0;
+  PtrType node_ptr = meta->retired_nodes;
+  while (node_ptr != 0) {
+    /* Retired nodes are not locked while their links are read */
+    FrameGuard frames{pool_.get()};
+    Node<KeysCount>* node = GetRaw(node_ptr);
+    if (node->RetiredStamp() < oldest) {
+      break;
+    }
+    prev_ptr = node_ptr;
+    node_ptr = node->RetiredNext();
   }
-
-  while (!current->IsWithin(key)) {
-    auto tmp_ptr = current_ptr;
-    current_ptr = current->LinkPointer();
-    current = RGetRawLocked(current_ptr);
-    RDispatchNode(tmp_ptr);
+  if (node_ptr == 0) {
+    return 0;
   }
 
-  PtrType res = current->Contains(key)
-    ? current->GetRecordByKey(key)
-    : 0;
+  if (prev_ptr == 0) {
+    meta->retired_nodes = 0;
+    LogNodes({}, true);
+  } else {
+    WLockNode(prev_ptr);
+    GetRaw(prev_ptr)->Retire(0, GetRaw(prev_ptr)->RetiredStamp());
+    LogNodes({prev_ptr});
+    UnlockNode(prev_ptr);
+  }
 
-  RDispatchNode(current);
+  std::size_t count = 0;
+  while (node_ptr != 0) {
+    PtrType next_ptr;
+    {
+      FrameGuard frames{pool_.get()};
+      next_ptr = GetRaw(node_ptr)->RetiredNext();
+    }
+    DeleteNode(node_ptr);
+    node_ptr = next_ptr;
+    ++count;
+  }
 
-  return res;
+  return count;
 }
 
 
 
 /*
- * Insert -
- * insert (key, record) into BlinkTree.
- *
- * @key: key that should be inserted.
- * @record: string_view to record.
+ * VerifySegment -
+ * verify nodes of 'level' from 'entries' [begin, end) and those
+ * reached from them through links before the next entry.
+ * Problem stops the walk from an entry: what it has linked to
+ * cannot be trusted.
 */
 template <std::size_t KeysCount>
-void BLinkTree<KeysCount>::Insert(KeyType key, std::string_view record) {
-  std::stack<PtrType> stack;
-
-  PtrType current_ptr = UpdateDescend(key, stack, 0);
-
-  /* Now current_ptr is leaf;
-   * no locks being hold. */
-
-  current_ptr = MoveRight(key, current_ptr);
-
-  /* Note: current is under WriteLock now */
-
-  if (GetRaw(current_ptr)->Contains(key)) {
-    UnlockNode(current_ptr);
-    return;
+void BLinkTree<KeysCount>::VerifySegment(
+  const std::vector<VerifyEntry>& entries,
+  std::size_t begin, std::size_t end,
+  std::uint32_t level, VerifyPart& part) {
+  auto node = std::make_unique<Node<KeysCount>>();
+  std::vector<KeyType> bounds;
+  std::vector<PtrType> children;
+  /* Links may go round in corrupt file */
+  PtrType max_steps = part.file_size / 4096;
+
+  for (std::size_t j = begin; j < end; ++j) {
+    PtrType ptr = entries[j].ptr;
+    KeyType lo = entries[j].lo;
+    KeyType hi = entries[j].hi;
+    PtrType next_ptr = j + 1 < entries.size() ? entries[j + 1].ptr : 0;
+
+    for (PtrType steps = 0; ; ++steps) {
+      if (!part.InFile(ptr) || steps == max_steps) {
+        part.Problem(part.report.broken_links, ptr, "pointer out of file");
+        break;
+      }
+      {
+        FrameGuard frames{pool_.get()};
+        *node = *GetRaw(ptr);
+      }
+      ++part.report.nodes;
+
+      if (!node->ChecksumValid()) {
+        part.Problem(part.report.corrupt, ptr, "checksum does not match");
+        break;
+      }
+      if (node->IsDead()) {
+        part.Problem(part.report.malformed, ptr, "dead node is reachable");
+        break;
+      }
+      if (node->Level() != level) {
+        part.Problem(part.report.malformed, ptr, "level does not match");
+        break;
+      }
+      if (node->IsRoot() != (ptr == part.root_ptr)) {
+        part.Problem(part.report.malformed, ptr, "root flag does not match");
+        break;
+      }
+      if (const char* what = node->Check(lo)) {
+        part.Problem(part.report.malformed, ptr, what);
+        break;
+      }
+      KeyType high = node->HighKey();
+      if (high > hi) {
+        part.Problem(part.report.malformed, ptr,
+                     "high key is above parent's fence");
+        break;
+      }
+
+      if (!node->IsLeaf()) {
+        node->Entries(bounds, children);
+        for (std::size_t i = 0; i < children.size(); ++i) {
+          part.children.push_back(
+            VerifyEntry{children[i], i == 0 ? lo : bounds[i - 1], bounds[i]});
+        }
+      } else {
+        for (std::size_t i = 0; i < node->Size(); ++i) {
+          PtrType record_ptr = node->GetIthPtr(i);
+          if (record_ptr != 0
+              && (record_ptr < 4096 || record_ptr >= part.file_size)) {
+            part.Problem(part.report.broken_links, ptr,
+                         "record pointer out of file");
+          }
+        }
+      }
+
+      PtrType link_ptr = node->LinkPointer();
+      if (high == hi) {
+        if (link_ptr != next_ptr) {
+          part.Problem(part.report.broken_links, ptr,
+                       "link does not lead to the next node of level");
+        }
+        break;
+      }
+      if (link_ptr == 0) {
+        part.Problem(part.report.broken_links, ptr,
+                     "level ends before parent's fence");
+        break;
+      }
+      /* Split of node has not got to the parent */
+      part.orphans.emplace_back(VerifyEntry{link_ptr, high, hi}, level);
+      lo = high;
+      ptr = link_ptr;
+    }
   }
+}
 
-  PtrType record_ptr = AllocateRecord(fd, record);
 
-  // DoInsertion:
-  while (true) {
-    PinNodeInRAM(current_ptr);
-    GetRaw(current_ptr)->Insert(key, record_ptr);
-    if (GetRaw(current_ptr)->IsSafe()) [[likely]] {
-      UnpinNode(current_ptr);
-      UnlockNode(current_ptr);
+/*
+ * VerifyRetired -
+ * nodes in the list of retired ones must be dead.
+*/
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::VerifyRetired(VerifyPart& part) {
+  auto node = std::make_unique<Node<KeysCount>>();
+  FileMeta* meta = reinterpret_cast<FileMeta*>(mapping);
+  PtrType max_steps = part.file_size / 4096;
+
+  PtrType ptr = meta->retired_nodes;
+  for (PtrType steps = 0; ptr != 0; ++steps) {
+    if (!part.InFile(ptr) || steps == max_steps) {
+      part.Problem(part.report.broken_links, ptr, "pointer out of file");
       break;
     }
-    if (GetRaw(current_ptr)->IsRoot()) {
-      /* 'current' is root and unsafe.
-       * Create 2 new nodes (new root and right son of new root). */
-      PtrType new_root_ptr = AllocateNode<KeysCount>(fd);
-      PtrType right_son_ptr = AllocateNode<KeysCount>(fd);
-      GetRaw(current_ptr)->RearrangeRoot(
-        GetRaw(new_root_ptr), new_root_ptr,
-        GetRaw(right_son_ptr), right_son_ptr,
-        current_ptr
-      );
-
-      MSync(GetRaw(right_son_ptr), NodeSize);
-      MSync(GetRaw(new_root_ptr), NodeSize);
-      UnpinNode(current_ptr);
-      MSync(GetRaw(current_ptr), NodeSize);
-
-      UpdateMeta(fd, mapping, new_root_ptr, GetRaw(new_root_ptr)->Level());
-
-      UnlockNode(current_ptr);
+    {
+      FrameGuard frames{pool_.get()};
+      *node = *GetRaw(ptr);
+    }
+    ++part.report.nodes;
 
+    if (!node->ChecksumValid()) {
+      part.Problem(part.report.corrupt, ptr, "checksum does not match");
       break;
     }
-
-    PtrType new_node_ptr = AllocateNode<KeysCount>(fd);
-    GetRaw(current_ptr)->Rearrange(GetRaw(new_node_ptr), new_node_ptr);
-
-    key = GetRaw(new_node_ptr)->GetMinKey();
-    record_ptr = new_node_ptr;
-
-    MSync(GetRaw(new_node_ptr), NodeSize);
-    UnpinNode(current_ptr);
-    MSync(GetRaw(current_ptr), NodeSize);
-
-    auto level = GetRaw(current_ptr)->Level();
-
-    UnlockNode(current_ptr);
-
-    if (stack.empty()) {
-      /* Stack is empty, but 'current' isn't root.
-       * Go again from root to current level,
-       * saving right-most nodes in 'stack'. */
-      UpdateDescend(key, stack, level);
+    if (!node->IsDead()) {
+      part.Problem(part.report.malformed, ptr, "retired node is alive");
+      break;
     }
-
-    current_ptr = stack.top();
-    stack.pop();
-
-    current_ptr = MoveRight(key, current_ptr);
-    /* Note: current is under WriteLock now */
+    ptr = node->RetiredNext();
   }
 }
 
 
-
 /*
- * Remove -
- * record under 'key' from tree.
- * Record counts as removed if pointer to it is 0.
- *
- * @key: key whose record should be removed.
+ * RepairSeparator -
+ * insert separator of orphan 'orphan_ptr' of 'level', whose range
+ * begins at 'key', into the parent: the rest of its split.
  *
  * Returns:
- * @bool: true if actually removed record.
+ * @bool: false if nothing was done: parent has the separator
+ *   already, or orphan is on root level and has no parent yet.
 */
 template <std::size_t KeysCount>
-bool BLinkTree<KeysCount>::Remove(KeyType key) {
-  PtrType current_ptr = GetRoot();
-  Node<KeysCount>* current = RGetRawLocked(current_ptr);
+bool BLinkTree<KeysCount>::RepairSeparator(PtrType orphan_ptr, KeyType key,
+                                           std::uint32_t level) {
+  WriteGuard writing{epochs};
+  EpochGuard guard{epochs, stats};
+  std::stack<PtrType> stack;
 
-  while (!current->IsLeaf()) {
-    auto tmp_ptr = current_ptr;
-    current_ptr = current->ScanNodeFor(key);
-    current = RGetRawLocked(current_ptr);
-    RDispatchNode(tmp_ptr);
+  UpdateDescend(key, stack, level);
+  if (stack.empty()) {
+    return false;
   }
+  PtrType parent_ptr = MoveRight(key, stack.top());
+  stack.pop();
 
-  RDispatchNode(current_ptr);
-
-  current_ptr = MoveRight(key, current_ptr);
-  /* 'current' is unser WriteLock now */
-
-  bool res = GetRaw(current_ptr)->Remove(key);
-
-  UnlockNode(current_ptr);
+  if (GetRaw(parent_ptr)->ScanNodeFor(key) == orphan_ptr) {
+    UnlockNode(parent_ptr);
+    return false;
+  }
+  InsertLocked(key, orphan_ptr, parent_ptr, stack);
+  Commit();
 
-  return res;
+  return true;
 }
 
 
 
 /*
- * ReadMeta - reads file meta.
+ * DefragLeaf -
+ * visit leaf from defrag_key_ on: move it unless it is in place
+ * and go past it; busy leaf is left for the next visit.
+ * Parent is locked first, then the leaf and its left sibling
+ * are only try-locked (writers lock children before parents).
  *
  * Returns:
- * @meta: copy of consistent file meta at some point.
+ * @bool: false if there are no leaves left for this pass.
 */
 template <std::size_t KeysCount>
-FileMeta BLinkTree<KeysCount>::ReadMeta() const {
-  FileMeta* meta = GetMetaLocked(fd, mapping);
+bool BLinkTree<KeysCount>::DefragLeaf(bool records, DefragStep& step) {
+  KeyType key = defrag_key_;
+  std::stack<PtrType> stack;
 
-  FileMeta copy{*meta};
+  PtrType parent_ptr = UpdateDescend(key, stack, 1);
+  {
+    FrameGuard frames{pool_.get()};
+    if (GetRaw(parent_ptr)->IsLeaf()) {
+      /* Root is the only leaf */
+      return false;
+    }
+  }
+  parent_ptr = MoveRight(key, parent_ptr);
+  ++step.visited;
+
+  Node<KeysCount>* parent = GetRaw(parent_ptr);
+  std::vector<KeyType> bounds;
+  std::vector<PtrType> children;
+  parent->Entries(bounds, children);
+  std::size_t i = std::find(children.begin(), children.end(),
+                            parent->ScanNodeFor(key)) - children.begin();
+  PtrType leaf_ptr = children[i];
+  PtrType left_ptr = defrag_left_;
+
+  /* Busy leaf (its latch may even be parent's) stays where it is
+   * this pass; parent tells where the next one begins */
+  auto skip = [&] {
+    UnlockNode(parent_ptr);
+    defrag_key_ = bounds[i];
+    defrag_left_ = leaf_ptr;
+    defrag_end_ = leaf_ptr + static_cast<PtrType>(NodeSize);
+    return bounds[i] != std::numeric_limits<KeyType>::max();
+  };
+
+  if (!TryWLockNode(leaf_ptr)) {
+    return skip();
+  }
+  if (left_ptr != 0 && !TryWLockNode(left_ptr)) {
+    UnlockNode(leaf_ptr);
+    return skip();
+  }
+  Node<KeysCount>* leaf = GetRaw(leaf_ptr);
+  Node<KeysCount>* left = left_ptr != 0 ? GetRaw(left_ptr) : nullptr;
 
-  DispatchMeta(fd, mapping, meta);
+  auto unlock = [&] {
+    if (left_ptr != 0) {
+      UnlockNode(left_ptr);
+    }
+    UnlockNode(leaf_ptr);
+    UnlockNode(parent_ptr);
+  };
+
+  /* Leaf split, and its parent has not got the separator yet */
+  if (leaf->ShouldMoveRight(key)) {
+    if (left_ptr != 0) {
+      UnlockNode(left_ptr);
+    }
+    UnlockNode(leaf_ptr);
+    return skip();
+  }
 
-  return copy;
-}
+  KeyType high_key = leaf->HighKey();
+  bool last = leaf->LinkPointer() == 0;
+  /* Pass starts from the left-most leaf, which has no left sibling */
+  bool linked = left == nullptr
+    || (!left->IsDead() && left->LinkPointer() == leaf_ptr);
+  PtrType end;
+  bool in_place = InPlace(leaf, leaf_ptr, records, end);
+
+  if (!linked || in_place) {
+    unlock();
+  } else {
+    std::vector<PtrType> old_records;
+    PtrType size = static_cast<PtrType>(NodeSize);
+    if (records) {
+      for (std::size_t j = 0; j < leaf->Size(); ++j) {
+        PtrType record_ptr = leaf->GetIthPtr(j);
+        if (record_ptr != 0) {
+          old_records.push_back(record_ptr);
+          size += ExtentSize(RecordSize(ReadRecord(record_ptr).size()));
+        }
+      }
+    }
 
+    PtrType new_ptr = AllocateRun(fd, mapping, size, wal);
+    if (new_ptr == -1) {
+      unlock();
+      return false;
+    }
 
+    Preserve(parent_ptr);
+    if (left != nullptr) {
+      Preserve(left_ptr);
+    }
+    Preserve(leaf_ptr);
+    /* Copy keeps leaf's stamp and older version for snapshots */
+    if (pool_) {
+      pool_->Install(new_ptr);
+    }
+    *GetRaw(new_ptr) = *GetRaw(leaf_ptr);
+    if (records) {
+      MoveRecords(GetRaw(new_ptr), new_ptr + NodeSize);
+    }
 
-/*
- * GetRoot - get current tree root.
- *
- * Returns:
- * @root: offset-pointer to root.
-*/
-template <std::size_t KeysCount>
-auto BLinkTree<KeysCount>::GetRoot() const {
-  FileMeta* meta = GetMetaLocked(fd, mapping);
+    leaf->MoveTo(new_ptr);
+    parent->SetIthPtr(i, new_ptr);
+    RetireNode(leaf_ptr);
+    if (left != nullptr) {
+      left->Relink(new_ptr);
+      LogNodes({new_ptr, leaf_ptr, left_ptr, parent_ptr}, true);
+    } else {
+      LogNodes({new_ptr, leaf_ptr, parent_ptr}, true);
+    }
 
-  PtrType root = meta->root_offset;
+    /* Records are reached only through the locked leaf; snapshots
+     * may still read them */
+    for (PtrType record_ptr : old_records) {
+      std::size_t length = ReadRecord(record_ptr).size();
+      if (!VersionsOpen(versions)
+          || !VersionDefer(versions, record_ptr, length)) {
+        FreeRecord(fd, mapping, record_ptr, length, wal);
+      }
+    }
 
-  DispatchMeta(fd, mapping, meta);
+    unlock();
+    UnpinNode(new_ptr);
 
-  return root;
-}
+    leaf_ptr = new_ptr;
+    end = new_ptr + size;
+    ++step.moved;
+  }
 
+  defrag_key_ = high_key;
+  defrag_left_ = leaf_ptr;
+  defrag_end_ = end;
 
-/*
- * Private methods
-*/
+  return !last;
+}
 
 
 /*
- * MoveRight -
- * go right on current tree level
- * until we find proper node to insert key.
+ * InPlace -
+ * WriteLocked leaf lies right after the end of its left sibling
+ * (defrag_end_), close enough for readahead to bring it in;
+ * with 'records' so do its records after it, in key order.
+ * Left-most leaf is in place if its right sibling follows it.
  *
- * @key: key that should be inserted.
- * @current_ptr: starting point
- * 
- * Returns:
- * @current_ptr: offset-pointer to WriteLocked node
- *   in which key should be inserted.
+ * @end: end of the leaf and its records (out).
 */
 template <std::size_t KeysCount>
-auto BLinkTree<KeysCount>::MoveRight(KeyType key, PtrType current_ptr) {
-  WLockNode(current_ptr);
-
-  while (true) {
-    auto tmp_ptr = GetRaw(current_ptr)->ScanNodeFor(key);
-    if (tmp_ptr == 0 || tmp_ptr != GetRaw(current_ptr)->LinkPointer()) {
-      break;
+bool BLinkTree<KeysCount>::InPlace(const Node<KeysCount>* leaf,
+                                   PtrType leaf_ptr, bool records,
+                                   PtrType& end) {
+  auto near = [](PtrType ptr, PtrType after) {
+    return ptr >= after && ptr - after < kReadaheadWindow;
+  };
+
+  end = leaf_ptr + static_cast<PtrType>(NodeSize);
+  bool in_place = defrag_left_ == 0 || near(leaf_ptr, defrag_end_);
+
+  for (std::size_t j = 0; records && j < leaf->Size(); ++j) {
+    PtrType record_ptr = leaf->GetIthPtr(j);
+    if (record_ptr == 0) {
+      continue;
     }
-    WLockNode(tmp_ptr);
-    UnlockNode(current_ptr);
-
-    current_ptr = tmp_ptr;
+    in_place = in_place && near(record_ptr, end);
+    end = std::max(end, record_ptr + static_cast<PtrType>(
+      ExtentSize(RecordSize(ReadRecord(record_ptr).size()))));
   }
 
-  return current_ptr;
+  if (defrag_left_ == 0) {
+    PtrType link_ptr = leaf->LinkPointer();
+    in_place = in_place && (link_ptr == 0 || near(link_ptr, end));
+  }
+  return in_place;
 }
 
 
-
 /*
- * UpdateDescend -
- * go down to level 'level' inclusively,
- * searching for place where 'key' could be inserted.
- * Right-most nodes are added to 'stack'.
- * 'stack' MUST be empty.
- *
- * @key: key that will be inserted
- * @stack: std::stack for saving right-most nodes
- * @level: go down until this level
- *
- * Returns:
- * @current_ptr: offset-pointer to RLocked node
- *   on needed level.
+ * MoveRecords -
+ * copy records of leaf copy (not shared yet) one after another
+ * from 'begin' on and point its entries to them. Copies are logged
+ * before the leaf is; old records are left for the caller to free.
 */
 template <std::size_t KeysCount>
-auto BLinkTree<KeysCount>::UpdateDescend(
-  KeyType key,
-  std::stack<PtrType>& stack,
-  std::uint32_t level) {
+void BLinkTree<KeysCount>::MoveRecords(Node<KeysCount>* leaf,
+                                       PtrType begin) {
+  std::vector<WalImage> images;
+  PtrType ptr = begin;
+
+  for (std::size_t j = 0; j < leaf->Size(); ++j) {
+    PtrType record_ptr = leaf->GetIthPtr(j);
+    if (record_ptr == 0) {
+      continue;
+    }
+    std::size_t size = RecordSize(ReadRecord(record_ptr).size());
+    const char* raw = mapping + record_ptr;
+    if (pwrite(fd, raw, size, ptr) != static_cast<ssize_t>(size)) {
+      perror("pwrite");
+      exit(EXIT_FAILURE);
+    }
+    images.push_back(WalImage{
+      .offset = ptr,
+      .data = raw,
+      .size = static_cast<std::uint32_t>(size)
+    });
+
+    leaf->SetIthPtr(j, ptr);
+    ptr += static_cast<PtrType>(ExtentSize(static_cast<off_t>(size)));
+  }
 
-  assert(stack.empty() && "UpdateDescend: stack is not empty!");
+  (void)WalAppend(wal, images.data(), images.size());
+}
 
-  PtrType current_ptr = GetRoot();
-  Node<KeysCount>* current = RGetRawLocked(current_ptr);
 
-  std::uint32_t current_level = current->Level();
 
-  while (current_level != level && !current->IsLeaf()) {
-    auto tmp_ptr = current_ptr;
-    current_ptr = current->ScanNodeFor(key);
-    if (current_ptr != GetRaw(tmp_ptr)->LinkPointer()) {
-      stack.push(tmp_ptr);
-    }
-    current = RGetRawLocked(current_ptr);
-    RDispatchNode(tmp_ptr);
+template <std::size_t KeysCount>
+inline Node<KeysCount>* BLinkTree<KeysCount>::GetRaw(PtrType ptr) {
+  if (pool_) {
+    return pool_->Get(ptr);
+  }
+  UpdateMappingIfNecessary(ptr);
+  return GlobalGetRaw<KeysCount>(ptr, mapping);
+}
 
-    current_level = current->Level();
+
+/*
+ * NewNode, UnpinNode, DeleteNode -
+ * allocate zeroed node, free node nobody can reach any more.
+ * Node is filled before anybody locks it, so in the pool
+ * it stays in memory until UnpinNode.
+*/
+template <std::size_t KeysCount>
+auto BLinkTree<KeysCount>::NewNode() {
+  PtrType ptr = AllocateNode<KeysCount>(fd, mapping, wal);
+  if (pool_ && ptr != -1) {
+    pool_->Install(ptr);
+  }
+  if (ptr != -1 && VersionsOpen(versions)) {
+    /* Open snapshots have no version of it */
+    GetRaw(ptr)->Restamp(EpochNow(epochs), 0);
   }
+  return ptr;
+}
 
-  RDispatchNode(current_ptr);
 
-  return current_ptr;
+template <std::size_t KeysCount>
+inline void BLinkTree<KeysCount>::UnpinNode(PtrType ptr) {
+  if (pool_) {
+    pool_->Unpin(ptr);
+  }
 }
 
 
+template <std::size_t KeysCount>
+void BLinkTree<KeysCount>::DeleteNode(PtrType ptr) {
+  if (pool_) {
+    /* Frame must not be written over the page once it is reused */
+    pool_->Discard(ptr);
+  }
+  FreeNode<KeysCount>(fd, mapping, ptr, wal);
+}
+
 
 template <std::size_t KeysCount>
-inline Node<KeysCount>* BLinkTree<KeysCount>::GetRaw(PtrType ptr) {
+inline void BLinkTree<KeysCount>::RLockNode(PtrType ptr) {
   UpdateMappingIfNecessary(ptr);
-  return GlobalGetRaw<KeysCount>(ptr, mapping);
+  if (!trace_enabled) [[likely]] {
+    GlobalRLockNodeWait<KeysCount>(fd, latches, ptr);
+  } else if (!GlobalRLockNode<KeysCount>(fd, latches, ptr)) {
+    std::uint64_t begin = TraceNow();
+    GlobalRLockNodeWait<KeysCount>(fd, latches, ptr);
+    TraceEnd(TRACE_LOCK_WAIT, begin, ptr, GetRaw(ptr)->Level());
+  }
 }
 
 
+/*
+ * RGetRawLocked -
+ * read locked node, or its private copy.
+ * May move mapping: node got earlier must be dispatched before,
+ * so readers go down holding one node at a time (links cover splits).
+*/
 template <std::size_t KeysCount>
 inline Node<KeysCount>* BLinkTree<KeysCount>::RGetRawLocked(PtrType ptr) {
+  if (pool_) {
+    /* Node is not evicted while locked, see BufferPool */
+    if (GlobalRLockNode<KeysCount>(fd, latches, ptr)) {
+      return pool_->Get(ptr);
+    }
+    FrameGuard frames{pool_.get()};
+    return GlobalRCopyNode<KeysCount>(ptr, pool_->Get(ptr));
+  }
   UpdateMappingIfNecessary(ptr);
-  return GlobalRGetRawLocked<KeysCount>(fd, ptr, mapping);
+  return GlobalRGetRawLocked<KeysCount>(fd, latches, ptr, mapping);
 }
 
 
 template <std::size_t KeysCount>
-inline void BLinkTree<KeysCount>::RDispatchNode(PtrType ptr) {
-  return GlobalRDispatchNode<KeysCount>(fd, ptr, mapping, GetRaw(ptr));
+inline void BLinkTree<KeysCount>::RDispatchNode(PtrType ptr,
+                                                Node<KeysCount>* node) {
+  const void* live = mapping + ptr;
+  if (pool_) {
+    live = pool_->Holds(node) ? node : nullptr;
+  }
+  return GlobalRDispatchNode<KeysCount>(fd, latches, ptr, live, node);
 }
 
 
 template <std::size_t KeysCount>
 inline void BLinkTree<KeysCount>::WLockNode(PtrType ptr) {
   UpdateMappingIfNecessary(ptr);
-  GlobalWLockNode<KeysCount>(fd, ptr);
+  if (!trace_enabled) [[likely]] {
+    GlobalWLockNode<KeysCount>(fd, latches, ptr);
+  } else if (!GlobalTryWLockNode<KeysCount>(fd, latches, ptr)) {
+    std::uint64_t begin = TraceNow();
+    GlobalWLockNode<KeysCount>(fd, latches, ptr);
+    TraceEnd(TRACE_LOCK_WAIT, begin, ptr, GetRaw(ptr)->Level());
+  }
+}
+
+
+template <std::size_t KeysCount>
+inline bool BLinkTree<KeysCount>::TryRLockNode(PtrType ptr) {
+  UpdateMappingIfNecessary(ptr);
+  return GlobalRLockNode<KeysCount>(fd, latches, ptr);
+}
+
+
+template <std::size_t KeysCount>
+inline bool BLinkTree<KeysCount>::TryWLockNode(PtrType ptr) {
+  UpdateMappingIfNecessary(ptr);
+  return GlobalTryWLockNode<KeysCount>(fd, latches, ptr);
 }
 
 
 template <std::size_t KeysCount>
 inline void BLinkTree<KeysCount>::UnlockNode(PtrType ptr) {
-  GlobalUnlockNode<KeysCount>(fd, ptr);
+  GlobalUnlockNode<KeysCount>(fd, latches, ptr);
 }
 
 
+/*
+ * LogNodes -
+ * log current content of WriteLocked nodes as one change;
+ * their checksums are brought up to date first.
+ *
+ * @with_retired: head of retired nodes list is changed too.
+*/
 template <std::size_t KeysCount>
-inline void BLinkTree<KeysCount>::PinNodeInRAM(PtrType ptr) {
-  GlobalPinNodeInRAM<KeysCount>(GetRaw(ptr));
+void BLinkTree<KeysCount>::LogNodes(std::initializer_list<PtrType> node_ptrs,
+                                    bool with_retired) {
+  WalImage images[5];
+  std::size_t count = 0;
+
+  assert(node_ptrs.size() < std::size(images));
+  for (PtrType node_ptr : node_ptrs) {
+    GetRaw(node_ptr)->UpdateChecksum();
+    images[count++] = WalImage{
+      .offset = node_ptr,
+      .data = GetRaw(node_ptr),
+      .size = static_cast<std::uint32_t>(Node<KeysCount>::ContentSize)
+    };
+  }
+  if (with_retired) {
+    images[count++] = WalImage{
+      .offset = offsetof(FileMeta, retired_nodes),
+      .data = mapping + offsetof(FileMeta, retired_nodes),
+      .size = sizeof(FileMeta::retired_nodes)
+    };
+  }
+
+  (void)WalAppend(wal, images, count);
 }
 
+
 template <std::size_t KeysCount>
-inline void BLinkTree<KeysCount>::UnpinNode(PtrType ptr) {
-  GlobalUnpinNode<KeysCount>(GetRaw(ptr));
+void BLinkTree<KeysCount>::LogMeta() {
+  WalImage image {
+    .offset = 0,
+    .data = mapping,
+    .size = offsetof(FileMeta, order)
+  };
+
+  (void)WalAppend(wal, &image, 1);
+}
+
+
+/*
+ * Commit -
+ * end of modifying operation: with 'sync_commit' wait until everything
+ * logged by this thread is durable, otherwise leave it to the log's
+ * background flush.
+*/
+template <std::size_t KeysCount>
+inline void BLinkTree<KeysCount>::Commit() {
+  if (sync_commit_) {
+    WalCommit(wal, WalLastLsn());
+  }
 }
 
 
 template <std::size_t KeysCount>
 void BLinkTree<KeysCount>::UpdateMappingIfNecessary(PtrType ptr) {
-  if (ptr + NodeSize > mapping_size)
+  if (ptr + NodeSize > MappingSize(&region_))
     [[unlikely]] {
     UpdateMapping();
   }
 }
 
 
+/*
+ * UpdateMapping -
+ * let pages the file has grown by since the last call be accessed;
+ * they are mostly mapped already, see ExtendMapping.
+*/
 template <std::size_t KeysCount>
 void BLinkTree<KeysCount>::UpdateMapping() {
-  struct stat statbuf;
-  if (fstat(fd, &statbuf))
-    [[unlikely]] {
-    perror("fstat");
-    exit(EXIT_FAILURE);
-  }
-  mapping =
-    (char*)mremap(
-      mapping,
-      mapping_size,
-      statbuf.st_size,
-      MREMAP_MAYMOVE
-    );
-  if (mapping == MAP_FAILED)
-    [[unlikely]] {
-    perror("mremap");
-    exit(EXIT_FAILURE);
-  }
-  mapping_size = statbuf.st_size;
-  if (madvise(mapping, mapping_size, MADV_RANDOM) == -1)
+  if (!ExtendMapping(&region_))
     [[unlikely]] {
-    perror("madvise");
     exit(EXIT_FAILURE);
   }
 }
@@ -0,0 +1,718 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "epoch.h"
+#include "io_ring.h"
+#include "latch_table.h"
+#include "locks.hpp"
+#include "node.hpp"
+#include "stats.h"
+
+/* Zero frames: nodes are read and written through the mapping */
+struct BufferPoolOptions {
+  std::size_t frames{0};
+};
+
+
+
+/*
+ * BufferPool -
+ * nodes of tree file cached in a fixed number of frames and read
+ * or written with O_DIRECT, so memory taken by nodes does not grow
+ * with the file and a cold node costs one read, not a page fault
+ * per page. Records and meta stay in the mapping.
+ *
+ * Frames are private to the process, so the pool's handle must be
+ * the only one open on the file (see BLinkTree). Threads share it:
+ * - lookup is lock free: 'table_' maps every page of the file
+ *   to its frame;
+ * - misses and eviction go under 'mutex_'; eviction is a clock
+ *   sweep, inner nodes get one more round than leaves;
+ * - node is evicted only under its write lock, so no writer has
+ *   a pointer to it; lock free readers may still have one, so they
+ *   read frames inside ReadGuard and evicted frame is reused when
+ *   every guard that could have seen it is over, as pages of retired
+ *   nodes are (see epoch.h). Guards are private to the pool and
+ *   short: long scans do not hold frames back. Frames that wait
+ *   longer than the pool can afford are taken from reserve of the
+ *   same size; memory of reserve is given back once its frames
+ *   are free again;
+ * - frame is dirty when node's version has moved since it was read
+ *   or written. Nodes created by a split are filled before they
+ *   are locked by anybody: they are pinned and stay dirty until
+ *   Unpin;
+ * - checkpoint writes dirty frames before the tree file is synced
+ *   (see WalSetFlusher), so the log never relies on frames;
+ * - misses are read through io_uring into registered frames, if the
+ *   kernel has it: Prefetch only queues a read and many of them go
+ *   to the device together, whoever needs the node waits for it.
+ *   Writes stay synchronous, eviction needs the page written first.
+*/
+template <std::size_t KeysCount>
+class BufferPool {
+public:
+  class ReadGuard;
+
+  BufferPool(const std::string& path, int fd, LatchTable* latches,
+             std::size_t frames, std::size_t file_reserve);
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  ~BufferPool();
+
+  Node<KeysCount>* Get(off_t offset);
+  bool Prefetch(off_t offset);
+  void Submit();
+  bool Loading(off_t offset) const;
+  void Poll();
+  bool Holds(const void* node) const;
+  Node<KeysCount>* Install(off_t offset);
+  void Unpin(off_t offset);
+  void Discard(off_t offset);
+
+  void Flush();
+  static void FlushPool(void* pool);
+
+private:
+  enum class FrameState : std::uint8_t { kFree, kLoading, kResident, kLimbo };
+
+  struct Frame {
+    off_t offset{0};
+    /* Limbo: frame is free once EpochOldest(readers_) is above it */
+    std::uint64_t stamp{0};
+    std::uint32_t clean_version{0};
+    std::uint8_t weight{1}; // clock rounds it survives without access
+    std::atomic<std::uint8_t> referenced{0};
+    bool dirty{false};
+    bool pinned{false}; // new node being filled, see Install
+    FrameState state{FrameState::kFree};
+  };
+
+  Node<KeysCount>* At(std::uint32_t frame) const;
+  std::uint32_t* Entry(off_t offset) const;
+
+  void Load(off_t offset, bool wait);
+  void WaitLoaded(off_t offset);
+  void Publish(std::uint32_t frame);
+  static void Loaded(void* pool, std::uint64_t frame, int result);
+
+  std::uint32_t TakeFrame(std::unique_lock<std::mutex>& lock, bool wait = true);
+  void GiveBack(std::uint32_t frame);
+  void ReleaseLimbo(std::uint64_t oldest);
+  bool Evict();
+  void ToLimbo(std::uint32_t frame);
+
+  void ReadPage(void* buf, off_t offset);
+  void WritePage(const void* buf, off_t offset);
+
+private:
+  int fd_; // tree file, for node locks
+  int direct_fd_; // tree file opened with O_DIRECT, if supported
+  LatchTable* latches_;
+  EpochTable* readers_; // ReadGuards of this process only
+  IoRing* ring_; // nullptr: misses are read with pread
+
+  std::size_t frames_count_;
+  std::size_t capacity_; // frames and reserve
+  char* frames_memory_;
+  std::unique_ptr<Frame[]> frames_;
+
+  std::uint32_t* table_; // frame + 1 for every page; 0 if not cached
+  std::size_t table_size_;
+
+  std::mutex mutex_;
+  std::uint32_t used_{0}; // frames below it were taken at least once
+  std::uint32_t hand_{0};
+  std::vector<std::uint32_t> free_;
+  std::vector<std::uint32_t> spare_; // reserve frames given back
+  std::deque<std::uint32_t> limbo_; // by stamp
+
+  void* bounce_; // stable copy of node being flushed
+
+  constexpr static auto NodeSize = sizeof(Node<KeysCount>);
+  constexpr static off_t kPage = 4096;
+  constexpr static std::uint32_t kLoading = UINT32_MAX;
+  /* Locked and pinned nodes of concurrent operations must fit */
+  constexpr static std::size_t kMinFrames = 64;
+};
+
+
+
+/*
+ * ReadGuard -
+ * frames got meanwhile are not reused, even if their nodes
+ * are evicted; for lock free reads. Does nothing without pool.
+*/
+template <std::size_t KeysCount>
+class BufferPool<KeysCount>::ReadGuard {
+public:
+  explicit ReadGuard(BufferPool* pool) : pool_{pool} {
+    if (pool_) {
+      EpochEnter(pool_->readers_);
+    }
+  }
+
+  ReadGuard(const ReadGuard&) = delete;
+  ReadGuard& operator=(const ReadGuard&) = delete;
+
+  ~ReadGuard() {
+    if (pool_) {
+      EpochExit(pool_->readers_);
+    }
+  }
+
+private:
+  BufferPool* pool_;
+};
+
+
+
+template <std::size_t KeysCount>
+BufferPool<KeysCount>::BufferPool(const std::string& path, int fd,
+                                  LatchTable* latches,
+                                  std::size_t frames,
+                                  std::size_t file_reserve)
+  : fd_{fd}, latches_{latches},
+    frames_count_{std::max(frames, kMinFrames)},
+    capacity_{2 * frames_count_} {
+  direct_fd_ = open(path.data(), O_RDWR | O_DIRECT);
+  if (direct_fd_ < 0 && errno == EINVAL) {
+    /* File system without direct I/O: frames still bound the memory
+     * the tree takes, page cache keeps a second copy */
+    direct_fd_ = open(path.data(), O_RDWR);
+  }
+  if (direct_fd_ < 0) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Nothing is backed until touched: reserve and page table
+   * of a small file cost address space only */
+  frames_memory_ = static_cast<char*>(
+    mmap(nullptr, capacity_ * NodeSize, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  table_size_ = file_reserve / kPage;
+  table_ = static_cast<std::uint32_t*>(
+    mmap(nullptr, table_size_ * sizeof(std::uint32_t), PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  /* Zeroed table is empty (see epoch.h); nobody else needs it in file */
+  readers_ = static_cast<EpochTable*>(
+    mmap(nullptr, sizeof(EpochTable), PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (frames_memory_ == MAP_FAILED || table_ == MAP_FAILED
+      || readers_ == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+
+  if (posix_memalign(&bounce_, kPage, NodeSize) != 0) {
+    perror("posix_memalign");
+    exit(EXIT_FAILURE);
+  }
+
+  frames_ = std::make_unique<Frame[]>(capacity_);
+  for (std::size_t i = frames_count_; i > 0; --i) {
+    free_.push_back(static_cast<std::uint32_t>(i - 1));
+  }
+  used_ = static_cast<std::uint32_t>(frames_count_);
+
+  /* Reserve is not registered: it would stay pinned when given back */
+  ring_ = OpenIoRing(direct_fd_, frames_memory_, frames_count_ * NodeSize,
+                     &BufferPool::Loaded, this);
+}
+
+
+template <std::size_t KeysCount>
+BufferPool<KeysCount>::~BufferPool() {
+  if (ring_) {
+    CloseIoRing(ring_);
+  }
+  Flush();
+
+  free(bounce_);
+  CloseEpochTable(readers_);
+  munmap(table_, table_size_ * sizeof(std::uint32_t));
+  munmap(frames_memory_, capacity_ * NodeSize);
+  close(direct_fd_);
+}
+
+
+
+/*
+ * Get -
+ * node at 'offset', read into a frame if necessary.
+ * Frame keeps the node while the node is locked by caller,
+ * otherwise only while caller is inside ReadGuard.
+ * Frames got before inside the same guard and not locked
+ * must not be used afterwards: Get that waits for a frame
+ * lets them be reused (see TakeFrame).
+*/
+template <std::size_t KeysCount>
+inline Node<KeysCount>* BufferPool<KeysCount>::Get(off_t offset) {
+  while (true) {
+    std::uint32_t frame = __atomic_load_n(Entry(offset), __ATOMIC_ACQUIRE);
+    if (frame != 0 && frame != kLoading) [[likely]] {
+      Frame& descriptor = frames_[frame - 1];
+      std::uint8_t weight = __atomic_load_n(&descriptor.weight,
+                                            __ATOMIC_RELAXED);
+      if (descriptor.referenced.load(std::memory_order_relaxed) != weight) {
+        descriptor.referenced.store(weight, std::memory_order_relaxed);
+      }
+      return At(frame - 1);
+    }
+
+    if (frame == kLoading) {
+      WaitLoaded(offset);
+    } else {
+      Load(offset, true);
+    }
+  }
+}
+
+
+/*
+ * Prefetch -
+ * start reading node at 'offset' unless it is cached; the read is
+ * queued until Submit, so reads of many nodes start together.
+ * Nothing is done without ring, or if no frame is free now.
+ *
+ * Returns:
+ * @bool: true if node is being read (see Loading).
+*/
+template <std::size_t KeysCount>
+inline bool BufferPool<KeysCount>::Prefetch(off_t offset) {
+  if (ring_ && __atomic_load_n(Entry(offset), __ATOMIC_RELAXED) == 0) {
+    Load(offset, false);
+  }
+  return Loading(offset);
+}
+
+
+/* Start reads queued by Prefetch */
+template <std::size_t KeysCount>
+inline void BufferPool<KeysCount>::Submit() {
+  if (ring_) {
+    IoRingSubmit(ring_);
+  }
+}
+
+
+/* Read of node at 'offset' is in flight: Get would wait for it */
+template <std::size_t KeysCount>
+inline bool BufferPool<KeysCount>::Loading(off_t offset) const {
+  return __atomic_load_n(Entry(offset), __ATOMIC_ACQUIRE) == kLoading;
+}
+
+
+/* Finish reads that are done, without waiting for the others */
+template <std::size_t KeysCount>
+inline void BufferPool<KeysCount>::Poll() {
+  if (ring_) {
+    (void)IoRingReap(ring_);
+  }
+}
+
+
+/* 'node' is a frame, not a private copy */
+template <std::size_t KeysCount>
+inline bool BufferPool<KeysCount>::Holds(const void* node) const {
+  const char* byte = static_cast<const char*>(node);
+  return frames_memory_ <= byte && byte < frames_memory_ + capacity_ * NodeSize;
+}
+
+
+/*
+ * Install -
+ * zeroed frame for node just allocated at 'offset'
+ * (allocator has zeroed the page in file as well).
+ * Frame is pinned: nobody holds the node's lock while it is filled.
+*/
+template <std::size_t KeysCount>
+Node<KeysCount>* BufferPool<KeysCount>::Install(off_t offset) {
+  std::unique_lock lock{mutex_};
+  std::uint32_t frame = TakeFrame(lock);
+  memset(static_cast<void*>(At(frame)), 0, NodeSize);
+
+  Frame& descriptor = frames_[frame];
+  descriptor.offset = offset;
+  descriptor.clean_version = 0;
+  descriptor.weight = 1;
+  descriptor.referenced.store(1, std::memory_order_relaxed);
+  descriptor.dirty = true;
+  descriptor.pinned = true;
+  descriptor.state = FrameState::kResident;
+  __atomic_store_n(Entry(offset), frame + 1, __ATOMIC_RELEASE);
+
+  return At(frame);
+}
+
+
+/* Node at 'offset' is filled and linked: it may be evicted now */
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::Unpin(off_t offset) {
+  std::lock_guard lock{mutex_};
+  frames_[*Entry(offset) - 1].pinned = false;
+}
+
+
+/*
+ * Discard -
+ * forget node at 'offset' without writing it: its page is being freed.
+*/
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::Discard(off_t offset) {
+  std::unique_lock lock{mutex_};
+  std::uint32_t frame;
+  while ((frame = __atomic_load_n(Entry(offset), __ATOMIC_ACQUIRE))
+         == kLoading) {
+    lock.unlock();
+    WaitLoaded(offset);
+    lock.lock();
+  }
+  if (frame != 0) {
+    __atomic_store_n(Entry(offset), 0, __ATOMIC_RELEASE);
+    frames_[frame - 1].pinned = false;
+    ToLimbo(frame - 1);
+  }
+}
+
+
+
+/*
+ * Flush -
+ * write every dirty frame. Nodes are copied between their
+ * modifications, as lock free readers do, so no lock is waited for.
+*/
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::Flush() {
+  for (std::uint32_t i = 0; ; ++i) {
+    std::lock_guard lock{mutex_};
+    if (i >= used_) {
+      break;
+    }
+    Frame& frame = frames_[i];
+    const Node<KeysCount>* node = At(i);
+    if (frame.state != FrameState::kResident
+        || (!frame.dirty && node->ReadBegin() == frame.clean_version)) {
+      continue;
+    }
+
+    std::uint32_t version;
+    while (true) {
+      version = node->ReadBegin();
+      if (!(version & 1)) {
+        memcpy(bounce_, static_cast<const void*>(node), NodeSize);
+        if (node->ReadValidate(version)) {
+          break;
+        }
+      }
+      sched_yield();
+    }
+
+    WritePage(bounce_, frame.offset);
+    StatsAdd(STATS_POOL_WRITEBACKS, 1);
+    frame.clean_version = version;
+    /* Pinned node may be half filled yet */
+    frame.dirty = frame.pinned;
+  }
+}
+
+
+/* Flusher for WalSetFlusher */
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::FlushPool(void* pool) {
+  static_cast<BufferPool*>(pool)->Flush();
+}
+
+
+
+template <std::size_t KeysCount>
+inline Node<KeysCount>* BufferPool<KeysCount>::At(std::uint32_t frame) const {
+  return reinterpret_cast<Node<KeysCount>*>(frames_memory_ + frame * NodeSize);
+}
+
+
+template <std::size_t KeysCount>
+inline std::uint32_t* BufferPool<KeysCount>::Entry(off_t offset) const {
+  if (offset % kPage != 0 || static_cast<std::size_t>(offset / kPage)
+      >= table_size_) [[unlikely]] {
+    fprintf(stderr, "BufferPool: no node at %lld\n",
+            static_cast<long long>(offset));
+    exit(EXIT_FAILURE);
+  }
+  return table_ + offset / kPage;
+}
+
+
+/*
+ * Load -
+ * read node at 'offset' into a frame, unless somebody has.
+ * Read goes through ring if there is one, and node is published
+ * when it is reaped; otherwise, or if ring is full, it is read here.
+ *
+ * @wait: frame may be waited for; without it nothing is read
+ * while every frame is busy, nor if ring is full.
+*/
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::Load(off_t offset, bool wait) {
+  std::unique_lock lock{mutex_};
+  if (__atomic_load_n(Entry(offset), __ATOMIC_ACQUIRE) != 0) {
+    return;
+  }
+  std::uint32_t frame = TakeFrame(lock, wait);
+  if (frame == kLoading) {
+    return;
+  }
+  if (__atomic_load_n(Entry(offset), __ATOMIC_ACQUIRE) != 0) {
+    /* Read by another thread while waiting for a frame */
+    GiveBack(frame);
+    return;
+  }
+
+  __atomic_store_n(Entry(offset), kLoading, __ATOMIC_RELAXED);
+  frames_[frame].offset = offset;
+  frames_[frame].state = FrameState::kLoading;
+  StatsAdd(STATS_POOL_MISSES, 1);
+
+  if (ring_ && IoRingRead(ring_, At(frame), NodeSize, offset, frame)) {
+    return;
+  }
+  if (!wait) {
+    __atomic_store_n(Entry(offset), 0, __ATOMIC_RELEASE);
+    GiveBack(frame);
+    return;
+  }
+
+  lock.unlock();
+  ReadPage(At(frame), offset);
+  lock.lock();
+  Publish(frame);
+}
+
+
+/* Node at 'offset' was being read; it is read now, or was given up */
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::WaitLoaded(off_t offset) {
+  if (ring_) {
+    IoRingWait(ring_, Entry(offset), kLoading);
+  } else {
+    sched_yield();
+  }
+}
+
+
+/* Frame just read is looked up from now on. Caller holds 'mutex_' */
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::Publish(std::uint32_t frame) {
+  Frame& descriptor = frames_[frame];
+  descriptor.clean_version = At(frame)->ReadBegin();
+  descriptor.weight = At(frame)->IsLeaf() ? 1 : 2;
+  descriptor.referenced.store(descriptor.weight, std::memory_order_relaxed);
+  descriptor.dirty = false;
+  descriptor.state = FrameState::kResident;
+  __atomic_store_n(Entry(descriptor.offset), frame + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Completion of ring reads, see OpenIoRing */
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::Loaded(void* pool, std::uint64_t frame,
+                                   int result) {
+  if (result != static_cast<int>(NodeSize)) {
+    errno = result < 0 ? -result : EIO;
+    perror("io_uring read");
+    exit(EXIT_FAILURE);
+  }
+  BufferPool* self = static_cast<BufferPool*>(pool);
+  std::lock_guard lock{self->mutex_};
+  self->Publish(static_cast<std::uint32_t>(frame));
+}
+
+
+/*
+ * TakeFrame -
+ * free frame; once 'frames_count_' pages are held,
+ * one is evicted ahead for every frame taken.
+ * Evicted frame is reused only after ReadGuards in progress,
+ * until then frames from reserve are taken, and if reserve
+ * is exhausted too, the guards are waited for (and reads in flight,
+ * whose frames cannot be evicted, are reaped meanwhile). Callers
+ * inside guards wait here as well, so their guards are refreshed
+ * while they wait: they hold no frames then (see Get).
+ * Caller holds 'lock'; it may be released while waiting.
+ *
+ * Returns:
+ * @kLoading: without 'wait', if no frame is free;
+ * reserve is left to the waiting callers then.
+*/
+template <std::size_t KeysCount>
+std::uint32_t BufferPool<KeysCount>::TakeFrame(
+  std::unique_lock<std::mutex>& lock, bool wait) {
+  while (true) {
+    ReleaseLimbo(EpochOldest(readers_));
+    if (!wait && used_ - frames_count_ > spare_.size()) {
+      /* Reserve is in use: guards hold back what prefetch would evict */
+      return kLoading;
+    }
+    std::size_t held = used_ - free_.size() - spare_.size() - limbo_.size();
+    if (held >= frames_count_ && Evict()) {
+      ReleaseLimbo(EpochOldest(readers_));
+    }
+
+    std::uint32_t frame;
+    if (!free_.empty()) {
+      frame = free_.back();
+      free_.pop_back();
+      return frame;
+    }
+    if (!wait) {
+      return kLoading;
+    }
+    if (!spare_.empty()) {
+      frame = spare_.back();
+      spare_.pop_back();
+      return frame;
+    }
+    if (used_ < capacity_) {
+      return used_++;
+    }
+
+    lock.unlock();
+    EpochRefresh(readers_, EpochNow(readers_));
+    if (ring_) {
+      (void)IoRingReap(ring_);
+    }
+    sched_yield();
+    lock.lock();
+  }
+}
+
+
+/* Frame taken by TakeFrame is not needed */
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::GiveBack(std::uint32_t frame) {
+  frames_[frame].state = FrameState::kFree;
+  if (frame < frames_count_) {
+    free_.push_back(frame);
+  } else {
+    spare_.push_back(frame);
+  }
+}
+
+
+/*
+ * ReleaseLimbo -
+ * frames nobody can be looking at are free again;
+ * memory of reserve frames is given back.
+*/
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::ReleaseLimbo(std::uint64_t oldest) {
+  while (!limbo_.empty() && frames_[limbo_.front()].stamp < oldest) {
+    std::uint32_t frame = limbo_.front();
+    limbo_.pop_front();
+
+    frames_[frame].state = FrameState::kFree;
+    if (frame < frames_count_) {
+      free_.push_back(frame);
+    } else {
+      (void)madvise(At(frame), NodeSize, MADV_DONTNEED);
+      spare_.push_back(frame);
+    }
+  }
+}
+
+
+/*
+ * Evict -
+ * clock sweep for a frame not accessed lately, not pinned and not locked;
+ * it is written if dirty and put into limbo.
+ *
+ * Returns:
+ * @bool: false if every frame is busy.
+*/
+template <std::size_t KeysCount>
+bool BufferPool<KeysCount>::Evict() {
+  for (std::size_t step = 0; step < 3 * used_; ++step) {
+    std::uint32_t i = hand_;
+    hand_ = (hand_ + 1) % used_;
+    Frame& frame = frames_[i];
+
+    if (frame.state != FrameState::kResident || frame.pinned) {
+      continue;
+    }
+    std::uint8_t referenced = frame.referenced.load(std::memory_order_relaxed);
+    if (referenced > 0) {
+      frame.referenced.store(referenced - 1, std::memory_order_relaxed);
+      continue;
+    }
+    /* Lock is only tried: its holder may be waiting for 'mutex_' */
+    if (!GlobalTryWLockNode<KeysCount>(fd_, latches_, frame.offset)) {
+      continue;
+    }
+
+    if (frame.dirty || At(i)->ReadBegin() != frame.clean_version) {
+      WritePage(At(i), frame.offset);
+      StatsAdd(STATS_POOL_WRITEBACKS, 1);
+    }
+    __atomic_store_n(Entry(frame.offset), 0, __ATOMIC_RELEASE);
+    GlobalUnlockNode<KeysCount>(fd_, latches_, frame.offset);
+
+    ToLimbo(i);
+    StatsAdd(STATS_POOL_EVICTIONS, 1);
+    return true;
+  }
+
+  return false;
+}
+
+
+/* Frame no longer in 'table_' waits for readers that may have it */
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::ToLimbo(std::uint32_t frame) {
+  frames_[frame].state = FrameState::kLimbo;
+  frames_[frame].stamp = EpochAdvance(readers_);
+  limbo_.push_back(frame);
+}
+
+
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::ReadPage(void* buf, off_t offset) {
+  if (pread(direct_fd_, buf, NodeSize, offset)
+      != static_cast<ssize_t>(NodeSize)) {
+    perror("pread");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+template <std::size_t KeysCount>
+void BufferPool<KeysCount>::WritePage(const void* buf, off_t offset) {
+  if (pwrite(direct_fd_, buf, NodeSize, offset)
+      != static_cast<ssize_t>(NodeSize)) {
+    perror("pwrite");
+    exit(EXIT_FAILURE);
+  }
+}
+
+#endif  // BUFFER_POOL_HPP
@@ -0,0 +1,434 @@
+#ifndef BULK_LOAD_HPP
+#define BULK_LOAD_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "allocate_data.hpp"
+#include "file_meta.h"
+#include "node.hpp"
+#include "stats.h"
+#include "wal.h"
+
+
+
+
+/*
+ * BulkLoader -
+ * builds tree file bottom-up from (key, record) pairs
+ * coming in strictly increasing key order.
+ *
+ * Every node gets its place in file when it is opened;
+ * leaf's records follow it. So file is produced by one sequential
+ * stream of large writes; only a sealed node whose slot has already
+ * left the write buffer is written separately (one per node, not per key).
+ * Tree becomes visible with single UpdateMeta in Finish.
+*/
+template <std::size_t KeysCount>
+class BulkLoader {
+private:
+  using KeyType = std::uint64_t;
+  using PtrType = off_t;
+
+public:
+  BulkLoader(std::string path, double fill_factor = 1.0);
+
+  ~BulkLoader();
+
+  bool Add(KeyType key, std::string_view record);
+
+  void Finish();
+
+  std::size_t Height() const;
+
+private:
+  struct Level {
+    Node<KeysCount> node;
+    PtrType node_ptr{0};
+    std::size_t sealed{0};
+    KeyType last_key{0}; // of inner node: its high key once sealed
+  };
+
+  void AddEntry(std::size_t level, KeyType key, PtrType ptr);
+  void SealNode(std::size_t level, PtrType link_ptr, KeyType high_key);
+  void OpenNode(std::size_t level, KeyType low_key);
+  bool IsFull(const Node<KeysCount>& node) const;
+
+  PtrType Reserve(std::size_t size, std::size_t alignment);
+  PtrType Append(const char* data, std::size_t size);
+  void WriteAt(PtrType offset, const void* data, std::size_t size);
+  void Flush();
+
+private:
+  int fd;
+  std::string path_;
+
+  double fill_factor_;
+
+  std::vector<Level> levels_;
+
+  std::vector<char> buffer_;
+  PtrType buffer_offset_{0}; // file offset of buffer_[0]
+
+  std::string encoded_; // record with header
+
+  KeyType last_key_{0};
+  bool empty_{true};
+  bool finished_{false};
+
+  constexpr static auto NodeSize = sizeof(Node<KeysCount>);
+  constexpr static std::size_t kBufferSize = 8 << 20;
+  constexpr static KeyType kInfValue = std::numeric_limits<KeyType>::max();
+};
+
+
+
+/*
+ * BulkLoad -
+ * build tree file from 'items'; sorts them if necessary.
+ *
+ * @path: tree file; overwritten.
+ * @items: (key, record) pairs; keys must be unique.
+ * @fill_factor: part of node capacity used, (0, 1].
+ *
+ * Returns:
+ * @bool: false if keys are not unique.
+*/
+template <std::size_t KeysCount>
+bool BulkLoad(std::string path,
+              std::span<std::pair<std::uint64_t, std::string_view>> items,
+              double fill_factor = 1.0) {
+  auto by_key = [](const auto& lhs, const auto& rhs) {
+    return lhs.first < rhs.first;
+  };
+  if (!std::is_sorted(items.begin(), items.end(), by_key)) {
+    std::sort(items.begin(), items.end(), by_key);
+  }
+
+  BulkLoader<KeysCount> loader{path, fill_factor};
+  for (const auto& [key, record] : items) {
+    if (!loader.Add(key, record)) {
+      return false;
+    }
+  }
+  loader.Finish();
+
+  return true;
+}
+
+
+
+
+template <std::size_t KeysCount>
+BulkLoader<KeysCount>::BulkLoader(std::string path, double fill_factor)
+  : path_{path}, fill_factor_{std::clamp(fill_factor, 0.0, 1.0)} {
+
+  std::filesystem::path fs_path{path_};
+  if (fs_path.has_parent_path()) {
+    std::filesystem::create_directories(fs_path.parent_path());
+  }
+
+  fd = open(path_.data(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  /* Log and counters of previous tree at this path are not ours */
+  RemoveWal(path_.data());
+  RemoveStats(path_.data());
+
+  buffer_.reserve(kBufferSize);
+
+  FileMeta meta {
+    .root_offset = 0, // set by Finish
+    .height = 0,
+    .order = KeysCount
+  };
+  Append(reinterpret_cast<const char*>(&meta), sizeof(meta));
+}
+
+
+template <std::size_t KeysCount>
+BulkLoader<KeysCount>::~BulkLoader() {
+  if (!finished_) {
+    Finish();
+  }
+  close(fd);
+}
+
+
+
+/*
+ * Add -
+ * append next (key, record) pair.
+ *
+ * Returns:
+ * @bool: false if key is not greater than previous one
+ *   (or is reserved maximum key); pair is ignored.
+*/
+template <std::size_t KeysCount>
+bool BulkLoader<KeysCount>::Add(KeyType key, std::string_view record) {
+  assert(!finished_ && "Add: loader is finished");
+
+  if ((!empty_ && key <= last_key_) || key == kInfValue) {
+    return false;
+  }
+
+  if (levels_.empty() || IsFull(levels_[0].node)) {
+    /* Open next leaf first: record must follow its own leaf */
+    AddEntry(0, key, 0);
+  }
+  /* Record takes whole extent, as if allocated by AllocateRecord */
+  encoded_.clear();
+  EncodeRecord(encoded_, record);
+  encoded_.resize(ExtentSize(encoded_.size()));
+  PtrType record_ptr = Append(encoded_.data(), encoded_.size());
+  levels_[0].node.Append(key, record_ptr);
+
+  last_key_ = key;
+  empty_ = false;
+
+  return true;
+}
+
+
+
+/*
+ * Finish -
+ * seal all open nodes from leaves up to root,
+ * write everything and publish root in meta.
+*/
+template <std::size_t KeysCount>
+void BulkLoader<KeysCount>::Finish() {
+  if (finished_) {
+    return;
+  }
+  finished_ = true;
+
+  /* Right-most leaf keeps sentinel key, as in TouchTreeFile */
+  if (levels_.empty() || IsFull(levels_[0].node)) {
+    AddEntry(0, kInfValue, 0);
+  }
+  levels_[0].node.Append(kInfValue, 0);
+
+  PtrType root_ptr = 0;
+  for (std::size_t level = 0; level < levels_.size(); ++level) {
+    Level& current = levels_[level];
+    if (level + 1 == levels_.size() && current.sealed == 0) {
+      /* The only node on the top level */
+      current.node.MarkRoot();
+      current.node.UpdateChecksum();
+      WriteAt(current.node_ptr, &current.node, NodeSize);
+      root_ptr = current.node_ptr;
+      break;
+    }
+    SealNode(level, 0, kInfValue);
+  }
+
+  Flush();
+  if (fdatasync(fd) == -1) {
+    perror("fdatasync");
+    exit(EXIT_FAILURE);
+  }
+
+  char* mapping = (char*)mmap(NULL, sizeof(FileMeta),
+                              PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  UpdateMeta(fd, mapping, root_ptr, levels_.size());
+  munmap(mapping, sizeof(FileMeta));
+}
+
+
+template <std::size_t KeysCount>
+std::size_t BulkLoader<KeysCount>::Height() const {
+  return levels_.size();
+}
+
+
+
+/*
+ * AddEntry -
+ * make room for entry 'key' on 'level': open first node of the level,
+ * or seal full node and open next one.
+ * Leaf entries are appended by caller (record goes after the leaf);
+ * inner entries are appended here.
+*/
+template <std::size_t KeysCount>
+void BulkLoader<KeysCount>::AddEntry(std::size_t level,
+                                     KeyType key, PtrType ptr) {
+  if (level == levels_.size()) {
+    levels_.emplace_back();
+    OpenNode(level, 0);
+  } else if (IsFull(levels_[level].node)) {
+    PtrType full_ptr = levels_[level].node_ptr;
+    Node<KeysCount> full = levels_[level].node;
+
+    /* Leaf ends right before the next key
+     * (or right after the last one, if the next is sentinel);
+     * inner node's last key is its high key. */
+    KeyType high_key = levels_[level].last_key;
+    if (level == 0) {
+      high_key = key == kInfValue ? full.GetMaxKey() + 1 : key;
+    }
+
+    OpenNode(level, high_key);
+
+    full.Seal(levels_[level].node_ptr, high_key);
+    full.UpdateChecksum();
+    WriteAt(full_ptr, &full, NodeSize);
+    ++levels_[level].sealed;
+
+    AddEntry(level + 1, high_key, full_ptr);
+  }
+
+  if (level != 0) {
+    levels_[level].node.Append(key, ptr);
+    levels_[level].last_key = key;
+  }
+}
+
+
+/*
+ * SealNode -
+ * close last node of 'level' and pass it to the parent level.
+*/
+template <std::size_t KeysCount>
+void BulkLoader<KeysCount>::SealNode(std::size_t level,
+                                     PtrType link_ptr, KeyType high_key) {
+  Level& current = levels_[level];
+
+  current.node.Seal(link_ptr, high_key);
+  current.node.UpdateChecksum();
+  WriteAt(current.node_ptr, &current.node, NodeSize);
+  ++current.sealed;
+
+  AddEntry(level + 1, high_key, current.node_ptr);
+}
+
+
+template <std::size_t KeysCount>
+void BulkLoader<KeysCount>::OpenNode(std::size_t level, KeyType low_key) {
+  levels_[level].node.InitEmpty(static_cast<std::uint32_t>(level), low_key);
+  levels_[level].node_ptr = Reserve(NodeSize, 4096);
+}
+
+
+/*
+ * IsFull -
+ * node has got its share (fill factor) of entries it can hold
+ * while being safe; inner nodes hold more than leaves.
+*/
+template <std::size_t KeysCount>
+bool BulkLoader<KeysCount>::IsFull(const Node<KeysCount>& node) const {
+  std::size_t limit = std::clamp<std::size_t>(
+    static_cast<std::size_t>(std::lround(node.MaxSize() * fill_factor_)),
+    2, node.MaxSize());
+  return node.Size() >= limit;
+}
+
+
+
+/*
+ * Reserve -
+ * take zeroed place at the end of stream.
+ *
+ * Returns:
+ * @offset: file offset of reserved place.
+*/
+template <std::size_t KeysCount>
+auto BulkLoader<KeysCount>::Reserve(std::size_t size, std::size_t alignment)
+  -> PtrType {
+  PtrType end = buffer_offset_ + static_cast<PtrType>(buffer_.size());
+  PtrType offset = (end + alignment - 1) / alignment * alignment;
+
+  if (buffer_.size() + (offset - end) + size > kBufferSize) {
+    Flush();
+    buffer_offset_ = offset;
+  }
+  buffer_.resize(offset + size - buffer_offset_, 0);
+
+  return offset;
+}
+
+
+template <std::size_t KeysCount>
+auto BulkLoader<KeysCount>::Append(const char* data, std::size_t size)
+  -> PtrType {
+  if (size > kBufferSize) [[unlikely]] {
+    /* Huge record: write it directly */
+    Flush();
+    PtrType offset = buffer_offset_;
+    if (pwrite(fd, data, size, offset) != static_cast<ssize_t>(size)) {
+      perror("pwrite");
+      exit(EXIT_FAILURE);
+    }
+    buffer_offset_ = offset + size;
+    return offset;
+  }
+
+  PtrType offset = Reserve(size, 1);
+  std::memcpy(buffer_.data() + (offset - buffer_offset_), data, size);
+  return offset;
+}
+
+
+/*
+ * WriteAt -
+ * write already reserved place.
+*/
+template <std::size_t KeysCount>
+void BulkLoader<KeysCount>::WriteAt(PtrType offset,
+                                    const void* data, std::size_t size) {
+  if (offset >= buffer_offset_) {
+    std::memcpy(buffer_.data() + (offset - buffer_offset_), data, size);
+    return;
+  }
+  if (pwrite(fd, data, size, offset) != static_cast<ssize_t>(size)) {
+    perror("pwrite");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+template <std::size_t KeysCount>
+void BulkLoader<KeysCount>::Flush() {
+  const char* data = buffer_.data();
+  std::size_t left = buffer_.size();
+  PtrType offset = buffer_offset_;
+
+  while (left > 0) {
+    ssize_t written = pwrite(fd, data, left, offset);
+    if (written <= 0) {
+      perror("pwrite");
+      exit(EXIT_FAILURE);
+    }
+    data += written;
+    left -= written;
+    offset += written;
+  }
+
+  buffer_offset_ = offset;
+  buffer_.clear();
+}
+
+#endif  // BULK_LOAD_HPP
@@ -0,0 +1,96 @@
+#include "checksum.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78u /* reflected 0x1EDC6F41 */
+
+static uint32_t crc32c_table[256];
+
+/* Whole CRC, from inverted 'crc' to inverted result */
+typedef uint32_t (*Crc32cKernel)(uint32_t crc, const uint8_t* bytes,
+                                 size_t size);
+
+static uint32_t Crc32cTable(uint32_t crc, const uint8_t* bytes, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    crc = crc32c_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+/* CPU instructions compute the same polynomial 8 bytes at a time */
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHardware(uint32_t crc, const uint8_t* bytes,
+                               size_t size) {
+  uint64_t wide = crc;
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    wide = _mm_crc32_u64(wide, word);
+    bytes += sizeof(word);
+  }
+  crc = (uint32_t)wide;
+  for (; size > 0; --size) {
+    crc = _mm_crc32_u8(crc, *bytes++);
+  }
+  return crc;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t Crc32cHardware(uint32_t crc, const uint8_t* bytes,
+                               size_t size) {
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc = __crc32cd(crc, word);
+    bytes += sizeof(word);
+  }
+  for (; size > 0; --size) {
+    crc = __crc32cb(crc, *bytes++);
+  }
+  return crc;
+}
+#endif
+
+static Crc32cKernel crc32c_kernel = Crc32cTable;
+
+__attribute__((constructor))
+static void InitCrc32cTable(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+    }
+    crc32c_table[i] = crc;
+  }
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_kernel = Crc32cHardware;
+  }
+#elif defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    crc32c_kernel = Crc32cHardware;
+  }
+#endif
+}
+
+uint32_t Crc32c(uint32_t crc, const void* data, size_t size) {
+  return ~crc32c_kernel(~crc, (const uint8_t*)data, size);
+}
+
+/* Table-driven CRC32C, whatever the CPU has (to check the fast one) */
+uint32_t Crc32cPortable(uint32_t crc, const void* data, size_t size) {
+  return ~Crc32cTable(~crc, (const uint8_t*)data, size);
+}
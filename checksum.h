@@ -0,0 +1,15 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli), as used by iSCSI/ext4.
+ * 'crc' is the value of previous part (0 for the first one). */
+uint32_t Crc32c(uint32_t crc, const void* data, size_t size);
+
+/* Same without CPU instructions (SSE4.2/ARMv8 CRC), which Crc32c
+ * uses where the CPU has them */
+uint32_t Crc32cPortable(uint32_t crc, const void* data, size_t size);
+
+#endif  // CHECKSUM_H
@@ -0,0 +1,255 @@
+#ifndef COROUTINE_HPP
+#define COROUTINE_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include <sched.h>
+
+/*
+ * Task -
+ * lazily started coroutine producing T; it runs when awaited and
+ * resumes its awaiter when done. Operations of BLinkTree suspend
+ * inside with Yield, so tasks in flight are driven by a Scheduler.
+*/
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  Task(Task&& other) noexcept : handle_{std::exchange(other.handle_, {})} {}
+  Task& operator=(Task&&) = delete;
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    handle_.promise().awaiter = awaiter;
+    return handle_;
+  }
+
+  T await_resume() {
+    if constexpr (!std::is_void_v<T>) {
+      return std::move(*handle_.promise().value);
+    }
+  }
+
+private:
+  explicit Task(Handle handle) : handle_{handle} {}
+
+  Handle handle_;
+};
+
+
+
+/* Part of promise common to every T */
+struct TaskPromiseBase {
+  /* Awaiter of finished task goes on in the same thread at once */
+  struct FinalAwaiter {
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<Promise> task) noexcept {
+      std::coroutine_handle<> awaiter = task.promise().awaiter;
+      return awaiter ? awaiter : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept {
+    return {};
+  }
+
+  FinalAwaiter final_suspend() const noexcept {
+    return {};
+  }
+
+  void unhandled_exception() const noexcept {
+    std::terminate();
+  }
+
+  std::coroutine_handle<> awaiter;
+};
+
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  template <typename U>
+  void return_value(U&& result) {
+    value.emplace(std::forward<U>(result));
+  }
+
+  std::optional<T> value;
+};
+
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  void return_void() const noexcept {}
+};
+
+
+template <typename T>
+struct Task<T>::promise_type : TaskPromise<T> {
+  Task get_return_object() {
+    return Task{Handle::from_promise(*this)};
+  }
+};
+
+
+
+/*
+ * Scheduler -
+ * runs tasks of one thread: every task suspended by Yield
+ * waits its turn behind the others in a ready queue.
+ * Tasks never block the thread on a lock or on disk, they yield
+ * and check again, so one thread keeps any number of them in
+ * flight. Without a Scheduler running, Yield does not suspend
+ * but yields the thread, and tasks wait as plain calls do.
+*/
+class Scheduler {
+public:
+  Scheduler() = default;
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  void Spawn(Task<void> task);
+  void Run();
+
+  void Post(std::coroutine_handle<> handle);
+  static Scheduler* Current();
+
+  std::size_t Running() const;
+
+private:
+  struct Detached;
+
+  static Detached Drive(Task<void> task, Scheduler* scheduler);
+
+private:
+  std::deque<std::coroutine_handle<>> ready_;
+  std::size_t running_{0}; // spawned and not finished
+
+  inline static thread_local Scheduler* current_{nullptr};
+};
+
+
+
+/* Coroutine of spawned task; frees itself when task is done */
+struct Scheduler::Detached {
+  struct promise_type {
+    Detached get_return_object() {
+      return Detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() const noexcept {
+      return {};
+    }
+
+    std::suspend_never final_suspend() const noexcept {
+      return {};
+    }
+
+    void return_void() const noexcept {}
+
+    void unhandled_exception() const noexcept {
+      std::terminate();
+    }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+
+inline Scheduler::Detached Scheduler::Drive(Task<void> task,
+                                            Scheduler* scheduler) {
+  co_await task;
+  --scheduler->running_;
+}
+
+
+
+/* 'task' starts in Run, after tasks spawned before it */
+inline void Scheduler::Spawn(Task<void> task) {
+  ++running_;
+  Post(Drive(std::move(task), this).handle);
+}
+
+
+/*
+ * Run -
+ * resume ready tasks in turn until every task spawned is done,
+ * tasks spawned meanwhile included.
+*/
+inline void Scheduler::Run() {
+  Scheduler* previous = std::exchange(current_, this);
+
+  while (!ready_.empty()) {
+    std::coroutine_handle<> handle = ready_.front();
+    ready_.pop_front();
+    handle.resume();
+  }
+
+  current_ = previous;
+}
+
+
+inline void Scheduler::Post(std::coroutine_handle<> handle) {
+  ready_.push_back(handle);
+}
+
+
+/* Scheduler running in calling thread, or nullptr */
+inline Scheduler* Scheduler::Current() {
+  return current_;
+}
+
+
+inline std::size_t Scheduler::Running() const {
+  return running_;
+}
+
+
+
+/*
+ * Yield -
+ * awaitable: let other tasks of the scheduler run first.
+*/
+struct Yield {
+  bool await_ready() const noexcept {
+    if (Scheduler::Current() == nullptr) {
+      sched_yield();
+      return true;
+    }
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) const {
+    Scheduler::Current()->Post(handle);
+  }
+
+  void await_resume() const noexcept {}
+};
+
+#endif  // COROUTINE_HPP
@@ -0,0 +1,272 @@
+#include "epoch.h"
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "owner.h"
+
+/* Epoch based reclamation shared by processes.
+ *
+ * Operation publishes global epoch in its thread's slot on entry
+ * and clears it on exit. Whoever unlinks a node takes stamp with
+ * EpochAdvance after the node became unreachable; operations entered
+ * later cannot find it, earlier ones hold epoch not above the stamp.
+ * So node is free to reuse once EpochOldest is above its stamp.
+ * Slots of dead threads are ignored and taken over, as latches are.
+ *
+ * Modifying operations are counted in the slot as well, so that
+ * EpochBlockWriters can hold new ones back and wait for those in
+ * progress: a point where no modification is halfway done. */
+
+struct EpochTable* OpenEpochTable(const char* tree_path) {
+  return (struct EpochTable*)OpenOwnedTable(
+    tree_path, ".epochs", sizeof(struct EpochTable), EPOCH_TABLE_MAGIC);
+}
+
+void CloseEpochTable(struct EpochTable* table) {
+  CloseOwnedTable(table, sizeof(struct EpochTable));
+}
+
+
+/*
+ * GetSlot -
+ * slot of calling thread, see GetOwnedSlot.
+ * Every handle of the tree in this thread shares the slot,
+ * so nested operations of different handles are counted together.
+*/
+static struct EpochSlot* GetSlot(struct EpochTable* table) {
+  bool claimed;
+  struct EpochSlot* slot = (struct EpochSlot*)GetOwnedSlot(
+    table, table->slots, EPOCH_TABLE_SLOTS, sizeof(struct EpochSlot),
+    &claimed);
+  if (slot == NULL) {
+    fprintf(stderr, "EpochEnter: all %d slots are taken\n",
+            EPOCH_TABLE_SLOTS);
+    exit(EXIT_FAILURE);
+  }
+
+  if (claimed) {
+    slot->depth = 0;
+    __atomic_store_n(&slot->writers, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+  }
+  return slot;
+}
+
+
+/*
+ * EpochEnter -
+ * start operation that may look at nodes without holding their locks.
+ * Calls nest; operation ends with the matching EpochExit.
+*/
+void EpochEnter(struct EpochTable* table) {
+  struct EpochSlot* slot = GetSlot(table);
+
+  if (slot->depth++ == 0) {
+    uint64_t epoch = __atomic_load_n(&table->epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&slot->epoch, epoch + 1, __ATOMIC_RELAXED);
+    /* Slot is visible before any node is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+void EpochExit(struct EpochTable* table) {
+  struct EpochSlot* slot = GetSlot(table);
+
+  if (--slot->depth == 0) {
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * EpochRefresh -
+ * operation of calling thread, if any, holds back only what became
+ * unreachable from 'epoch' (see EpochNow) on, as if it had entered
+ * then. For a point where it holds nothing it read before 'epoch',
+ * so that waiting there, or a thread that is never idle, does not
+ * hold back everything unlinked meanwhile.
+*/
+void EpochRefresh(struct EpochTable* table, uint64_t epoch) {
+  struct EpochSlot* slot = GetSlot(table);
+
+  if (slot->depth > 0) {
+    __atomic_store_n(&slot->epoch, epoch + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+
+/* Global epoch: what operation entering now would see */
+uint64_t EpochNow(struct EpochTable* table) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&table->epoch, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * EpochAdvance -
+ * stamp for something that has just become unreachable.
+ *
+ * Returns:
+ * @stamp: it may be reused once EpochOldest() > stamp.
+*/
+uint64_t EpochAdvance(struct EpochTable* table) {
+  return __atomic_fetch_add(&table->epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * EpochSynchronize -
+ * wait until operations of other threads entered at 'epoch'
+ * or before are over; those entered later see everything
+ * published before 'epoch' was taken by EpochAdvance.
+ * Operation of calling thread, if any, is not waited for.
+*/
+void EpochSynchronize(struct EpochTable* table, uint64_t epoch) {
+  uint32_t self = CurrentTid();
+
+  for (int i = 0; i < EPOCH_TABLE_SLOTS; ++i) {
+    struct EpochSlot* slot = &table->slots[i];
+
+    while (true) {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      uint32_t tid = __atomic_load_n(&slot->tid, __ATOMIC_ACQUIRE);
+      uint64_t entered = __atomic_load_n(&slot->epoch, __ATOMIC_ACQUIRE);
+
+      if (tid == 0 || tid == self || entered == 0 || entered - 1 > epoch
+          || !OwnerIsAlive(tid)) {
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+
+/*
+ * EpochOldest -
+ * oldest epoch seen by operations in progress
+ * (current epoch if there are none).
+*/
+uint64_t EpochOldest(struct EpochTable* table) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  uint64_t oldest = __atomic_load_n(&table->epoch, __ATOMIC_ACQUIRE);
+
+  for (int i = 0; i < EPOCH_TABLE_SLOTS; ++i) {
+    struct EpochSlot* slot = &table->slots[i];
+    uint32_t tid = __atomic_load_n(&slot->tid, __ATOMIC_ACQUIRE);
+    uint64_t epoch = __atomic_load_n(&slot->epoch, __ATOMIC_ACQUIRE);
+
+    if (tid == 0 || epoch == 0 || epoch - 1 >= oldest) {
+      continue;
+    }
+    if (!OwnerIsAlive(tid)) {
+      /* Died inside an operation */
+      continue;
+    }
+    oldest = epoch - 1;
+  }
+
+  return oldest;
+}
+
+
+/*
+ * EpochTryBeginWrite -
+ * start modifying operation, unless writers are held back
+ * by another thread (see EpochBlockWriters). Calls nest;
+ * operation ends with the matching EpochEndWrite.
+ *
+ * Returns:
+ * @bool: true if operation may start.
+*/
+bool EpochTryBeginWrite(struct EpochTable* table) {
+  struct EpochSlot* slot = GetSlot(table);
+  uint32_t writers = slot->writers;
+  __atomic_store_n(&slot->writers, writers + 1, __ATOMIC_RELAXED);
+  /* Either blocker sees the count, or we see its gate */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  uint32_t gate = __atomic_load_n(&table->writers_gate, __ATOMIC_ACQUIRE);
+  if (gate == 0 || gate == CurrentTid()) {
+    return true;
+  }
+  if (!OwnerIsAlive(gate)) {
+    (void)__atomic_compare_exchange_n(&table->writers_gate, &gate, 0, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    return true;
+  }
+
+  __atomic_store_n(&slot->writers, writers, __ATOMIC_RELEASE);
+  return false;
+}
+
+/*
+ * EpochBeginWrite -
+ * EpochTryBeginWrite that waits while writers are held back.
+ * Operation nested in another modifying one of the thread is
+ * not held: blocker waits for the outer one anyway.
+*/
+void EpochBeginWrite(struct EpochTable* table) {
+  struct EpochSlot* slot = GetSlot(table);
+  if (slot->writers > 0) {
+    __atomic_store_n(&slot->writers, slot->writers + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  while (!EpochTryBeginWrite(table)) {
+    sched_yield();
+  }
+}
+
+void EpochEndWrite(struct EpochTable* table) {
+  struct EpochSlot* slot = GetSlot(table);
+  __atomic_store_n(&slot->writers, slot->writers - 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * EpochBlockWriters -
+ * hold back modifying operations of other threads that have not
+ * started yet, and wait for those in progress to end.
+ * Writers stay blocked until EpochUnblockWriters; blockers
+ * take turns. Modifying operations of calling thread, if any,
+ * are not waited for.
+*/
+void EpochBlockWriters(struct EpochTable* table) {
+  uint32_t self = CurrentTid();
+  while (true) {
+    uint32_t gate = 0;
+    if (__atomic_compare_exchange_n(&table->writers_gate, &gate, self, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      break;
+    }
+    if (!OwnerIsAlive(gate)) {
+      (void)__atomic_compare_exchange_n(&table->writers_gate, &gate, 0,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED);
+      continue;
+    }
+    sched_yield();
+  }
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  for (int i = 0; i < EPOCH_TABLE_SLOTS; ++i) {
+    struct EpochSlot* slot = &table->slots[i];
+    while (true) {
+      uint32_t tid = __atomic_load_n(&slot->tid, __ATOMIC_ACQUIRE);
+      uint32_t writers = __atomic_load_n(&slot->writers, __ATOMIC_ACQUIRE);
+      if (tid == 0 || tid == self || writers == 0 || !OwnerIsAlive(tid)) {
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+void EpochUnblockWriters(struct EpochTable* table) {
+  __atomic_store_n(&table->writers_gate, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,64 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define EPOCH_TABLE_MAGIC 0x48434f50454b4c42ULL /* "BLKEPOCH" */
+#define EPOCH_TABLE_SLOTS 1024
+
+/* Operation in progress of one thread; owned by thread with 'tid' */
+struct EpochSlot {
+  uint32_t tid; /* 0 if slot is free */
+  uint32_t depth; /* nested operations of the owner */
+  uint64_t epoch; /* global epoch seen on entry plus 1; 0 if idle */
+  uint32_t writers; /* modifying operations of the owner in progress */
+
+  char pad[64 - 3 * sizeof(uint32_t) - sizeof(uint64_t)];
+} __attribute__((aligned(64)));
+
+/* Sidecar file '<tree>.epochs', mmapped by every process.
+ * Nodes unlinked from the tree are stamped with the global epoch
+ * and reused only when every operation that could have seen them
+ * is over. All-zero content is a valid empty table. */
+struct EpochTable {
+  uint64_t magic;
+  uint64_t epoch;
+  uint32_t writers_gate; /* tid of thread holding writers back or 0 */
+
+  char pad[64 - 2 * sizeof(uint64_t) - sizeof(uint32_t)];
+
+  struct EpochSlot slots[EPOCH_TABLE_SLOTS];
+};
+
+
+struct EpochTable* OpenEpochTable(const char* tree_path);
+
+void CloseEpochTable(struct EpochTable* table);
+
+void EpochEnter(struct EpochTable* table);
+
+void EpochExit(struct EpochTable* table);
+
+void EpochRefresh(struct EpochTable* table, uint64_t epoch);
+
+uint64_t EpochNow(struct EpochTable* table);
+
+uint64_t EpochAdvance(struct EpochTable* table);
+
+uint64_t EpochOldest(struct EpochTable* table);
+
+void EpochSynchronize(struct EpochTable* table, uint64_t epoch);
+
+bool EpochTryBeginWrite(struct EpochTable* table);
+
+void EpochBeginWrite(struct EpochTable* table);
+
+void EpochEndWrite(struct EpochTable* table);
+
+void EpochBlockWriters(struct EpochTable* table);
+
+void EpochUnblockWriters(struct EpochTable* table);
+
+#endif  // EPOCH_H
@@ -1,8 +1,12 @@
 #include "file_meta.h"
 
+#include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +15,14 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include "memory_sync.h"
+
+/* Record locks do not exclude threads of one process:
+ * they take these first. Meta readers take the mutex too,
+ * as one thread's unlock would drop read lock of the other. */
+static pthread_mutex_t meta_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
 bool RLockMeta(int fd) {
   struct flock flockstr = {
     .l_type = F_RDLCK,
@@ -19,7 +31,14 @@ bool RLockMeta(int fd) {
     .l_len = sizeof(struct FileMeta)
   };
 
-  return fcntl(fd, F_SETLK, &flockstr) != -1;
+  if (pthread_mutex_trylock(&meta_mutex) != 0) {
+    return false;
+  }
+  if (fcntl(fd, F_SETLK, &flockstr) == -1) {
+    pthread_mutex_unlock(&meta_mutex);
+    return false;
+  }
+  return true;
 }
 
 struct FileMeta* GetMetaLocked(int fd, char* mapping) {
@@ -50,6 +69,7 @@ void WLockMeta(int fd, char* mapping) {
     .l_len = sizeof(struct FileMeta)
   };
 
+  pthread_mutex_lock(&meta_mutex);
   (void)fcntl(fd, F_SETLKW, &flockstr);
 }
 
@@ -62,6 +82,7 @@ void UnlockMeta(int fd, char* mapping) {
   };
 
   (void)fcntl(fd, F_SETLKW, &flockstr);
+  pthread_mutex_unlock(&meta_mutex);
 }
 
 void DispatchMeta(int fd, char* mapping, void* meta) {
@@ -74,26 +95,100 @@ void DispatchMeta(int fd, char* mapping, void* meta) {
   }
 }
 
-void UpdateMeta(int fd, char* mapping, off_t new_root, size_t new_height) {
-  struct FileMeta new_meta = {
-    .root_offset = new_root,
-    .height = new_height
+/* One compaction at a time: it owns 'retired_nodes'.
+ * Open file description lock, so that handles of one process
+ * exclude each other too. */
+#define COMPACTION_LOCK_OFFSET (((off_t)1 << 62) + 1)
+
+bool TryLockCompaction(int fd) {
+  struct flock flockstr = {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = COMPACTION_LOCK_OFFSET,
+    .l_len = 1
   };
 
+  return fcntl(fd, F_OFD_SETLK, &flockstr) != -1;
+}
+
+void UnlockCompaction(int fd) {
+  struct flock flockstr = {
+    .l_type = F_UNLCK,
+    .l_whence = SEEK_SET,
+    .l_start = COMPACTION_LOCK_OFFSET,
+    .l_len = 1
+  };
+
+  (void)fcntl(fd, F_OFD_SETLK, &flockstr);
+}
+
+static_assert(offsetof(struct FileMeta, version) % sizeof(uint64_t) == 0,
+              "FileMeta: version must be aligned for atomic access");
+
+
+/*
+ * MetaVersion -
+ * version of root and height; even if they are not being changed.
+ * Same version means same root: it may be cached until version changes.
+*/
+uint64_t MetaVersion(const char* mapping) {
+  const struct FileMeta* meta = (const struct FileMeta*)mapping;
+  return __atomic_load_n(&meta->version, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * ReadMetaRoot -
+ * consistent root and height without locking meta:
+ * read is retried while UpdateMeta is in progress.
+ *
+ * Returns:
+ * @version: (even) version they belong to.
+*/
+uint64_t ReadMetaRoot(const char* mapping, off_t* root, size_t* height) {
+  const struct FileMeta* meta = (const struct FileMeta*)mapping;
+
+  while (true) {
+    uint64_t version = MetaVersion(mapping);
+    if (version % 2 != 0) {
+      sched_yield();
+      continue;
+    }
+    *root = __atomic_load_n(&meta->root_offset, __ATOMIC_RELAXED);
+    *height = __atomic_load_n(&meta->height, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&meta->version, __ATOMIC_RELAXED) == version) {
+      return version;
+    }
+  }
+}
+
+
+void UpdateMeta(int fd, char* mapping, off_t new_root, size_t new_height) {
+  struct FileMeta* meta = (struct FileMeta*)mapping;
+
   /* WriteLock Meta first */
   WLockMeta(fd, mapping);
   /* Pin Meta in RAM */
   mlock(mapping, sizeof(struct FileMeta));
 
-  new_meta.order = ((struct FileMeta*)mapping)->order;
+  /* Odd version: readers retry, cached roots are dropped */
+  uint64_t version = __atomic_load_n(&meta->version, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->version, version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  /* Rest of the page (allocator state) is not ours to overwrite */
+  __atomic_store_n(&meta->root_offset, new_root, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->height, new_height, __ATOMIC_RELAXED);
 
-  memcpy(mapping, &new_meta, sizeof(struct FileMeta));
+  __atomic_store_n(&meta->version, version + 2, __ATOMIC_RELEASE);
 
   /* Unpin Meta from RAM */
   munlock(mapping, sizeof(struct FileMeta));
 
   /* Push Meta to disk */
-  msync(mapping, sizeof(struct FileMeta), MS_SYNC);
+  MSync(mapping, sizeof(struct FileMeta));
 
   UnlockMeta(fd, mapping);
 }
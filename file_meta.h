@@ -3,14 +3,25 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
+#include "allocate.h"
+
 struct FileMeta {
   off_t root_offset; /* current root of tree; may be overwritten */
   size_t height; /* current height of tree */
   size_t order; /* 2*order is max number of elements in node */
 
-  char pad[4096 - sizeof(off_t) - sizeof(size_t) - sizeof(size_t)];
+  struct AllocState alloc_state; /* owned by allocate.c */
+
+  off_t retired_nodes; /* nodes merged away, waiting for readers to leave */
+
+  /* Bumped twice by UpdateMeta: odd while root and height change */
+  uint64_t version;
+
+  char pad[4096 - sizeof(off_t) - sizeof(size_t) - sizeof(size_t)
+           - sizeof(struct AllocState) - sizeof(off_t) - sizeof(uint64_t)];
 } __attribute__((packed));
 
 
@@ -24,6 +35,14 @@ void UnlockMeta(int fd, char* mapping);
 
 void DispatchMeta(int fd, char* mapping, void* meta);
 
+bool TryLockCompaction(int fd);
+
+void UnlockCompaction(int fd);
+
+uint64_t MetaVersion(const char* mapping);
+
+uint64_t ReadMetaRoot(const char* mapping, off_t* root, size_t* height);
+
 void UpdateMeta(int fd,
                 char* mapping,
                 off_t new_root,
@@ -0,0 +1,359 @@
+#include "io_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* Rings are driven with raw system calls, no liburing.
+ *
+ * Submission side is under 'sq_lock': reads are written to the
+ * queue and counted in 'queued' until IoRingSubmit hands them all
+ * to the kernel. Completion side is under 'cq_lock': whoever holds
+ * it reaps and runs callbacks, others need not wait for their own
+ * reads, somebody reaps them. 'pending' bounds reads queued or in
+ * flight below completion queue size, so completions never overflow. */
+
+#define IO_RING_BUFFER_CHUNK ((size_t)1 << 30) /* kernel limit per iovec */
+
+struct IoRing {
+  int ring_fd;
+  int fd;
+
+  pthread_mutex_t sq_lock;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned sq_entries;
+  unsigned queued; /* written to the queue, not submitted */
+
+  pthread_mutex_t cq_lock;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  unsigned pending; /* queued or in flight; atomic */
+
+  char* buffers; /* registered, or NULL */
+  size_t buffers_size;
+
+  IoComplete complete;
+  void* arg;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+static int Setup(unsigned entries, struct io_uring_params* params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int Enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                      min_complete, flags, NULL, 0);
+}
+
+static int Register(int ring_fd, unsigned opcode, void* arg, unsigned count) {
+  return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+}
+
+/*
+ * MapRings -
+ * map submission and completion queues of 'ring_fd'.
+ *
+ * Returns:
+ * @int: 0 on success, -1 on failure.
+*/
+static int MapRings(struct IoRing* ring, const struct io_uring_params* params) {
+  ring->sq_ring_size = params->sq_off.array
+                       + params->sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params->cq_off.cqes
+                       + params->cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  ring->cq_ring = ring->sq_ring;
+  if (!single) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      perror("mmap");
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      return -1;
+    }
+  }
+  ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(
+    NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    perror("mmap");
+    if (ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    return -1;
+  }
+
+  char* sq = (char*)ring->sq_ring;
+  char* cq = (char*)ring->cq_ring;
+  ring->sq_tail = (unsigned*)(sq + params->sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params->sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params->sq_off.array);
+  ring->sq_entries = params->sq_entries;
+  ring->cq_head = (unsigned*)(cq + params->cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params->cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+  return 0;
+}
+
+/*
+ * RegisterBuffers -
+ * pin 'buffers' once for all reads into them. Pinned memory counts
+ * against RLIMIT_MEMLOCK; if it is refused, reads go unregistered.
+*/
+static void RegisterBuffers(struct IoRing* ring, void* buffers, size_t size) {
+  if (buffers == NULL || size == 0) {
+    return;
+  }
+  size_t count = (size + IO_RING_BUFFER_CHUNK - 1) / IO_RING_BUFFER_CHUNK;
+  struct iovec* iovecs = (struct iovec*)calloc(count, sizeof(struct iovec));
+  if (iovecs == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    size_t begin = i * IO_RING_BUFFER_CHUNK;
+    iovecs[i].iov_base = (char*)buffers + begin;
+    iovecs[i].iov_len = size - begin < IO_RING_BUFFER_CHUNK
+                        ? size - begin : IO_RING_BUFFER_CHUNK;
+  }
+  if (Register(ring->ring_fd, IORING_REGISTER_BUFFERS,
+               iovecs, (unsigned)count) == 0) {
+    ring->buffers = (char*)buffers;
+    ring->buffers_size = size;
+  }
+  free(iovecs);
+}
+
+/*
+ * OpenIoRing -
+ * ring for reads from 'fd'; 'complete' is called with 'arg'
+ * for every one of them.
+ *
+ * @buffers: memory most reads go to, may be NULL.
+ *
+ * Returns:
+ * @ring: ring handle, or NULL if io_uring is not available
+ *   (old kernel, disabled by sysctl or seccomp).
+*/
+struct IoRing* OpenIoRing(int fd, void* buffers, size_t size,
+                          IoComplete complete, void* arg) {
+  struct IoRing* ring = (struct IoRing*)calloc(1, sizeof(struct IoRing));
+  if (ring == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->complete = complete;
+  ring->arg = arg;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->ring_fd = Setup(IO_RING_ENTRIES, &params);
+  if (ring->ring_fd < 0) {
+    free(ring);
+    return NULL;
+  }
+  if (MapRings(ring, &params) == -1) {
+    close(ring->ring_fd);
+    free(ring);
+    return NULL;
+  }
+  pthread_mutex_init(&ring->sq_lock, NULL);
+  pthread_mutex_init(&ring->cq_lock, NULL);
+
+  RegisterBuffers(ring, buffers, size);
+  return ring;
+}
+
+/*
+ * ReapLocked -
+ * run callbacks of finished reads. Caller holds 'cq_lock'.
+ *
+ * Returns:
+ * @unsigned: number of reads reaped.
+*/
+static unsigned ReapLocked(struct IoRing* ring) {
+  unsigned reaped = 0;
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    uint64_t user_data = cqe->user_data;
+    int result = cqe->res;
+    /* Entry is copied out, kernel may reuse it */
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&ring->pending, 1, __ATOMIC_RELEASE);
+
+    ring->complete(ring->arg, user_data, result);
+    ++reaped;
+  }
+  return reaped;
+}
+
+/* Reads still queued are submitted and all of them waited for */
+void CloseIoRing(struct IoRing* ring) {
+  pthread_mutex_lock(&ring->cq_lock);
+  while (__atomic_load_n(&ring->pending, __ATOMIC_ACQUIRE) > 0) {
+    IoRingSubmit(ring);
+    if (ReapLocked(ring) == 0) {
+      (void)Enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    }
+  }
+  pthread_mutex_unlock(&ring->cq_lock);
+
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->ring_fd);
+  pthread_mutex_destroy(&ring->sq_lock);
+  pthread_mutex_destroy(&ring->cq_lock);
+  free(ring);
+}
+
+/*
+ * IoRingRead -
+ * queue read of 'size' bytes at 'offset' into 'buf';
+ * it starts with the next IoRingSubmit.
+ *
+ * Returns:
+ * @bool: false if the ring is full; reap and try again.
+*/
+bool IoRingRead(struct IoRing* ring, void* buf, size_t size, off_t offset,
+                uint64_t user_data) {
+  pthread_mutex_lock(&ring->sq_lock);
+  if (__atomic_load_n(&ring->pending, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    pthread_mutex_unlock(&ring->sq_lock);
+    return false;
+  }
+  __atomic_add_fetch(&ring->pending, 1, __ATOMIC_RELEASE);
+
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+
+  char* byte = (char*)buf;
+  if (ring->buffers != NULL && ring->buffers <= byte
+      && byte + size <= ring->buffers + ring->buffers_size
+      && (size_t)(byte - ring->buffers) / IO_RING_BUFFER_CHUNK
+         == (size_t)(byte + size - 1 - ring->buffers) / IO_RING_BUFFER_CHUNK) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = (uint16_t)((size_t)(byte - ring->buffers)
+                                / IO_RING_BUFFER_CHUNK);
+  } else {
+    sqe->opcode = IORING_OP_READ;
+  }
+  sqe->fd = ring->fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)size;
+  sqe->off = (uint64_t)offset;
+  sqe->user_data = user_data;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->queued;
+
+  pthread_mutex_unlock(&ring->sq_lock);
+  return true;
+}
+
+/* Start every read queued so far, by any thread */
+void IoRingSubmit(struct IoRing* ring) {
+  pthread_mutex_lock(&ring->sq_lock);
+  while (ring->queued > 0) {
+    int submitted = Enter(ring->ring_fd, ring->queued, 0, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* Out of kernel resources: reads stay queued for next submit */
+      if (errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter");
+      }
+      break;
+    }
+    ring->queued -= (unsigned)submitted;
+  }
+  pthread_mutex_unlock(&ring->sq_lock);
+}
+
+/*
+ * IoRingReap -
+ * run callbacks of reads finished so far, without waiting;
+ * nothing is done while another thread reaps.
+ *
+ * Returns:
+ * @unsigned: number of reads reaped.
+*/
+unsigned IoRingReap(struct IoRing* ring) {
+  if (pthread_mutex_trylock(&ring->cq_lock) != 0) {
+    return 0;
+  }
+  unsigned reaped = ReapLocked(ring);
+  pthread_mutex_unlock(&ring->cq_lock);
+  return reaped;
+}
+
+/*
+ * IoRingWait -
+ * reap until '*word' is not 'busy' any more, as callback
+ * of a read sets it.
+*/
+void IoRingWait(struct IoRing* ring, const uint32_t* word, uint32_t busy) {
+  /* Reads queued by caller start even while another thread reaps */
+  IoRingSubmit(ring);
+  pthread_mutex_lock(&ring->cq_lock);
+  while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == busy) {
+    IoRingSubmit(ring);
+    if (ReapLocked(ring) > 0) {
+      continue;
+    }
+    if (__atomic_load_n(&ring->pending, __ATOMIC_ACQUIRE) == 0) {
+      /* Read is not queued yet */
+      sched_yield();
+      continue;
+    }
+    if (Enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+        && errno != EINTR) {
+      perror("io_uring_enter");
+      sched_yield();
+    }
+  }
+  pthread_mutex_unlock(&ring->cq_lock);
+}
@@ -0,0 +1,38 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IO_RING_ENTRIES 256 /* reads queued or in flight at most */
+
+/* Called for every finished read with its 'user_data' and result:
+ * bytes read, or -errno. Runs in whichever thread reaps it. */
+typedef void (*IoComplete)(void* arg, uint64_t user_data, int result);
+
+/* io_uring instance reading one file, shared by threads.
+ * Reads are queued by any thread and submitted together by the next
+ * IoRingSubmit, so concurrent operations share the syscall and
+ * the device sees all of them at once. Reads into 'buffers' given
+ * to OpenIoRing use them as registered buffers: pages are not
+ * pinned and unpinned for every read. */
+struct IoRing;
+
+
+struct IoRing* OpenIoRing(int fd, void* buffers, size_t size,
+                          IoComplete complete, void* arg);
+
+void CloseIoRing(struct IoRing* ring);
+
+bool IoRingRead(struct IoRing* ring, void* buf, size_t size, off_t offset,
+                uint64_t user_data);
+
+void IoRingSubmit(struct IoRing* ring);
+
+unsigned IoRingReap(struct IoRing* ring);
+
+void IoRingWait(struct IoRing* ring, const uint32_t* word, uint32_t busy);
+
+#endif  // IO_RING_H
@@ -0,0 +1,349 @@
+#include "latch_table.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "owner.h"
+#include "stats.h"
+
+/* Latch word:
+ *   bit 31     - somebody sleeps on the futex;
+ *   bit 30     - latch is held by writer;
+ *   bits 0..29 - writer's tid if bit 30 is set, otherwise
+ *     bits 0..14  - reader cells in use: reader with bit i
+ *                   keeps its tid in readers[i],
+ *     bits 15..29 - number of readers that found no free cell.
+ * Keeping owner's tid inside the word lets a waiter
+ * detect crashed writer and steal the latch with single CAS;
+ * crashed reader's bit is cleared the same way.
+ * Reader claims its cell before setting the bit and clears
+ * the bit before freeing the cell, so a free cell never has its bit set.
+ * Readers counted without a cell cannot be recovered: a slot
+ * read by more than LATCH_READER_CELLS holders at once may stay
+ * latched forever if one of the extra ones crashes. */
+#define LATCH_WAITERS (1u << 31)
+#define LATCH_WRITER  (1u << 30)
+#define LATCH_PAYLOAD (LATCH_WRITER - 1)
+#define LATCH_CELLS   ((1u << LATCH_READER_CELLS) - 1)
+#define LATCH_UNCOUNTED_READER (1u << LATCH_READER_CELLS)
+#define LATCH_RECOVERING (1u << 31) /* cell: tid of thread freeing it */
+
+#define LATCH_SPINS 128
+#define LATCH_WAIT_NS 20000000 /* 20ms; then check if owner is alive */
+
+static struct Latch* LatchAt(struct LatchTable* table, off_t key) {
+  /* Fibonacci hashing of node offset */
+  uint64_t hash = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+  return &table->latches[hash >> (64 - LATCH_TABLE_SLOTS_LOG)];
+}
+
+static void CpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+
+struct LatchTable* OpenLatchTable(const char* tree_path) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s.locks", tree_path) >= (int)sizeof(path)) {
+    fprintf(stderr, "OpenLatchTable: path is too long\n");
+    return NULL;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+  /* Truncation to the same size keeps content,
+   * so concurrent openers cannot wipe held latches. */
+  if (ftruncate(fd, sizeof(struct LatchTable)) == -1) {
+    perror("ftruncate");
+    close(fd);
+    return NULL;
+  }
+
+  void* mapping = mmap(
+    NULL,
+    sizeof(struct LatchTable),
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    fd,
+    0
+  );
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  struct LatchTable* table = (struct LatchTable*)mapping;
+  if (__atomic_load_n(&table->magic, __ATOMIC_ACQUIRE) != LATCH_TABLE_MAGIC) {
+    table->slots_count = LATCH_TABLE_SLOTS;
+    __atomic_store_n(&table->magic, LATCH_TABLE_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  return table;
+}
+
+/*
+ * OpenPrivateLatchTable -
+ * latch table of this process (and its children), not backed by file.
+ * Used under record locks, which do not exclude threads of one process.
+*/
+struct LatchTable* OpenPrivateLatchTable(void) {
+  void* mapping = mmap(
+    NULL,
+    sizeof(struct LatchTable),
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE,
+    -1,
+    0
+  );
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  struct LatchTable* table = (struct LatchTable*)mapping;
+  table->slots_count = LATCH_TABLE_SLOTS;
+  table->magic = LATCH_TABLE_MAGIC;
+
+  return table;
+}
+
+void CloseLatchTable(struct LatchTable* table) {
+  if (table != NULL) {
+    munmap(table, sizeof(struct LatchTable));
+  }
+}
+
+
+/*
+ * ClaimCell -
+ * take a free reader cell of 'latch'.
+ *
+ * Returns:
+ * @cell: index of the cell, or -1 if all are taken.
+*/
+static int ClaimCell(struct Latch* latch) {
+  for (int i = 0; i < LATCH_READER_CELLS; ++i) {
+    uint32_t expected = 0;
+    if (__atomic_load_n(&latch->readers[i], __ATOMIC_RELAXED) == 0
+        && __atomic_compare_exchange_n(&latch->readers[i], &expected,
+                                       CurrentTid(), false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool TryRLockWord(struct Latch* latch) {
+  uint32_t value = __atomic_load_n(&latch->word, __ATOMIC_RELAXED);
+  if (value & LATCH_WRITER) {
+    return false;
+  }
+
+  int cell = ClaimCell(latch);
+  uint32_t add = cell == -1 ? LATCH_UNCOUNTED_READER : 1u << cell;
+  while (!(value & LATCH_WRITER)) {
+    uint32_t desired = cell == -1 ? value + add : value | add;
+    /* Release: whoever sees the bit sees the cell */
+    if (__atomic_compare_exchange_n(&latch->word, &value, desired, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+
+  if (cell != -1) {
+    __atomic_store_n(&latch->readers[cell], 0, __ATOMIC_RELEASE);
+  }
+  return false;
+}
+
+static bool TryWLockWord(struct Latch* latch) {
+  uint32_t* word = &latch->word;
+  uint32_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+  while ((value & ~LATCH_WAITERS) == 0) {
+    uint32_t desired = (value & LATCH_WAITERS) | LATCH_WRITER | CurrentTid();
+    if (__atomic_compare_exchange_n(word, &value, desired, true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * ReleaseDeadReaders -
+ * clear bits of readers that crashed holding 'latch', then free
+ * their cells. Cells left by readers that crashed while taking
+ * or releasing the latch (bit is clear) are freed as well.
+ * Cell is first marked with the tid of the thread freeing it,
+ * so only one thread clears its bit, and a crash in between
+ * is recovered the same way.
+ *
+ * Returns:
+ * @bool: true if some reader's bit was cleared.
+*/
+static bool ReleaseDeadReaders(struct Latch* latch) {
+  bool released = false;
+
+  for (int i = 0; i < LATCH_READER_CELLS; ++i) {
+    uint32_t tid = __atomic_load_n(&latch->readers[i], __ATOMIC_ACQUIRE);
+    if (tid == 0 || OwnerIsAlive(tid & ~LATCH_RECOVERING)
+        || !__atomic_compare_exchange_n(&latch->readers[i], &tid,
+                                        CurrentTid() | LATCH_RECOVERING,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+      continue;
+    }
+
+    /* Cell is not free until we free it: its bit can be trusted */
+    uint32_t bit = 1u << i;
+    uint32_t value = __atomic_load_n(&latch->word, __ATOMIC_RELAXED);
+    while (!(value & LATCH_WRITER) && (value & bit)) {
+      if (__atomic_compare_exchange_n(&latch->word, &value, value & ~bit,
+                                      true, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_RELAXED)) {
+        released = true;
+        break;
+      }
+    }
+    __atomic_store_n(&latch->readers[i], 0, __ATOMIC_RELEASE);
+  }
+
+  return released;
+}
+
+/*
+ * LockSlow -
+ * spin for a while, then sleep on futex.
+ * Every timed out sleep checks whether holders are still alive;
+ * latch of dead writer or reader is released on its behalf.
+*/
+static void LockSlow(struct Latch* latch, bool (*try_lock)(struct Latch*)) {
+  StatsAdd(STATS_LOCK_WAITS, 1);
+  uint32_t* word = &latch->word;
+
+  for (int i = 0; i < LATCH_SPINS; ++i) {
+    if (try_lock(latch)) {
+      return;
+    }
+    CpuRelax();
+  }
+
+  while (!try_lock(latch)) {
+    uint32_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+    if ((value & LATCH_WRITER) && !OwnerIsAlive(value & LATCH_PAYLOAD)) {
+      /* Owner crashed while holding latch */
+      if (__atomic_compare_exchange_n(word, &value, 0, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        FutexWakeAll(word);
+      }
+      continue;
+    }
+    if (!(value & LATCH_WRITER) && (value & LATCH_CELLS)
+        && ReleaseDeadReaders(latch)) {
+      FutexWakeAll(word);
+      continue;
+    }
+    if (!(value & LATCH_WAITERS)
+        && !__atomic_compare_exchange_n(word, &value, value | LATCH_WAITERS,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+      continue;
+    }
+    FutexWait(word, value | LATCH_WAITERS, LATCH_WAIT_NS);
+  }
+}
+
+
+bool LatchTryRLock(struct LatchTable* table, off_t key) {
+  return TryRLockWord(LatchAt(table, key));
+}
+
+void LatchRLock(struct LatchTable* table, off_t key) {
+  struct Latch* latch = LatchAt(table, key);
+  if (!TryRLockWord(latch)) {
+    LockSlow(latch, TryRLockWord);
+  }
+}
+
+bool LatchTryWLock(struct LatchTable* table, off_t key) {
+  return TryWLockWord(LatchAt(table, key));
+}
+
+void LatchWLock(struct LatchTable* table, off_t key) {
+  struct Latch* latch = LatchAt(table, key);
+  if (!TryWLockWord(latch)) {
+    LockSlow(latch, TryWLockWord);
+  }
+}
+
+/*
+ * OwnCell -
+ * cell of calling reader in 'latch' whose bit is set in 'value'.
+ *
+ * Returns:
+ * @cell: index of the cell, or -1 if reader holds no cell.
+*/
+static int OwnCell(struct Latch* latch, uint32_t value) {
+  for (int i = 0; i < LATCH_READER_CELLS; ++i) {
+    if ((value & (1u << i))
+        && __atomic_load_n(&latch->readers[i], __ATOMIC_RELAXED)
+             == CurrentTid()) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * LatchUnlock -
+ * release latch held either by reader or by writer.
+ * Writer and readers never hold latch at the same time,
+ * so mode is seen from the word itself.
+*/
+void LatchUnlock(struct LatchTable* table, off_t key) {
+  struct Latch* latch = LatchAt(table, key);
+  uint32_t* word = &latch->word;
+  uint32_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+  uint32_t desired;
+  int cell = -1;
+
+  do {
+    if (value & LATCH_WRITER) {
+      desired = 0;
+    } else {
+      /* Nobody else clears our bit: cell found once stays ours */
+      if (cell == -1) {
+        cell = OwnCell(latch, value);
+      }
+      desired = cell == -1 ? value - LATCH_UNCOUNTED_READER
+                           : value & ~(1u << cell);
+      if ((desired & LATCH_PAYLOAD) == 0) {
+        desired = 0;
+      }
+    }
+  } while (!__atomic_compare_exchange_n(word, &value, desired, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (!(value & LATCH_WRITER) && cell != -1) {
+    __atomic_store_n(&latch->readers[cell], 0, __ATOMIC_RELEASE);
+  }
+
+  if ((value & LATCH_WAITERS) && !(desired & LATCH_WAITERS)) {
+    FutexWakeAll(word);
+  }
+}
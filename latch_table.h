@@ -0,0 +1,51 @@
+#ifndef LATCH_TABLE_H
+#define LATCH_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LATCH_TABLE_MAGIC 0x484354414c4b4c42ULL /* "BLKLATCH" */
+#define LATCH_TABLE_SLOTS_LOG 16
+#define LATCH_TABLE_SLOTS (1 << LATCH_TABLE_SLOTS_LOG)
+
+#define LATCH_READER_CELLS 15
+
+struct Latch {
+  uint32_t word; /* futex word; layout is described in latch_table.c */
+
+  /* tids of readers holding the latch, one per bit of 'word' */
+  uint32_t readers[LATCH_READER_CELLS];
+} __attribute__((aligned(64)));
+
+/* Sidecar file '<tree>.locks', mmapped by every process.
+ * All-zero content means "every latch is free",
+ * so a freshly truncated file needs no initialization. */
+struct LatchTable {
+  uint64_t magic;
+  uint64_t slots_count;
+
+  char pad[64 - 2 * sizeof(uint64_t)];
+
+  struct Latch latches[LATCH_TABLE_SLOTS];
+};
+
+
+struct LatchTable* OpenLatchTable(const char* tree_path);
+
+struct LatchTable* OpenPrivateLatchTable(void);
+
+void CloseLatchTable(struct LatchTable* table);
+
+bool LatchTryRLock(struct LatchTable* table, off_t key);
+
+void LatchRLock(struct LatchTable* table, off_t key);
+
+bool LatchTryWLock(struct LatchTable* table, off_t key);
+
+void LatchWLock(struct LatchTable* table, off_t key);
+
+void LatchUnlock(struct LatchTable* table, off_t key);
+
+#endif  // LATCH_TABLE_H
@@ -1,31 +1,183 @@
 #ifndef LOCKS_HPP
 #define LOCKS_HPP
 
+#include "latch_table.h"
 #include "node.hpp"
+#include "stats.h"
+#include "trace.h"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <utility>
 
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/*
+ * Node locks backend is chosen at compile time:
+ * - default: shared memory latch table (latch_table.h),
+ *   uncontended lock/unlock does not enter the kernel;
+ * - BLINK_FCNTL_LOCKS: POSIX record locks on node's byte range.
+ *   Record locks belong to process, so they are taken under
+ *   node's latch in 'latches', table private to the process
+ *   (OpenPrivateLatchTable). Readers share the latch: one thread's
+ *   unlock would drop read lock of the other, so they count
+ *   themselves per node (ReadLocks) and only the last reader
+ *   of the process releases record lock.
+*/
+
+
+#if defined(BLINK_FCNTL_LOCKS)
+/*
+ * RecordLockNode -
+ * fcntl 'command' with lock 'type' on node's byte range.
+ *
+ * Returns:
+ * @bool: false if lock is not taken.
+*/
+template <std::size_t KeysCount>
+bool RecordLockNode(int fd, short type, int command, off_t offset) {
+  struct flock flockstr {
+    .l_type = type,
+    .l_whence = SEEK_SET,
+    .l_start = offset,
+    .l_len = sizeof(Node<KeysCount>)
+  };
+
+  return fcntl(fd, command, &flockstr) != -1;
+}
+
+/*
+ * RecordLockNodeWait -
+ * take record lock of 'type' on node, waiting if necessary.
+*/
+template <std::size_t KeysCount>
+void RecordLockNodeWait(int fd, short type, off_t offset) {
+  if (!RecordLockNode<KeysCount>(fd, type, F_SETLK, offset)) {
+    StatsAdd(STATS_LOCK_WAITS, 1);
+    (void)RecordLockNode<KeysCount>(fd, type, F_SETLKW, offset);
+  }
+}
+
+/*
+ * Readers of the process holding record read lock of a node,
+ * by (fd, offset). 'taking' is set while the first of them waits
+ * for the record lock without the mutex: the rest wait for it.
+*/
+struct ReadLockHolders {
+  uint32_t count;
+  bool taking;
+};
+
+struct ReadLocks {
+  std::mutex mutex;
+  std::condition_variable taken;
+  std::map<std::pair<int, off_t>, ReadLockHolders> holders;
+};
+
+inline ReadLocks read_locks;
+
+/*
+ * RecordRLockNode -
+ * join readers of node in this process, taking record read lock
+ * if there are none yet; waits for writer only if 'wait' is set.
+ *
+ * Returns:
+ * @bool: false if lock is not taken.
+*/
+template <std::size_t KeysCount>
+bool RecordRLockNode(int fd, off_t offset, bool wait) {
+  std::unique_lock lock{read_locks.mutex};
+  while (read_locks.holders[{fd, offset}].taking) {
+    if (!wait) {
+      return false;
+    }
+    read_locks.taken.wait(lock);
+  }
+  auto& holders = read_locks.holders[{fd, offset}];
+  if (holders.count > 0) {
+    ++holders.count;
+    return true;
+  }
+  if (RecordLockNode<KeysCount>(fd, F_RDLCK, F_SETLK, offset)) {
+    holders.count = 1;
+    return true;
+  }
+  if (!wait) {
+    read_locks.holders.erase({fd, offset});
+    return false;
+  }
+
+  /* Writer of other process may wait for a node read locked
+   * by a thread here: do not keep the mutex from its unlock */
+  holders.taking = true;
+  lock.unlock();
+  StatsAdd(STATS_LOCK_WAITS, 1);
+  (void)RecordLockNode<KeysCount>(fd, F_RDLCK, F_SETLKW, offset);
+  lock.lock();
+
+  holders.taking = false;
+  holders.count = 1;
+  read_locks.taken.notify_all();
+  return true;
+}
+
+/*
+ * RecordRUnlockNode -
+ * leave readers of node in this process, the last one drops
+ * record read lock.
+ *
+ * Returns:
+ * @bool: false if node has no readers here (it is write locked).
+*/
+template <std::size_t KeysCount>
+bool RecordRUnlockNode(int fd, off_t offset) {
+  std::lock_guard lock{read_locks.mutex};
+  auto it = read_locks.holders.find({fd, offset});
+  if (it == read_locks.holders.end()) {
+    return false;
+  }
+  if (--it->second.count == 0) {
+    (void)RecordLockNode<KeysCount>(fd, F_UNLCK, F_SETLK, offset);
+    read_locks.holders.erase(it);
+  }
+  return true;
+}
+#endif
+
+
+template <std::size_t KeysCount>
+bool GlobalRLockNode(int fd, LatchTable* latches, off_t offset);
 
 template <std::size_t KeysCount>
-bool GlobalRLockNode(int fd, off_t offset);
+void GlobalRLockNodeWait(int fd, LatchTable* latches, off_t offset);
 
 template <std::size_t KeysCount>
 Node<KeysCount>* GlobalGetRaw(off_t offset, char* mapping);
 
 template <std::size_t KeysCount>
-Node<KeysCount>* GlobalRGetRawLocked(int fd, off_t offset, char* mapping);
+Node<KeysCount>* GlobalRGetRawLocked(int fd, LatchTable* latches,
+                                     off_t offset, char* mapping);
+
+template <std::size_t KeysCount>
+Node<KeysCount>* GlobalRCopyNode(off_t offset, const Node<KeysCount>* live);
 
 template <std::size_t KeysCount>
-void GlobalWLockNode(int fd, off_t offset);
+void GlobalWLockNode(int fd, LatchTable* latches, off_t offset);
 
 template <std::size_t KeysCount>
-void GlobalUnlockNode(int fd, off_t offset);
+bool GlobalTryWLockNode(int fd, LatchTable* latches, off_t offset);
+
+template <std::size_t KeysCount>
+void GlobalUnlockNode(int fd, LatchTable* latches, off_t offset);
 
 template <std::size_t KeysCount>
 void GlobalPinNodeInRAM(Node<KeysCount>* node);
@@ -34,22 +186,45 @@ template <std::size_t KeysCount>
 void GlobalUnpinNode(Node<KeysCount>* node);
 
 template <std::size_t KeysCount>
-void GlobalRDispatchNode(int fd, off_t offset, char* mapping);
+void GlobalRDispatchNode(int fd, LatchTable* latches,
+                         off_t offset, const void* live, void* node);
 
 
 /*
- * 
+ * GlobalRLockNode -
+ * try to take read lock on node without waiting.
+ *
+ * Returns:
+ * @bool: true if lock is taken.
 */
 template <std::size_t KeysCount>
-bool GlobalRLockNode(int fd, off_t offset) {
-  struct flock flockstr {
-    .l_type = F_RDLCK,
-    .l_whence = SEEK_SET,
-    .l_start = offset,
-    .l_len = sizeof(Node<KeysCount>)
-  };
+bool GlobalRLockNode(int fd, LatchTable* latches, off_t offset) {
+#if defined(BLINK_FCNTL_LOCKS)
+  if (!LatchTryRLock(latches, offset)) {
+    return false;
+  }
+  if (RecordRLockNode<KeysCount>(fd, offset, false)) {
+    return true;
+  }
+  LatchUnlock(latches, offset);
+  return false;
+#else
+  return LatchTryRLock(latches, offset);
+#endif
+}
 
-  return fcntl(fd, F_SETLK, &flockstr) != -1;
+/*
+ * GlobalRLockNodeWait -
+ * take read lock on node, waiting for writer if necessary.
+*/
+template <std::size_t KeysCount>
+void GlobalRLockNodeWait(int fd, LatchTable* latches, off_t offset) {
+#if defined(BLINK_FCNTL_LOCKS)
+  LatchRLock(latches, offset);
+  (void)RecordRLockNode<KeysCount>(fd, offset, true);
+#else
+  LatchRLock(latches, offset);
+#endif
 }
 
 /*
@@ -64,19 +239,46 @@ Node<KeysCount>* GlobalGetRaw(off_t offset, char* mapping) {
 *
 */
 template <std::size_t KeysCount>
-Node<KeysCount>* GlobalRGetRawLocked(int fd, off_t offset, char* mapping) {
-  if (GlobalRLockNode<KeysCount>(fd, offset)) {
+Node<KeysCount>* GlobalRGetRawLocked(int fd, LatchTable* latches,
+                                     off_t offset, char* mapping) {
+  if (GlobalRLockNode<KeysCount>(fd, latches, offset)) {
     // range is locked
     return GlobalGetRaw<KeysCount>(offset, mapping);
   }
 
   // unlucky
+  return GlobalRCopyNode<KeysCount>(offset,
+                                    GlobalGetRaw<KeysCount>(offset, mapping));
+}
+
+/*
+ * GlobalRCopyNode -
+ * private copy of node 'live' at 'offset' that could not be read locked.
+ * Writer holds the node: copy is taken between its changes,
+ * validated by node's version as lock free reads are.
+*/
+template <std::size_t KeysCount>
+Node<KeysCount>* GlobalRCopyNode(off_t offset, const Node<KeysCount>* live) {
+  StatsAdd(STATS_READ_FALLBACKS, 1);
+  std::uint64_t begin = TraceBegin();
   size_t size = sizeof(Node<KeysCount>);
   void* node = malloc(size);
-  if (pread(fd, node, size, offset) != size) {
-    perror("pread");
-    return nullptr;
+  if (node == nullptr) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
   }
+  while (true) {
+    auto version = live->ReadBegin();
+    if (!(version & 1)) {
+      memcpy(node, static_cast<const void*>(live), size);
+      if (live->ReadValidate(version)) {
+        break;
+      }
+    }
+    sched_yield();
+  }
+  TraceEnd(TRACE_READ_FALLBACK, begin, offset,
+           reinterpret_cast<Node<KeysCount>*>(node)->Level());
   return reinterpret_cast<Node<KeysCount>*>(node);
 }
 
@@ -84,30 +286,51 @@ Node<KeysCount>* GlobalRGetRawLocked(int fd, off_t offset, char* mapping) {
 *
 */
 template <std::size_t KeysCount>
-void GlobalWLockNode(int fd, off_t offset) {
-  struct flock flockstr {
-    .l_type = F_WRLCK,
-    .l_whence = SEEK_SET,
-    .l_start = offset,
-    .l_len = sizeof(Node<KeysCount>)
-  };
+void GlobalWLockNode(int fd, LatchTable* latches, off_t offset) {
+#if defined(BLINK_FCNTL_LOCKS)
+  LatchWLock(latches, offset);
+  RecordLockNodeWait<KeysCount>(fd, F_WRLCK, offset);
+#else
+  LatchWLock(latches, offset);
+#endif
+}
 
-  (void)fcntl(fd, F_SETLKW, &flockstr);
+/*
+ * GlobalTryWLockNode -
+ * try to take write lock on node without waiting.
+ *
+ * Returns:
+ * @bool: true if lock is taken.
+*/
+template <std::size_t KeysCount>
+bool GlobalTryWLockNode(int fd, LatchTable* latches, off_t offset) {
+#if defined(BLINK_FCNTL_LOCKS)
+  if (!LatchTryWLock(latches, offset)) {
+    return false;
+  }
+  if (RecordLockNode<KeysCount>(fd, F_WRLCK, F_SETLK, offset)) {
+    return true;
+  }
+  LatchUnlock(latches, offset);
+  return false;
+#else
+  return LatchTryWLock(latches, offset);
+#endif
 }
 
 /*
 *
 */
 template <std::size_t KeysCount>
-void GlobalUnlockNode(int fd, off_t offset) {
-  struct flock flockstr {
-    .l_type = F_UNLCK,
-    .l_whence = SEEK_SET,
-    .l_start = offset,
-    .l_len = sizeof(Node<KeysCount>)
-  };
-
-  (void)fcntl(fd, F_SETLKW, &flockstr);
+void GlobalUnlockNode(int fd, LatchTable* latches, off_t offset) {
+#if defined(BLINK_FCNTL_LOCKS)
+  if (!RecordRUnlockNode<KeysCount>(fd, offset)) {
+    (void)RecordLockNode<KeysCount>(fd, F_UNLCK, F_SETLK, offset);
+  }
+  LatchUnlock(latches, offset);
+#else
+  LatchUnlock(latches, offset);
+#endif
 }
 
 /*
@@ -136,9 +359,12 @@ void GlobalUnpinNode(Node<KeysCount>* node) {
 *
 */
 template <std::size_t KeysCount>
-void GlobalRDispatchNode(int fd, off_t offset, char* mapping, void* node) {
-  if (node == offset + mapping) {
-    GlobalUnlockNode<KeysCount>(fd, offset);
+void GlobalRDispatchNode(int fd, LatchTable* latches,
+                         off_t offset, const void* live, void* node) {
+  /* Either node was locked,
+   * or it was malloc'ed. */
+  if (node == live) {
+    GlobalUnlockNode<KeysCount>(fd, latches, offset);
   } else {
     free(node);
   }
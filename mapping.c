@@ -0,0 +1,190 @@
+#include "mapping.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+/* Tree file mapped at an address that never moves.
+ *
+ * Address range is reserved once per handle with PROT_NONE, and file
+ * is mapped over it with MAP_FIXED as it grows, so pointers into the
+ * tree survive growth and no reader has to remap under a lock.
+ * Growth made by another handle or process becomes visible
+ * with the next ExtendMapping. */
+
+static size_t RoundUp(size_t size, size_t unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+/*
+ * Reserve -
+ * take inaccessible range of at most 'size' bytes aligned to 'align';
+ * size is halved while address space is short (ulimit -v, overcommit).
+ *
+ * @mapping: its base and reserved are set.
+ *
+ * Returns:
+ * @int: 0 on success, -1 on failure.
+*/
+static int Reserve(struct Mapping* mapping, size_t size, size_t align) {
+  for (; size >= MAPPING_MIN_RESERVE; size /= 2) {
+    char* range = (char*)mmap(
+      NULL,
+      size + align,
+      PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+      -1,
+      0
+    );
+    if (range == MAP_FAILED) {
+      continue;
+    }
+    /* Cut off misaligned head and the rest of the tail */
+    char* base = (char*)RoundUp((uintptr_t)range, align);
+    if (base != range) {
+      munmap(range, base - range);
+    }
+    if (base + size != range + size + align) {
+      munmap(base + size, range + size + align - (base + size));
+    }
+    mapping->base = base;
+    mapping->reserved = size;
+    return 0;
+  }
+  perror("mmap");
+  return -1;
+}
+
+/*
+ * OpenMapping -
+ * reserve range for file 'fd' and map file as it is now.
+ *
+ * @options: may be NULL for defaults.
+ *
+ * Returns:
+ * @int: 0 on success, -1 on failure.
+*/
+int OpenMapping(struct Mapping* mapping, int fd,
+                const struct MappingOptions* options) {
+  struct MappingOptions defaults = {0};
+  if (options == NULL) {
+    options = &defaults;
+  }
+  memset(mapping, 0, sizeof(*mapping));
+  mapping->fd = fd;
+  mapping->huge_pages = options->huge_pages;
+
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t unit = mapping->huge_pages ? MAPPING_HUGE_PAGE : page;
+  mapping->chunk = RoundUp(options->chunk ? options->chunk : MAPPING_CHUNK,
+                           unit);
+  size_t reserve = RoundUp(
+    options->reserve ? options->reserve : MAPPING_RESERVE, mapping->chunk);
+
+  if (Reserve(mapping, reserve, mapping->huge_pages ? unit : page) == -1) {
+    return -1;
+  }
+  if (pthread_mutex_init(&mapping->lock, NULL) != 0) {
+    fprintf(stderr, "OpenMapping: pthread_mutex_init failed\n");
+    munmap(mapping->base, mapping->reserved);
+    return -1;
+  }
+  if (!ExtendMapping(mapping)) {
+    CloseMapping(mapping);
+    return -1;
+  }
+  return 0;
+}
+
+void CloseMapping(struct Mapping* mapping) {
+  munmap(mapping->base, mapping->reserved);
+  pthread_mutex_destroy(&mapping->lock);
+}
+
+/*
+ * MapChunks -
+ * map file over reserved range from 'mapped' up to 'end'.
+ *
+ * Returns:
+ * @bool: true on success.
+*/
+static bool MapChunks(struct Mapping* mapping, size_t end) {
+  int flags = MAP_SHARED | MAP_FIXED;
+  struct statfs fs;
+  if (mapping->huge_pages
+      && fstatfs(mapping->fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+    flags |= MAP_HUGETLB;
+  }
+
+  char* begin = mapping->base + mapping->mapped;
+  size_t size = end - mapping->mapped;
+  if (mmap(begin, size, PROT_READ | PROT_WRITE, flags,
+           mapping->fd, (off_t)mapping->mapped) == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  if (mapping->huge_pages) {
+    /* Kernels without THP for files refuse, small pages do as well */
+    if (madvise(begin, size, MADV_HUGEPAGE) == -1 && errno != EINVAL) {
+      perror("madvise");
+      return false;
+    }
+  } else if (madvise(begin, size, MADV_RANDOM) == -1) {
+    perror("madvise");
+    return false;
+  }
+  mapping->mapped = end;
+  StatsAdd(STATS_REMAPS, 1);
+  return true;
+}
+
+/*
+ * ExtendMapping -
+ * let the whole current file be accessed through the mapping.
+ * Chunks are mapped ahead of file end, so most growths of the file
+ * only move 'valid' and take no system call but fstat.
+ *
+ * Returns:
+ * @bool: true on success.
+*/
+bool ExtendMapping(struct Mapping* mapping) {
+  pthread_mutex_lock(&mapping->lock);
+
+  struct stat statbuf;
+  if (fstat(mapping->fd, &statbuf) == -1) {
+    perror("fstat");
+    pthread_mutex_unlock(&mapping->lock);
+    return false;
+  }
+  size_t size = (size_t)statbuf.st_size;
+  if (size > mapping->reserved) {
+    fprintf(stderr, "ExtendMapping: file is larger than reserved range\n");
+    pthread_mutex_unlock(&mapping->lock);
+    return false;
+  }
+  if (size > mapping->mapped) {
+    size_t end = RoundUp(size, mapping->chunk);
+    if (end > mapping->reserved) {
+      end = mapping->reserved;
+    }
+    if (!MapChunks(mapping, end)) {
+      pthread_mutex_unlock(&mapping->lock);
+      return false;
+    }
+  }
+  if (size > mapping->valid) {
+    __atomic_store_n(&mapping->valid, size, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&mapping->lock);
+  return true;
+}
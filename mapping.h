@@ -0,0 +1,48 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAPPING_RESERVE ((size_t)1 << 40) /* address range for the file */
+#define MAPPING_MIN_RESERVE ((size_t)1 << 30)
+#define MAPPING_CHUNK ((size_t)64 << 20) /* mapped at once, past file end */
+#define MAPPING_HUGE_PAGE ((size_t)2 << 20)
+
+/* Zero fields take defaults above */
+struct MappingOptions {
+  size_t reserve;
+  size_t chunk;
+  bool huge_pages; /* THP, or hugetlbfs pages if file lives there */
+};
+
+/* File mapped at a fixed address for the whole life of a handle.
+ * Range is reserved once; file is mapped over it chunk by chunk
+ * in place, so pointers into it stay valid and nothing is remapped
+ * when the file grows. Pages past file end are mapped but must not
+ * be touched, 'valid' tells where the file ends. */
+struct Mapping {
+  char* base;
+  size_t reserved;
+  size_t chunk;
+  size_t mapped; /* multiple of chunk, up to reserved */
+  size_t valid; /* file size seen last; read without lock */
+  int fd;
+  bool huge_pages;
+  pthread_mutex_t lock;
+};
+
+
+int OpenMapping(struct Mapping* mapping, int fd,
+                const struct MappingOptions* options);
+
+void CloseMapping(struct Mapping* mapping);
+
+bool ExtendMapping(struct Mapping* mapping);
+
+static inline size_t MappingSize(const struct Mapping* mapping) {
+  return __atomic_load_n(&mapping->valid, __ATOMIC_ACQUIRE);
+}
+
+#endif  // MAPPING_H
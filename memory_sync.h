@@ -2,10 +2,32 @@
 #define MEMORY_SYNC_H
 
 #include <stddef.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
+#include "stats.h"
+#include "trace.h"
+
+/* Durability barriers, counted and timed in stats of current operation,
+ * traced if tracing is on */
+
 inline void MSync(void* addr, size_t len) {
+  uint64_t trace = TraceBegin();
+  uint64_t start = StatsNow();
   msync(addr, len, MS_SYNC);
+  StatsAdd(STATS_MSYNC_CALLS, 1);
+  StatsAdd(STATS_MSYNC_NS, StatsNow() - start);
+  TraceEnd(TRACE_MSYNC, trace, 0, 0);
+}
+
+inline int DataSync(int fd) {
+  uint64_t trace = TraceBegin();
+  uint64_t start = StatsNow();
+  int result = fdatasync(fd);
+  StatsAdd(STATS_FDATASYNC_CALLS, 1);
+  StatsAdd(STATS_FDATASYNC_NS, StatsNow() - start);
+  TraceEnd(TRACE_FDATASYNC, trace, 0, 0);
+  return result;
 }
 
 #endif  // MEMORY_SYNC_H
@@ -7,17 +7,41 @@
 #include <cstdint>
 #include <iostream>
 #include <limits>
+#include <vector>
 
 #include <sys/types.h>
 
+#include "checksum.h"
+#include "node_inner.hpp"
+#include "node_search.hpp"
 
 
 
-template <std::size_t KeysCount>
+
+/*
+ * Node -
+ * page of B-link tree: sorted keys with child (or record) pointers,
+ * link to right sibling and high key.
+ * Leaves keep (key, record) pairs in keys_/ptrs_; inner nodes use
+ * the same bytes in one of compressed layouts (node_inner.hpp),
+ * so they hold more children than leaf holds entries.
+ *
+ * @KeysCount: order; leaf holds up to 2*KeysCount entries
+ *   (see KeysPerPage for order that fills whole pages).
+ * @Key: unsigned key type; its maximum is reserved as sentinel.
+ * @Ptr: child/record pointer type; 0 is null.
+ * @Search: intra-node search kernel (node_search.hpp).
+*/
+template <std::size_t KeysCount,
+          typename Key = std::uint64_t,
+          typename Ptr = off_t,
+          typename Search = DefaultSearch>
 class __attribute__((packed)) Node {
+public:
+  using KeyType = Key;
+  using PtrType = Ptr;
+
 private:
-  using KeyType = std::uint64_t;
-  using PtrType = off_t;
 
   // +1 for insertion in unsafe node
   KeyType keys_[2 * KeysCount + 1];
@@ -28,6 +52,10 @@ private:
   PtrType link_ptr_{0};
   // Pointer to right sibling.
 
+  KeyType high_key_{0};
+  // Upper bound (exclusive) of keys that belong to this node;
+  // keys >= high_key_ are reached through link_ptr_.
+
   std::uint32_t level_{0};
   // Leafs have level_ 0;
   // root has maximum level_.
@@ -36,17 +64,59 @@ private:
   // flags' bits:
   // 0: Node is leaf
   // 1: Node is root
+  // 2: Node is dead: merged into node at link_ptr_ (see Absorb, Collapse)
+
+  std::uint32_t version_{0};
+  // Seqlock word: odd while node is being modified.
+  // Bumped by every modification of shared node.
+
+  std::uint32_t layout_{kPlainLayout};
+  // InnerLayout of inner node's entries.
+
+  KeyType low_key_{0};
+  // Lower bound (inclusive) of keys that belong to this node
+  // when it was created; inner node's separators are encoded against it.
+
+  std::uint64_t stamp_{0};
+  // Epoch this version of node was written at (see BLinkTree::Snapshot);
+  // nodes written while no snapshot was open keep the old one.
+
+  std::uint64_t older_{0};
+  // Offset of the version it replaced in '<tree>.versions', or 0.
+
+  std::uint32_t checksum_{0};
+  // CRC32C of everything above but version_, as of the last time
+  // node was logged (see UpdateChecksum).
 
   constexpr static std::size_t CSize = sizeof(keys_) + sizeof(ptrs_)
-    + sizeof(arr_size_) + sizeof(link_ptr_) + sizeof(level_) + sizeof(flags_);
+    + sizeof(arr_size_) + sizeof(link_ptr_) + sizeof(high_key_)
+    + sizeof(level_) + sizeof(flags_) + sizeof(version_) + sizeof(layout_)
+    + sizeof(low_key_) + sizeof(stamp_) + sizeof(older_)
+    + sizeof(checksum_);
   constexpr static std::size_t PagesCount = (CSize - 1) / 4096 + 1;
   constexpr static std::size_t PadSize = PagesCount * 4096 - CSize;
 
   char pad[PadSize];
   
-  constexpr static std::size_t kInfValue = std::numeric_limits<std::size_t>::max();
+  constexpr static KeyType kInfValue = std::numeric_limits<KeyType>::max();
+
+  constexpr static std::size_t BodySize = sizeof(keys_) + sizeof(ptrs_);
+  // Separators and page numbers are narrower than keys and pointers
+  constexpr static bool kCompressed =
+    sizeof(KeyType) == sizeof(std::uint64_t) && sizeof(PtrType) == sizeof(std::uint64_t);
+
+  using PlainFormat = InnerFormat<KeyType, PtrType, KeyType, PtrType>;
+  using WideFormat = InnerFormat<KeyType, PtrType, std::uint64_t, std::uint32_t>;
+  using NarrowFormat = InnerFormat<KeyType, PtrType, std::uint32_t, std::uint32_t>;
 
 public:
+  constexpr static std::size_t Capacity = 2 * KeysCount + 1;
+  // Bytes of node that carry data; the rest of its pages is padding.
+  constexpr static std::size_t ContentSize = CSize;
+  // Bytes of node besides its entries.
+  constexpr static std::size_t HeaderSize
+    = CSize - Capacity * (sizeof(KeyType) + sizeof(PtrType));
+
   Node() = default;
   Node& operator=(const Node&) = default;
   Node(const Node&) = default;
@@ -55,6 +125,11 @@ public:
 
   void InitRoot();
 
+  void InitEmpty(std::uint32_t level, KeyType low_key = 0);
+  void Append(KeyType key, PtrType ptr);
+  void Seal(PtrType link_ptr, KeyType high_key);
+  void MarkRoot();
+
   auto/*PtrType*/ ScanNodeFor(KeyType key) const;
   void Insert(KeyType key, PtrType record_ptr);
   bool Remove(KeyType key);
@@ -64,51 +139,206 @@ public:
                      Node* right_son, PtrType right_son_ptr,
                      PtrType current_ptr);
 
+  std::size_t Purge();
+  bool CanAbsorb(const Node* right) const;
+  void Absorb(Node* right, PtrType this_ptr);
+  void RemoveChild(std::size_t i);
+  void Collapse(PtrType child_ptr);
+  void MoveTo(PtrType new_ptr);
+  void Relink(PtrType link_ptr);
+  void SetIthPtr(std::size_t i, PtrType ptr);
+
+  void Retire(PtrType next, std::uint64_t stamp);
+  auto/*PtrType*/ RetiredNext() const;
+  std::uint64_t RetiredStamp() const;
+
+  void Restamp(std::uint64_t stamp, std::uint64_t older);
+  std::uint64_t Stamp() const;
+  std::uint64_t Older() const;
+
+  void UpdateChecksum();
+  bool ChecksumValid() const;
+  const char* Check(KeyType low) const;
+  void Entries(std::vector<KeyType>& bounds,
+               std::vector<PtrType>& children) const;
+
   bool Contains(KeyType key) const;
   bool IsWithin(KeyType key) const;
+  bool ShouldMoveRight(KeyType key) const;
   auto/*PtrType*/ GetRecordByKey(KeyType key) const;
+  std::size_t CopyRange(KeyType lo, KeyType hi,
+                        KeyType* keys, PtrType* ptrs) const;
 
   auto/*KeyType*/ GetMaxKey() const;
   auto/*KeyType*/ GetMinKey() const;
+  auto/*KeyType*/ HighKey() const;
+
+  std::uint32_t ReadBegin() const;
+  bool ReadValidate(std::uint32_t version) const;
 
   bool IsLeaf() const;
   bool IsInner() const;
   bool IsRoot() const;
   bool IsSafe() const;
+  bool IsDead() const;
 
   auto/*PtrType*/ LinkPointer() const;
   std::uint32_t Level() const;
 
   std::size_t Size() const;
+  std::size_t LiveSize() const;
+  std::size_t MaxSize() const;
 
   void PrintAll() const;
   auto/*PtrType*/ GetIthPtr(size_t i) const;
 
+private:
+  void WriteBegin();
+  void WriteEnd();
+
+  void DoRearrange(Node* new_node, PtrType new_node_ptr);
+  void MakeDead(PtrType link_ptr);
+
+  std::size_t LowerBound(KeyType key) const;
+  std::size_t UpperBound(KeyType key) const;
+
+  bool IsLive(std::size_t i) const;
+  std::uint32_t ComputeChecksum() const;
+
+  char* Body() const;
+  template <typename Visitor>
+  decltype(auto) VisitLayout(Visitor visitor) const;
+  static std::uint32_t LayoutFor(KeyType low, KeyType high);
+  static std::size_t MaxSizeOf(std::uint32_t layout);
+
+  void DecodeInner(std::vector<KeyType>& seps,
+                   std::vector<PtrType>& children) const;
+  void EncodeInner(KeyType low, KeyType high,
+                   const KeyType* seps, const PtrType* children,
+                   std::size_t count);
 };
 
 
-template <std::size_t KeysCount>
-void Node<KeysCount>::InitRoot() {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::InitRoot() {
   arr_size_ = 1;
   keys_[0] = kInfValue;
   ptrs_[0] = 0;
 
   link_ptr_ = 0;
+  high_key_ = kInfValue;
+  low_key_ = 0;
   level_ = 0;
   flags_ = 0b11;
+  layout_ = kPlainLayout;
+  stamp_ = 0;
+  older_ = 0;
 }
 
 
 /*
- *
+ * InitEmpty, Append, Seal, MarkRoot -
+ * build node from already sorted entries (bulk loading).
+ * Node is not shared yet, so no locks and versions are involved.
+ * Inner node is appended (child's high key, child) pairs in wide layout
+ * (up to MaxSize() of them) and gets its final layout when sealed;
+ * the last key is its high key.
 */
-template <std::size_t KeysCount>
-auto Node<KeysCount>::ScanNodeFor(KeyType key) const {
-  auto begin = keys_;
-  auto end = begin + arr_size_;
-  auto pos = std::upper_bound(begin, end, key);
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::InitEmpty(std::uint32_t level,
+                                                  KeyType low_key) {
+  arr_size_ = 0;
+  link_ptr_ = 0;
+  high_key_ = kInfValue;
+  low_key_ = low_key;
+  level_ = level;
+  flags_ = level == 0 ? 0b1 : 0b0;
+  version_ = 0;
+  stamp_ = 0;
+  older_ = 0;
+  /* Appended keys end with the high key, so they may not fit into
+   * narrow layout even if fences do: it is chosen by Seal */
+  layout_ = level == 0 || !kCompressed ? kPlainLayout : kWideLayout;
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Append(KeyType key, PtrType ptr) {
+  assert(arr_size_ < MaxSize() + 1 && "Append: Node is full!");
+
+  if (!IsLeaf()) {
+    VisitLayout([&]<typename Format>(Format) {
+      auto seps = Format::Seps(Body());
+      assert((arr_size_ == 0 || Format::DecodeSep(seps[arr_size_ - 1], low_key_) < key)
+             && "Append: keys are not sorted!");
+      seps[arr_size_] = Format::EncodeSep(key, low_key_);
+      Format::Children(Body(), BodySize)[arr_size_] = Format::EncodeChild(ptr);
+    });
+    arr_size_++;
+    return;
+  }
+
+  assert((arr_size_ == 0 || keys_[arr_size_ - 1] < key)
+         && "Append: keys are not sorted!");
+
+  keys_[arr_size_] = key;
+  ptrs_[arr_size_] = ptr;
+  arr_size_++;
+}
 
-  return pos == end ? LinkPointer() : ptrs_[pos - begin];
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Seal(PtrType link_ptr, KeyType high_key) {
+  link_ptr_ = link_ptr;
+
+  if (!IsLeaf()) {
+    std::vector<KeyType> seps;
+    std::vector<PtrType> children;
+    DecodeInner(seps, children);
+    EncodeInner(low_key_, high_key, seps.data(), children.data(),
+                children.size());
+    return;
+  }
+
+  high_key_ = high_key;
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::MarkRoot() {
+  /* Also makes root of the only child of collapsed root,
+   * which is shared: change must be seen by its version */
+  WriteBegin();
+  flags_ |= 0b10;
+  WriteEnd();
+}
+
+
+/*
+ * ScanNodeFor -
+ * child of inner node where 'key' belongs,
+ * or right sibling if key is not below high key.
+ * Separators are searched in their encoded form.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+auto Node<KeysCount, Key, Ptr, Search>::ScanNodeFor(KeyType key) const {
+  if (IsLeaf()) [[unlikely]] {
+    auto begin = keys_;
+    auto end = begin + arr_size_;
+    auto pos = begin + UpperBound(key);
+
+    return pos == end ? LinkPointer() : ptrs_[pos - begin];
+  }
+
+  return VisitLayout([&]<typename Format>(Format) -> PtrType {
+    /* May be read without lock (see ReadBegin):
+     * never trust arr_size_ beyond the body. */
+    std::size_t size = std::min(arr_size_, Format::Capacity(BodySize));
+    if (size == 0 || !IsWithin(key)) {
+      return LinkPointer();
+    }
+    std::size_t pos = Format::template UpperRank<Search>(
+      Body(), size - 1, low_key_, key);
+
+    return Format::DecodeChild(Format::Children(Body(), BodySize)[pos]);
+  });
 }
 
 
@@ -116,17 +346,50 @@ auto Node<KeysCount>::ScanNodeFor(KeyType key) const {
 /*
  *
 */
-template <std::size_t KeysCount>
-void Node<KeysCount>::Insert(KeyType key, PtrType record_ptr) {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Insert(KeyType key, PtrType record_ptr) {
   /* Node MUST be under Write Lock */
+  WriteBegin();
+
+  if (!IsLeaf()) {
+    /* Separator 'key' bounds child it was split from,
+     * new child 'record_ptr' takes next slot. */
+    assert(key >= low_key_ && key < high_key_
+           && "Insert: separator is out of node's fences");
+    VisitLayout([&]<typename Format>(Format) {
+      auto seps = Format::Seps(Body());
+      auto children = Format::Children(Body(), BodySize);
+      std::size_t count = arr_size_ - 1;
+      std::size_t pos = Format::template UpperRank<Search>(
+        Body(), count, low_key_, key);
+
+      std::copy_backward(seps + pos, seps + count, seps + count + 1);
+      std::copy_backward(children + pos + 1, children + arr_size_,
+                         children + arr_size_ + 1);
+      seps[pos] = Format::EncodeSep(key, low_key_);
+      children[pos + 1] = Format::EncodeChild(record_ptr);
+    });
+    arr_size_++;
+
+    WriteEnd();
+    return;
+  }
+
   auto begin = keys_;
   auto end = begin + arr_size_;
-  auto pos = std::upper_bound(begin, end, key);
+  auto pos = begin + LowerBound(key);
+
+  if (pos != end && *pos == key) {
+    /* Key was removed earlier: reuse its slot */
+    ptrs_[pos - begin] = record_ptr;
+    WriteEnd();
+    return;
+  }
 
   auto ptrs_begin = ptrs_;
   auto ptrs_end = ptrs_begin + arr_size_;
   auto ptrs_pos = ptrs_begin + (pos - begin);
-  
+
   if (pos < end) {
     /* Place for new element */
     std::copy_backward(pos, end, end + 1);
@@ -136,20 +399,24 @@ void Node<KeysCount>::Insert(KeyType key, PtrType record_ptr) {
   *pos = key;
   *ptrs_pos = record_ptr;
   arr_size_++;
+
+  WriteEnd();
 }
 
 
 /*
  *
 */
-template <std::size_t KeysCount>
-bool Node<KeysCount>::Remove(KeyType key) {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+bool Node<KeysCount, Key, Ptr, Search>::Remove(KeyType key) {
   auto begin = keys_;
   auto end = begin + arr_size_;
-  auto pos = std::lower_bound(begin, end, key);
+  auto pos = begin + LowerBound(key);
 
-  if (pos != end && *pos == key) {
+  if (pos != end && *pos == key && ptrs_[pos - begin] != 0) {
+    WriteBegin();
     ptrs_[pos - begin] = 0;
+    WriteEnd();
     return true;
   }
   return false;
@@ -159,40 +426,75 @@ bool Node<KeysCount>::Remove(KeyType key) {
 /*
  *
 */
-template <std::size_t KeysCount>
-void Node<KeysCount>::Rearrange(Node* new_node, PtrType new_node_ptr) {
-  /* Our node is unsafe, i.e. now (after insertion)
-   * contains (2*KeysCount + 1) keys and ptrs.
-   * new_node is newly allocated node.
-   * [0, ..., KeysCount-1] -> this;
-   * [KeysCount, ..., 2*KeysCount] -> new_node. */
-  std::copy(
-    keys_ + KeysCount,
-    keys_ + arr_size_,
-    new_node->keys_
-  );
-  std::copy(
-    ptrs_ + KeysCount,
-    ptrs_ + arr_size_,
-    new_node->ptrs_
-  );
-
-  new_node->arr_size_ = KeysCount + 1;
-  arr_size_ = KeysCount;
-  
-  new_node->link_ptr_ = link_ptr_;
-  link_ptr_ = new_node_ptr;
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Rearrange(Node* new_node, PtrType new_node_ptr) {
+  WriteBegin();
+  DoRearrange(new_node, new_node_ptr);
+  WriteEnd();
+}
 
+
+/*
+ * DoRearrange -
+ * split node; its HighKey() becomes separator for parent.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::DoRearrange(Node* new_node, PtrType new_node_ptr) {
   new_node->level_ = level_;
   new_node->flags_ = flags_;
+
+  if (!IsLeaf()) {
+    /* Halves get fences of their own,
+     * so they may be kept in narrower layout than the whole. */
+    std::vector<KeyType> seps;
+    std::vector<PtrType> children;
+    DecodeInner(seps, children);
+
+    std::size_t left = children.size() / 2;
+    KeyType separator = seps[left - 1];
+    new_node->EncodeInner(separator, high_key_,
+                          seps.data() + left, children.data() + left,
+                          children.size() - left);
+    EncodeInner(low_key_, separator, seps.data(), children.data(), left);
+  } else {
+    /* Our node is unsafe, i.e. now (after insertion)
+     * contains (2*KeysCount + 1) keys and ptrs.
+     * new_node is newly allocated node.
+     * [0, ..., KeysCount-1] -> this;
+     * [KeysCount, ..., 2*KeysCount] -> new_node. */
+    std::copy(
+      keys_ + KeysCount,
+      keys_ + arr_size_,
+      new_node->keys_
+    );
+    std::copy(
+      ptrs_ + KeysCount,
+      ptrs_ + arr_size_,
+      new_node->ptrs_
+    );
+
+    new_node->arr_size_ = KeysCount + 1;
+    arr_size_ = KeysCount;
+
+    /* Left part ends right before new_node's first key */
+    new_node->high_key_ = high_key_;
+    new_node->low_key_ = new_node->keys_[0];
+    new_node->layout_ = kPlainLayout;
+    high_key_ = new_node->keys_[0];
+  }
+
+  /* new_node is complete before it becomes reachable */
+  new_node->link_ptr_ = link_ptr_;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  link_ptr_ = new_node_ptr;
 }
 
 
 /*
  *
 */
-template <std::size_t KeysCount>
-void Node<KeysCount>::RearrangeRoot(
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::RearrangeRoot(
   Node* new_root, PtrType new_root_ptr,
   Node* right_son, PtrType right_son_ptr,
   PtrType current_ptr) {
@@ -201,30 +503,381 @@ void Node<KeysCount>::RearrangeRoot(
 
   assert(IsRoot() && "RearrangeRoot: called for non root");
 
+  WriteBegin();
+
   flags_ ^= 0b10; // no longer the root
   
-  Rearrange(right_son, right_son_ptr); // split old root
+  DoRearrange(right_son, right_son_ptr); // split old root
 
-  new_root->arr_size_ = 2;
   new_root->link_ptr_ = 0;
   new_root->level_ = level_ + 1;
   new_root->flags_ = 0b10; // indicating non-leaf root
 
-  new_root->keys_[0] = right_son->GetMinKey();
-  new_root->keys_[1] = kInfValue;
-  new_root->ptrs_[0] = current_ptr;
-  new_root->ptrs_[1] = right_son_ptr;
+  KeyType separator = high_key_;
+  PtrType children[] = {current_ptr, right_son_ptr};
+  new_root->EncodeInner(low_key_, kInfValue, &separator, children, 2);
+
+  WriteEnd();
 }
 
 
 /*
+ * Purge -
+ * drop removed entries of leaf (right-most leaf keeps its sentinel).
  *
+ * Returns:
+ * @count: number of dropped entries.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+std::size_t Node<KeysCount, Key, Ptr, Search>::Purge() {
+  /* Node MUST be under Write Lock */
+  if (LiveSize() == arr_size_) {
+    return 0;
+  }
+
+  WriteBegin();
+
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < arr_size_; ++i) {
+    if (IsLive(i)) {
+      keys_[count] = keys_[i];
+      ptrs_[count] = ptrs_[i];
+      ++count;
+    }
+  }
+  std::size_t purged = arr_size_ - count;
+  arr_size_ = count;
+
+  WriteEnd();
+
+  return purged;
+}
+
+
+/*
+ * CanAbsorb -
+ * entries of this node and its right sibling fit into one node
+ * with a quarter of its room left for inserts.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+bool Node<KeysCount, Key, Ptr, Search>::CanAbsorb(const Node* right) const {
+  std::size_t limit = IsLeaf()
+    ? MaxSize() : MaxSizeOf(LayoutFor(low_key_, right->high_key_));
+  return LiveSize() + right->LiveSize() <= 3 * limit / 4;
+}
+
+
+/*
+ * Absorb -
+ * merge right sibling into this node; right one becomes dead.
+ * Dead node sends everybody who still comes to it back here,
+ * and this node now covers its whole range, so readers that
+ * took pointer to it before the merge find their keys.
+ * Both nodes MUST be under Write Lock, this->LinkPointer() == right,
+ * and their live entries MUST fit into one safe node.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Absorb(Node* right, PtrType this_ptr) {
+  assert(CanAbsorb(right) && "Absorb: entries do not fit!");
+
+  Purge();
+
+  WriteBegin();
+  right->WriteBegin();
+
+  if (!IsLeaf()) {
+    /* Our high key separates our children from right's ones;
+     * merged fences may need wider layout. */
+    std::vector<KeyType> seps;
+    std::vector<PtrType> children;
+    std::vector<KeyType> right_seps;
+    std::vector<PtrType> right_children;
+    DecodeInner(seps, children);
+    right->DecodeInner(right_seps, right_children);
+
+    seps.push_back(high_key_);
+    seps.insert(seps.end(), right_seps.begin(), right_seps.end());
+    children.insert(children.end(),
+                    right_children.begin(), right_children.end());
+    EncodeInner(low_key_, right->high_key_, seps.data(), children.data(),
+                children.size());
+  } else {
+    for (std::size_t i = 0; i < right->arr_size_; ++i) {
+      if (right->IsLive(i)) {
+        keys_[arr_size_] = right->keys_[i];
+        ptrs_[arr_size_] = right->ptrs_[i];
+        ++arr_size_;
+      }
+    }
+    high_key_ = right->high_key_;
+  }
+  link_ptr_ = right->link_ptr_;
+
+  right->MakeDead(this_ptr);
+
+  right->WriteEnd();
+  WriteEnd();
+}
+
+
+/*
+ * RemoveChild -
+ * forget i-th child of inner node, it was merged into (i-1)-th one;
+ * (i-1)-th child now covers range of both.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::RemoveChild(std::size_t i) {
+  /* Node MUST be under Write Lock */
+  assert(i > 0 && i < arr_size_ && "RemoveChild: no left sibling!");
+
+  WriteBegin();
+
+  /* Separator between the two children goes away with the right one */
+  VisitLayout([&]<typename Format>(Format) {
+    auto seps = Format::Seps(Body());
+    auto children = Format::Children(Body(), BodySize);
+    std::copy(seps + i, seps + arr_size_ - 1, seps + i - 1);
+    std::copy(children + i + 1, children + arr_size_, children + i);
+  });
+  --arr_size_;
+
+  WriteEnd();
+}
+
+
+/*
+ * Collapse -
+ * root with the only child gives its role away;
+ * tree becomes one level lower.
+ * Both nodes MUST be under Write Lock.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Collapse(PtrType child_ptr) {
+  assert(IsRoot() && arr_size_ == 1 && "Collapse: not a root of one child");
+
+  WriteBegin();
+  MakeDead(child_ptr);
+  WriteEnd();
+}
+
+
+/*
+ * MoveTo, Relink, SetIthPtr -
+ * node, its right sibling, or a child or record it points to
+ * has been copied to another place (see BLinkTree::Defragment).
+ * Moved node becomes dead with link to its copy, like the node
+ * merged away, so readers that still reach it go on to the copy.
+ * Node MUST be under Write Lock.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::MoveTo(PtrType new_ptr) {
+  WriteBegin();
+  MakeDead(new_ptr);
+  WriteEnd();
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Relink(PtrType link_ptr) {
+  WriteBegin();
+  link_ptr_ = link_ptr;
+  WriteEnd();
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::SetIthPtr(std::size_t i, PtrType ptr) {
+  assert(i < arr_size_ && "SetIthPtr: no such entry!");
+
+  WriteBegin();
+  if (IsLeaf()) {
+    ptrs_[i] = ptr;
+  } else {
+    VisitLayout([&]<typename Format>(Format) {
+      Format::Children(Body(), BodySize)[i] = Format::EncodeChild(ptr);
+    });
+  }
+  WriteEnd();
+}
+
+
+/*
+ * Retire, RetiredNext, RetiredStamp -
+ * dead node waits for reuse in list of retired nodes;
+ * its first entry keeps next element of list and reclamation stamp.
 */
-template <std::size_t KeysCount>
-bool Node<KeysCount>::Contains(KeyType key) const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Retire(PtrType next, std::uint64_t stamp) {
+  /* Node MUST be under Write Lock */
+  assert(IsDead() && "Retire: node is alive!");
+
+  WriteBegin();
+  /* Stamp must fit: trees with narrow keys wrap after 2^32 retirements */
+  keys_[0] = static_cast<KeyType>(stamp);
+  ptrs_[0] = next;
+  WriteEnd();
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline auto Node<KeysCount, Key, Ptr, Search>::RetiredNext() const {
+  return ptrs_[0];
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::uint64_t Node<KeysCount, Key, Ptr, Search>::RetiredStamp() const {
+  return keys_[0];
+}
+
+
+/*
+ * Restamp, Stamp, Older -
+ * epoch node is being written at and offset of the version it
+ * replaces (see BLinkTree::Preserve). Node MUST be under Write Lock.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Restamp(std::uint64_t stamp,
+                                                std::uint64_t older) {
+  WriteBegin();
+  stamp_ = stamp;
+  older_ = older;
+  WriteEnd();
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::uint64_t Node<KeysCount, Key, Ptr, Search>::Stamp() const {
+  return stamp_;
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::uint64_t Node<KeysCount, Key, Ptr, Search>::Older() const {
+  return older_;
+}
+
+
+/*
+ * UpdateChecksum, ChecksumValid -
+ * CRC32C of node's content. Seqlock word is left out: it changes
+ * on every lock of the node, content does not. Checksum is set
+ * whenever node goes to the log (see BLinkTree::LogNodes) or to a
+ * new file, so it is valid in every node at rest.
+ * Node MUST be under Write Lock for UpdateChecksum.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline void Node<KeysCount, Key, Ptr, Search>::UpdateChecksum() {
+  checksum_ = ComputeChecksum();
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::ChecksumValid() const {
+  return checksum_ == ComputeChecksum();
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+std::uint32_t Node<KeysCount, Key, Ptr, Search>::ComputeChecksum() const {
+  constexpr std::size_t version_at = offsetof(Node, version_);
+  constexpr std::size_t checksum_at = offsetof(Node, checksum_);
+  auto bytes = reinterpret_cast<const char*>(this);
+
+  std::uint32_t crc = Crc32c(0, bytes, version_at);
+  return Crc32c(crc, bytes + version_at + sizeof(version_),
+                checksum_at - version_at - sizeof(version_));
+}
+
+
+/*
+ * Check -
+ * look for what is wrong with node read from file (not dead one):
+ * its flags and level, order of keys and their fences.
+ * 'low' is the lower bound of keys node is reached for,
+ * i.e. the key its parent or left sibling hands over at.
+ *
+ * Returns:
+ * @problem: description of the first problem found, or nullptr.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+const char* Node<KeysCount, Key, Ptr, Search>::Check(KeyType low) const {
+  if ((flags_ & ~0b111u) != 0) {
+    return "unknown flags";
+  }
+  if (IsLeaf() != (level_ == 0)) {
+    return "leaf flag does not match level";
+  }
+  if (high_key_ < low) {
+    return "high key is below low fence";
+  }
+
+  if (IsLeaf()) {
+    if (arr_size_ > MaxSize()) {
+      return "too many entries";
+    }
+    for (std::size_t i = 0; i < arr_size_; ++i) {
+      if (i > 0 && keys_[i] <= keys_[i - 1]) {
+        return "keys are not sorted";
+      }
+      /* Right-most leaf keeps the sentinel */
+      bool sentinel = keys_[i] == kInfValue && high_key_ == kInfValue
+        && ptrs_[i] == 0;
+      if (!sentinel && (keys_[i] < low || keys_[i] >= high_key_)) {
+        return "key is out of fences";
+      }
+    }
+    return nullptr;
+  }
+
+  if (kCompressed ? layout_ > kNarrowLayout : layout_ != kPlainLayout) {
+    return "unknown layout";
+  }
+  if (arr_size_ == 0 || arr_size_ > MaxSizeOf(layout_)) {
+    return "bad number of children";
+  }
+  std::vector<KeyType> seps;
+  std::vector<PtrType> children;
+  DecodeInner(seps, children);
+  KeyType prev = low;
+  for (KeyType sep : seps) {
+    if (sep <= prev || sep >= high_key_) {
+      return "separators are not sorted or out of fences";
+    }
+    prev = sep;
+  }
+  return nullptr;
+}
+
+
+/*
+ * Entries -
+ * children of inner node with upper bounds of their ranges;
+ * the last one is node's high key.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::Entries(
+  std::vector<KeyType>& bounds, std::vector<PtrType>& children) const {
+  DecodeInner(bounds, children);
+  bounds.push_back(high_key_);
+}
+
+
+/*
+ * MakeDead -
+ * empty node whose range is covered by 'link_ptr' now.
+ * High key 0 makes every key move along the link,
+ * so readers need no special case.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::MakeDead(PtrType link_ptr) {
+  arr_size_ = 0;
+  high_key_ = 0;
+  link_ptr_ = link_ptr;
+  flags_ = (flags_ & 0b1) | 0b100;
+}
+
+
+/*
+ *
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+bool Node<KeysCount, Key, Ptr, Search>::Contains(KeyType key) const {
   auto begin = keys_;
   auto end = begin + arr_size_;
-  auto pos = std::lower_bound(begin, end, key);
+  auto pos = begin + LowerBound(key);
 
   return pos != end && *pos == key
     && ptrs_[pos - begin] != 0;
@@ -234,87 +887,356 @@ bool Node<KeysCount>::Contains(KeyType key) const {
 /*
  *
 */
-template <std::size_t KeysCount>
-bool Node<KeysCount>::IsWithin(KeyType key) const {
-  return GetMinKey() <= key && key < GetMaxKey();
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+bool Node<KeysCount, Key, Ptr, Search>::IsWithin(KeyType key) const {
+  return key < high_key_;
+}
+
+
+/*
+ * ShouldMoveRight -
+ * key belongs to some node to the right of this one.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::ShouldMoveRight(KeyType key) const {
+  return link_ptr_ != 0 && !IsWithin(key);
 }
 
 
 /*
  *
 */
-template <std::size_t KeysCount>
-auto Node<KeysCount>::GetRecordByKey(KeyType key) const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+auto Node<KeysCount, Key, Ptr, Search>::GetRecordByKey(KeyType key) const {
   auto begin = keys_;
   auto end = begin + arr_size_;
-  auto pos = std::upper_bound(begin, end, key);
+  auto pos = begin + LowerBound(key);
+
+  return pos != end && *pos == key ? ptrs_[pos - begin] : PtrType{0};
+}
+
+
+/*
+ * CopyRange -
+ * copy leaf entries with lo <= key < hi,
+ * skipping removed ones (ptr == 0).
+ *
+ * @keys, @ptrs: output arrays of at least Capacity elements.
+ *
+ * Returns:
+ * @count: number of copied entries.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+std::size_t Node<KeysCount, Key, Ptr, Search>::CopyRange(KeyType lo, KeyType hi,
+                                       KeyType* keys, PtrType* ptrs) const {
+  /* May be called without lock (see ReadBegin):
+   * never trust arr_size_ beyond array bounds. */
+  std::size_t size = std::min(arr_size_, Capacity);
+  auto begin = keys_;
+  auto pos = begin + Search::template Rank<false>(begin, size, lo);
+
+  std::size_t count = 0;
+  for (std::size_t i = pos - begin; i < size && keys_[i] < hi; ++i) {
+    if (ptrs_[i] != 0) {
+      keys[count] = keys_[i];
+      ptrs[count] = ptrs_[i];
+      ++count;
+    }
+  }
 
-  return ptrs_[pos - begin];
+  return count;
 }
 
-template <std::size_t KeysCount>
-inline auto Node<KeysCount>::GetMaxKey() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline auto Node<KeysCount, Key, Ptr, Search>::GetMaxKey() const {
   assert(arr_size_ > 0 && "GetMaxKey: Node is empty!");
   return keys_[arr_size_ - 1];
 }
 
-template <std::size_t KeysCount>
-inline auto Node<KeysCount>::GetMinKey() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline auto Node<KeysCount, Key, Ptr, Search>::GetMinKey() const {
   assert(arr_size_ > 0 && "GetMinKey: Node is empty!");
   return keys_[0];
 }
 
-template <std::size_t KeysCount>
-inline bool Node<KeysCount>::IsLeaf() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline auto Node<KeysCount, Key, Ptr, Search>::HighKey() const {
+  return high_key_;
+}
+
+
+/*
+ * ReadBegin -
+ * start optimistic (lock free) read of node.
+ *
+ * Returns:
+ * @version: value to pass to ReadValidate;
+ *   odd value means node is being modified right now.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::uint32_t Node<KeysCount, Key, Ptr, Search>::ReadBegin() const {
+  return __atomic_load_n(&version_, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * ReadValidate -
+ * finish optimistic read of node.
+ *
+ * Returns:
+ * @bool: true if nothing was changed since ReadBegin,
+ *   so everything read in between is consistent.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::ReadValidate(std::uint32_t version) const {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return !(version & 1)
+    && __atomic_load_n(&version_, __ATOMIC_RELAXED) == version;
+}
+
+
+/*
+ * LowerBound, UpperBound -
+ * index of the first key >= 'key' (> 'key'), found by Search kernel.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::size_t Node<KeysCount, Key, Ptr, Search>::LowerBound(KeyType key) const {
+  return Search::template Rank<false>(keys_, arr_size_, key);
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::size_t Node<KeysCount, Key, Ptr, Search>::UpperBound(KeyType key) const {
+  return Search::template Rank<true>(keys_, arr_size_, key);
+}
+
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline void Node<KeysCount, Key, Ptr, Search>::WriteBegin() {
+  /* Node MUST be under Write Lock */
+  __atomic_fetch_add(&version_, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline void Node<KeysCount, Key, Ptr, Search>::WriteEnd() {
+  __atomic_fetch_add(&version_, 1, __ATOMIC_RELEASE);
+}
+
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::IsLeaf() const {
   return flags_ & 0b1;
 }
 
-template <std::size_t KeysCount>
-inline bool Node<KeysCount>::IsRoot() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::IsRoot() const {
   return flags_ & 0b10;
 }
 
-template <std::size_t KeysCount>
-inline bool Node<KeysCount>::IsInner() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::IsInner() const {
   return !(IsLeaf() || IsRoot());
 }
 
-template <std::size_t KeysCount>
-inline bool Node<KeysCount>::IsSafe() const {
-  return arr_size_ <= 2 * KeysCount;
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::IsSafe() const {
+  return arr_size_ <= MaxSize();
 }
 
-template <std::size_t KeysCount>
-inline auto Node<KeysCount>::LinkPointer() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::IsDead() const {
+  return flags_ & 0b100;
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline auto Node<KeysCount, Key, Ptr, Search>::LinkPointer() const {
   return link_ptr_;
 }
 
-template <std::size_t KeysCount>
-inline std::uint32_t Node<KeysCount>::Level() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::uint32_t Node<KeysCount, Key, Ptr, Search>::Level() const {
   return level_;
 }
 
-template <std::size_t KeysCount>
-std::size_t Node<KeysCount>::Size() const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+std::size_t Node<KeysCount, Key, Ptr, Search>::Size() const {
   return arr_size_;
 }
 
-template <std::size_t KeysCount>
-void Node<KeysCount>::PrintAll() const {
+/*
+ * LiveSize -
+ * number of entries left after Purge.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+std::size_t Node<KeysCount, Key, Ptr, Search>::LiveSize() const {
+  if (!IsLeaf()) {
+    return arr_size_;
+  }
+  std::size_t size = 0;
+  for (std::size_t i = 0; i < arr_size_; ++i) {
+    size += IsLive(i);
+  }
+  return size;
+}
+
+/*
+ * MaxSize -
+ * number of entries (children) node holds while being safe;
+ * one more makes it split.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline std::size_t Node<KeysCount, Key, Ptr, Search>::MaxSize() const {
+  return IsLeaf() ? 2 * KeysCount : MaxSizeOf(layout_);
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline bool Node<KeysCount, Key, Ptr, Search>::IsLive(std::size_t i) const {
+  /* Leaf only */
+  return ptrs_[i] != 0 || keys_[i] == kInfValue;
+}
+
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+inline char* Node<KeysCount, Key, Ptr, Search>::Body() const {
+  return reinterpret_cast<char*>(const_cast<KeyType*>(keys_));
+}
+
+
+/*
+ * VisitLayout -
+ * call 'visitor(Format{})' with InnerFormat of this inner node's layout.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+template <typename Visitor>
+inline decltype(auto) Node<KeysCount, Key, Ptr, Search>::VisitLayout(
+  Visitor visitor) const {
+  if constexpr (!kCompressed) {
+    return visitor(PlainFormat{});
+  } else {
+    if (layout_ == kNarrowLayout) {
+      return visitor(NarrowFormat{});
+    }
+    return visitor(WideFormat{});
+  }
+}
+
+
+/*
+ * LayoutFor -
+ * narrowest layout of inner node with fences [low, high).
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+std::uint32_t Node<KeysCount, Key, Ptr, Search>::LayoutFor(KeyType low,
+                                                           KeyType high) {
+  if constexpr (!kCompressed) {
+    return kPlainLayout;
+  } else {
+    return NarrowFormat::Fits(low, high) ? kNarrowLayout : kWideLayout;
+  }
+}
+
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+std::size_t Node<KeysCount, Key, Ptr, Search>::MaxSizeOf(std::uint32_t layout) {
+  /* One slot stays free for the insertion that makes node unsafe */
+  if constexpr (!kCompressed) {
+    return PlainFormat::Capacity(BodySize) - 1;
+  } else {
+    return layout == kNarrowLayout
+      ? NarrowFormat::Capacity(BodySize) - 1
+      : WideFormat::Capacity(BodySize) - 1;
+  }
+}
+
+
+/*
+ * DecodeInner -
+ * separators (Size() - 1 of them) and children of inner node.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::DecodeInner(
+  std::vector<KeyType>& seps, std::vector<PtrType>& children) const {
+  VisitLayout([&]<typename Format>(Format) {
+    auto encoded_seps = Format::Seps(Body());
+    auto encoded_children = Format::Children(Body(), BodySize);
+
+    seps.resize(arr_size_ > 0 ? arr_size_ - 1 : 0);
+    children.resize(arr_size_);
+    for (std::size_t i = 0; i < seps.size(); ++i) {
+      seps[i] = Format::DecodeSep(encoded_seps[i], low_key_);
+    }
+    for (std::size_t i = 0; i < children.size(); ++i) {
+      children[i] = Format::DecodeChild(encoded_children[i]);
+    }
+  });
+}
+
+
+/*
+ * EncodeInner -
+ * make this inner node hold 'count' children and 'count' - 1
+ * separators between them, with fences [low, high),
+ * in the narrowest layout that fits.
+*/
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::EncodeInner(
+  KeyType low, KeyType high,
+  const KeyType* seps, const PtrType* children, std::size_t count) {
+  layout_ = LayoutFor(low, high);
+  assert(count <= MaxSizeOf(layout_) + 1 && "EncodeInner: node is full!");
+
+  low_key_ = low;
+  high_key_ = high;
+  arr_size_ = count;
+
+  VisitLayout([&]<typename Format>(Format) {
+    auto encoded_seps = Format::Seps(Body());
+    auto encoded_children = Format::Children(Body(), BodySize);
+
+    for (std::size_t i = 0; i + 1 < count; ++i) {
+      encoded_seps[i] = Format::EncodeSep(seps[i], low);
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+      encoded_children[i] = Format::EncodeChild(children[i]);
+    }
+  });
+}
+
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+void Node<KeysCount, Key, Ptr, Search>::PrintAll() const {
+  if (!IsLeaf()) {
+    /* Child i is printed with its upper bound */
+    std::vector<KeyType> seps;
+    std::vector<PtrType> children;
+    DecodeInner(seps, children);
+    seps.push_back(high_key_);
+    for (size_t i = 0; i < children.size(); ++i) {
+      std::cout << "key = " << seps[i]
+        << " ; offset = " << children[i] << "\n";
+    }
+    return;
+  }
+
   for (size_t i = 0; i < arr_size_; ++i) {
     std::cout << "key = " << keys_[i]
       << " ; offset = " << ptrs_[i] << "\n";
   }
 }
 
-template <std::size_t KeysCount>
-auto Node<KeysCount>::GetIthPtr(size_t i) const {
+template <std::size_t KeysCount, typename Key, typename Ptr, typename Search>
+auto Node<KeysCount, Key, Ptr, Search>::GetIthPtr(size_t i) const {
+  if (!IsLeaf()) {
+    return VisitLayout([&]<typename Format>(Format) {
+      return Format::DecodeChild(Format::Children(Body(), BodySize)[i]);
+    });
+  }
   return ptrs_[i];
 }
 
 // Node
-// Key: uint64_t
-// Val: off_t
+// Key: uint64_t by default
+// Val: off_t by default
 /*****************************************************
 *
 * ||p_0 k_0||---||p_1 k_1||-- ..... --||p_{2k} k_{2k}||
@@ -325,4 +1247,25 @@ auto Node<KeysCount>::GetIthPtr(size_t i) const {
 *
 *****************************************************/
 
+
+/*
+ * KeysPerPage -
+ * largest order whose node fits into 'PageSize' bytes,
+ * so node fills its page instead of being mostly padding.
+ * E.g. BLinkTree<KeysPerPage<4096>> has order 126 (252 entries).
+*/
+template <std::size_t PageSize,
+          typename Key = std::uint64_t,
+          typename Ptr = off_t>
+constexpr std::size_t KeysPerPage =
+  ((PageSize - Node<1, Key, Ptr>::HeaderSize)
+     / (sizeof(Key) + sizeof(Ptr)) - 1) / 2;
+
+static_assert(sizeof(Node<KeysPerPage<4096>>) == 4096);
+static_assert(sizeof(Node<KeysPerPage<16384>>) == 16384);
+static_assert(sizeof(Node<KeysPerPage<65536>>) == 65536);
+static_assert(sizeof(Node<KeysPerPage<2097152>>) == 2097152);
+static_assert(sizeof(Node<KeysPerPage<4096, std::uint32_t, std::uint32_t>,
+                          std::uint32_t, std::uint32_t>) == 4096);
+
 #endif  // NODE_HPP
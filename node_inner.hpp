@@ -0,0 +1,113 @@
+#ifndef NODE_INNER_HPP
+#define NODE_INNER_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+
+
+
+/*
+ * Layouts of inner nodes.
+ *
+ * Inner node with n children keeps n-1 separators: child i covers
+ * [sep[i-1], sep[i]), where sep[-1] is node's low fence and sep[n-1]
+ * is its high key (so the last separator is never stored).
+ * Separators are stored as deltas from the low fence, children as
+ * page numbers if Child is narrower than pointer. Node's entry arrays
+ * are one body for them: [Sep seps[C]] [Child children[C]],
+ * C = Capacity(body size).
+ *
+ * Node<..., uint64_t, off_t> uses
+ * - kWideLayout: 64-bit deltas, 32-bit page numbers (12 bytes per child);
+ * - kNarrowLayout: 32-bit deltas, 32-bit page numbers (8 bytes per child),
+ *   if node's fences are at most 2^32 apart.
+ * Every separator inserted later lies between the fences, so layout
+ * is only changed when fences are (split, merge, bulk loading).
+ * Nodes of other key/pointer types keep both as they are (kPlainLayout).
+*/
+enum InnerLayout : std::uint32_t {
+  kPlainLayout = 0, // also every leaf
+  kWideLayout = 1,
+  kNarrowLayout = 2
+};
+
+
+template <typename Key, typename Ptr, typename Sep, typename Child>
+struct InnerFormat {
+  using SepAlias [[gnu::may_alias]] = Sep;
+  using ChildAlias [[gnu::may_alias]] = Child;
+
+  constexpr static int kPageShift = 12; // nodes are page aligned
+
+  constexpr static std::size_t Capacity(std::size_t body_size) {
+    return body_size / (sizeof(Sep) + sizeof(Child));
+  }
+
+  /* Node with fences [low, high) can be kept in this format */
+  static bool Fits(Key low, Key high) {
+    return static_cast<Key>(high - low - 1) <= std::numeric_limits<Sep>::max();
+  }
+
+  static SepAlias* Seps(char* body) {
+    return reinterpret_cast<SepAlias*>(body);
+  }
+
+  static ChildAlias* Children(char* body, std::size_t body_size) {
+    return reinterpret_cast<ChildAlias*>(
+      body + Capacity(body_size) * sizeof(Sep));
+  }
+
+  static Sep EncodeSep(Key key, Key low) {
+    assert(key >= low && key - low <= std::numeric_limits<Sep>::max()
+           && "EncodeSep: separator is out of node's fences");
+    return static_cast<Sep>(key - low);
+  }
+
+  static Key DecodeSep(Sep sep, Key low) {
+    return low + sep;
+  }
+
+  static Child EncodeChild(Ptr ptr) {
+    if constexpr (sizeof(Child) < sizeof(Ptr)) {
+      assert(ptr % (Ptr{1} << kPageShift) == 0
+             && (ptr >> kPageShift) <= std::numeric_limits<Child>::max()
+             && "EncodeChild: node is not addressable by page number");
+      return static_cast<Child>(ptr >> kPageShift);
+    } else {
+      return static_cast<Child>(ptr);
+    }
+  }
+
+  static Ptr DecodeChild(Child child) {
+    if constexpr (sizeof(Child) < sizeof(Ptr)) {
+      return static_cast<Ptr>(child) << kPageShift;
+    } else {
+      return static_cast<Ptr>(child);
+    }
+  }
+
+  /*
+   * UpperRank -
+   * number of first 'count' separators not greater than 'key'.
+   * Key is compared in encoded form, without decoding separators.
+  */
+  template <typename Search>
+  static std::size_t UpperRank(const char* body, std::size_t count,
+                               Key low, Key key) {
+    if (key < low) {
+      return 0;
+    }
+    Key delta = key - low;
+    if (delta > std::numeric_limits<Sep>::max()) {
+      /* Beyond the fences: every separator precedes it */
+      return count;
+    }
+    return Search::template Rank<true, Sep>(
+      reinterpret_cast<const SepAlias*>(body), count, static_cast<Sep>(delta));
+  }
+};
+
+#endif  // NODE_INNER_HPP
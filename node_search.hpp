@@ -0,0 +1,267 @@
+#ifndef NODE_SEARCH_HPP
+#define NODE_SEARCH_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+
+
+
+/*
+ * Search kernels over sorted keys of a node.
+ * Node takes one of them as template parameter
+ * (Node<KeysCount, Search>); every kernel provides
+ *
+ *   template <bool Upper, typename Key>
+ *   static std::size_t Rank(const Key* keys, std::size_t size, Key key);
+ *
+ * Rank is the number of keys that come before 'key':
+ * keys < key (lower bound) or, if Upper, keys <= key (upper bound).
+ *
+ * - StdSearch: std::lower_bound / std::upper_bound;
+ * - BranchlessSearch: binary search with conditional moves,
+ *   no mispredicted branches;
+ * - Avx2Search, Avx512Search: compare whole array with the key and
+ *   count, 4 or 8 keys per instruction; caller checks CPU support;
+ * - InterpolationSearch: guesses position of uniformly distributed
+ *   keys, then finishes with BranchlessSearch;
+ * - AutoSearch: branchless halving down to one or two vectors,
+ *   then the widest compare-and-count the CPU has (detected at startup).
+ * SIMD kernels handle 64-bit unsigned keys; other keys go branchless.
+ *
+ * Default is BranchlessSearch: on bench/node_search it is never slower
+ * than the SIMD kernels for orders up to 127, and linear counting loses
+ * badly on large nodes.
+*/
+
+
+template <bool Upper, typename Key>
+inline bool Precedes(Key lhs, Key key) {
+  return Upper ? lhs <= key : lhs < key;
+}
+
+
+struct StdSearch {
+  template <bool Upper, typename Key>
+  static std::size_t Rank(const Key* keys, std::size_t size, Key key) {
+    auto pos = Upper ? std::upper_bound(keys, keys + size, key)
+                     : std::lower_bound(keys, keys + size, key);
+    return pos - keys;
+  }
+};
+
+
+struct BranchlessSearch {
+  template <bool Upper, typename Key>
+  static std::size_t Rank(const Key* keys, std::size_t size, Key key) {
+    if (size == 0) {
+      return 0;
+    }
+
+    /* Keys before 'base' precede 'key', keys from 'base + size' do not */
+    const Key* base = keys;
+    while (size > 1) {
+      std::size_t half = size / 2;
+      base += Precedes<Upper>(base[half], key) ? half : 0;
+      size -= half;
+    }
+
+    return (base - keys) + Precedes<Upper>(*base, key);
+  }
+};
+
+
+#if defined(__x86_64__)
+
+/*
+ * CountAvx2, CountAvx512 -
+ * number of 64-bit unsigned keys preceding 'key', any order.
+*/
+template <bool Upper>
+__attribute__((target("avx2,popcnt")))
+std::size_t CountAvx2(const std::uint64_t* keys, std::size_t size,
+                      std::uint64_t key) {
+  /* AVX2 compares signed numbers only: shift both sides by 2^63 */
+  const __m256i sign = _mm256_set1_epi64x(std::numeric_limits<std::int64_t>::min());
+  const __m256i pivot = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+
+  std::size_t count = 0;
+  std::size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m256i chunk = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), sign);
+    /* Upper: count keys > key and subtract */
+    __m256i mask = Upper ? _mm256_cmpgt_epi64(chunk, pivot)
+                         : _mm256_cmpgt_epi64(pivot, chunk);
+    count += std::popcount(static_cast<unsigned>(
+      _mm256_movemask_pd(_mm256_castsi256_pd(mask))));
+  }
+  if (Upper) {
+    count = i - count;
+  }
+  for (; i < size; ++i) {
+    count += Precedes<Upper>(keys[i], key);
+  }
+
+  return count;
+}
+
+template <bool Upper>
+__attribute__((target("avx512f,popcnt")))
+std::size_t CountAvx512(const std::uint64_t* keys, std::size_t size,
+                        std::uint64_t key) {
+  const __m512i pivot = _mm512_set1_epi64(key);
+
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < size; i += 8) {
+    /* Tail is loaded under mask: no read past the array */
+    __mmask8 valid = size - i >= 8 ? 0xFF : (1u << (size - i)) - 1;
+    __m512i chunk = _mm512_maskz_loadu_epi64(valid, keys + i);
+    __mmask8 mask = Upper ? _mm512_mask_cmple_epu64_mask(valid, chunk, pivot)
+                          : _mm512_mask_cmplt_epu64_mask(valid, chunk, pivot);
+    count += std::popcount(static_cast<unsigned>(mask));
+  }
+
+  return count;
+}
+
+#endif
+
+
+struct Avx2Search {
+  template <bool Upper, typename Key>
+  static std::size_t Rank(const Key* keys, std::size_t size, Key key) {
+#if defined(__x86_64__)
+    if constexpr (std::is_same_v<Key, std::uint64_t>) {
+      return CountAvx2<Upper>(keys, size, key);
+    }
+#endif
+    return BranchlessSearch::Rank<Upper>(keys, size, key);
+  }
+};
+
+
+struct Avx512Search {
+  template <bool Upper, typename Key>
+  static std::size_t Rank(const Key* keys, std::size_t size, Key key) {
+#if defined(__x86_64__)
+    if constexpr (std::is_same_v<Key, std::uint64_t>) {
+      return CountAvx512<Upper>(keys, size, key);
+    }
+#endif
+    return BranchlessSearch::Rank<Upper>(keys, size, key);
+  }
+};
+
+
+struct InterpolationSearch {
+  template <bool Upper, typename Key>
+  static std::size_t Rank(const Key* keys, std::size_t size, Key key) {
+    std::size_t lo = 0;
+    std::size_t hi = size;
+
+    /* Right-most nodes end with maximum key, which says
+     * nothing about distribution of the others */
+    if (hi > 0 && keys[hi - 1] == std::numeric_limits<Key>::max()) {
+      if (Precedes<Upper>(keys[hi - 1], key)) {
+        return hi;
+      }
+      --hi;
+    }
+
+    /* Answer is in [lo, hi] */
+    for (int step = 0; step < kSteps && hi - lo > kWindow; ++step) {
+      Key first = keys[lo];
+      Key last = keys[hi - 1];
+      if (!Precedes<Upper>(first, key)) {
+        return lo;
+      }
+      if (Precedes<Upper>(last, key)) {
+        return hi;
+      }
+
+      double fraction = static_cast<double>(key - first)
+        / static_cast<double>(last - first);
+      std::size_t guess = lo + static_cast<std::size_t>(
+        fraction * static_cast<double>(hi - 1 - lo));
+      guess = std::min(guess, hi - 1);
+
+      if (Precedes<Upper>(keys[guess], key)) {
+        lo = guess + 1;
+      } else {
+        hi = guess;
+      }
+    }
+
+    return lo + BranchlessSearch::Rank<Upper>(keys + lo, hi - lo, key);
+  }
+
+private:
+  constexpr static int kSteps = 3;
+  constexpr static std::size_t kWindow = 8;
+};
+
+
+struct AutoSearch {
+  enum class Kernel {
+    kScalar,
+    kAvx2,
+    kAvx512
+  };
+
+  static Kernel Detect() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) {
+      return Kernel::kAvx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return Kernel::kAvx2;
+    }
+#endif
+    return Kernel::kScalar;
+  }
+
+  template <bool Upper, typename Key>
+  static std::size_t Rank(const Key* keys, std::size_t size, Key key) {
+    if constexpr (!std::is_same_v<Key, std::uint64_t>) {
+      return BranchlessSearch::Rank<Upper>(keys, size, key);
+    } else {
+#if defined(__x86_64__)
+      if (kernel == Kernel::kScalar) {
+        return BranchlessSearch::Rank<Upper>(keys, size, key);
+      }
+
+      /* Halve as BranchlessSearch does, count the last few keys */
+      constexpr std::size_t window = 8;
+      const Key* base = keys;
+      while (size > window) {
+        std::size_t half = size / 2;
+        base += Precedes<Upper>(base[half], key) ? half : 0;
+        size -= half;
+      }
+
+      std::size_t count = kernel == Kernel::kAvx512
+        ? CountAvx512<Upper>(base, size, key)
+        : CountAvx2<Upper>(base, size, key);
+      return (base - keys) + count;
+#else
+      return BranchlessSearch::Rank<Upper>(keys, size, key);
+#endif
+    }
+  }
+
+  inline static const Kernel kernel = Detect();
+};
+
+
+using DefaultSearch = BranchlessSearch;
+
+#endif  // NODE_SEARCH_HPP
@@ -0,0 +1,226 @@
+#include "owner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define OWNER_CACHE 8 /* slots remembered per thread, of all tables */
+
+struct SlotCache {
+  const void* table;
+  void* slot;
+};
+
+__thread uint32_t owner_tid = 0;
+
+static __thread struct SlotCache cache[OWNER_CACHE];
+static __thread unsigned cache_next = 0;
+
+/* Child of fork inherits thread locals of forking thread:
+ * locks and slots it takes must not carry parent's tid */
+static void ForgetTid(void) {
+  owner_tid = 0;
+  memset(cache, 0, sizeof(cache));
+}
+
+__attribute__((constructor))
+static void InitOwner(void) {
+  (void)pthread_atfork(NULL, NULL, ForgetTid);
+}
+
+/*
+ * OwnerIsAlive -
+ * check if thread 'tid' still exists; one that cannot be signalled
+ * (EPERM) is taken as alive.
+*/
+bool OwnerIsAlive(uint32_t tid) {
+  return kill((pid_t)tid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * FutexWait -
+ * sleep while '*word' equals 'expected', for 'ns' at most:
+ * waiter wakes up to check if owner is alive.
+*/
+void FutexWait(uint32_t* word, uint32_t expected, long ns) {
+  struct timespec timeout = {
+    .tv_sec = ns / 1000000000L,
+    .tv_nsec = ns % 1000000000L
+  };
+  (void)syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+void FutexWakeAll(uint32_t* word) {
+  (void)syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/*
+ * TryLockAlone, LockShared -
+ * presence lock: every process keeps a read lock on the first byte
+ * of the sidecar while it is open, so the first opener can tell
+ * it is alone and reset the file. Open file description locks are used,
+ * so two handles of one process do not see each other as the same owner.
+*/
+bool TryLockAlone(int fd) {
+  struct flock flockstr = {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = 0,
+    .l_len = 1
+  };
+  return fcntl(fd, F_OFD_SETLK, &flockstr) != -1;
+}
+
+void LockShared(int fd, int command) {
+  struct flock flockstr = {
+    .l_type = F_RDLCK,
+    .l_whence = SEEK_SET,
+    .l_start = 0,
+    .l_len = 1
+  };
+  (void)fcntl(fd, command, &flockstr);
+}
+
+
+/*
+ * OpenOwnedTable -
+ * map sidecar '<tree_path><suffix>' of 'size' bytes shared,
+ * creating it if needed. All-zero content must be a valid table:
+ * only 'magic' in its first 8 bytes is set.
+ *
+ * Returns:
+ * @table: mapped table, or NULL on failure.
+*/
+void* OpenOwnedTable(const char* tree_path, const char* suffix,
+                     size_t size, uint64_t magic) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s%s", tree_path, suffix)
+      >= (int)sizeof(path)) {
+    fprintf(stderr, "OpenOwnedTable: path is too long\n");
+    return NULL;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+  /* Truncation to the same size keeps content */
+  if (ftruncate(fd, (off_t)size) == -1) {
+    perror("ftruncate");
+    close(fd);
+    return NULL;
+  }
+
+  void* mapping = mmap(
+    NULL,
+    size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    fd,
+    0
+  );
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  uint64_t* table_magic = (uint64_t*)mapping;
+  if (__atomic_load_n(table_magic, __ATOMIC_ACQUIRE) != magic) {
+    __atomic_store_n(table_magic, magic, __ATOMIC_RELEASE);
+  }
+
+  return mapping;
+}
+
+void CloseOwnedTable(void* table, size_t size) {
+  if (table == NULL) {
+    return;
+  }
+  /* Slot itself stays ours: other handles of this thread may use it */
+  for (int i = 0; i < OWNER_CACHE; ++i) {
+    if (cache[i].table == table) {
+      cache[i] = (struct SlotCache){0};
+    }
+  }
+  munmap(table, size);
+}
+
+
+static uint32_t* SlotTid(void* slots, size_t stride, size_t i) {
+  return (uint32_t*)((char*)slots + i * stride);
+}
+
+/*
+ * ClaimSlot -
+ * find slot of calling thread, or take one that is free
+ * or left by a dead thread.
+*/
+static void* ClaimSlot(void* slots, size_t count, size_t stride,
+                       bool* claimed) {
+  uint32_t tid = CurrentTid();
+
+  for (size_t i = 0; i < count; ++i) {
+    if (__atomic_load_n(SlotTid(slots, stride, i), __ATOMIC_ACQUIRE) == tid) {
+      return SlotTid(slots, stride, i);
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t* slot = SlotTid(slots, stride, (tid + i) % count);
+    uint32_t owner = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if ((owner == 0 || !OwnerIsAlive(owner))
+        && __atomic_compare_exchange_n(slot, &owner, tid, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      *claimed = true;
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * GetOwnedSlot -
+ * slot of calling thread in 'table': 'count' slots of 'stride' bytes
+ * at 'slots', each starting with uint32_t tid of its owner (0 if free).
+ * Slot is found once and remembered in thread locals.
+ *
+ * @claimed: set if slot is newly taken, and its other fields are stale.
+ *
+ * Returns:
+ * @slot: slot of the thread, or NULL if every slot has a live owner.
+*/
+void* GetOwnedSlot(const void* table, void* slots, size_t count,
+                   size_t stride, bool* claimed) {
+  *claimed = false;
+  for (int i = 0; i < OWNER_CACHE; ++i) {
+    if (cache[i].table == table
+        && __atomic_load_n((uint32_t*)cache[i].slot, __ATOMIC_RELAXED)
+          == CurrentTid()) {
+      return cache[i].slot;
+    }
+  }
+
+  void* slot = ClaimSlot(slots, count, stride, claimed);
+  if (slot != NULL) {
+    cache[cache_next] = (struct SlotCache){ .table = table, .slot = slot };
+    cache_next = (cache_next + 1) % OWNER_CACHE;
+  }
+
+  return slot;
+}
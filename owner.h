@@ -0,0 +1,44 @@
+#ifndef OWNER_H
+#define OWNER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+/* Helpers of state shared by processes (latch table, log, epochs,
+ * versions, stats): its locks and slots are owned by a thread id,
+ * so that a waiter can tell a crashed owner from a slow one.
+ * Internal to the modules; the tree does not use them. */
+
+/* Cached gettid(); reset in the child of fork, see owner.c */
+extern __thread uint32_t owner_tid;
+
+inline uint32_t CurrentTid(void) {
+  if (owner_tid == 0) {
+    owner_tid = (uint32_t)syscall(SYS_gettid);
+  }
+  return owner_tid;
+}
+
+bool OwnerIsAlive(uint32_t tid);
+
+void FutexWait(uint32_t* word, uint32_t expected, long ns);
+
+void FutexWakeAll(uint32_t* word);
+
+bool TryLockAlone(int fd);
+
+void LockShared(int fd, int command);
+
+void* OpenOwnedTable(const char* tree_path, const char* suffix,
+                     size_t size, uint64_t magic);
+
+void CloseOwnedTable(void* table, size_t size);
+
+void* GetOwnedSlot(const void* table, void* slots, size_t count,
+                   size_t stride, bool* claimed);
+
+#endif  // OWNER_H
@@ -0,0 +1,159 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "owner.h"
+
+/* Operation counters shared by processes.
+ *
+ * Every thread adds to a slot of its own, found once per table
+ * and remembered in thread locals; operation of the tree binds
+ * the slot for its duration, so modules below the tree (allocator,
+ * log, mapping) count into it through 'stats_slot' without knowing
+ * which tree they work for. Readers sum all slots without locks:
+ * counters only grow, a sum is as fresh as its latest slot. */
+
+__thread struct StatsSlot* stats_slot = NULL;
+
+static const char* const kCounterNames[STATS_SPLITS] = {
+  "descents",
+  "move_right",
+  "lock_waits",
+  "read_fallbacks",
+  "root_splits",
+  "allocate_calls",
+  "allocate_bytes",
+  "msync_calls",
+  "msync_ns",
+  "fdatasync_calls",
+  "fdatasync_ns",
+  "remaps",
+  "pool_misses",
+  "pool_evictions",
+  "pool_writebacks",
+};
+
+/* Child of fork inherits thread locals of forking thread */
+static void ForgetBinding(void) {
+  stats_slot = NULL;
+}
+
+__attribute__((constructor))
+static void InitStats(void) {
+  (void)pthread_atfork(NULL, NULL, ForgetBinding);
+}
+
+
+static bool StatsPath(char* path, const char* tree_path) {
+  if (snprintf(path, PATH_MAX, "%s.stats", tree_path) >= PATH_MAX) {
+    fprintf(stderr, "Stats: path is too long\n");
+    return false;
+  }
+  return true;
+}
+
+
+struct StatsTable* OpenStatsTable(const char* tree_path) {
+  return (struct StatsTable*)OpenOwnedTable(
+    tree_path, ".stats", sizeof(struct StatsTable), STATS_TABLE_MAGIC);
+}
+
+void CloseStatsTable(struct StatsTable* table) {
+  CloseOwnedTable(table, sizeof(struct StatsTable));
+}
+
+
+/*
+ * StatsBind -
+ * make calling thread count into its slot of 'table'
+ * until the matching StatsRestore.
+ *
+ * Returns:
+ * @previous: binding to be restored.
+*/
+struct StatsSlot* StatsBind(struct StatsTable* table) {
+  struct StatsSlot* previous = stats_slot;
+
+  /* Slot taken over keeps its counters, see StatsTable */
+  bool claimed;
+  stats_slot = (struct StatsSlot*)GetOwnedSlot(
+    table, table->slots, STATS_TABLE_SLOTS, sizeof(struct StatsSlot),
+    &claimed);
+  if (stats_slot == NULL) {
+    /* Every slot has a live owner: the last one is shared */
+    stats_slot = &table->slots[STATS_TABLE_SLOTS - 1];
+  }
+
+  return previous;
+}
+
+void StatsRestore(struct StatsSlot* previous) {
+  stats_slot = previous;
+}
+
+
+void ReadStats(struct StatsTable* table, struct TreeStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < STATS_TABLE_SLOTS; ++i) {
+    for (int j = 0; j < STATS_COUNTERS; ++j) {
+      stats->counters[j] +=
+        __atomic_load_n(&table->slots[i].counters[j], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/*
+ * ResetStats -
+ * zero counters of every slot; additions racing with it
+ * may survive or be lost.
+*/
+void ResetStats(struct StatsTable* table) {
+  for (int i = 0; i < STATS_TABLE_SLOTS; ++i) {
+    for (int j = 0; j < STATS_COUNTERS; ++j) {
+      __atomic_store_n(&table->slots[i].counters[j], 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+/*
+ * StatsCounterName -
+ * name of 'counter' for dumps.
+ *
+ * Returns:
+ * @name: e.g. "descents" or "splits_2".
+*/
+const char* StatsCounterName(int counter) {
+  static __thread char name[32];
+
+  if (counter < STATS_SPLITS) {
+    return kCounterNames[counter];
+  }
+  snprintf(name, sizeof(name), "splits_%d", counter - STATS_SPLITS);
+  return name;
+}
+
+/*
+ * RemoveStats -
+ * drop counters of a tree file that is being created anew.
+*/
+void RemoveStats(const char* tree_path) {
+  char path[PATH_MAX];
+  if (StatsPath(path, tree_path) && unlink(path) == -1 && errno != ENOENT) {
+    perror("unlink");
+  }
+}
+
+uint64_t StatsNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,93 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STATS_TABLE_MAGIC 0x53544154534b4c42ULL /* "BLKSTATS" */
+#define STATS_TABLE_SLOTS 1024
+#define STATS_LEVELS 16 /* splits above are counted in the last level */
+
+enum StatsCounter {
+  STATS_DESCENTS, /* walks from root, restarts included */
+  STATS_MOVE_RIGHT, /* link pointers followed */
+  STATS_LOCK_WAITS, /* node locks not free at first try */
+  STATS_READ_FALLBACKS, /* read locks given up for a validated copy */
+  STATS_ROOT_SPLITS,
+  STATS_ALLOCATE_CALLS,
+  STATS_ALLOCATE_BYTES,
+  STATS_MSYNC_CALLS,
+  STATS_MSYNC_NS,
+  STATS_FDATASYNC_CALLS,
+  STATS_FDATASYNC_NS,
+  STATS_REMAPS, /* mmaps of grown file */
+  STATS_POOL_MISSES, /* nodes read into buffer pool */
+  STATS_POOL_EVICTIONS,
+  STATS_POOL_WRITEBACKS, /* dirty frames written by eviction or checkpoint */
+  STATS_SPLITS, /* STATS_SPLITS + level: splits of that level */
+  STATS_COUNTERS = STATS_SPLITS + STATS_LEVELS
+};
+
+/* Counters of one thread; shared by late comers once all are taken */
+struct StatsSlot {
+  uint32_t tid; /* 0 if slot is free */
+  uint32_t pad;
+
+  uint64_t counters[STATS_COUNTERS];
+} __attribute__((aligned(64)));
+
+/* Sidecar file '<tree>.stats', mmapped by every process.
+ * Counters of all processes since the file was created (or reset);
+ * a slot keeps counting for whoever takes it over after its
+ * owner is gone. All-zero content is a valid empty table. */
+struct StatsTable {
+  uint64_t magic;
+
+  char pad[64 - sizeof(uint64_t)];
+
+  struct StatsSlot slots[STATS_TABLE_SLOTS];
+};
+
+/* Sum over all slots */
+struct TreeStats {
+  uint64_t counters[STATS_COUNTERS];
+};
+
+/* Slot of the operation the calling thread is in, or NULL */
+extern __thread struct StatsSlot* stats_slot;
+
+
+struct StatsTable* OpenStatsTable(const char* tree_path);
+
+void CloseStatsTable(struct StatsTable* table);
+
+struct StatsSlot* StatsBind(struct StatsTable* table);
+
+void StatsRestore(struct StatsSlot* previous);
+
+void ReadStats(struct StatsTable* table, struct TreeStats* stats);
+
+void ResetStats(struct StatsTable* table);
+
+void RemoveStats(const char* tree_path);
+
+const char* StatsCounterName(int counter);
+
+uint64_t StatsNow(void);
+
+static inline void StatsAdd(enum StatsCounter counter, uint64_t value) {
+  struct StatsSlot* slot = stats_slot;
+  if (slot != NULL) {
+    __atomic_fetch_add(&slot->counters[counter], value, __ATOMIC_RELAXED);
+  }
+}
+
+static inline void StatsAddSplit(uint32_t level) {
+  if (level >= STATS_LEVELS) {
+    level = STATS_LEVELS - 1;
+  }
+  StatsAdd((enum StatsCounter)(STATS_SPLITS + level), 1);
+}
+
+#endif  // STATS_H
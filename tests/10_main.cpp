@@ -0,0 +1,120 @@
+#include "blinktree.hpp"
+#include "touch_file.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 13);
+}
+
+int main() {
+  std::string path = "./database/test_10.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+
+  constexpr int kThreads = 8;
+  constexpr uint64_t kCount = 40000;
+
+  /* One handle shared by all threads */
+  BLinkTree<4> tree{path, false};
+  std::atomic<bool> ok{true};
+  std::atomic<int> running{kThreads};
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      bool thread_ok = true;
+      for (uint64_t key = t; key < kCount; key += kThreads) {
+        tree.Insert(key, Value(key));
+      }
+      for (uint64_t key = t; key < kCount; key += kThreads) {
+        auto guard = tree.Get(key);
+        thread_ok = thread_ok && guard && guard.Value() == Value(key);
+      }
+      for (uint64_t key = t; key < kCount; key += kThreads) {
+        if (key % 4 != 0) {
+          thread_ok = thread_ok && tree.Remove(key);
+        }
+      }
+      if (!thread_ok) {
+        ok = false;
+      }
+      --running;
+    });
+  }
+
+  /* Readers and compaction run alongside writers */
+  threads.emplace_back([&] {
+    std::size_t compacted = 0;
+    while (running > 0) {
+      compacted += tree.Compact();
+    }
+    printf("Compaction during writes: %zu nodes removed\n", compacted);
+  });
+  threads.emplace_back([&] {
+    while (running > 0) {
+      uint64_t previous = 0;
+      bool first = true;
+      bool scan_ok = true;
+      tree.ForEach(0, kCount, [&](uint64_t key, off_t) {
+        scan_ok = scan_ok && (first || previous < key);
+        previous = key;
+        first = false;
+      });
+      if (!scan_ok) {
+        ok = false;
+      }
+    }
+  });
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  tree.Compact();
+
+  std::size_t expected = 0;
+  for (uint64_t key = 0; key < kCount; ++key) {
+    auto guard = tree.Get(key);
+    bool present = key % 4 == 0;
+    ok = ok && static_cast<bool>(guard) == present;
+    ok = ok && (!present || guard.Value() == Value(key));
+    expected += present;
+  }
+  std::size_t scanned = 0;
+  tree.ForEach(0, kCount, [&](uint64_t, off_t) { ++scanned; });
+  ok = ok && scanned == expected;
+
+  printf("%d threads sharing one handle - %s\n",
+         kThreads, ok ? "OK" : "FAILED");
+
+  /* Child of multithreaded process locks with its own identity */
+  if (fork() == 0) {
+    BLinkTree<4> child{path, false};
+    bool child_ok = true;
+    for (uint64_t key = 1; key < kCount; key += 4) {
+      child.Insert(key, Value(key));
+    }
+    for (uint64_t key = 1; key < kCount; key += 4) {
+      child_ok = child_ok && child.Get(key);
+    }
+    _exit(child_ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  int status;
+  wait(&status);
+  ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+  ok = ok && tree.Get(kCount - 3) && tree.Get(kCount / 2 + 1);
+
+  printf("Forked child - %s\n", ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,76 @@
+#include "blinktree.hpp"
+#include "file_meta.h"
+#include "mapping.h"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Large values make the file grow past several mapping chunks */
+static std::string Value(uint64_t key) {
+  std::string value(1000, 'a' + key % 26);
+  value += std::to_string(key);
+  return value;
+}
+
+static bool Check(BLinkTree<4>& tree, uint64_t begin, uint64_t end) {
+  bool ok = true;
+  for (uint64_t key = begin; key < end; ++key) {
+    auto guard = tree.Get(key);
+    ok = ok && guard && guard.Value() == Value(key);
+  }
+  return ok;
+}
+
+int main() {
+  std::string path = "./database/test_11.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  bool ok = true;
+
+  constexpr uint64_t kCount = 80000;
+
+  /* Small reservation and chunks, huge pages where file system allows */
+  MappingOptions options{
+    .reserve = std::size_t{1} << 30,
+    .chunk = std::size_t{4} << 20,
+    .huge_pages = true
+  };
+  BLinkTree<4> reader{path, false, options};
+  ok = ok && !reader.Get(0);
+
+  {
+    BLinkTree<4> writer{path, false};
+    for (uint64_t key = 0; key < kCount / 2; ++key) {
+      writer.Insert(key, Value(key));
+    }
+  }
+  ok = ok && Check(reader, 0, kCount / 2);
+
+  /* Other process grows the file under the reader */
+  if (fork() == 0) {
+    BLinkTree<4> writer{path, false};
+    for (uint64_t key = kCount / 2; key < kCount; ++key) {
+      writer.Insert(key, Value(key));
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  int status;
+  wait(&status);
+  ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+
+  ok = ok && Check(reader, 0, kCount);
+  off_t end = reader.ReadMeta().alloc_state.end;
+  ok = ok && end > (off_t{64} << 20);
+
+  printf("File grown to %lld MiB under reader - %s\n",
+         static_cast<long long>(end >> 20), ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
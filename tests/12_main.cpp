@@ -0,0 +1,98 @@
+#include "blinktree.hpp"
+#include "file_meta.h"
+#include "stats.h"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 17);
+}
+
+int main() {
+  std::string path = "./database/test_12.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  bool ok = true;
+
+  constexpr uint64_t kCount = 5000;
+
+  BLinkTree<4> tree{path};
+  TreeStats before = tree.Stats();
+  for (int i = 0; i < STATS_COUNTERS; ++i) {
+    ok = ok && before.counters[i] == 0;
+  }
+
+  /* Every split is counted at its level, root splits grow the tree */
+  for (uint64_t key = 0; key < kCount; ++key) {
+    tree.Insert(key, Value(key));
+  }
+  for (uint64_t key = 0; key < kCount; ++key) {
+    ok = ok && tree.Get(key);
+  }
+  TreeStats stats = tree.Stats();
+  std::size_t height = tree.ReadMeta().height;
+  uint64_t splits = 0;
+  for (int level = 0; level < STATS_LEVELS; ++level) {
+    splits += stats.counters[STATS_SPLITS + level];
+  }
+  ok = ok && stats.counters[STATS_ROOT_SPLITS] == height - 1;
+  ok = ok && stats.counters[STATS_SPLITS] > 0 && splits > height;
+  ok = ok && stats.counters[STATS_DESCENTS] >= 2 * kCount;
+  /* One record and maybe nodes per insert */
+  ok = ok && stats.counters[STATS_ALLOCATE_CALLS] >= kCount + splits;
+  ok = ok && stats.counters[STATS_ALLOCATE_BYTES]
+    >= stats.counters[STATS_ALLOCATE_CALLS];
+  ok = ok && stats.counters[STATS_FDATASYNC_CALLS] > 0;
+  ok = ok && stats.counters[STATS_MSYNC_CALLS] >= height - 1;
+
+  printf("%llu descents, %llu splits, %llu root splits - %s\n",
+         static_cast<unsigned long long>(stats.counters[STATS_DESCENTS]),
+         static_cast<unsigned long long>(splits),
+         static_cast<unsigned long long>(stats.counters[STATS_ROOT_SPLITS]),
+         ok ? "OK" : "FAILED");
+
+  /* Threads and other processes add to the same counters */
+  tree.ResetStats();
+  constexpr int kThreads = 4;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&tree] {
+      for (uint64_t key = 0; key < kCount; ++key) {
+        tree.Search(key);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (fork() == 0) {
+    BLinkTree<4> child{path};
+    for (uint64_t key = 0; key < kCount; ++key) {
+      child.Search(key);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  int status;
+  wait(&status);
+  ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+
+  stats = tree.Stats();
+  ok = ok && stats.counters[STATS_DESCENTS] >= (kThreads + 1) * kCount;
+  ok = ok && stats.counters[STATS_SPLITS] == 0;
+
+  printf("%llu descents by %d threads and a child - %s\n",
+         static_cast<unsigned long long>(stats.counters[STATS_DESCENTS]),
+         kThreads, ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,129 @@
+#include "blinktree.hpp"
+#include "touch_file.hpp"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct Spans {
+  std::map<std::string, std::size_t> count;
+  bool ok{true};
+};
+
+/* Export spans recorded so far and count them by name */
+static Spans Export(const std::string& path, std::size_t height) {
+  Spans spans;
+  spans.ok = TraceExport(path.data());
+
+  std::ifstream input{path};
+  std::string line;
+  std::string last;
+  std::getline(input, line);
+  spans.ok = spans.ok && line == "{\"traceEvents\":[";
+  while (std::getline(input, line)) {
+    last = line;
+    std::size_t at = line.find("{\"name\":\"");
+    if (at == std::string::npos || line.find("\"ph\":\"X\"") == std::string::npos) {
+      continue;
+    }
+    at += 9;
+    std::string name = line.substr(at, line.find('"', at) - at);
+    ++spans.count[name];
+
+    /* Waits are for nodes of this tree */
+    if (name == "lock_wait") {
+      std::size_t level = std::stoul(line.substr(line.find("\"level\":") + 8));
+      spans.ok = spans.ok && level < height
+        && line.find("\"offset\":0,") == std::string::npos;
+    }
+  }
+  spans.ok = spans.ok && last == "]}";
+  return spans;
+}
+
+int main() {
+  std::string path = "./database/test_13.bin";
+  std::string trace = "./database/test_13.json";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+
+  constexpr int kThreads = 4;
+  constexpr uint64_t kCount = 24000;
+
+  BLinkTree<4> tree{path, false};
+  TraceEnable(true);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (uint64_t key = t; key < kCount; key += kThreads) {
+        tree.Insert(key, std::to_string(key));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::size_t height = tree.ReadMeta().height;
+  Spans spans = Export(trace, height);
+  bool ok = spans.ok;
+  ok = ok && spans.count["insert"] == kCount;
+  ok = ok && spans.count["descent"] >= kCount;
+  ok = ok && spans.count["split"] > 0;
+  ok = ok && spans.count["root_split"] == height - 1;
+  ok = ok && spans.count["allocate"] > 0;
+
+  printf("Spans of %d writers: %zu inserts, %zu splits, %zu lock waits - %s\n",
+         kThreads, spans.count["insert"], spans.count["split"],
+         spans.count["lock_wait"], ok ? "OK" : "FAILED");
+
+  /* Nothing is recorded while tracing is off */
+  TraceClear();
+  TraceEnable(false);
+  for (uint64_t key = 0; key < kCount; key += 7) {
+    ok = ok && tree.Get(key);
+  }
+  spans = Export(trace, height);
+  ok = ok && spans.ok && spans.count.empty();
+
+  TraceEnable(true);
+  for (uint64_t key = 0; key < kCount; key += 7) {
+    ok = ok && tree.Get(key);
+  }
+  spans = Export(trace, height);
+  ok = ok && spans.ok && spans.count["get"] == (kCount + 6) / 7;
+  ok = ok && spans.count["insert"] == 0;
+
+  printf("Tracing turned off and on - %s\n", ok ? "OK" : "FAILED");
+
+  /* Child of fork exports only its own spans */
+  if (fork() == 0) {
+    BLinkTree<4> child{path, false};
+    for (uint64_t key = kCount; key < kCount + 100; ++key) {
+      child.Insert(key, std::to_string(key));
+    }
+    Spans child_spans = Export(trace, child.ReadMeta().height);
+    bool child_ok = child_spans.ok && child_spans.count["insert"] == 100
+      && child_spans.count["get"] == 0;
+    _exit(child_ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  int status;
+  wait(&status);
+  ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+
+  printf("Forked child - %s\n", ok ? "OK" : "FAILED");
+
+  unlink(trace.data());
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
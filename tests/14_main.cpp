@@ -0,0 +1,149 @@
+#include "blinktree.hpp"
+#include "stats.h"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 19);
+}
+
+/* Keys below 'count' are present iff 'present(key)' */
+template <typename Tree, typename Predicate>
+static bool Check(Tree& tree, uint64_t count, Predicate present) {
+  bool ok = true;
+  std::size_t expected = 0;
+  for (uint64_t key = 0; key < count; ++key) {
+    auto guard = tree.Get(key);
+    ok = ok && static_cast<bool>(guard) == present(key);
+    ok = ok && (!guard || guard.Value() == Value(key));
+    expected += present(key);
+  }
+  std::size_t scanned = 0;
+  tree.ForEach(0, count, [&](uint64_t key, off_t) {
+    ok = ok && present(key);
+    ++scanned;
+  });
+  return ok && scanned == expected;
+}
+
+/* Exit status of a child running 'body' */
+template <typename Body>
+static int InChild(Body body) {
+  if (fork() == 0) {
+    _exit(body() ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  int status;
+  wait(&status);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main() {
+  std::string path = "./database/test_14.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  bool ok = true;
+
+  constexpr int kThreads = 4;
+  constexpr uint64_t kCount = 40000;
+  /* Tree of thousands of nodes in the smallest pool */
+  constexpr BufferPoolOptions kPool{.frames = 64};
+
+  {
+    BLinkTree<4> tree{path, false, {}, kPool};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&, t] {
+        for (uint64_t key = t; key < kCount; key += kThreads) {
+          tree.Insert(key, Value(key));
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    ok = ok && Check(tree, kCount, [](uint64_t) { return true; });
+
+    TreeStats stats = tree.Stats();
+    ok = ok && stats.counters[STATS_POOL_MISSES] > 0;
+    ok = ok && stats.counters[STATS_POOL_EVICTIONS] > 0;
+    ok = ok && stats.counters[STATS_POOL_WRITEBACKS] > 0;
+
+    printf("%d writers, 64 frames: %llu misses, %llu evictions - %s\n",
+           kThreads,
+           static_cast<unsigned long long>(stats.counters[STATS_POOL_MISSES]),
+           static_cast<unsigned long long>(stats.counters[STATS_POOL_EVICTIONS]),
+           ok ? "OK" : "FAILED");
+
+    /* Readers, removers and compaction share the pool */
+    threads.clear();
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&, t] {
+        for (uint64_t key = t; key < kCount; key += kThreads) {
+          if (key % 3 != 0) {
+            tree.Remove(key);
+          } else if (!tree.Get(key)) {
+            ok = false;
+          }
+        }
+      });
+    }
+    threads.emplace_back([&] { tree.Compact(); });
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    tree.Compact();
+    ok = ok && Check(tree, kCount, [](uint64_t key) { return key % 3 == 0; });
+
+    printf("Removals and compaction - %s\n", ok ? "OK" : "FAILED");
+
+    /* Pool's handle is the only one */
+    int status = InChild([&] {
+      BLinkTree<4> other{path};
+      return true;
+    });
+    ok = ok && status == EXIT_FAILURE;
+
+    printf("Second handle refused - %s\n", ok ? "OK" : "FAILED");
+  }
+
+  /* Frames are in the file once the handle is closed */
+  {
+    BLinkTree<4> tree{path};
+    ok = ok && Check(tree, kCount, [](uint64_t key) { return key % 3 == 0; });
+  }
+
+  printf("Written back - %s\n", ok ? "OK" : "FAILED");
+
+  /* Committed inserts of a crashed process are replayed from log */
+  int status = InChild([&] {
+    BLinkTree<4> tree{path, true, {}, kPool};
+    for (uint64_t key = 0; key < kCount; key += 3) {
+      tree.Remove(key);
+    }
+    for (uint64_t key = 1; key < kCount; key += 3) {
+      tree.Insert(key, Value(key));
+    }
+    _exit(EXIT_SUCCESS);
+    return true;
+  });
+  ok = ok && status == EXIT_SUCCESS;
+  {
+    BLinkTree<4> tree{path, true, {}, kPool};
+    ok = ok && Check(tree, kCount, [](uint64_t key) { return key % 3 == 1; });
+  }
+
+  printf("Crash with dirty frames - %s\n", ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
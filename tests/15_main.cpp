@@ -0,0 +1,122 @@
+#include "blinktree.hpp"
+#include "touch_file.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 23);
+}
+
+/* Batch of every key below 'count' in random order, some twice */
+static std::vector<uint64_t> Batch(uint64_t count, uint64_t seed) {
+  std::vector<uint64_t> keys;
+  for (uint64_t key = 0; key < count; ++key) {
+    keys.push_back(key);
+    if (key % 7 == 0) {
+      keys.push_back(key);
+    }
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64{seed});
+  return keys;
+}
+
+/* MultiGet finds even keys, each as often as it is asked for;
+ * odd ones only if 'odd_may_exist' */
+template <typename Tree>
+static bool CheckEven(Tree& tree, const std::vector<uint64_t>& keys,
+                      bool odd_may_exist = false) {
+  bool ok = true;
+  std::vector<int> found(keys.size(), 0);
+  uint64_t last = 0;
+
+  tree.MultiGet(keys, [&](std::size_t i, std::string_view record) {
+    ok = ok && (keys[i] % 2 == 0 || odd_may_exist);
+    ok = ok && record == Value(keys[i]);
+    ok = ok && keys[i] >= last;
+    last = keys[i];
+    ++found[i];
+  });
+
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    if (keys[i] % 2 == 0) {
+      ok = ok && found[i] == 1;
+    } else {
+      ok = ok && found[i] <= (odd_may_exist ? 1 : 0);
+    }
+  }
+  return ok;
+}
+
+int main() {
+  std::string path = "./database/test_15.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  bool ok = true;
+
+  constexpr uint64_t kCount = 20000;
+  constexpr int kReaders = 4;
+  std::vector<uint64_t> keys = Batch(kCount, 15);
+
+  {
+    BLinkTree<4> tree{path, false};
+    for (uint64_t key = 0; key < kCount; key += 2) {
+      tree.Insert(key, Value(key));
+    }
+
+    ok = ok && CheckEven(tree, keys);
+    bool called = false;
+    tree.MultiGet({}, [&](std::size_t, std::string_view) { called = true; });
+    ok = ok && !called;
+
+    printf("MultiGet of %zu keys - %s\n", keys.size(), ok ? "OK" : "FAILED");
+
+    /* Splits, removals and compaction run under the lookups */
+    std::atomic<bool> writing{true};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kReaders; ++t) {
+      threads.emplace_back([&, t] {
+        std::vector<uint64_t> own = Batch(kCount, t);
+        while (writing) {
+          if (!CheckEven(tree, own, true)) {
+            ok = false;
+          }
+        }
+      });
+    }
+    for (int round = 0; round < 3; ++round) {
+      for (uint64_t key = 1; key < kCount; key += 2) {
+        tree.Insert(key, Value(key));
+      }
+      for (uint64_t key = 1; key < kCount; key += 2) {
+        tree.Remove(key);
+      }
+      tree.Compact();
+    }
+    writing = false;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    printf("MultiGet alongside writers - %s\n", ok ? "OK" : "FAILED");
+  }
+
+  /* Frames of the pool are read the same way */
+  {
+    BLinkTree<4> tree{path, false, {}, BufferPoolOptions{.frames = 64}};
+    ok = ok && CheckEven(tree, keys);
+  }
+
+  printf("MultiGet through buffer pool - %s\n", ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
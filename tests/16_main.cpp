@@ -0,0 +1,119 @@
+#include "blinktree.hpp"
+#include "stats.h"
+#include "touch_file.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 29);
+}
+
+int main() {
+  std::string path = "./database/test_16.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  std::atomic<bool> ok{true};
+
+  constexpr uint64_t kCount = 40000;
+  constexpr uint64_t kExtra = 1000000; // keys inserted under the readers
+  constexpr int kThreads = 2;
+  constexpr BufferPoolOptions kPool{.frames = 64};
+
+  {
+    BLinkTree<4> tree{path, false};
+    for (uint64_t key = 0; key < kCount; ++key) {
+      tree.Insert(key, Value(key));
+    }
+  }
+
+  /* Every kind of read misses in a pool much smaller than the tree,
+   * so reads and prefetches of all threads share the ring */
+  {
+    BLinkTree<4> tree{path, false, {}, kPool};
+    std::atomic<bool> reading{true};
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&, t] {
+        std::vector<uint64_t> keys(kCount);
+        for (uint64_t key = 0; key < kCount; ++key) {
+          keys[key] = key;
+        }
+        std::shuffle(keys.begin(), keys.end(), std::mt19937_64(t));
+        std::vector<int> found(kCount, 0);
+        tree.MultiGet(keys, [&](std::size_t i, std::string_view record) {
+          ok = ok && record == Value(keys[i]);
+          ++found[i];
+        });
+        ok = ok && std::count(found.begin(), found.end(), 1) == kCount;
+      });
+      threads.emplace_back([&, t] {
+        std::mt19937_64 random(t + kThreads);
+        for (int i = 0; i < 20000; ++i) {
+          uint64_t key = random() % kCount;
+          auto guard = tree.Get(key);
+          ok = ok && guard && guard.Value() == Value(key);
+        }
+      });
+      threads.emplace_back([&] {
+        uint64_t expected = 0;
+        tree.ForEach(0, kCount, [&](uint64_t key, off_t) {
+          ok = ok && key == expected++;
+        });
+        ok = ok && expected == kCount;
+      });
+    }
+    std::thread writer{[&] {
+      for (uint64_t key = kExtra; reading; ++key) {
+        tree.Insert(key, Value(key));
+      }
+    }};
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    reading = false;
+    writer.join();
+
+    TreeStats stats = tree.Stats();
+    ok = ok && stats.counters[STATS_POOL_MISSES] > 0;
+
+    printf("Concurrent reads, 64 frames: %llu misses - %s\n",
+           static_cast<unsigned long long>(stats.counters[STATS_POOL_MISSES]),
+           ok ? "OK" : "FAILED");
+  }
+
+  /* Prefetched frames that nobody asked for are harmless */
+  {
+    BLinkTree<4> tree{path, false, {}, kPool};
+    std::vector<uint64_t> keys;
+    for (uint64_t key = 0; key < kCount; key += 997) {
+      keys.push_back(key);
+    }
+    std::size_t found = 0;
+    tree.MultiGet(keys, [&](std::size_t i, std::string_view record) {
+      ok = ok && record == Value(keys[i]);
+      ++found;
+    });
+    ok = ok && found == keys.size();
+  }
+  {
+    BLinkTree<4> tree{path};
+    std::size_t scanned = 0;
+    tree.ForEach(0, kCount, [&](uint64_t, off_t) { ++scanned; });
+    ok = ok && scanned == kCount && tree.Get(kExtra);
+  }
+
+  printf("Reopened - %s\n", ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
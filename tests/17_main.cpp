@@ -0,0 +1,136 @@
+#include "blinktree.hpp"
+#include "coroutine.hpp"
+#include "stats.h"
+#include "touch_file.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static std::string Value(uint64_t i) {
+  return std::to_string(i * 31);
+}
+
+/* Key of task 'i'; odd keys are left to the other thread */
+static uint64_t Key(uint64_t i) {
+  return i * 2;
+}
+
+/* Insert, find, and remove it again if 'i' is odd */
+static Task<void> Write(BLinkTree<4>& tree, uint64_t i,
+                        std::string_view value, std::atomic<bool>& ok) {
+  uint64_t key = Key(i);
+  co_await tree.InsertAsync(key, value);
+
+  off_t ptr = co_await tree.SearchAsync(key);
+  ok = ok && ptr != 0 && tree.Get(key).Value() == value;
+
+  if (i % 2 == 1) {
+    bool removed = co_await tree.RemoveAsync(key);
+    ok = ok && removed && co_await tree.SearchAsync(key) == 0;
+  }
+}
+
+static Task<void> Read(BLinkTree<4>& tree, uint64_t i,
+                       std::atomic<bool>& ok) {
+  off_t ptr = co_await tree.SearchAsync(Key(i));
+  ok = ok && (ptr != 0) == (i % 2 == 0);
+}
+
+/* Keys of even tasks below 'count' in order */
+static Task<void> Scan(BLinkTree<4>& tree, uint64_t count,
+                       std::atomic<bool>& ok) {
+  uint64_t expected = 0;
+  co_await tree.ScanAsync(0, Key(count), [&](uint64_t key, off_t) {
+    ok = ok && key == expected;
+    expected += Key(2);
+  });
+  ok = ok && expected == Key(count);
+}
+
+int main() {
+  std::string path = "./database/test_17.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  std::atomic<bool> ok{true};
+
+  constexpr uint64_t kCount = 2000; // tasks in flight in one thread
+  std::vector<std::string> values(kCount);
+  for (uint64_t i = 0; i < kCount; ++i) {
+    values[i] = Value(i);
+  }
+
+  /* Another thread splits and locks the same leaves meanwhile */
+  {
+    BLinkTree<4> tree{path, false};
+    std::atomic<bool> writing{true};
+    std::thread writer{[&] {
+      for (uint64_t i = 0; writing; ++i) {
+        tree.Insert(Key(i % kCount) + 1, "odd");
+      }
+    }};
+
+    Scheduler scheduler;
+    for (uint64_t i = 0; i < kCount; ++i) {
+      scheduler.Spawn(Write(tree, i, values[i], ok));
+    }
+    scheduler.Run();
+    ok = ok && scheduler.Running() == 0;
+
+    writing = false;
+    writer.join();
+
+    for (uint64_t i = 0; i < kCount; ++i) {
+      tree.Remove(Key(i) + 1);
+      scheduler.Spawn(Read(tree, i, ok));
+    }
+    scheduler.Spawn(Scan(tree, kCount, ok));
+    scheduler.Run();
+  }
+
+  printf("%llu tasks in one thread - %s\n",
+         static_cast<unsigned long long>(kCount), ok ? "OK" : "FAILED");
+
+  /* Tasks pause while their frames are read */
+  {
+    BLinkTree<4> tree{path, false, {}, BufferPoolOptions{.frames = 64}};
+    Scheduler scheduler;
+    for (uint64_t i = 0; i < kCount; ++i) {
+      scheduler.Spawn(Read(tree, i, ok));
+    }
+    scheduler.Spawn(Scan(tree, kCount, ok));
+    scheduler.Run();
+
+    TreeStats stats = tree.Stats();
+    ok = ok && stats.counters[STATS_POOL_MISSES] > 0;
+  }
+
+  printf("Through buffer pool - %s\n", ok ? "OK" : "FAILED");
+
+  /* Commits of the tasks share flushes */
+  {
+    BLinkTree<4> tree{path};
+    Scheduler scheduler;
+    for (uint64_t i = 1; i < kCount; i += 2) {
+      scheduler.Spawn(Write(tree, i, values[i], ok));
+    }
+    scheduler.Run();
+  }
+  {
+    BLinkTree<4> tree{path};
+    for (uint64_t i = 0; i < kCount; ++i) {
+      auto guard = tree.Get(Key(i));
+      ok = ok && (i % 2 == 0 ? guard && guard.Value() == values[i] : !guard);
+    }
+  }
+
+  printf("Sync commit - %s\n", ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,197 @@
+#include "blinktree.hpp"
+#include "touch_file.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 31);
+}
+
+/* View holds exactly keys from 'first' below 'count', 'step' apart */
+template <typename View>
+static bool CheckView(const View& view, uint64_t first, uint64_t count,
+                      uint64_t step) {
+  bool ok = true;
+  uint64_t expected = first;
+  view.ForEach(0, count, [&](uint64_t key, off_t record_ptr) {
+    ok = ok && key == expected && view.Read(record_ptr) == Value(key);
+    expected += step;
+  });
+  ok = ok && expected >= count && expected < count + step;
+
+  for (uint64_t key = 0; key < count; key += 97) {
+    off_t record_ptr = view.Search(key);
+    if (key % step == first) {
+      ok = ok && record_ptr != 0 && view.Read(record_ptr) == Value(key);
+    } else {
+      ok = ok && record_ptr == 0;
+    }
+  }
+  return ok;
+}
+
+static off_t VersionsSize(const std::string& path) {
+  struct stat statbuf;
+  return stat((path + ".versions").data(), &statbuf) == 0
+    ? statbuf.st_size : -1;
+}
+
+int main() {
+  std::string path = "./database/test_18.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  bool ok = true;
+
+  constexpr uint64_t kCount = 20000;
+  constexpr int kReaders = 3;
+
+  {
+    BLinkTree<4> tree{path, false};
+    for (uint64_t key = 0; key < kCount; key += 2) {
+      tree.Insert(key, Value(key));
+    }
+
+    /* Inserts, removals, splits and merges under long scans of a view */
+    auto view = tree.Snapshot();
+    std::atomic<bool> writing{true};
+    std::atomic<bool> readers_ok{true};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kReaders; ++t) {
+      readers.emplace_back([&] {
+        while (writing) {
+          if (!CheckView(view, 0, kCount, 2)) {
+            readers_ok = false;
+          }
+        }
+      });
+    }
+    for (int round = 0; round < 3; ++round) {
+      for (uint64_t key = 1; key < kCount; key += 2) {
+        tree.Insert(key, Value(key));
+      }
+      for (uint64_t key = 1; key < kCount; key += 2) {
+        tree.Remove(key);
+      }
+      tree.Compact();
+    }
+    for (uint64_t key = 0; key < kCount; key += 4) {
+      tree.Remove(key);
+    }
+    tree.Compact();
+    writing = false;
+    for (auto& thread : readers) {
+      thread.join();
+    }
+    ok = ok && readers_ok && CheckView(view, 0, kCount, 2);
+
+    printf("Snapshot under writers - %s\n", ok ? "OK" : "FAILED");
+
+    /* The next view sees what the first did not, nothing older */
+    {
+      auto later = tree.Snapshot();
+      ok = ok && later.Epoch() > view.Epoch();
+      std::size_t count = 0;
+      later.ForEach(0, kCount, [&](uint64_t key, off_t) {
+        ok = ok && key % 4 == 2;
+        ++count;
+      });
+      ok = ok && count == kCount / 4;
+      ok = ok && later.Search(kCount / 2) == 0
+        && view.Search(kCount / 2) != 0;
+    }
+    ok = ok && VersionsSize(path) > VERSION_DATA;
+
+    auto moved = std::move(view);
+    ok = ok && CheckView(moved, 0, kCount, 2);
+  }
+  /* Versions and deferred records are given back with the last view */
+  ok = ok && VersionsSize(path) == VERSION_DATA;
+
+  printf("Later snapshot and release - %s\n", ok ? "OK" : "FAILED");
+
+  /* Versions of frames are saved as well */
+  {
+    BLinkTree<4> tree{path, false, {}, BufferPoolOptions{.frames = 16}};
+    auto view = tree.Snapshot();
+    std::mt19937_64 random{18};
+    for (uint64_t key = 2; key < kCount; key += 4) {
+      tree.Remove(key);
+      tree.Insert(kCount + random() % kCount, Value(key));
+    }
+    tree.Compact();
+    ok = ok && CheckView(view, 2, kCount, 4);
+
+    std::size_t count = 0;
+    tree.ForEach(0, kCount, [&](uint64_t, off_t) { ++count; });
+    ok = ok && count == 0;
+  }
+  {
+    BLinkTree<4> tree{path};
+    auto view = tree.Snapshot();
+    std::size_t count = 0;
+    view.ForEach(0, kCount, [&](uint64_t, off_t) { ++count; });
+    ok = ok && count == 0;
+  }
+
+  printf("Snapshot through buffer pool - %s\n", ok ? "OK" : "FAILED");
+
+  /* Views taken while writers split leaves: every insert is seen
+   * whole or not at all, and each writer's keys form a prefix */
+  {
+    unlink(path.data());
+    TouchTreeFile<4>(path);
+    BLinkTree<4> tree{path, false};
+    constexpr int kWriters = 4;
+    constexpr uint64_t kPerWriter = 5000;
+
+    std::atomic<bool> writing{true};
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kWriters; ++t) {
+      writers.emplace_back([&tree, t] {
+        for (uint64_t i = 0; i < kPerWriter; ++i) {
+          uint64_t key = i * kWriters + t;
+          tree.Insert(key, Value(key));
+        }
+      });
+    }
+    std::thread finish([&] {
+      for (auto& thread : writers) {
+        thread.join();
+      }
+      writing = false;
+    });
+
+    std::size_t views = 0;
+    while (writing) {
+      auto view = tree.Snapshot();
+      uint64_t seen[kWriters] = {0};
+      view.ForEach(0, UINT64_MAX, [&](uint64_t key, off_t record_ptr) {
+        ok = ok && key / kWriters == seen[key % kWriters]
+          && view.Read(record_ptr) == Value(key);
+        ++seen[key % kWriters];
+      });
+      for (int t = 0; t < kWriters; ++t) {
+        uint64_t last = seen[t] * kWriters + t;
+        ok = ok && (seen[t] == 0 || view.Search(last - kWriters) != 0)
+          && view.Search(last) == 0;
+      }
+      ++views;
+    }
+    finish.join();
+
+    printf("%zu snapshots under concurrent writers - %s\n",
+           views, ok ? "OK" : "FAILED");
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,178 @@
+#include "blinktree.hpp"
+#include "bulk_load.hpp"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "file_meta.h"
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 19);
+}
+
+static bool ReadNode(int fd, off_t ptr, Node<4>& node) {
+  return pread(fd, &node, sizeof(node), ptr) == sizeof(node);
+}
+
+static bool WriteNode(int fd, off_t ptr, const Node<4>& node) {
+  return pwrite(fd, &node, sizeof(node), ptr) == sizeof(node);
+}
+
+/* Left-most node of 'level', found through the file of closed tree */
+static off_t LeftMost(int fd, uint32_t level) {
+  FileMeta meta;
+  if (pread(fd, &meta, sizeof(meta), 0) != sizeof(meta)) {
+    return 0;
+  }
+  off_t ptr = meta.root_offset;
+  Node<4> node;
+  while (ReadNode(fd, ptr, node) && node.Level() > level) {
+    ptr = node.GetIthPtr(0);
+  }
+  return ptr;
+}
+
+static bool FindAll(BLinkTree<4>& tree, uint64_t count) {
+  for (uint64_t key = 0; key < count; key += 3) {
+    if (tree.Search(key) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  bool ok = true;
+
+  /* CPU instructions give what the table does, at any length and offset */
+  {
+    std::mt19937_64 random{19};
+    std::vector<unsigned char> data(4096 + 64);
+    for (auto& byte : data) {
+      byte = static_cast<unsigned char>(random());
+    }
+    for (std::size_t size = 0; size < 200; ++size) {
+      std::size_t offset = random() % 64;
+      ok = ok && Crc32c(7, data.data() + offset, size)
+        == Crc32cPortable(7, data.data() + offset, size);
+    }
+    ok = ok && Crc32c(0, data.data(), data.size())
+      == Crc32cPortable(0, data.data(), data.size());
+    ok = ok && Crc32c(0, "123456789", 9) == 0xE3069283u;
+  }
+
+  printf("Hardware CRC32C - %s\n", ok ? "OK" : "FAILED");
+
+  std::string path = "./database/test_19.bin";
+  constexpr uint64_t kCount = 30000;
+
+  /* Tree after splits, removals and merges checks out,
+   * with one thread or several of them */
+  {
+    unlink(path.data());
+    TouchTreeFile<4>(path);
+    BLinkTree<4> tree{path, false};
+    for (uint64_t key = 0; key < kCount; ++key) {
+      tree.Insert(key, Value(key));
+    }
+    for (uint64_t key = 0; key < kCount; ++key) {
+      if (key % 3 != 0) {
+        tree.Remove(key);
+      }
+    }
+    tree.Compact();
+
+    VerifyReport one = tree.Verify({.threads = 1});
+    VerifyReport many = tree.Verify({.threads = 4});
+    ok = ok && one.Ok() && many.Ok() && one.problems.empty();
+    ok = ok && one.nodes == many.nodes && one.levels == many.levels;
+    ok = ok && one.levels >= 3 && one.orphans == 0;
+  }
+
+  printf("Verify after splits and merges - %s\n", ok ? "OK" : "FAILED");
+
+  /* Split whose separator has not got to the parent */
+  {
+    int fd = open(path.data(), O_RDWR);
+    off_t parent_ptr = LeftMost(fd, 1);
+    Node<4> parent;
+    ok = ok && ReadNode(fd, parent_ptr, parent) && parent.Size() > 2;
+    parent.RemoveChild(1);
+    parent.UpdateChecksum();
+    ok = ok && WriteNode(fd, parent_ptr, parent);
+    close(fd);
+  }
+  {
+    BLinkTree<4> tree{path, false};
+    VerifyReport report = tree.Verify();
+    ok = ok && !report.Ok() && report.orphans == 1
+      && report.corrupt == 0 && report.malformed == 0
+      && report.broken_links == 0;
+    /* Reached through links meanwhile */
+    ok = ok && FindAll(tree, kCount);
+
+    report = tree.Verify({.repair = true});
+    ok = ok && report.orphans == 1 && report.repaired == 1 && report.Ok();
+    report = tree.Verify({.threads = 3});
+    ok = ok && report.orphans == 0 && report.Ok() && FindAll(tree, kCount);
+  }
+
+  printf("Orphan repaired - %s\n", ok ? "OK" : "FAILED");
+
+  /* Bit gone wrong in a leaf */
+  {
+    int fd = open(path.data(), O_RDWR);
+    off_t leaf_ptr = LeftMost(fd, 0);
+    Node<4> leaf;
+    ok = ok && ReadNode(fd, leaf_ptr, leaf);
+    unsigned char* bytes = reinterpret_cast<unsigned char*>(&leaf);
+    bytes[8] ^= 0x10;
+    ok = ok && WriteNode(fd, leaf_ptr, leaf);
+    close(fd);
+  }
+  {
+    BLinkTree<4> tree{path, false};
+    VerifyReport report = tree.Verify({.threads = 2});
+    ok = ok && !report.Ok() && report.corrupt == 1
+      && report.problems.size() == 1;
+  }
+
+  printf("Corrupt node found - %s\n", ok ? "OK" : "FAILED");
+
+  /* Bulk loaded tree, and one kept in buffer pool */
+  {
+    std::vector<std::string> values;
+    std::vector<std::pair<uint64_t, std::string_view>> items;
+    for (uint64_t key = 0; key < kCount; ++key) {
+      values.push_back(Value(key));
+    }
+    for (uint64_t key = 0; key < kCount; ++key) {
+      items.emplace_back(key * 2, values[key]);
+    }
+    unlink(path.data());
+    ok = ok && BulkLoad<4>(path, items, 0.7);
+
+    BLinkTree<4> tree{path, false, {}, BufferPoolOptions{.frames = 16}};
+    ok = ok && tree.Verify({.threads = 4}).Ok();
+    for (uint64_t key = 1; key < kCount; key += 2) {
+      tree.Insert(key, Value(key));
+    }
+    VerifyReport report = tree.Verify({.threads = 4});
+    ok = ok && report.Ok() && report.levels >= 3;
+  }
+
+  printf("Verify of bulk loaded tree through buffer pool - %s\n",
+         ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
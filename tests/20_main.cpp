@@ -0,0 +1,214 @@
+#include "blinktree.hpp"
+#include "touch_file.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 20) + std::string(key % 40, 'v');
+}
+
+/* Tree holds exactly keys below 'count' with 'key % step == first' */
+static bool CheckTree(BLinkTree<4>& tree, uint64_t first, uint64_t count,
+                      uint64_t step) {
+  bool ok = true;
+  uint64_t expected = first;
+  tree.ForEach(0, count, [&](uint64_t key, off_t) {
+    ok = ok && key == expected;
+    expected += step;
+  });
+  ok = ok && expected >= count && expected < count + step;
+
+  for (uint64_t key = 0; key < count; ++key) {
+    auto guard = tree.Get(key);
+    if (key % step == first) {
+      ok = ok && guard && guard.Value() == Value(key);
+    } else {
+      ok = ok && !guard;
+    }
+  }
+  return ok;
+}
+
+/* Whole pass, in steps of 'pages' leaves */
+static DefragStep Pass(BLinkTree<4>& tree, DefragOptions options,
+                       std::size_t& steps) {
+  DefragStep total;
+  steps = 0;
+  while (!total.done) {
+    DefragStep step = tree.Defragment(options);
+    total.visited += step.visited;
+    total.moved += step.moved;
+    total.done = step.done;
+    ++steps;
+  }
+  return total;
+}
+
+/* Keys in random order scatter leaves over file */
+static void Age(BLinkTree<4>& tree, uint64_t first, uint64_t count,
+                uint64_t step, uint64_t seed) {
+  std::vector<uint64_t> keys;
+  for (uint64_t key = first; key < count; key += step) {
+    keys.push_back(key);
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64{seed});
+  for (uint64_t key : keys) {
+    tree.Insert(key, Value(key));
+  }
+}
+
+int main() {
+  std::string path = "./database/test_20.bin";
+  bool ok = true;
+
+  constexpr uint64_t kCount = 20000;
+
+  /* Leaves follow each other after the pass; records stay */
+  {
+    unlink(path.data());
+    TouchTreeFile<4>(path);
+    BLinkTree<4> tree{path, false};
+    Age(tree, 0, kCount, 1, 20);
+
+    LeafLocality before = tree.Locality();
+    std::size_t steps;
+    DefragStep pass = Pass(tree, {.pages = 16}, steps);
+    LeafLocality after = tree.Locality();
+
+    ok = ok && before.leaves == after.leaves && before.records == kCount;
+    ok = ok && before.sequential * 2 < before.leaves;
+    ok = ok && after.forward == after.leaves - 1
+      && after.sequential == after.leaves - 1;
+    ok = ok && after.mean_distance < before.mean_distance;
+    ok = ok && pass.moved > 0 && steps > 1;
+    ok = ok && CheckTree(tree, 0, kCount, 1) && tree.Verify().Ok();
+
+    /* Nothing is out of place any more */
+    pass = Pass(tree, {.pages = 16}, steps);
+    ok = ok && pass.moved == 0;
+
+    printf("before: %zu leaves, %zu sequential, distance %.1f pages\n",
+           before.leaves, before.sequential, before.mean_distance);
+    printf("after: %zu leaves, %zu sequential, distance %.1f pages\n",
+           after.leaves, after.sequential, after.mean_distance);
+  }
+
+  printf("Leaves in key order - %s\n", ok ? "OK" : "FAILED");
+
+  /* Records go after their leaves */
+  {
+    BLinkTree<4> tree{path, false};
+    ok = ok && tree.Locality().records_near * 2 < kCount;
+
+    std::size_t steps;
+    DefragStep pass = Pass(tree, {.pages = 64, .records = true}, steps);
+    LeafLocality after = tree.Locality();
+    ok = ok && pass.moved > 0 && after.records_near == kCount;
+    ok = ok && after.sequential == after.leaves - 1;
+    ok = ok && CheckTree(tree, 0, kCount, 1) && tree.Verify().Ok();
+
+    pass = Pass(tree, {.pages = 64, .records = true}, steps);
+    ok = ok && pass.moved == 0;
+  }
+
+  printf("Records next to leaves - %s\n", ok ? "OK" : "FAILED");
+
+  /* Writers, readers and a snapshot alongside */
+  {
+    unlink(path.data());
+    TouchTreeFile<4>(path);
+    BLinkTree<4> tree{path, false};
+    Age(tree, 0, kCount, 1, 21);
+
+    auto view = tree.Snapshot();
+    std::atomic<bool> running{true};
+    std::atomic<bool> readers_ok{true};
+    std::vector<std::thread> threads;
+    /* Keys of other residues come and go */
+    threads.emplace_back([&] {
+      while (running) {
+        for (uint64_t key = kCount; key < 2 * kCount; key += 7) {
+          tree.Insert(key, Value(key));
+        }
+        for (uint64_t key = kCount; key < 2 * kCount; key += 7) {
+          tree.Remove(key);
+        }
+      }
+    });
+    for (int t = 0; t < 2; ++t) {
+      threads.emplace_back([&, t] {
+        std::mt19937_64 random(t);
+        while (running) {
+          uint64_t key = random() % kCount;
+          auto guard = tree.Get(key);
+          if (!guard || guard.Value() != Value(key)) {
+            readers_ok = false;
+          }
+          guard.Release();
+          std::size_t count = 0;
+          tree.ForEach(key, key + 100, [&](uint64_t other, off_t) {
+            count += other < kCount;
+          });
+          if (count != std::min<uint64_t>(100, kCount - key)) {
+            readers_ok = false;
+          }
+        }
+      });
+    }
+
+    std::size_t steps;
+    for (int round = 0; round < 2; ++round) {
+      Pass(tree, {.pages = 8, .records = round == 1}, steps);
+    }
+    running = false;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    ok = ok && readers_ok;
+
+    std::size_t count = 0;
+    view.ForEach(0, 2 * kCount, [&](uint64_t key, off_t record_ptr) {
+      ok = ok && key == count && view.Read(record_ptr) == Value(key);
+      ++count;
+    });
+    ok = ok && count == kCount;
+
+    ok = ok && CheckTree(tree, 0, kCount, 1) && tree.Verify().Ok();
+  }
+
+  printf("Defragment under load - %s\n", ok ? "OK" : "FAILED");
+
+  /* Copies of leaves through buffer pool */
+  {
+    BLinkTree<4> tree{path, false, {}, BufferPoolOptions{.frames = 16}};
+    for (uint64_t key = 1; key < kCount; key += 2) {
+      tree.Remove(key);
+    }
+    tree.Compact();
+    Age(tree, 1, kCount, 2, 22);
+
+    std::size_t steps;
+    Pass(tree, {.pages = 32, .records = true}, steps);
+    LeafLocality after = tree.Locality();
+    ok = ok && after.sequential == after.leaves - 1;
+    ok = ok && CheckTree(tree, 0, kCount, 1) && tree.Verify().Ok();
+  }
+  {
+    BLinkTree<4> tree{path};
+    ok = ok && CheckTree(tree, 0, kCount, 1) && tree.Verify().Ok();
+  }
+
+  printf("Defragment through buffer pool - %s\n", ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,95 @@
+#include "latch_table.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Child takes 'readers' read latches on 'key' (and a write latch
+ * on another key if asked) and is killed holding them */
+static bool KillHolder(LatchTable* latches, off_t key, int readers,
+                       off_t write_key) {
+  int ready[2];
+  if (pipe(ready) == -1) {
+    perror("pipe");
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (int i = 0; i < readers; ++i) {
+      LatchRLock(latches, key);
+    }
+    if (write_key != 0) {
+      LatchWLock(latches, write_key);
+    }
+    char byte = 1;
+    (void)write(ready[1], &byte, 1);
+    pause();
+    _exit(EXIT_FAILURE);
+  }
+
+  char byte = 0;
+  bool ok = read(ready[0], &byte, 1) == 1;
+  close(ready[0]);
+  close(ready[1]);
+
+  /* Latches are held by a live process */
+  ok = ok && !LatchTryWLock(latches, key);
+
+  kill(pid, SIGKILL);
+  int status;
+  waitpid(pid, &status, 0);
+  return ok && WIFSIGNALED(status);
+}
+
+int main() {
+  std::string path = "./database/test_22.bin";
+  std::filesystem::create_directories("./database");
+  unlink((path + ".locks").data());
+  LatchTable* latches = OpenLatchTable(path.data());
+  if (latches == nullptr) {
+    return EXIT_FAILURE;
+  }
+  /* Waiting forever is the failure being tested */
+  alarm(20);
+  bool ok = true;
+
+  /* Writer waits for dead reader */
+  ok = KillHolder(latches, 4096, 1, 0) && ok;
+  LatchWLock(latches, 4096);
+  LatchUnlock(latches, 4096);
+  printf("Dead reader - %s\n", ok ? "OK" : "FAILED");
+
+  /* Several read latches of one dead process, live reader next to them */
+  LatchRLock(latches, 8192);
+  ok = KillHolder(latches, 8192, 3, 12288) && ok;
+  ok = ok && !LatchTryWLock(latches, 8192);
+  LatchUnlock(latches, 8192);
+  LatchWLock(latches, 8192);
+  LatchUnlock(latches, 8192);
+  LatchWLock(latches, 12288);
+  LatchUnlock(latches, 12288);
+  printf("Dead readers and writer next to live reader - %s\n",
+         ok ? "OK" : "FAILED");
+
+  /* Readers beyond reader cells are counted and released alike */
+  for (int i = 0; i < 2 * LATCH_READER_CELLS; ++i) {
+    ok = ok && LatchTryRLock(latches, 16384);
+  }
+  for (int i = 0; i < 2 * LATCH_READER_CELLS; ++i) {
+    ok = ok && !LatchTryWLock(latches, 16384);
+    LatchUnlock(latches, 16384);
+  }
+  ok = ok && LatchTryWLock(latches, 16384);
+  LatchUnlock(latches, 16384);
+  printf("Readers beyond cells - %s\n", ok ? "OK" : "FAILED");
+
+  CloseLatchTable(latches);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
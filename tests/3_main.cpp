@@ -0,0 +1,57 @@
+#include "blinktree.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+
+int main() {
+  std::string path = "./database/test_3.bin";
+
+  BLinkTree<4> tree{path};
+
+  std::set<uint64_t> keys;
+  for (int i = 0; i < 1000; ++i) {
+    uint64_t key = (uint64_t)rand() % 100000;
+    keys.insert(key);
+    tree.Insert(key, "_ABRA_CADA_BRA!_");
+  }
+
+  /* Every third key is removed and must not be seen by scan */
+  int i = 0;
+  for (auto it = keys.begin(); it != keys.end(); ++i) {
+    if (i % 3 == 0) {
+      tree.Remove(*it);
+      it = keys.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  uint64_t lo = 20000;
+  uint64_t hi = 70000;
+
+  auto expected = keys.lower_bound(lo);
+  size_t seen = 0;
+  bool ok = true;
+
+  for (auto it = tree.Scan(lo, hi); it.Valid(); it.Next()) {
+    if (expected == keys.end() || *expected != it.Key()) {
+      ok = false;
+      break;
+    }
+    ++expected;
+    ++seen;
+  }
+  ok = ok && (expected == keys.end() || *expected >= hi);
+
+  size_t total = 0;
+  tree.ForEach(0, UINT64_MAX, [&total](uint64_t, off_t) { ++total; });
+  ok = ok && total == keys.size();
+
+  printf("Scan [%lu, %lu): %zu records, full scan: %zu records - %s\n",
+         lo, hi, seen, total, ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,29 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int main() {
+  if (fork() == 0) {
+    execve("./bin/3_init", NULL, NULL);
+
+    perror("execve");
+    exit(EXIT_FAILURE);
+  }
+  wait(0);
+
+  printf("Testing started...\n");
+  if (fork() == 0) {
+    execve("./bin/3_main", NULL, NULL);
+
+    perror("execve");
+    exit(EXIT_FAILURE);
+  }
+  int status;
+  wait(&status);
+
+  printf("Testing ended!\n");
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
@@ -0,0 +1,53 @@
+#include "blinktree.hpp"
+#include "bulk_load.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+int main() {
+  std::string path = "./database/test_4.bin";
+
+  std::vector<std::pair<uint64_t, std::string_view>> items;
+  for (uint64_t i = 0; i < 10000; ++i) {
+    items.emplace_back((i * 7919) % 10007 * 2, "_ABRA_CADA_BRA!_");
+  }
+
+  if (!BulkLoad<4>(path, items, 0.75)) {
+    printf("BulkLoad FAILED\n");
+    return EXIT_FAILURE;
+  }
+
+  BLinkTree<4> tree{path};
+  bool ok = true;
+
+  /* Bulk loaded tree must accept ordinary inserts (odd keys) */
+  for (uint64_t i = 0; i < 2000; ++i) {
+    tree.Insert(i * 10 + 1, "_ABRA_CADA_BRA!_");
+  }
+
+  for (const auto& [key, record] : items) {
+    ok = ok && tree.Search(key) != 0;
+  }
+  for (uint64_t i = 0; i < 2000; ++i) {
+    ok = ok && tree.Search(i * 10 + 1) != 0 && tree.Search(i * 10 + 3) == 0;
+  }
+
+  size_t total = 0;
+  uint64_t previous = 0;
+  tree.ForEach(0, UINT64_MAX, [&](uint64_t key, off_t) {
+    ok = ok && (total == 0 || previous < key);
+    previous = key;
+    ++total;
+  });
+  ok = ok && total == items.size() + 2000;
+
+  printf("Bulk load: height %zu, %zu records - %s\n",
+         tree.ReadMeta().height, total, ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,156 @@
+#include "allocate_data.hpp"
+#include "blinktree.hpp"
+#include "file_meta.h"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int main() {
+  std::string path = "./database/test_5.bin";
+  TouchTreeFile<4>(path);
+
+  int fd = open(path.data(), O_RDWR);
+  char* mapping = (char*)mmap(NULL, sizeof(FileMeta),
+                              PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd < 0 || mapping == MAP_FAILED) {
+    perror("open/mmap");
+    return EXIT_FAILURE;
+  }
+  const AllocState& state = ((FileMeta*)mapping)->alloc_state;
+  bool ok = true;
+
+  std::string record(100, 'r');
+  std::vector<off_t> records;
+  std::vector<off_t> nodes;
+
+  /* Churn: everything freed must be handed out again, file must not grow */
+  off_t end = 0;
+  for (int round = 0; round < 10; ++round) {
+    for (int i = 0; i < 1000; ++i) {
+      records.push_back(AllocateRecord(fd, mapping, record));
+    }
+    for (int i = 0; i < 50; ++i) {
+      off_t node_ptr = AllocateNode<4>(fd, mapping);
+      ok = ok && node_ptr % 4096 == 0;
+      nodes.push_back(node_ptr);
+    }
+    if (round == 0) {
+      end = state.end;
+    }
+    ok = ok && state.end == end;
+
+    for (off_t record_ptr : records) {
+      FreeRecord(fd, mapping, record_ptr, record.size());
+    }
+    for (off_t node_ptr : nodes) {
+      FreeNode<4>(fd, mapping, node_ptr);
+    }
+    records.clear();
+    nodes.clear();
+  }
+  ok = ok && state.free_pages_count == 50;
+
+  struct stat statbuf;
+  fstat(fd, &statbuf);
+  ok = ok && statbuf.st_size == state.reserved_end && state.end <= statbuf.st_size;
+
+  printf("Allocator churn: end %ld, file %ld - %s\n",
+         (long)state.end, (long)statbuf.st_size, ok ? "OK" : "FAILED");
+
+  /* Tree keeps working on top of reused space */
+  {
+    BLinkTree<4> tree{path};
+    for (uint64_t i = 0; i < 2000; ++i) {
+      tree.Insert(i * 3, "_ABRA_CADA_BRA!_");
+    }
+    for (uint64_t i = 0; i < 2000; ++i) {
+      ok = ok && tree.Search(i * 3) != 0 && tree.Search(i * 3 + 1) == 0;
+    }
+  }
+  ok = ok && state.free_pages_count == 0;
+
+  printf("Tree on reused pages - %s\n", ok ? "OK" : "FAILED");
+
+  /* Values are read back in place; removed records are reused */
+  {
+    BLinkTree<4> tree{path};
+    for (uint64_t i = 0; i < 2000; ++i) {
+      auto guard = tree.Get(i * 3);
+      ok = ok && guard && guard.Verify()
+        && guard.Value() == "_ABRA_CADA_BRA!_";
+    }
+    ok = ok && !tree.Get(1);
+
+    for (int round = 0; round < 5; ++round) {
+      for (uint64_t i = 0; i < 2000; ++i) {
+        ok = ok && tree.Remove(i * 3);
+      }
+      if (round == 1) {
+        end = state.end;
+      }
+      for (uint64_t i = 0; i < 2000; ++i) {
+        tree.Insert(i * 3, std::to_string(i * round));
+      }
+      ok = ok && (round <= 1 || state.end == end);
+    }
+    for (uint64_t i = 0; i < 2000; ++i) {
+      auto guard = tree.Get(i * 3);
+      ok = ok && guard && guard.Value() == std::to_string(i * 4);
+    }
+  }
+
+  printf("Record heap: end %ld - %s\n", (long)state.end, ok ? "OK" : "FAILED");
+
+  /* Records inserted in batch carry one header each and are freed alone */
+  {
+    BLinkTree<4> tree{path};
+    std::vector<std::string> values;
+    for (uint64_t i = 0; i < 2000; ++i) {
+      values.push_back(std::string(i % 50 + 1, 'a' + i % 26));
+    }
+    std::vector<std::pair<uint64_t, std::string_view>> batch;
+    for (uint64_t i = 0; i < 2000; ++i) {
+      batch.emplace_back(i * 3 + 1, values[i]);
+    }
+    tree.InsertBatch(batch);
+
+    for (uint64_t i = 0; i < 2000; ++i) {
+      auto guard = tree.Get(i * 3 + 1);
+      ok = ok && guard && guard.Verify() && guard.Value() == values[i];
+    }
+    for (uint64_t i = 0; i < 2000; ++i) {
+      ok = ok && tree.Remove(i * 3 + 1);
+    }
+    end = state.end;
+    for (uint64_t i = 0; i < 2000; ++i) {
+      tree.Insert(i * 3 + 1, values[i]);
+    }
+    ok = ok && state.end == end;
+    for (uint64_t i = 0; i < 2000; ++i) {
+      auto guard = tree.Get(i * 3 + 1);
+      ok = ok && guard && guard.Value() == values[i];
+    }
+    for (uint64_t i = 0; i < 2000; ++i) {
+      auto guard = tree.Get(i * 3);
+      ok = ok && guard && guard.Value() == std::to_string(i * 4);
+    }
+  }
+
+  printf("Batch records: end %ld - %s\n", (long)state.end, ok ? "OK" : "FAILED");
+
+  munmap(mapping, sizeof(FileMeta));
+  close(fd);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,167 @@
+#include "blinktree.hpp"
+#include "touch_file.hpp"
+
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Crash after commit: the child's pages never reach the tree file
+ * (file is rolled back to its last checkpointed state),
+ * so everything committed must come back from the log. */
+
+static std::string Value(uint64_t key) {
+  return "value_" + std::to_string(key * 7);
+}
+
+/* Nodes bigger than the default ring's image limit are logged too */
+static bool CrashWithHugeNodes() {
+  constexpr std::size_t kOrder = KeysPerPage<4 << 20>;
+  std::string path = "./database/test_6_huge.bin";
+  unlink(path.data());
+  TouchTreeFile<kOrder>(path);
+
+  {
+    BLinkTree<kOrder> tree{path};
+    tree.Insert(0, Value(0));
+  }
+
+  int fd = open(path.data(), O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+  struct stat statbuf;
+  fstat(fd, &statbuf);
+  std::vector<char> snapshot(statbuf.st_size);
+  bool ok = pread(fd, snapshot.data(), snapshot.size(), 0)
+    == static_cast<ssize_t>(snapshot.size());
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    BLinkTree<kOrder> tree{path};
+    for (uint64_t i = 1; i < 4; ++i) {
+      tree.Insert(i, Value(i));
+    }
+    raise(SIGKILL);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  ok = ok && WIFSIGNALED(status);
+
+  fstat(fd, &statbuf);
+  std::vector<char> zeroes(statbuf.st_size - snapshot.size(), 0);
+  ok = ok
+    && pwrite(fd, snapshot.data(), snapshot.size(), 0)
+      == static_cast<ssize_t>(snapshot.size())
+    && pwrite(fd, zeroes.data(), zeroes.size(), snapshot.size())
+      == static_cast<ssize_t>(zeroes.size());
+  close(fd);
+
+  BLinkTree<kOrder> tree{path};
+  for (uint64_t i = 0; i < 4; ++i) {
+    auto guard = tree.Get(i);
+    ok = ok && guard && guard.Verify() && guard.Value() == Value(i);
+  }
+  return ok;
+}
+
+int main() {
+  std::string path = "./database/test_6.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+
+  {
+    BLinkTree<4> tree{path};
+    for (uint64_t i = 0; i < 500; ++i) {
+      tree.Insert(i, Value(i));
+    }
+  }
+
+  /* Tree file as of clean close */
+  int fd = open(path.data(), O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return EXIT_FAILURE;
+  }
+  struct stat statbuf;
+  fstat(fd, &statbuf);
+  std::vector<char> snapshot(statbuf.st_size);
+  if (pread(fd, snapshot.data(), snapshot.size(), 0)
+      != static_cast<ssize_t>(snapshot.size())) {
+    perror("pread");
+    return EXIT_FAILURE;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* Both handles stay open: closing the last one would checkpoint */
+    BLinkTree<4> tree{path};
+    BLinkTree<4> lazy_tree{path, false};
+    for (uint64_t i = 500; i < 1000; ++i) {
+      tree.Insert(i, Value(i));
+    }
+    for (uint64_t i = 1000; i < 1500; ++i) {
+      lazy_tree.Insert(i, Value(i));
+    }
+    for (uint64_t i = 0; i < 100; ++i) {
+      lazy_tree.Remove(i);
+    }
+    lazy_tree.Sync();
+    raise(SIGKILL);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  bool ok = WIFSIGNALED(status);
+
+  /* Lose every page written after the snapshot */
+  fstat(fd, &statbuf);
+  std::vector<char> zeroes(statbuf.st_size - snapshot.size(), 0);
+  ok = ok
+    && pwrite(fd, snapshot.data(), snapshot.size(), 0)
+      == static_cast<ssize_t>(snapshot.size())
+    && pwrite(fd, zeroes.data(), zeroes.size(), snapshot.size())
+      == static_cast<ssize_t>(zeroes.size());
+  close(fd);
+
+  printf("Crash after commit - %s\n", ok ? "OK" : "FAILED");
+
+  {
+    BLinkTree<4> tree{path};
+    for (uint64_t i = 0; i < 1500; ++i) {
+      auto guard = tree.Get(i);
+      if (i < 100) {
+        ok = ok && !guard;
+      } else {
+        ok = ok && guard && guard.Verify() && guard.Value() == Value(i);
+      }
+    }
+
+    std::size_t count = 0;
+    tree.ForEach(0, 2000, [&count](uint64_t, off_t) { ++count; });
+    ok = ok && count == 1400;
+
+    /* Tree stays writable after replay */
+    for (uint64_t i = 1500; i < 2000; ++i) {
+      tree.Insert(i, Value(i));
+    }
+    for (uint64_t i = 1500; i < 2000; ++i) {
+      ok = ok && tree.Search(i) != 0;
+    }
+  }
+
+  printf("Replay - %s\n", ok ? "OK" : "FAILED");
+
+  ok = CrashWithHugeNodes() && ok;
+  printf("Replay of 4 MiB nodes - %s\n", ok ? "OK" : "FAILED");
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
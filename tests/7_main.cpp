@@ -0,0 +1,183 @@
+#include "blinktree.hpp"
+#include "file_meta.h"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 11);
+}
+
+/* Every key below 'count' is present iff 'present(key)' */
+template <typename Predicate>
+static bool Check(BLinkTree<4>& tree, uint64_t count, Predicate present) {
+  bool ok = true;
+  std::size_t expected = 0;
+
+  for (uint64_t key = 0; key < count; ++key) {
+    auto guard = tree.Get(key);
+    if (present(key)) {
+      ok = ok && guard && guard.Value() == Value(key);
+      ++expected;
+    } else {
+      ok = ok && !guard;
+    }
+  }
+
+  std::size_t scanned = 0;
+  uint64_t last = 0;
+  tree.ForEach(0, count, [&](uint64_t key, off_t) {
+    ok = ok && (scanned == 0 || key > last) && present(key);
+    last = key;
+    ++scanned;
+  });
+
+  return ok && scanned == expected;
+}
+
+int main() {
+  std::string path = "./database/test_7.bin";
+  unlink(path.data());
+  TouchTreeFile<4>(path);
+  bool ok = true;
+
+  constexpr uint64_t kCount = 5000;
+
+  /* Removals followed by compaction shrink the tree */
+  {
+    BLinkTree<4> tree{path};
+    for (uint64_t key = 0; key < kCount; ++key) {
+      tree.Insert(key, Value(key));
+    }
+    std::size_t height = tree.ReadMeta().height;
+
+    for (uint64_t key = 0; key < kCount; ++key) {
+      if (key % 10 != 0) {
+        tree.Remove(key);
+      }
+    }
+    std::size_t removed = tree.Compact();
+    ok = ok && removed > 0 && tree.ReadMeta().height < height;
+    ok = ok && Check(tree, kCount, [](uint64_t key) { return key % 10 == 0; });
+
+    printf("Compaction: %zu nodes removed, height %zu -> %zu - %s\n",
+           removed, height, tree.ReadMeta().height, ok ? "OK" : "FAILED");
+
+    /* Pages of merged nodes are reused */
+    FileMeta meta = tree.ReadMeta();
+    ok = ok && meta.alloc_state.free_pages_count > 0;
+    off_t end = meta.alloc_state.end;
+
+    for (uint64_t key = 0; key < kCount; ++key) {
+      if (key % 10 != 0 && key % 3 == 0) {
+        tree.Insert(key, Value(key));
+      }
+    }
+    ok = ok && Check(tree, kCount, [](uint64_t key) {
+      return key % 10 == 0 || key % 3 == 0;
+    });
+    ok = ok && tree.ReadMeta().alloc_state.end == end;
+
+    printf("Reuse of merged pages - %s\n", ok ? "OK" : "FAILED");
+
+    /* Empty tree collapses to a single leaf */
+    for (uint64_t key = 0; key < kCount; ++key) {
+      tree.Remove(key);
+    }
+    tree.Compact();
+    ok = ok && tree.ReadMeta().height == 1;
+    ok = ok && Check(tree, kCount, [](uint64_t) { return false; });
+
+    for (uint64_t key = 0; key < kCount; ++key) {
+      tree.Insert(key, Value(key));
+    }
+    ok = ok && Check(tree, kCount, [](uint64_t) { return true; });
+
+    printf("Collapse to leaf - %s\n", ok ? "OK" : "FAILED");
+  }
+
+  /* Root cached by one handle follows splits and collapses made by another */
+  {
+    std::string root_path = "./database/test_7_root.bin";
+    unlink(root_path.data());
+    TouchTreeFile<4>(root_path);
+
+    BLinkTree<4> reader{root_path};
+    BLinkTree<4> writer{root_path};
+    ok = ok && !reader.Get(0) && reader.ReadMeta().height == 1;
+
+    for (uint64_t key = 0; key < kCount; ++key) {
+      writer.Insert(key, Value(key));
+    }
+    ok = ok && Check(reader, kCount, [](uint64_t) { return true; });
+    ok = ok && reader.ReadMeta().height > 1;
+
+    for (uint64_t key = 0; key < kCount; ++key) {
+      writer.Remove(key);
+    }
+    writer.Compact();
+    ok = ok && reader.ReadMeta().height == 1;
+    ok = ok && Check(reader, kCount, [](uint64_t) { return false; });
+
+    printf("Root changed by other handle - %s\n", ok ? "OK" : "FAILED");
+  }
+
+  /* Compaction runs alongside writers and readers of other processes */
+  constexpr int kWriters = 3;
+  for (int writer = 0; writer < kWriters; ++writer) {
+    if (fork() == 0) {
+      BLinkTree<4> tree{path};
+      bool child_ok = true;
+      for (int round = 0; round < 4; ++round) {
+        for (uint64_t key = writer; key < kCount; key += kWriters) {
+          if (key % 4 != 0) {
+            child_ok = child_ok && tree.Remove(key);
+          }
+        }
+        for (uint64_t key = writer; key < kCount; key += kWriters) {
+          auto guard = tree.Get(key);
+          child_ok = child_ok && (key % 4 == 0) == static_cast<bool>(guard);
+        }
+        for (uint64_t key = writer; key < kCount; key += kWriters) {
+          if (key % 4 != 0) {
+            tree.Insert(key, Value(key));
+          }
+        }
+      }
+      for (uint64_t key = writer; key < kCount; key += kWriters) {
+        if (key % 2 != 0) {
+          child_ok = child_ok && tree.Remove(key);
+        }
+      }
+      _exit(child_ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  {
+    BLinkTree<4> tree{path};
+    std::size_t removed = 0;
+    for (int done = 0; done < kWriters;) {
+      removed += tree.Compact();
+      int status;
+      pid_t pid = waitpid(-1, &status, WNOHANG);
+      if (pid > 0) {
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+        ++done;
+      }
+    }
+    removed += tree.Compact();
+    ok = ok && Check(tree, kCount, [](uint64_t key) { return key % 2 == 0; });
+
+    printf("Concurrent compaction: %zu nodes removed - %s\n",
+           removed, ok ? "OK" : "FAILED");
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,120 @@
+#include "blinktree.hpp"
+#include "file_meta.h"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 7);
+}
+
+struct Shape {
+  std::size_t height;
+  bool ok;
+};
+
+/* Fill tree of given order with 'count' keys in random order */
+template <std::size_t KeysCount>
+static Shape Fill(const std::string& path, uint64_t count) {
+  unlink(path.data());
+  TouchTreeFile<KeysCount>(path);
+
+  BLinkTree<KeysCount> tree{path, false};
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t key = i * 2654435761u % count;
+    tree.Insert(key, Value(key));
+  }
+
+  bool ok = true;
+  for (uint64_t key = 0; key < count; ++key) {
+    auto guard = tree.Get(key);
+    ok = ok && guard && guard.Value() == Value(key);
+  }
+  ok = ok && !tree.Get(count);
+
+  std::size_t scanned = 0;
+  tree.ForEach(0, count, [&](uint64_t, off_t) { ++scanned; });
+  ok = ok && scanned == count;
+
+  return {tree.ReadMeta().height, ok};
+}
+
+/* Node with 32-bit keys and page ids behaves as the default one */
+static bool CheckNarrowNode() {
+  using Narrow = Node<KeysPerPage<4096, uint32_t, uint32_t>,
+                      uint32_t, uint32_t>;
+  auto node = std::make_unique<Narrow>();
+  node->InitRoot();
+
+  bool ok = true;
+  for (uint32_t key = 2; key < 2 * Narrow::Capacity - 2; key += 2) {
+    node->Insert(key, key + 1);
+  }
+  ok = ok && node->Size() == Narrow::Capacity - 1;
+
+  for (uint32_t key = 2; key < 2 * Narrow::Capacity - 2; key += 2) {
+    ok = ok && node->Contains(key) && !node->Contains(key + 1);
+    ok = ok && node->GetRecordByKey(key) == key + 1;
+    ok = ok && node->ScanNodeFor(key - 1) == key + 1;
+  }
+  return ok;
+}
+
+/* Node filling a 2 MiB huge page holds as many entries as it claims */
+static bool CheckHugeNode() {
+  using Huge = Node<KeysPerPage<2097152>>;
+  auto node = std::make_unique<Huge>();
+  node->InitRoot();
+
+  bool ok = true;
+  for (uint64_t key = 2; key < 2 * Huge::Capacity - 2; key += 2) {
+    node->Insert(key, key + 1);
+  }
+  ok = ok && node->Size() == Huge::Capacity - 1;
+
+  for (uint64_t key = 2; key < 2 * Huge::Capacity - 2; key += 2) {
+    ok = ok && node->Contains(key) && !node->Contains(key + 1);
+    ok = ok && node->GetRecordByKey(key) == static_cast<off_t>(key + 1);
+  }
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+  constexpr uint64_t kCount = 5000;
+
+  Shape small = Fill<4>("./database/test_8_small.bin", kCount);
+  Shape page = Fill<KeysPerPage<4096>>("./database/test_8_4k.bin", kCount);
+  Shape large = Fill<KeysPerPage<16384>>("./database/test_8_16k.bin", kCount);
+
+  printf("order 4: height %zu\n", small.height);
+  printf("order %zu: height %zu\n", KeysPerPage<4096>, page.height);
+  printf("order %zu: height %zu\n", KeysPerPage<16384>, large.height);
+
+  ok = ok && small.ok && page.ok && large.ok;
+  /* Page-filling nodes: lower tree, fewer pages per lookup */
+  ok = ok && page.height < small.height && large.height <= page.height;
+  ok = ok && page.height <= 2 && large.height <= 2;
+
+  if (!CheckNarrowNode()) {
+    printf("Node with 32-bit keys and pointers is broken\n");
+    ok = false;
+  }
+  if (!CheckHugeNode()) {
+    printf("Node of a 2 MiB page is broken\n");
+    ok = false;
+  }
+
+  if (!ok) {
+    printf("Page-filling nodes test failed\n");
+    return EXIT_FAILURE;
+  }
+  printf("Page-filling nodes test passed\n");
+  return EXIT_SUCCESS;
+}
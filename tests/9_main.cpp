@@ -0,0 +1,133 @@
+#include "blinktree.hpp"
+#include "file_meta.h"
+#include "touch_file.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+constexpr std::size_t kOrder = KeysPerPage<4096>;
+using PageNode = Node<kOrder>;
+
+static std::string Value(uint64_t key) {
+  return std::to_string(key * 7);
+}
+
+/*
+ * Inner node with fences [low, high): children are pages 1, 2, ...,
+ * separators are 'low' + step, 'low' + 2 * step, ...
+ * Node is filled up to MaxSize() by Append and Insert,
+ * then every child is looked up.
+*/
+static bool CheckInner(uint64_t low, uint64_t high, uint64_t step,
+                       std::size_t& max_size) {
+  auto node = std::make_unique<PageNode>();
+  node->InitEmpty(1, low);
+  /* A few children come from bulk loading, the rest from splits */
+  std::size_t appended = 8;
+  for (std::size_t i = 1; i <= appended; ++i) {
+    node->Append(low + i * step, static_cast<off_t>(i * 2 * 4096));
+  }
+  node->Seal(0, high);
+  max_size = node->MaxSize();
+
+  bool ok = true;
+  for (std::size_t i = appended; node->Size() < max_size; ++i) {
+    /* Last child is split in the middle */
+    node->Insert(low + i * step - step / 2, static_cast<off_t>((2 * i + 1) * 4096));
+  }
+  ok = ok && node->Size() == max_size && node->IsSafe();
+
+  for (std::size_t i = 1; i <= appended; ++i) {
+    uint64_t child_low = low + (i - 1) * step;
+    uint64_t expected = i * 2 * 4096;
+    ok = ok && node->ScanNodeFor(child_low) == static_cast<off_t>(expected);
+  }
+  ok = ok && node->ScanNodeFor(high) == node->LinkPointer();
+  return ok;
+}
+
+/* Dense keys inserted in random order, some removed and compacted */
+static bool CheckTree(const std::string& path, uint64_t count,
+                      std::size_t& root_size) {
+  unlink(path.data());
+  TouchTreeFile<kOrder>(path);
+
+  BLinkTree<kOrder> tree{path, false};
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t key = i * 2654435761u % count;
+    tree.Insert(key, Value(key));
+  }
+
+  FileMeta meta = tree.ReadMeta();
+  int fd = open(path.data(), O_RDONLY);
+  auto root = std::make_unique<PageNode>();
+  bool ok = fd >= 0
+    && pread(fd, root.get(), sizeof(PageNode), meta.root_offset)
+      == static_cast<ssize_t>(sizeof(PageNode));
+  close(fd);
+  root_size = root->Size();
+
+  for (uint64_t key = 0; key < count; key += 3) {
+    ok = ok && tree.Remove(key);
+  }
+  tree.Compact();
+  for (uint64_t key = 0; key < count; key += 6) {
+    tree.Insert(key, Value(key));
+  }
+
+  std::size_t expected = 0;
+  for (uint64_t key = 0; key < count; ++key) {
+    bool present = key % 3 != 0 || key % 6 == 0;
+    auto guard = tree.Get(key);
+    ok = ok && static_cast<bool>(guard) == present;
+    ok = ok && (!present || guard.Value() == Value(key));
+    expected += present;
+  }
+
+  std::size_t scanned = 0;
+  uint64_t previous = 0;
+  tree.ForEach(0, count, [&](uint64_t key, off_t) {
+    ok = ok && (scanned == 0 || previous < key);
+    previous = key;
+    ++scanned;
+  });
+  ok = ok && scanned == expected;
+
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+
+  /* Fences 2^20 apart: 32-bit deltas */
+  std::size_t narrow = 0;
+  ok = CheckInner(1ull << 40, (1ull << 40) + (1ull << 20), 1 << 10, narrow) && ok;
+  /* Unbounded right-most node: 64-bit deltas */
+  std::size_t wide = 0;
+  ok = CheckInner(1ull << 40, std::numeric_limits<uint64_t>::max(),
+                  1ull << 30, wide) && ok;
+
+  printf("order %zu: leaf holds %zu keys, inner node %zu (wide) "
+         "or %zu (narrow) children\n", kOrder, 2 * kOrder, wide, narrow);
+  ok = ok && 2 * kOrder < wide && wide < narrow;
+
+  std::size_t root_size = 0;
+  ok = CheckTree("./database/test_9.bin", 60000, root_size) && ok;
+  printf("root of 60000 keys: %zu children\n", root_size);
+  /* Root holds more leaves than a leaf holds keys */
+  ok = ok && root_size > 2 * kOrder;
+
+  if (!ok) {
+    printf("Compressed inner nodes test failed\n");
+    return EXIT_FAILURE;
+  }
+  printf("Compressed inner nodes test passed\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+#include "blinktree.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_meta.h"
+
+/*
+ * blinktree_fsck - verify tree file, see BLinkTree::Verify.
+ *
+ * Usage: blinktree_fsck <tree-file> [--repair] [--threads N]
+ *
+ * Opening the tree replays its log first, so splits cut short by
+ * a crash are as far as the log got them. --repair gives orphans
+ * (nodes whose split has not reached the parent) their separators.
+ * Exits with 0 if nothing is wrong (or left unrepaired).
+*/
+
+template <std::size_t KeysCount>
+int Check(const std::string& path, VerifyOptions options) {
+  BLinkTree<KeysCount> tree{path};
+  VerifyReport report = tree.Verify(options);
+
+  for (const std::string& problem : report.problems) {
+    std::cout << problem << "\n";
+  }
+  std::cout << report.nodes << " nodes on " << report.levels << " levels\n"
+    << "corrupt: " << report.corrupt << "\n"
+    << "malformed: " << report.malformed << "\n"
+    << "broken links: " << report.broken_links << "\n"
+    << "orphans: " << report.orphans
+    << " (" << report.repaired << " repaired)\n";
+
+  return report.Ok() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+      << " <tree-file> [--repair] [--threads N]\n";
+    return EXIT_FAILURE;
+  }
+
+  std::string path = argv[1];
+  VerifyOptions options;
+  for (int i = 2; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--repair") == 0) {
+      options.repair = true;
+    } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      options.threads = static_cast<unsigned>(std::atoi(argv[++i]));
+    }
+  }
+
+  /* Order decides the node layout, so it is read before opening */
+  FileMeta meta;
+  int fd = open(path.data(), O_RDONLY);
+  if (fd < 0 || pread(fd, &meta, sizeof(meta), 0) != sizeof(meta)) {
+    perror(path.data());
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  switch (meta.order) {
+    case 4: return Check<4>(path, options);
+    case 8: return Check<8>(path, options);
+    case 16: return Check<16>(path, options);
+    case 32: return Check<32>(path, options);
+    case 64: return Check<64>(path, options);
+    case KeysPerPage<4096>: return Check<KeysPerPage<4096>>(path, options);
+    case KeysPerPage<16384>: return Check<KeysPerPage<16384>>(path, options);
+    case KeysPerPage<65536>: return Check<KeysPerPage<65536>>(path, options);
+  }
+
+  std::cerr << "Unsupported order " << meta.order << "\n";
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,122 @@
+#include "bulk_load.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+ * bulk_load - build tree file from text input.
+ *
+ * Usage: bulk_load <tree-file> <order> [fill-factor] [--sorted] < input
+ *
+ * Every input line is "<key> <record>".
+ * With --sorted lines are streamed straight into the file
+ * (keys must be strictly increasing), otherwise they are
+ * collected and sorted first.
+*/
+
+template <std::size_t KeysCount>
+int Load(const std::string& path, double fill_factor, bool sorted) {
+  std::string line;
+  std::size_t count = 0;
+
+  auto parse = [&line](std::uint64_t& key, std::string_view& record) {
+    char* end;
+    key = std::strtoull(line.c_str(), &end, 10);
+    if (end == line.c_str()) {
+      return false;
+    }
+    std::string_view rest{end};
+    record = rest.substr(std::min(rest.size(), rest.find_first_not_of(" \t")));
+    return true;
+  };
+
+  if (sorted) {
+    BulkLoader<KeysCount> loader{path, fill_factor};
+    while (std::getline(std::cin, line)) {
+      std::uint64_t key;
+      std::string_view record;
+      if (!parse(key, record)) {
+        continue;
+      }
+      if (!loader.Add(key, record)) {
+        std::cerr << "Key " << key << " is out of order\n";
+        return EXIT_FAILURE;
+      }
+      ++count;
+    }
+    loader.Finish();
+    std::cout << count << " records loaded, height " << loader.Height() << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  std::vector<std::string> records;
+  std::vector<std::uint64_t> keys;
+  while (std::getline(std::cin, line)) {
+    std::uint64_t key;
+    std::string_view record;
+    if (!parse(key, record)) {
+      continue;
+    }
+    keys.push_back(key);
+    records.emplace_back(record);
+  }
+
+  std::vector<std::pair<std::uint64_t, std::string_view>> items;
+  items.reserve(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    items.emplace_back(keys[i], records[i]);
+  }
+
+  if (!BulkLoad<KeysCount>(path, items, fill_factor)) {
+    std::cerr << "Keys are not unique\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << items.size() << " records loaded\n";
+  return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+      << " <tree-file> <order> [fill-factor] [--sorted] < input\n";
+    return EXIT_FAILURE;
+  }
+
+  std::string path = argv[1];
+  int order = std::atoi(argv[2]);
+  double fill_factor = 1.0;
+  bool sorted = false;
+
+  for (int i = 3; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--sorted") == 0) {
+      sorted = true;
+    } else {
+      fill_factor = std::atof(argv[i]);
+    }
+  }
+
+  switch (order) {
+    case 4: return Load<4>(path, fill_factor, sorted);
+    case 8: return Load<8>(path, fill_factor, sorted);
+    case 16: return Load<16>(path, fill_factor, sorted);
+    case 32: return Load<32>(path, fill_factor, sorted);
+    case 64: return Load<64>(path, fill_factor, sorted);
+    /* Nodes filling 4K, 16K and 64K pages */
+    case KeysPerPage<4096>: return Load<KeysPerPage<4096>>(path, fill_factor, sorted);
+    case KeysPerPage<16384>: return Load<KeysPerPage<16384>>(path, fill_factor, sorted);
+    case KeysPerPage<65536>: return Load<KeysPerPage<65536>>(path, fill_factor, sorted);
+  }
+
+  std::cerr << "Unsupported order " << order << " (4, 8, 16, 32, 64, "
+    << KeysPerPage<4096> << ", " << KeysPerPage<16384> << ", "
+    << KeysPerPage<65536> << ")\n";
+  return EXIT_FAILURE;
+}
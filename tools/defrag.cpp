@@ -0,0 +1,91 @@
+#include "blinktree.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_meta.h"
+
+/*
+ * defrag - lay leaves out in key order, see BLinkTree::Defragment.
+ *
+ * Usage: defrag <tree-file> [--records] [--pages N]
+ *
+ * Runs whole pass, N leaves per step (64 by default), so other
+ * processes with the tree open wait at most one step for the
+ * compaction lock. --records moves records after their leaves too.
+ * Prints leaf locality before and after.
+*/
+
+static void Print(const char* when, const LeafLocality& locality) {
+  std::printf("%s: %zu leaves, %zu forward, %zu sequential, "
+              "mean distance %.1f pages, %zu/%zu records near\n",
+              when, locality.leaves, locality.forward, locality.sequential,
+              locality.mean_distance, locality.records_near,
+              locality.records);
+}
+
+template <std::size_t KeysCount>
+int Defrag(const std::string& path, DefragOptions options) {
+  BLinkTree<KeysCount> tree{path};
+  Print("before", tree.Locality());
+
+  DefragStep total;
+  while (!total.done) {
+    DefragStep step = tree.Defragment(options);
+    total.visited += step.visited;
+    total.moved += step.moved;
+    total.done = step.done;
+  }
+
+  Print("after", tree.Locality());
+  std::printf("%zu leaves moved\n", total.moved);
+  return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+      << " <tree-file> [--records] [--pages N]\n";
+    return EXIT_FAILURE;
+  }
+
+  std::string path = argv[1];
+  DefragOptions options;
+  for (int i = 2; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--records") == 0) {
+      options.records = true;
+    } else if (std::strcmp(argv[i], "--pages") == 0 && i + 1 < argc) {
+      options.pages = static_cast<std::size_t>(std::atoll(argv[++i]));
+    }
+  }
+
+  /* Order decides the node layout, so it is read before opening */
+  FileMeta meta;
+  int fd = open(path.data(), O_RDONLY);
+  if (fd < 0 || pread(fd, &meta, sizeof(meta), 0) != sizeof(meta)) {
+    perror(path.data());
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  switch (meta.order) {
+    case 4: return Defrag<4>(path, options);
+    case 8: return Defrag<8>(path, options);
+    case 16: return Defrag<16>(path, options);
+    case 32: return Defrag<32>(path, options);
+    case 64: return Defrag<64>(path, options);
+    case KeysPerPage<4096>: return Defrag<KeysPerPage<4096>>(path, options);
+    case KeysPerPage<16384>: return Defrag<KeysPerPage<16384>>(path, options);
+    case KeysPerPage<65536>: return Defrag<KeysPerPage<65536>>(path, options);
+  }
+
+  std::cerr << "Unsupported order " << meta.order << "\n";
+  return EXIT_FAILURE;
+}
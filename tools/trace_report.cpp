@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * trace_report - rank nodes by time spent waiting for their locks.
+ *
+ * Usage: trace_report [-n top] <trace.json>...
+ *
+ * Reads traces written with BLINK_TRACE (one file per process,
+ * see trace.h) and prints:
+ * - time per span kind (operations, descents, splits, syncs...);
+ * - node offsets by total lock wait time, with their level,
+ *   so a hot root or right-most leaf stands out.
+*/
+
+struct Total {
+  std::uint64_t count{0};
+  double us{0};
+  double max_us{0};
+  unsigned level{0};
+
+  void Add(double dur) {
+    ++count;
+    us += dur;
+    max_us = std::max(max_us, dur);
+  }
+};
+
+
+/* Value of number field '"key":' in line, or false if absent */
+static bool Field(const std::string& line, const char* key, double& value) {
+  std::size_t at = line.find(key);
+  if (at == std::string::npos) {
+    return false;
+  }
+  value = std::strtod(line.c_str() + at + std::strlen(key), nullptr);
+  return true;
+}
+
+
+int main(int argc, char** argv) {
+  std::size_t top = 20;
+  int first = 1;
+  if (argc > 2 && std::string{argv[1]} == "-n") {
+    top = std::strtoull(argv[2], nullptr, 10);
+    first = 3;
+  }
+  if (first >= argc) {
+    std::cerr << "Usage: " << argv[0] << " [-n top] <trace.json>...\n";
+    return EXIT_FAILURE;
+  }
+
+  std::map<std::string, Total> kinds;
+  std::map<std::uint64_t, Total> waits;
+
+  for (int i = first; i < argc; ++i) {
+    std::ifstream input{argv[i]};
+    if (!input) {
+      std::cerr << "Cannot open " << argv[i] << "\n";
+      return EXIT_FAILURE;
+    }
+    std::string line;
+    while (std::getline(input, line)) {
+      std::size_t name_at = line.find("{\"name\":\"");
+      double dur;
+      if (name_at == std::string::npos || !Field(line, "\"dur\":", dur)) {
+        continue;
+      }
+      name_at += std::strlen("{\"name\":\"");
+      std::string name = line.substr(name_at, line.find('"', name_at) - name_at);
+      kinds[name].Add(dur);
+
+      double offset;
+      double level;
+      if (name == "lock_wait" && Field(line, "\"offset\":", offset)
+          && Field(line, "\"level\":", level)) {
+        Total& total = waits[static_cast<std::uint64_t>(offset)];
+        total.Add(dur);
+        total.level = static_cast<unsigned>(level);
+      }
+    }
+  }
+
+  printf("%-14s %10s %12s %10s %10s\n",
+         "span", "count", "total_ms", "avg_us", "max_us");
+  for (const auto& [name, total] : kinds) {
+    printf("%-14s %10llu %12.3f %10.2f %10.2f\n", name.c_str(),
+           static_cast<unsigned long long>(total.count), total.us / 1000,
+           total.us / total.count, total.max_us);
+  }
+
+  std::vector<std::pair<std::uint64_t, Total>> ranked(waits.begin(),
+                                                      waits.end());
+  std::sort(ranked.begin(), ranked.end(), [](const auto& lhs, const auto& rhs) {
+    return lhs.second.us > rhs.second.us;
+  });
+  double all = kinds.count("lock_wait") ? kinds["lock_wait"].us : 0;
+
+  printf("\nHot nodes by lock wait time:\n");
+  printf("%14s %6s %10s %12s %10s %7s\n",
+         "offset", "level", "waits", "total_ms", "max_us", "share");
+  for (std::size_t i = 0; i < std::min(top, ranked.size()); ++i) {
+    const auto& [offset, total] = ranked[i];
+    printf("%14llu %6u %10llu %12.3f %10.2f %6.1f%%\n",
+           static_cast<unsigned long long>(offset), total.level,
+           static_cast<unsigned long long>(total.count), total.us / 1000,
+           total.max_us, all > 0 ? 100 * total.us / all : 0.0);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+#include "touch_file.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+
+#include "stats.h"
+
+/*
+ * tree_stats - print operation counters of a tree file.
+ *
+ * Usage: tree_stats <tree-file> [--reset]
+ *
+ * Counters are summed over every process that has used the tree
+ * since its '<tree-file>.stats' was created; --reset zeroes them
+ * after printing.
+*/
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <tree-file> [--reset]\n";
+    return EXIT_FAILURE;
+  }
+
+  PrintStats(argv[1]);
+
+  if (argc > 2 && std::string_view{argv[2]} == "--reset") {
+    StatsTable* table = OpenStatsTable(argv[1]);
+    if (table == nullptr) {
+      return EXIT_FAILURE;
+    }
+    ResetStats(table);
+    CloseStatsTable(table);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -3,6 +3,8 @@
 
 #include "node.hpp"
 #include "file_meta.h"
+#include "stats.h"
+#include "wal.h"
 
 #include <filesystem>
 #include <iostream>
@@ -30,6 +32,9 @@ void TouchTreeFile(std::string_view path_view) {
     std::cerr << "Error in open tree file\n";
     exit(EXIT_FAILURE);
   }
+  /* Log and counters of previous tree at this path are not ours */
+  RemoveWal(path_view.data());
+  RemoveStats(path_view.data());
 
   ssize_t written;
 
@@ -39,6 +44,7 @@ void TouchTreeFile(std::string_view path_view) {
 
   Node<KeysCount> root;
   root.InitRoot();
+  root.UpdateChecksum();
 
   written = pwrite(fd, &root, sizeof(root), sizeof(meta));
 
@@ -94,4 +100,39 @@ void ReadBinFile(std::string_view path_view) {
   close(fd);
 }
 
+
+/*
+ * PrintStats -
+ * dump counters of the tree at 'path' (see stats.h);
+ * counters that are still zero are left out.
+*/
+inline void PrintStats(std::string_view path_view) {
+  StatsTable* table = OpenStatsTable(path_view.data());
+  if (table == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  TreeStats stats;
+  ReadStats(table, &stats);
+  CloseStatsTable(table);
+
+  std::cout << "Stats:\n";
+  for (int i = 0; i < STATS_COUNTERS; ++i) {
+    if (i < STATS_SPLITS || stats.counters[i] != 0) {
+      std::cout << "\t- " << StatsCounterName(i) << ": "
+        << stats.counters[i] << "\n";
+    }
+  }
+
+  auto average = [](std::uint64_t ns, std::uint64_t calls) {
+    return calls == 0 ? 0.0 : ns / 1000.0 / calls;
+  };
+  std::cout << "\t- msync_avg_us: "
+    << average(stats.counters[STATS_MSYNC_NS],
+               stats.counters[STATS_MSYNC_CALLS])
+    << "\n\t- fdatasync_avg_us: "
+    << average(stats.counters[STATS_FDATASYNC_NS],
+               stats.counters[STATS_FDATASYNC_CALLS])
+    << "\n";
+}
+
 #endif  // TOUCH_FILE_HPP
@@ -0,0 +1,233 @@
+#include "trace.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "owner.h"
+
+/* Spans of operations, kept per process.
+ *
+ * Every thread writes into a ring of its own without any lock:
+ * event is filled in, then 'head' is published. Rings are never
+ * freed: ring of finished thread is taken by the next new one,
+ * so spans of short lived threads survive until exported.
+ * Export reads rings while they may be written; events being
+ * overwritten at that moment may come out torn, so export
+ * is meant for quiet moments (exit, between runs). */
+
+struct TraceRing {
+  struct TraceRing* next;
+  uint32_t owned; /* 1 while some thread writes into it */
+  uint64_t head; /* events written so far */
+
+  struct TraceEvent events[TRACE_RING_EVENTS];
+};
+
+bool trace_enabled = false;
+
+static char trace_prefix[PATH_MAX];
+static struct TraceRing* rings = NULL;
+static pthread_key_t ring_key;
+
+static __thread struct TraceRing* ring = NULL;
+
+static const char* const kKindNames[TRACE_KINDS] = {
+  "search",
+  "get",
+  "multi_get",
+  "insert",
+  "insert_batch",
+  "remove",
+  "scan",
+  "compact",
+  "descent",
+  "lock_wait",
+  "read_fallback",
+  "split",
+  "root_split",
+  "allocate",
+  "msync",
+  "fdatasync",
+};
+
+static void ReleaseRing(void* arg) {
+  struct TraceRing* owned = (struct TraceRing*)arg;
+  __atomic_store_n(&owned->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* Child of fork has the only thread: parent's spans are not its own */
+static void ForgetRings(void) {
+  for (struct TraceRing* r = rings; r != NULL; r = r->next) {
+    r->owned = 0;
+    r->head = 0;
+  }
+  ring = NULL;
+}
+
+__attribute__((constructor))
+static void InitTrace(void) {
+  (void)pthread_key_create(&ring_key, ReleaseRing);
+  (void)pthread_atfork(NULL, NULL, ForgetRings);
+
+  const char* prefix = getenv("BLINK_TRACE");
+  if (prefix != NULL && *prefix != '\0'
+      && strlen(prefix) < sizeof(trace_prefix)) {
+    strcpy(trace_prefix, prefix);
+    trace_enabled = true;
+    atexit(TraceDump);
+  }
+}
+
+
+void TraceEnable(bool enabled) {
+  __atomic_store_n(&trace_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+uint64_t TraceNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/*
+ * GetRing -
+ * ring of calling thread: one left by a finished thread,
+ * or a new one.
+ *
+ * Returns:
+ * @ring: ring of the thread, or NULL if out of memory.
+*/
+static struct TraceRing* GetRing(void) {
+  if (ring != NULL) {
+    return ring;
+  }
+
+  for (struct TraceRing* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+       r != NULL; r = r->next) {
+    uint32_t owned = 0;
+    if (__atomic_compare_exchange_n(&r->owned, &owned, 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      ring = r;
+      break;
+    }
+  }
+
+  if (ring == NULL) {
+    struct TraceRing* fresh =
+      (struct TraceRing*)calloc(1, sizeof(struct TraceRing));
+    if (fresh == NULL) {
+      return NULL;
+    }
+    fresh->owned = 1;
+    fresh->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &fresh->next, fresh, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    ring = fresh;
+  }
+
+  (void)pthread_setspecific(ring_key, ring);
+  return ring;
+}
+
+
+/*
+ * TraceRecord -
+ * add span of 'kind' from 'begin' till now to thread's ring.
+ * @offset: node or extent the span is about, 0 if none
+ * @level: level of that node
+*/
+void TraceRecord(enum TraceKind kind, uint64_t begin,
+                 off_t offset, uint32_t level) {
+  struct TraceRing* r = GetRing();
+  if (r == NULL) {
+    return;
+  }
+
+  uint64_t head = r->head;
+  struct TraceEvent* event = &r->events[head % TRACE_RING_EVENTS];
+  event->begin = begin;
+  event->end = TraceNow();
+  event->offset = (uint64_t)offset;
+  event->tid = CurrentTid();
+  event->level = (uint16_t)level;
+  event->kind = (uint16_t)kind;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * TraceWrite -
+ * write spans of this process as Chrome trace event JSON,
+ * readable by chrome://tracing and Perfetto. One event per line.
+*/
+void TraceWrite(FILE* file) {
+  int pid = (int)getpid();
+  fprintf(file, "{\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"blinktree %d\"}}", pid, pid);
+
+  for (struct TraceRing* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+       r != NULL; r = r->next) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+    for (uint64_t i = first; i < head; ++i) {
+      const struct TraceEvent* event = &r->events[i % TRACE_RING_EVENTS];
+      if (event->kind >= TRACE_KINDS || event->end < event->begin) {
+        continue;
+      }
+      fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"blink\",\"ph\":\"X\","
+              "\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+              "\"args\":{\"offset\":%llu,\"level\":%u}}",
+              kKindNames[event->kind], pid, event->tid,
+              event->begin / 1000.0, (event->end - event->begin) / 1000.0,
+              (unsigned long long)event->offset, event->level);
+    }
+  }
+
+  fprintf(file, "\n]}\n");
+}
+
+bool TraceExport(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    perror("fopen");
+    return false;
+  }
+  TraceWrite(file);
+  return fclose(file) == 0;
+}
+
+/*
+ * TraceDump -
+ * export spans to '<prefix>.<pid>.json' if tracing was turned on
+ * by BLINK_TRACE; for processes that leave by _exit.
+*/
+void TraceDump(void) {
+  if (trace_prefix[0] == '\0') {
+    return;
+  }
+  char path[PATH_MAX + 16];
+  snprintf(path, sizeof(path), "%s.%d.json", trace_prefix, (int)getpid());
+  (void)TraceExport(path);
+}
+
+/* Drop spans recorded so far; no operation should be running */
+void TraceClear(void) {
+  for (struct TraceRing* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+       r != NULL; r = r->next) {
+    __atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+  }
+}
+
+const char* TraceKindName(int kind) {
+  return kind >= 0 && kind < TRACE_KINDS ? kKindNames[kind] : "unknown";
+}
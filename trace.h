@@ -0,0 +1,79 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define TRACE_RING_EVENTS (1 << 15) /* latest events kept per thread */
+
+/* Tracing is off unless BLINK_TRACE=<prefix> is set at start,
+ * then every process dumps '<prefix>.<pid>.json' at exit
+ * (or at TraceDump). TraceEnable turns it on and off at run time. */
+
+enum TraceKind {
+  TRACE_SEARCH,
+  TRACE_GET,
+  TRACE_MULTI_GET,
+  TRACE_INSERT,
+  TRACE_INSERT_BATCH,
+  TRACE_REMOVE,
+  TRACE_SCAN,
+  TRACE_COMPACT,
+  TRACE_DESCENT,
+  TRACE_LOCK_WAIT, /* node offset and level */
+  TRACE_READ_FALLBACK, /* node offset and level */
+  TRACE_SPLIT, /* node offset and level */
+  TRACE_ROOT_SPLIT,
+  TRACE_ALLOCATE, /* offset of the new extent */
+  TRACE_MSYNC,
+  TRACE_FDATASYNC,
+  TRACE_KINDS
+};
+
+/* Complete span; 32 bytes, so a ring is 1 MiB */
+struct TraceEvent {
+  uint64_t begin; /* ns, CLOCK_MONOTONIC: same in every process */
+  uint64_t end;
+  uint64_t offset;
+  uint32_t tid;
+  uint16_t level;
+  uint16_t kind;
+};
+
+extern bool trace_enabled;
+
+
+void TraceEnable(bool enabled);
+
+uint64_t TraceNow(void);
+
+void TraceRecord(enum TraceKind kind, uint64_t begin,
+                 off_t offset, uint32_t level);
+
+void TraceWrite(FILE* file);
+
+bool TraceExport(const char* path);
+
+void TraceDump(void);
+
+void TraceClear(void);
+
+const char* TraceKindName(int kind);
+
+/* Start of span, or 0 if tracing is off */
+static inline uint64_t TraceBegin(void) {
+  return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED) ? TraceNow() : 0;
+}
+
+/* Span started by TraceBegin is over */
+static inline void TraceEnd(enum TraceKind kind, uint64_t begin,
+                            off_t offset, uint32_t level) {
+  if (begin != 0) {
+    TraceRecord(kind, begin, offset, level);
+  }
+}
+
+#endif  // TRACE_H
@@ -0,0 +1,407 @@
+#include "versions.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "owner.h"
+
+/* Node versions kept for snapshots.
+ *
+ * Snapshot takes its epoch with EpochAdvance: versions stamped at or
+ * before it are what it sees. Node written since is stamped later, and
+ * the version it replaced is copied here first if some snapshot may
+ * need it, so every node heads a chain of older versions. Copies are
+ * appended and never changed, so they are read with no lock at all.
+ * Space is bump allocated and given back as a whole when the last
+ * snapshot is released: only then nobody can follow a chain.
+ * The first process to open the store drops whatever is left in it:
+ * snapshots die with their processes, and records deferred by them
+ * may have been brought back by log replay. */
+
+#define VERSION_GROWTH ((size_t)1 << 20) /* file grows at least by */
+#define VERSION_DEFERRED_COUNT \
+  ((VERSION_DATA - 2 * sizeof(uint64_t)) / sizeof(struct DeferredRecord))
+
+struct DeferredRecord {
+  uint64_t ptr;
+  uint64_t size;
+};
+
+/* Page of records removed while snapshots were open */
+struct DeferredPage {
+  uint64_t next; /* page filled before, or 0 */
+  uint64_t count;
+  struct DeferredRecord records[VERSION_DEFERRED_COUNT];
+};
+
+/*
+ * LockStore, UnlockStore -
+ * spin lock keeping holder's tid; lock of dead holder is stolen.
+*/
+static void LockStore(struct VersionHeader* header) {
+  for (unsigned spins = 0; ; ++spins) {
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&header->lock, &expected, CurrentTid(),
+                                    true, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      return;
+    }
+    if (spins % 1024 == 1023 && expected != 0 && !OwnerIsAlive(expected)
+        && __atomic_compare_exchange_n(&header->lock, &expected,
+                                       CurrentTid(), false, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED)) {
+      return;
+    }
+    sched_yield();
+  }
+}
+
+static void UnlockStore(struct VersionHeader* header) {
+  __atomic_store_n(&header->lock, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * OpenVersionStore -
+ * open versions of tree at 'tree_path'; the first opener empties it.
+ *
+ * Returns:
+ * @store: store handle, or NULL on failure.
+*/
+struct VersionStore* OpenVersionStore(const char* tree_path) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s.versions", tree_path)
+      >= (int)sizeof(path)) {
+    fprintf(stderr, "OpenVersionStore: path is too long\n");
+    return NULL;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+
+  bool alone = TryLockAlone(fd);
+  if (alone) {
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, VERSION_DATA) == -1) {
+      perror("ftruncate");
+      close(fd);
+      return NULL;
+    }
+  } else {
+    /* Waits for the first opener to empty it */
+    LockShared(fd, F_OFD_SETLKW);
+  }
+
+  struct VersionStore* store =
+    (struct VersionStore*)calloc(1, sizeof(struct VersionStore));
+  struct MappingOptions options = { .reserve = MAPPING_MIN_RESERVE };
+  if (OpenMapping(&store->mapping, fd, &options) == -1) {
+    free(store);
+    close(fd);
+    return NULL;
+  }
+  store->header = (struct VersionHeader*)store->mapping.base;
+
+  if (alone) {
+    struct VersionHeader* header = store->header;
+    header->end = VERSION_DATA;
+    header->magic = VERSION_STORE_MAGIC;
+
+    LockShared(fd, F_OFD_SETLK);
+  }
+
+  return store;
+}
+
+void CloseVersionStore(struct VersionStore* store) {
+  if (store == NULL) {
+    return;
+  }
+  int fd = store->mapping.fd;
+  CloseMapping(&store->mapping);
+  close(fd);
+  free(store);
+}
+
+
+/*
+ * Allocate -
+ * append 'size' bytes to the store, growing the file if needed.
+ * Store MUST be locked.
+ *
+ * Returns:
+ * @offset: of allocated bytes, or 0 on failure.
+*/
+static uint64_t Allocate(struct VersionStore* store, size_t size) {
+  struct VersionHeader* header = store->header;
+  size = (size + VERSION_DATA - 1) / VERSION_DATA * VERSION_DATA;
+  uint64_t offset = header->end;
+
+  /* File may have been shrunk and grown by other processes */
+  struct stat statbuf;
+  if (fstat(store->mapping.fd, &statbuf) == -1) {
+    perror("fstat");
+    return 0;
+  }
+  if ((uint64_t)statbuf.st_size < offset + size) {
+    off_t grown = (off_t)(offset + (size > VERSION_GROWTH
+                                    ? size : VERSION_GROWTH));
+    if (ftruncate(store->mapping.fd, grown) == -1) {
+      perror("ftruncate");
+      return 0;
+    }
+  }
+  if (MappingSize(&store->mapping) < offset + size
+      && !ExtendMapping(&store->mapping)) {
+    return 0;
+  }
+
+  header->end = offset + size;
+  return offset;
+}
+
+
+/*
+ * ReleaseSlot -
+ * free snapshot slot. Store MUST be locked.
+ *
+ * Returns:
+ * @bool: true if it was the last snapshot open.
+*/
+static bool ReleaseSlot(struct VersionHeader* header, int slot) {
+  __atomic_store_n(&header->slots[slot].epoch, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&header->slots[slot].pid, 0, __ATOMIC_RELEASE);
+  return __atomic_sub_fetch(&header->open, 1, __ATOMIC_SEQ_CST) == 0;
+}
+
+
+/*
+ * TakeSnapshot -
+ * open snapshot at the current epoch.
+ * Slot is published before the epoch is taken, so writers that
+ * stamp nodes after the epoch already see that versions are needed;
+ * writers that stamped before it are waited for by the caller
+ * (see EpochBlockWriters).
+ *
+ * @epoch: epoch of the snapshot.
+ *
+ * Returns:
+ * @slot: to release it with, or -1 if all slots are taken.
+*/
+int TakeSnapshot(struct VersionStore* store, struct EpochTable* epochs,
+                 uint64_t* epoch) {
+  struct VersionHeader* header = store->header;
+  uint32_t pid = (uint32_t)getpid();
+  int taken = -1;
+
+  LockStore(header);
+  for (int i = 0; i < VERSION_SNAPSHOTS; ++i) {
+    struct VersionSlot* slot = &header->slots[i];
+    if (slot->pid != 0 && !OwnerIsAlive(slot->pid)) {
+      /* Its deferred records wait for the last release */
+      (void)ReleaseSlot(header, i);
+    }
+    if (slot->pid == 0 && taken == -1) {
+      taken = i;
+    }
+  }
+  if (taken == -1) {
+    UnlockStore(header);
+    fprintf(stderr, "TakeSnapshot: all %d slots are taken\n",
+            VERSION_SNAPSHOTS);
+    return -1;
+  }
+  header->slots[taken].pid = pid;
+  __atomic_store_n(&header->slots[taken].epoch, VERSION_PENDING,
+                   __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&header->open, 1, __ATOMIC_SEQ_CST);
+  UnlockStore(header);
+
+  *epoch = EpochAdvance(epochs);
+  __atomic_store_n(&header->slots[taken].epoch, *epoch + 1,
+                   __ATOMIC_SEQ_CST);
+
+  return taken;
+}
+
+
+/*
+ * ReleaseSnapshot -
+ * close snapshot taken into 'slot'. The last one to go
+ * empties the store and frees every deferred record
+ * by 'free_record', outside of the store lock.
+*/
+void ReleaseSnapshot(struct VersionStore* store, int slot,
+                     VersionFree free_record, void* arg) {
+  struct VersionHeader* header = store->header;
+  struct DeferredRecord* records = NULL;
+  size_t count = 0;
+
+  LockStore(header);
+  if (ReleaseSlot(header, slot)) {
+    size_t capacity = 0;
+    for (uint64_t page = header->deferred; page != 0; ) {
+      const struct DeferredPage* deferred = (const struct DeferredPage*)
+        VersionAt(store, page, sizeof(struct DeferredPage));
+      if (count + deferred->count > capacity) {
+        capacity = (count + deferred->count) * 2;
+        records = (struct DeferredRecord*)realloc(
+          records, capacity * sizeof(struct DeferredRecord));
+      }
+      memcpy(records + count, deferred->records,
+             deferred->count * sizeof(struct DeferredRecord));
+      count += deferred->count;
+      page = deferred->next;
+    }
+
+    header->deferred = 0;
+    header->end = VERSION_DATA;
+    if (ftruncate(store->mapping.fd, VERSION_DATA) == -1) {
+      perror("ftruncate");
+    }
+  }
+  UnlockStore(header);
+
+  for (size_t i = 0; i < count; ++i) {
+    free_record(arg, (off_t)records[i].ptr, records[i].size);
+  }
+  free(records);
+}
+
+
+/*
+ * VersionNeeded -
+ * some open snapshot may read version of node stamped at 'stamp'.
+*/
+bool VersionNeeded(struct VersionStore* store, uint64_t stamp) {
+  struct VersionHeader* header = store->header;
+
+  for (int i = 0; i < VERSION_SNAPSHOTS; ++i) {
+    uint64_t epoch = __atomic_load_n(&header->slots[i].epoch,
+                                     __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch - 1 >= stamp) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*
+ * VersionOldest -
+ * epoch of the oldest snapshot open (UINT64_MAX if there are none).
+ * Nodes it may reach are unlinked later, so they are not reused
+ * before oldest snapshot is above their stamp, just as with EpochOldest.
+*/
+uint64_t VersionOldest(struct VersionStore* store) {
+  struct VersionHeader* header = store->header;
+  uint64_t oldest = UINT64_MAX;
+
+  for (int i = 0; i < VERSION_SNAPSHOTS; ++i) {
+    uint64_t epoch = __atomic_load_n(&header->slots[i].epoch,
+                                     __ATOMIC_SEQ_CST);
+    if (epoch == VERSION_PENDING) {
+      /* Epoch of the snapshot is not known yet */
+      return 0;
+    }
+    if (epoch != 0 && epoch - 1 < oldest) {
+      oldest = epoch - 1;
+    }
+  }
+  return oldest;
+}
+
+
+/*
+ * VersionCopy -
+ * keep copy of 'size' bytes at 'data' (version of a node).
+ *
+ * @offset: of the copy, or 0 if no snapshot is open anymore.
+ *
+ * Returns:
+ * @bool: false if store cannot grow.
+*/
+bool VersionCopy(struct VersionStore* store, const void* data, size_t size,
+                 uint64_t* offset) {
+  struct VersionHeader* header = store->header;
+  bool ok = true;
+  *offset = 0;
+
+  LockStore(header);
+  if (header->open > 0) {
+    *offset = Allocate(store, size);
+    if (*offset != 0) {
+      memcpy(store->mapping.base + *offset, data, size);
+    } else {
+      ok = false;
+    }
+  }
+  UnlockStore(header);
+
+  return ok;
+}
+
+
+/* Copy at 'offset' made by VersionCopy, mapped if made by other process */
+const void* VersionAt(struct VersionStore* store, uint64_t offset,
+                      size_t size) {
+  if (MappingSize(&store->mapping) < offset + size
+      && !ExtendMapping(&store->mapping)) {
+    exit(EXIT_FAILURE);
+  }
+  return store->mapping.base + offset;
+}
+
+
+/*
+ * VersionDefer -
+ * put record of 'size' bytes at 'ptr' off until the last snapshot
+ * is released, if any is open.
+ *
+ * Returns:
+ * @bool: true if deferred; false if record is to be freed now.
+*/
+bool VersionDefer(struct VersionStore* store, off_t ptr, size_t size) {
+  struct VersionHeader* header = store->header;
+  bool deferred = false;
+
+  LockStore(header);
+  if (header->open > 0) {
+    struct DeferredPage* page = header->deferred == 0 ? NULL
+      : (struct DeferredPage*)VersionAt(store, header->deferred,
+                                        sizeof(struct DeferredPage));
+
+    if (page == NULL || page->count == VERSION_DEFERRED_COUNT) {
+      uint64_t offset = Allocate(store, sizeof(struct DeferredPage));
+      if (offset != 0) {
+        struct DeferredPage* fresh =
+          (struct DeferredPage*)(store->mapping.base + offset);
+        fresh->next = header->deferred;
+        fresh->count = 0;
+        header->deferred = offset;
+        page = fresh;
+      } else {
+        page = NULL;
+      }
+    }
+    if (page != NULL) {
+      page->records[page->count++] =
+        (struct DeferredRecord){ .ptr = (uint64_t)ptr, .size = size };
+      deferred = true;
+    }
+  }
+  UnlockStore(header);
+
+  return deferred;
+}
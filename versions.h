@@ -0,0 +1,77 @@
+#ifndef VERSIONS_H
+#define VERSIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "epoch.h"
+#include "mapping.h"
+
+#define VERSION_STORE_MAGIC 0x4e535245564b4c42ULL /* "BLKVERSN" */
+#define VERSION_SNAPSHOTS 64 /* snapshots open at once, all processes */
+#define VERSION_DATA 4096 /* versions start after the header page */
+#define VERSION_PENDING UINT64_MAX /* snapshot is being taken */
+
+/* Snapshot of a process with 'pid' */
+struct VersionSlot {
+  uint32_t pid; /* 0 if slot is free */
+  uint32_t reserved;
+  uint64_t epoch; /* snapshot's epoch plus 1; 0 if slot is free */
+};
+
+/* Header page of sidecar file '<tree>.versions', shared by processes.
+ * While snapshots are open, writers copy node versions that some
+ * snapshot may still read here before changing the node, and records
+ * removed meanwhile are put on the deferred list instead of freed.
+ * Both are dropped when the last snapshot is released. */
+struct VersionHeader {
+  uint64_t magic;
+  uint64_t end; /* versions are appended here */
+  uint64_t deferred; /* page of deferred records filled last, or 0 */
+  uint32_t lock; /* tid of holder, 0 if free */
+  uint32_t open; /* snapshots taken and not released */
+
+  char pad[64 - 3 * sizeof(uint64_t) - 2 * sizeof(uint32_t)];
+
+  struct VersionSlot slots[VERSION_SNAPSHOTS];
+};
+
+struct VersionStore {
+  struct VersionHeader* header; /* mapping.base */
+  struct Mapping mapping;
+};
+
+/* Called for every deferred record when the last snapshot is released */
+typedef void (*VersionFree)(void* arg, off_t ptr, size_t size);
+
+
+struct VersionStore* OpenVersionStore(const char* tree_path);
+
+void CloseVersionStore(struct VersionStore* store);
+
+int TakeSnapshot(struct VersionStore* store, struct EpochTable* epochs,
+                 uint64_t* epoch);
+
+void ReleaseSnapshot(struct VersionStore* store, int slot,
+                     VersionFree free_record, void* arg);
+
+bool VersionNeeded(struct VersionStore* store, uint64_t stamp);
+
+uint64_t VersionOldest(struct VersionStore* store);
+
+bool VersionCopy(struct VersionStore* store, const void* data, size_t size,
+                 uint64_t* offset);
+
+const void* VersionAt(struct VersionStore* store, uint64_t offset,
+                      size_t size);
+
+bool VersionDefer(struct VersionStore* store, off_t ptr, size_t size);
+
+/* Some snapshot is open; writers need to look closer */
+static inline bool VersionsOpen(const struct VersionStore* store) {
+  return __atomic_load_n(&store->header->open, __ATOMIC_SEQ_CST) != 0;
+}
+
+#endif  // VERSIONS_H
@@ -0,0 +1,677 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "checksum.h"
+#include "memory_sync.h"
+#include "owner.h"
+
+/* Redo log with group commit.
+ *
+ * Writer reserves place for a group of images under a short spin lock,
+ * copies images into the mmapped ring without any lock and stamps the
+ * group with its lsn. Committer waits until log is durable up to its lsn:
+ * the first one to come takes 'flush_lock', waits for all reserved groups
+ * to be stamped and makes one fdatasync for everybody; others sleep on
+ * 'flush_seq'. Dead writers and leaders are detected by tid, as latches do.
+ *
+ * Tree pages are written back by the kernel whenever it wants; checkpoint
+ * fdatasyncs the tree file and moves 'checkpoint_lsn', freeing the ring.
+ * Pages cached outside the mapping are written by the flusher first
+ * (see WalSetFlusher).
+ * The first process to open the log replays every intact group after
+ * 'checkpoint_lsn'. Replay stops at the first torn or missing group, so
+ * the tree gets a prefix of the log: no operation is replayed without
+ * the ones it depended on (they hold lower lsns).
+ * Writeback of mmapped pages cannot be held back until their log is
+ * durable; replay overwrites such early pages with their last logged
+ * image, only a page with no durable image since checkpoint keeps it. */
+
+#define WAL_HEADER_SIZE 4096
+#define WAL_MAX_IMAGE(wal) ((wal)->capacity / 8) /* bigger are synced in place */
+#define WAL_RING_NODES 16 /* ring holds at least this many node images */
+#define WAL_CHECKPOINT_MS 100 /* checkpointer wakes up this often */
+#define WAL_WAIT_NS 10000000 /* 10ms; then check if flush leader is alive */
+
+struct WalGroup {
+  uint64_t lsn; /* equals group's position once complete; written last */
+  uint32_t size; /* whole group with header, multiple of WAL_ALIGN */
+  uint32_t crc; /* CRC32C of everything after header */
+  uint32_t owner; /* tid of writer */
+  uint32_t count; /* number of images; 0 for padding */
+  uint64_t reserved;
+};
+
+struct WalImageHeader {
+  int64_t offset;
+  uint32_t size;
+  uint32_t zero; /* no data follows, zeroes are written */
+};
+
+struct Wal {
+  int fd;
+  int tree_fd;
+
+  struct WalHeader* header;
+  char* ring;
+  uint64_t capacity;
+
+  void (*flush)(void* arg); /* writes pages cached by the process */
+  void* flush_arg;
+
+  pid_t pid; /* process that started checkpointer */
+  pthread_t checkpointer;
+  uint32_t stop;
+};
+
+static __thread uint64_t appended_lsn = 0;
+
+
+/*
+ * TryLockOwned, LockOwned, UnlockOwned -
+ * spin lock keeping holder's tid; lock of dead holder is stolen.
+*/
+static bool TryLockOwned(uint32_t* word) {
+  uint32_t expected = 0;
+  if (__atomic_compare_exchange_n(word, &expected, CurrentTid(), false,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return true;
+  }
+  if (!OwnerIsAlive(expected)) {
+    /* Steal; loser of the race simply fails */
+    return __atomic_compare_exchange_n(word, &expected, CurrentTid(), false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  }
+  return false;
+}
+
+static void LockOwned(uint32_t* word) {
+  uint32_t expected = 0;
+  for (unsigned spins = 0; ; ++spins) {
+    expected = 0;
+    if (__atomic_compare_exchange_n(word, &expected, CurrentTid(), true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return;
+    }
+    if (spins % 1024 == 1023 && TryLockOwned(word)) {
+      return;
+    }
+    sched_yield();
+  }
+}
+
+static void UnlockOwned(uint32_t* word) {
+  __atomic_store_n(word, 0, __ATOMIC_RELEASE);
+}
+
+
+static uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static struct WalGroup* GroupAt(struct Wal* wal, uint64_t lsn) {
+  return (struct WalGroup*)(wal->ring + lsn % wal->capacity);
+}
+
+
+/*
+ * Flush -
+ * make every group reserved so far durable.
+ * Called by flush leader only.
+*/
+static void Flush(struct Wal* wal) {
+  struct WalHeader* header = wal->header;
+  uint64_t target = __atomic_load_n(&header->reserved_lsn, __ATOMIC_ACQUIRE);
+  uint64_t lsn = __atomic_load_n(&header->flushed_lsn, __ATOMIC_RELAXED);
+
+  while (lsn < target) {
+    struct WalGroup* group = GroupAt(wal, lsn);
+
+    for (unsigned spins = 0;
+         __atomic_load_n(&group->lsn, __ATOMIC_ACQUIRE) != lsn; ++spins) {
+      if (spins % 1024 == 1023 && !OwnerIsAlive(group->owner)) {
+        /* Writer died before completing the group */
+        group->count = 0;
+        __atomic_store_n(&group->lsn, lsn, __ATOMIC_RELEASE);
+        break;
+      }
+      sched_yield();
+    }
+
+    lsn += group->size;
+  }
+
+  if (DataSync(wal->fd) == -1) {
+    perror("fdatasync");
+    exit(EXIT_FAILURE);
+  }
+
+  __atomic_store_n(&header->flushed_lsn, lsn, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * WalCommit -
+ * wait until log is durable up to 'lsn'.
+ * Committers coming while a flush is in progress are served
+ * together by the next one.
+*/
+void WalCommit(struct Wal* wal, uint64_t lsn) {
+  struct WalHeader* header = wal->header;
+
+  while (__atomic_load_n(&header->flushed_lsn, __ATOMIC_ACQUIRE) < lsn) {
+    uint32_t seq = __atomic_load_n(&header->flush_seq, __ATOMIC_ACQUIRE);
+
+    if (TryLockOwned(&header->flush_lock)) {
+      if (__atomic_load_n(&header->flushed_lsn, __ATOMIC_ACQUIRE) < lsn) {
+        Flush(wal);
+      }
+      UnlockOwned(&header->flush_lock);
+
+      __atomic_add_fetch(&header->flush_seq, 1, __ATOMIC_RELEASE);
+      FutexWakeAll(&header->flush_seq);
+      continue;
+    }
+
+    FutexWait(&header->flush_seq, seq, WAL_WAIT_NS);
+  }
+}
+
+
+/*
+ * WalTryCommit -
+ * WalCommit that does not wait for flush of another thread:
+ * log is flushed by the caller if nobody is flushing it.
+ *
+ * Returns:
+ * @bool: true if log is durable up to 'lsn'.
+*/
+bool WalTryCommit(struct Wal* wal, uint64_t lsn) {
+  struct WalHeader* header = wal->header;
+
+  if (__atomic_load_n(&header->flushed_lsn, __ATOMIC_ACQUIRE) >= lsn) {
+    return true;
+  }
+
+  if (TryLockOwned(&header->flush_lock)) {
+    if (__atomic_load_n(&header->flushed_lsn, __ATOMIC_ACQUIRE) < lsn) {
+      Flush(wal);
+    }
+    UnlockOwned(&header->flush_lock);
+
+    __atomic_add_fetch(&header->flush_seq, 1, __ATOMIC_RELEASE);
+    FutexWakeAll(&header->flush_seq);
+  }
+
+  return __atomic_load_n(&header->flushed_lsn, __ATOMIC_ACQUIRE) >= lsn;
+}
+
+
+/*
+ * WalCheckpoint -
+ * write tree pages back and drop the log before it.
+ * Returns at once if another checkpoint is in progress.
+*/
+void WalCheckpoint(struct Wal* wal) {
+  struct WalHeader* header = wal->header;
+
+  if (!TryLockOwned(&header->checkpoint_lock)) {
+    sched_yield();
+    return;
+  }
+
+  /* Groups below 'lsn' were logged after their pages were modified */
+  uint64_t lsn = __atomic_load_n(&header->reserved_lsn, __ATOMIC_ACQUIRE);
+  WalCommit(wal, lsn);
+
+  void (*flush)(void*) = __atomic_load_n(&wal->flush, __ATOMIC_ACQUIRE);
+  if (flush != NULL) {
+    flush(wal->flush_arg);
+  }
+
+  if (DataSync(wal->tree_fd) == -1) {
+    perror("fdatasync");
+    exit(EXIT_FAILURE);
+  }
+
+  if (lsn > __atomic_load_n(&header->checkpoint_lsn, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&header->checkpoint_lsn, lsn, __ATOMIC_RELEASE);
+    MSync(header, WAL_HEADER_SIZE);
+  }
+
+  UnlockOwned(&header->checkpoint_lock);
+}
+
+
+/*
+ * WalSetFlusher -
+ * 'flush' writes tree pages the process keeps out of the mapping;
+ * checkpoint calls it before syncing the tree file. It runs on
+ * any thread, concurrently with writers, until the log is closed.
+*/
+void WalSetFlusher(struct Wal* wal, void (*flush)(void* arg), void* arg) {
+  wal->flush_arg = arg;
+  __atomic_store_n(&wal->flush, flush, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Reserve -
+ * take place for a group of 'size' bytes.
+ * Group never wraps around the ring: tail is filled with padding.
+ * If ring is full, checkpoint is made first.
+ *
+ * Returns:
+ * @lsn: position of the group.
+*/
+static uint64_t Reserve(struct Wal* wal, uint32_t size) {
+  struct WalHeader* header = wal->header;
+
+  while (true) {
+    LockOwned(&header->reserve_lock);
+
+    uint64_t lsn = header->reserved_lsn;
+    uint64_t tail = wal->capacity - lsn % wal->capacity;
+    uint64_t needed = (tail < size ? tail : 0) + size;
+    uint64_t checkpoint_lsn =
+      __atomic_load_n(&header->checkpoint_lsn, __ATOMIC_ACQUIRE);
+
+    if (lsn + needed - checkpoint_lsn <= wal->capacity) {
+      if (tail < size) {
+        struct WalGroup* padding = GroupAt(wal, lsn);
+        padding->size = (uint32_t)tail;
+        padding->owner = CurrentTid();
+        padding->count = 0;
+        __atomic_store_n(&padding->lsn, lsn, __ATOMIC_RELEASE);
+        lsn += tail;
+      }
+
+      struct WalGroup* group = GroupAt(wal, lsn);
+      group->size = size;
+      group->owner = CurrentTid();
+      __atomic_store_n(&header->reserved_lsn, lsn + size, __ATOMIC_RELEASE);
+
+      UnlockOwned(&header->reserve_lock);
+      return lsn;
+    }
+
+    UnlockOwned(&header->reserve_lock);
+    WalCheckpoint(wal);
+  }
+}
+
+
+/*
+ * WalAppend -
+ * log images of one atomic change; all of them are replayed or none.
+ * Images must already be applied to the tree file (or mapping).
+ * Images too big for the ring are synced to the tree file instead;
+ * node images never are (see OpenWal).
+ *
+ * Returns:
+ * @lsn: end of the group; pass it to WalCommit.
+*/
+uint64_t WalAppend(struct Wal* wal,
+                   const struct WalImage* images, size_t count) {
+  uint64_t size = sizeof(struct WalGroup);
+  bool synced = false;
+
+  for (size_t i = 0; i < count; ++i) {
+    if (images[i].data != NULL && images[i].size > WAL_MAX_IMAGE(wal)) {
+      if (!synced && DataSync(wal->tree_fd) == -1) {
+        perror("fdatasync");
+        exit(EXIT_FAILURE);
+      }
+      synced = true;
+      continue;
+    }
+    size += sizeof(struct WalImageHeader);
+    if (images[i].data != NULL) {
+      size += AlignUp(images[i].size, 8);
+    }
+  }
+  size = AlignUp(size, WAL_ALIGN);
+
+  uint64_t lsn = Reserve(wal, (uint32_t)size);
+  struct WalGroup* group = GroupAt(wal, lsn);
+  char* out = (char*)(group + 1);
+  uint32_t logged = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    if (images[i].data != NULL && images[i].size > WAL_MAX_IMAGE(wal)) {
+      continue;
+    }
+    struct WalImageHeader image = {
+      .offset = images[i].offset,
+      .size = images[i].size,
+      .zero = images[i].data == NULL
+    };
+    memcpy(out, &image, sizeof(image));
+    out += sizeof(image);
+    if (images[i].data != NULL) {
+      memcpy(out, images[i].data, images[i].size);
+      out += AlignUp(images[i].size, 8);
+    }
+    ++logged;
+  }
+
+  group->count = logged;
+  group->crc = Crc32c(0, group + 1, size - sizeof(*group));
+  __atomic_store_n(&group->lsn, lsn, __ATOMIC_RELEASE);
+
+  appended_lsn = lsn + size;
+  return lsn + size;
+}
+
+
+/*
+ * WalLastLsn -
+ * end of the last group appended by calling thread.
+*/
+uint64_t WalLastLsn(void) {
+  return appended_lsn;
+}
+
+
+static void ApplyImage(int tree_fd, const struct WalImageHeader* image,
+                       const char* data) {
+  static const char zeroes[4096] = {0};
+  off_t offset = image->offset;
+  size_t left = image->size;
+
+  while (left > 0) {
+    size_t chunk = left;
+    const char* source = data;
+    if (image->zero) {
+      chunk = left < sizeof(zeroes) ? left : sizeof(zeroes);
+      source = zeroes;
+    }
+    ssize_t written = pwrite(tree_fd, source, chunk, offset);
+    if (written <= 0) {
+      perror("pwrite");
+      exit(EXIT_FAILURE);
+    }
+    offset += written;
+    left -= written;
+    if (!image->zero) {
+      data += written;
+    }
+  }
+}
+
+
+/*
+ * Replay -
+ * apply intact groups after checkpoint to tree file.
+ * Called by the only process having the log open.
+*/
+static void Replay(struct Wal* wal) {
+  struct WalHeader* header = wal->header;
+  uint64_t lsn = header->checkpoint_lsn;
+  size_t groups = 0;
+
+  while (true) {
+    struct WalGroup* group = GroupAt(wal, lsn);
+    uint64_t offset = lsn % wal->capacity;
+
+    if (group->lsn != lsn
+        || group->size < sizeof(*group) || group->size % WAL_ALIGN != 0
+        || offset + group->size > wal->capacity) {
+      break;
+    }
+    if (group->count != 0) {
+      if (Crc32c(0, group + 1, group->size - sizeof(*group)) != group->crc) {
+        break;
+      }
+      const char* in = (const char*)(group + 1);
+      for (uint32_t i = 0; i < group->count; ++i) {
+        struct WalImageHeader image;
+        memcpy(&image, in, sizeof(image));
+        in += sizeof(image);
+        ApplyImage(wal->tree_fd, &image, in);
+        if (!image.zero) {
+          in += AlignUp(image.size, 8);
+        }
+      }
+      ++groups;
+    }
+
+    lsn += group->size;
+  }
+
+  if (groups != 0) {
+    if (DataSync(wal->tree_fd) == -1) {
+      perror("fdatasync");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "WAL: replayed %zu groups\n", groups);
+  }
+
+  header->checkpoint_lsn = lsn;
+  header->reserved_lsn = lsn;
+  header->flushed_lsn = lsn;
+  MSync(header, WAL_HEADER_SIZE);
+}
+
+
+static void* CheckpointLoop(void* arg) {
+  struct Wal* wal = (struct Wal*)arg;
+  struct WalHeader* header = wal->header;
+
+  struct timespec period = {
+    .tv_sec = 0,
+    .tv_nsec = WAL_CHECKPOINT_MS * 1000000L
+  };
+
+  while (!__atomic_load_n(&wal->stop, __ATOMIC_ACQUIRE)) {
+    (void)syscall(SYS_futex, &wal->stop, FUTEX_WAIT_PRIVATE, 0,
+                  &period, NULL, 0);
+
+    uint64_t reserved = __atomic_load_n(&header->reserved_lsn,
+                                        __ATOMIC_ACQUIRE);
+    if (reserved - __atomic_load_n(&header->checkpoint_lsn, __ATOMIC_ACQUIRE)
+        > wal->capacity / 4) {
+      WalCheckpoint(wal);
+    } else {
+      /* Commits that did not wait (see BLinkTree::Sync) */
+      WalCommit(wal, reserved);
+    }
+  }
+
+  return NULL;
+}
+
+
+static void WalPath(char* path, const char* tree_path) {
+  if (snprintf(path, PATH_MAX, "%s.wal", tree_path) >= PATH_MAX) {
+    fprintf(stderr, "WAL: path is too long\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+/*
+ * ReplaySmaller -
+ * replay log of 'size' bytes left by an open with smaller nodes,
+ * before it is grown and started anew.
+*/
+static void ReplaySmaller(int fd, int tree_fd, off_t size) {
+  char* mapping = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+
+  struct Wal old = {
+    .fd = fd,
+    .tree_fd = tree_fd,
+    .header = (struct WalHeader*)mapping,
+    .ring = mapping + WAL_HEADER_SIZE,
+    .capacity = (uint64_t)(size - WAL_HEADER_SIZE)
+  };
+  if (old.header->magic == WAL_MAGIC
+      && old.header->capacity == old.capacity) {
+    Replay(&old);
+  }
+
+  munmap(mapping, size);
+}
+
+
+/*
+ * OpenWal -
+ * open log of tree at 'tree_path'; the first opener replays it.
+ * Ring holds WAL_RING_NODES images of 'node_size' bytes at least,
+ * so every group of nodes is logged whole and replayed atomically.
+ *
+ * Returns:
+ * @wal: log handle, or NULL on failure
+ * (e.g. log is open by others with a ring too small for such nodes).
+*/
+struct Wal* OpenWal(const char* tree_path, int tree_fd, size_t node_size) {
+  char path[PATH_MAX];
+  WalPath(path, tree_path);
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+
+  bool alone = TryLockAlone(fd);
+  if (!alone) {
+    /* Waits for the first opener to finish replay */
+    LockShared(fd, F_OFD_SETLKW);
+  }
+
+  uint64_t capacity = AlignUp(WAL_RING_NODES * node_size, WAL_HEADER_SIZE);
+  if (capacity < WAL_CAPACITY) {
+    capacity = WAL_CAPACITY;
+  }
+  off_t size = WAL_HEADER_SIZE + capacity;
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) == -1) {
+    perror("fstat");
+    close(fd);
+    return NULL;
+  }
+  if (statbuf.st_size > size) {
+    /* Log created with another capacity */
+    size = statbuf.st_size;
+  } else if (statbuf.st_size < size && !alone) {
+    fprintf(stderr, "WAL: log is too small for nodes of %zu bytes\n",
+            node_size);
+    close(fd);
+    return NULL;
+  } else if (statbuf.st_size < size) {
+    if (statbuf.st_size > WAL_HEADER_SIZE) {
+      ReplaySmaller(fd, tree_fd, statbuf.st_size);
+    }
+    /* Old groups must not look valid in the bigger ring */
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+      perror("ftruncate");
+      close(fd);
+      return NULL;
+    }
+  }
+
+  char* mapping = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return NULL;
+  }
+
+  struct Wal* wal = (struct Wal*)calloc(1, sizeof(struct Wal));
+  wal->fd = fd;
+  wal->tree_fd = tree_fd;
+  wal->header = (struct WalHeader*)mapping;
+  wal->ring = mapping + WAL_HEADER_SIZE;
+
+  if (alone) {
+    struct WalHeader* header = wal->header;
+    if (header->magic != WAL_MAGIC
+        || header->capacity != (uint64_t)(size - WAL_HEADER_SIZE)) {
+      memset(header, 0, sizeof(*header));
+      header->capacity = size - WAL_HEADER_SIZE;
+      header->magic = WAL_MAGIC;
+    }
+    wal->capacity = header->capacity;
+
+    header->reserve_lock = 0;
+    header->flush_lock = 0;
+    header->checkpoint_lock = 0;
+    Replay(wal);
+
+    LockShared(fd, F_OFD_SETLK);
+  }
+  wal->capacity = wal->header->capacity;
+
+  wal->pid = getpid();
+  if (pthread_create(&wal->checkpointer, NULL, CheckpointLoop, wal) != 0) {
+    fprintf(stderr, "WAL: cannot start checkpointer\n");
+    wal->pid = 0;
+  }
+
+  return wal;
+}
+
+
+/*
+ * CloseWal -
+ * the last process to close the log checkpoints it,
+ * so next open has nothing to replay.
+*/
+void CloseWal(struct Wal* wal) {
+  if (wal == NULL) {
+    return;
+  }
+
+  /* Checkpointer is not inherited by fork'ed child */
+  if (wal->pid == getpid()) {
+    __atomic_store_n(&wal->stop, 1, __ATOMIC_RELEASE);
+    (void)syscall(SYS_futex, &wal->stop, FUTEX_WAKE_PRIVATE, INT_MAX,
+                  NULL, NULL, 0);
+    pthread_join(wal->checkpointer, NULL);
+  }
+
+  if (TryLockAlone(wal->fd)) {
+    WalCheckpoint(wal);
+  }
+
+  munmap(wal->header, WAL_HEADER_SIZE + wal->capacity);
+  close(wal->fd);
+  free(wal);
+}
+
+
+/*
+ * RemoveWal -
+ * drop log of a tree file that is being created anew.
+*/
+void RemoveWal(const char* tree_path) {
+  char path[PATH_MAX];
+  WalPath(path, tree_path);
+
+  if (unlink(path) == -1 && errno != ENOENT) {
+    perror("unlink");
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WAL_MAGIC 0x4c41574b4e494c42ULL /* "BLINKWAL" */
+#define WAL_CAPACITY ((uint64_t)16 << 20) /* ring of redo records */
+#define WAL_ALIGN 32
+
+/* Sidecar file '<tree>.wal': header page followed by a ring of groups.
+ * Log positions (lsn) grow forever; group at 'lsn' lives at
+ * ring offset lsn % capacity. Only magic, capacity and checkpoint_lsn
+ * matter after restart, the rest is rebuilt by replay. */
+struct WalHeader {
+  uint64_t magic;
+  uint64_t capacity;
+
+  uint64_t checkpoint_lsn; /* log before it is applied to tree file */
+  uint64_t reserved_lsn; /* next group starts here */
+  uint64_t flushed_lsn; /* log before it is durable */
+
+  uint32_t reserve_lock; /* tid of holder or 0 */
+  uint32_t flush_lock; /* tid of flush leader or 0 */
+  uint32_t checkpoint_lock; /* tid of checkpointer or 0 */
+  uint32_t flush_seq; /* futex word: bumped after every flush */
+
+  char pad[4096 - 5 * sizeof(uint64_t) - 4 * sizeof(uint32_t)];
+};
+
+/* Physical redo image: 'size' bytes to be written at 'offset'
+ * of tree file; NULL 'data' means zeroes. */
+struct WalImage {
+  off_t offset;
+  const void* data;
+  uint32_t size;
+};
+
+struct Wal;
+
+
+struct Wal* OpenWal(const char* tree_path, int tree_fd, size_t node_size);
+
+void CloseWal(struct Wal* wal);
+
+uint64_t WalAppend(struct Wal* wal,
+                   const struct WalImage* images, size_t count);
+
+uint64_t WalLastLsn(void);
+
+void WalCommit(struct Wal* wal, uint64_t lsn);
+
+bool WalTryCommit(struct Wal* wal, uint64_t lsn);
+
+void WalCheckpoint(struct Wal* wal);
+
+void WalSetFlusher(struct Wal* wal, void (*flush)(void* arg), void* arg);
+
+void RemoveWal(const char* tree_path);
+
+#endif  // WAL_H